@@ -0,0 +1,882 @@
+/*
+ * Fake pcsc-lite library with emulated readers and cards
+ *
+ * Copyright 2023 Konstantin Romanov
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Stand-in for libpcsclite.so, loaded by winscard instead of the real one
+ * when WINSCARD_PCSCLITE points to it. It needs neither pcscd nor a card:
+ * every reader holds an in-memory ISO 7816-4 card, so that benchmarks run
+ * the same way on any box.
+ *
+ * Build with make in this directory, or:
+ *   cc -O2 -shared -fPIC -o libfakepcsc.so fakepcsc.c -lpthread
+ *
+ * Settings:
+ *   FAKEPCSC_READERS=<n>      number of readers, 2 by default (at most 64)
+ *   FAKEPCSC_LATENCY_US=<us>  time spent by each APDU exchange, 0 by default
+ *
+ * The card file system is
+ *   3F00        MF
+ *     2F00      EF, 256 bytes
+ *     5000      DF, also selected by its name "FAKEPCSC"
+ *       5001    EF, 4096 bytes
+ * and understands SELECT (by file id or DF name), READ BINARY,
+ * UPDATE BINARY and GET RESPONSE. With T=0, responses come through
+ * 61xx/GET RESPONSE and a wrong Le gets 6Cxx, like real T=0 cards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* pcsc-lite ABI */
+typedef long LONG;
+typedef unsigned long DWORD;
+typedef long SCARDCONTEXT;
+typedef long SCARDHANDLE;
+typedef unsigned char BYTE;
+
+#define MAX_ATR_SIZE 33
+
+typedef struct
+{
+    const char *szReader;
+    void *pvUserData;
+    DWORD dwCurrentState;
+    DWORD dwEventState;
+    DWORD cbAtr;
+    unsigned char rgbAtr[MAX_ATR_SIZE];
+} SCARD_READERSTATE;
+
+typedef struct
+{
+    unsigned long dwProtocol;
+    unsigned long cbPciLength;
+} SCARD_IO_REQUEST;
+
+#define SCARD_S_SUCCESS             ((LONG)0x00000000)
+#define SCARD_E_CANCELLED           ((LONG)0x80100002)
+#define SCARD_E_INVALID_HANDLE      ((LONG)0x80100003)
+#define SCARD_E_INVALID_PARAMETER   ((LONG)0x80100004)
+#define SCARD_E_NO_MEMORY           ((LONG)0x80100006)
+#define SCARD_E_INSUFFICIENT_BUFFER ((LONG)0x80100008)
+#define SCARD_E_UNKNOWN_READER      ((LONG)0x80100009)
+#define SCARD_E_TIMEOUT             ((LONG)0x8010000A)
+#define SCARD_E_SHARING_VIOLATION   ((LONG)0x8010000B)
+#define SCARD_E_PROTO_MISMATCH      ((LONG)0x8010000F)
+#define SCARD_E_INVALID_VALUE       ((LONG)0x80100011)
+#define SCARD_E_UNSUPPORTED_FEATURE ((LONG)0x8010001F)
+#define SCARD_E_NO_READERS_AVAILABLE ((LONG)0x8010002E)
+
+#define SCARD_AUTOALLOCATE          ((DWORD)-1)
+#define INFINITE                    0xFFFFFFFF
+
+#define SCARD_SHARE_EXCLUSIVE       0x0001
+#define SCARD_SHARE_SHARED          0x0002
+#define SCARD_SHARE_DIRECT          0x0003
+
+#define SCARD_PROTOCOL_T0           0x0001
+#define SCARD_PROTOCOL_T1           0x0002
+#define SCARD_PROTOCOL_RAW          0x0004
+
+#define SCARD_LEAVE_CARD            0x0000
+#define SCARD_RESET_CARD            0x0001
+#define SCARD_UNPOWER_CARD          0x0002
+
+#define SCARD_PRESENT               0x0004
+#define SCARD_POWERED               0x0010
+#define SCARD_SPECIFIC              0x0040
+
+#define SCARD_STATE_IGNORE          0x0001
+#define SCARD_STATE_CHANGED         0x0002
+#define SCARD_STATE_UNKNOWN         0x0004
+#define SCARD_STATE_PRESENT         0x0020
+#define SCARD_STATE_EXCLUSIVE       0x0080
+#define SCARD_STATE_INUSE           0x0100
+
+#define SCARD_ATTR_VENDOR_NAME      0x00010100
+#define SCARD_ATTR_ATR_STRING       0x00090303
+
+#define PNP_NOTIFICATION            "\\\\?PnP?\\Notification"
+
+#define MAX_READERS    64
+#define PCSCLITE_MAX_READERS_CONTEXTS 16    /* readers in one SCardGetStatusChange, as in pcsc-lite */
+#define MAX_CONTEXTS   1024
+#define MAX_CARDS      1024
+
+/*
+ * emulated card
+ */
+struct card_file
+{
+    unsigned short fid;
+    unsigned short parent;        /* fid of the DF holding the file */
+    const char *name;             /* DF name, NULL for EFs */
+    size_t size;                  /* 0 for DFs */
+    BYTE *data;
+};
+
+struct card
+{
+    struct card_file files[4];
+    unsigned short current_df;
+    unsigned short current_ef;    /* 0 when no EF is selected */
+    BYTE response[258];           /* waiting for GET RESPONSE */
+    size_t response_length;
+    unsigned int events;          /* card events counter, reported in the upper bits of the state */
+};
+
+struct reader
+{
+    char name[64];
+    struct card card;
+    int exclusive;                /* connected in exclusive mode */
+    int shared;                   /* number of shared connections */
+    DWORD protocol;               /* protocol of the connections */
+};
+
+struct context
+{
+    SCARDCONTEXT handle;
+    int cancelled;
+};
+
+struct connection
+{
+    SCARDHANDLE handle;
+    SCARDCONTEXT context;
+    int reader;
+    DWORD share_mode;
+};
+
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+static struct reader readers[MAX_READERS];
+static int reader_count;
+static struct context contexts[MAX_CONTEXTS];
+static struct connection connections[MAX_CARDS];
+static long next_handle = 0x1000;
+static unsigned int latency_us;
+
+static BYTE card_atr[] = { 0x3B, 0x8A, 0x80, 0x01, 'F', 'A', 'K', 'E', 'P', 'C', 'S', 'C', '0', '1', 0x00 };
+
+static void init_card( struct card *card )
+{
+    static const struct card_file files[] =
+    {
+        { 0x3F00, 0x3F00, NULL, 0, NULL },
+        { 0x2F00, 0x3F00, NULL, 256, NULL },
+        { 0x5000, 0x3F00, "FAKEPCSC", 0, NULL },
+        { 0x5001, 0x5000, NULL, 4096, NULL },
+    };
+    size_t i, j;
+
+    memcpy( card->files, files, sizeof(files) );
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        if (!card->files[i].size) continue;
+        card->files[i].data = malloc( card->files[i].size );
+        for (j = 0; card->files[i].data && j < card->files[i].size; j++)
+            card->files[i].data[j] = (BYTE)(j + card->files[i].fid);
+    }
+    card->current_df = 0x3F00;
+    card->current_ef = 0;
+}
+
+static void fake_init(void)
+{
+    const char *env;
+    BYTE tck = 0;
+    size_t i;
+
+    reader_count = 2;
+    if ((env = getenv( "FAKEPCSC_READERS" ))) reader_count = atoi( env );
+    if (reader_count < 0) reader_count = 0;
+    if (reader_count > MAX_READERS) reader_count = MAX_READERS;
+    if ((env = getenv( "FAKEPCSC_LATENCY_US" ))) latency_us = atoi( env );
+
+    for (i = 1; i < sizeof(card_atr) - 1; i++) tck ^= card_atr[i];
+    card_atr[sizeof(card_atr) - 1] = tck;
+
+    for (i = 0; i < (size_t)reader_count; i++)
+    {
+        /* same naming as pcscd: <name> <reader number> <slot> */
+        snprintf( readers[i].name, sizeof(readers[i].name), "Fake PCSC Reader %02u 00", (unsigned int)i );
+        init_card( &readers[i].card );
+    }
+}
+
+static struct card_file *find_file( struct card *card, unsigned short fid )
+{
+    size_t i;
+    for (i = 0; i < sizeof(card->files) / sizeof(card->files[0]); i++)
+        if (card->files[i].fid == fid) return &card->files[i];
+    return NULL;
+}
+
+static size_t set_sw( BYTE *out, BYTE sw1, BYTE sw2 )
+{
+    out[0] = sw1;
+    out[1] = sw2;
+    return 2;
+}
+
+/* answer with data, through GET RESPONSE for T=0 */
+static size_t respond( struct card *card, DWORD protocol, const BYTE *data, size_t length, BYTE *out )
+{
+    if (protocol == SCARD_PROTOCOL_T0 && length)
+    {
+        memcpy( card->response, data, length );
+        card->response_length = length;
+        return set_sw( out, 0x61, (BYTE)length );
+    }
+    memcpy( out, data, length );
+    return length + set_sw( out + length, 0x90, 0x00 );
+}
+
+static size_t card_select( struct card *card, DWORD protocol, const BYTE *apdu, size_t length, BYTE *out )
+{
+    struct card_file *file = NULL;
+    BYTE fcp[16];
+    size_t lc = length > 4 ? apdu[4] : 0, i;
+
+    if (length < 5 || length < 5 + lc) return set_sw( out, 0x67, 0x00 );
+    if (apdu[2] == 0x00 && lc == 2)
+        file = find_file( card, apdu[5] << 8 | apdu[6] );
+    else if (apdu[2] == 0x04)
+    {
+        for (i = 0; i < sizeof(card->files) / sizeof(card->files[0]); i++)
+        {
+            const char *name = card->files[i].name;
+            if (name && strlen( name ) == lc && !memcmp( name, apdu + 5, lc )) file = &card->files[i];
+        }
+    }
+    else
+        return set_sw( out, 0x6A, 0x86 );
+    if (!file) return set_sw( out, 0x6A, 0x82 );
+
+    if (file->size)
+    {
+        card->current_df = file->parent;
+        card->current_ef = file->fid;
+    }
+    else
+    {
+        card->current_df = file->fid;
+        card->current_ef = 0;
+    }
+    if ((apdu[3] & 0x0C) == 0x0C) return set_sw( out, 0x90, 0x00 );
+
+    /* FCP: file id and size */
+    fcp[0] = 0x62;
+    fcp[1] = 8;
+    fcp[2] = 0x83; fcp[3] = 2; fcp[4] = file->fid >> 8; fcp[5] = file->fid & 0xFF;
+    fcp[6] = 0x80; fcp[7] = 2; fcp[8] = (BYTE)(file->size >> 8); fcp[9] = file->size & 0xFF;
+    return respond( card, protocol, fcp, 10, out );
+}
+
+static size_t card_read_binary( struct card *card, DWORD protocol, const BYTE *apdu, size_t length, BYTE *out )
+{
+    struct card_file *file = card->current_ef ? find_file( card, card->current_ef ) : NULL;
+    size_t offset, le, available;
+
+    if (length < 4 || length > 5) return set_sw( out, 0x67, 0x00 );
+    if (!file) return set_sw( out, 0x69, 0x86 );
+    if (apdu[2] & 0x80) return set_sw( out, 0x6A, 0x81 );
+    offset = apdu[2] << 8 | apdu[3];
+    le = length == 5 && apdu[4] ? apdu[4] : 256;
+    if (offset >= file->size) return set_sw( out, 0x6B, 0x00 );
+    available = file->size - offset;
+    if (le > available)
+    {
+        /* T=0 asks for the right length, the other protocols return what is there */
+        if (protocol == SCARD_PROTOCOL_T0) return set_sw( out, 0x6C, (BYTE)available );
+        memcpy( out, file->data + offset, available );
+        return available + set_sw( out + available, 0x62, 0x82 );
+    }
+    memcpy( out, file->data + offset, le );
+    return le + set_sw( out + le, 0x90, 0x00 );
+}
+
+static size_t card_update_binary( struct card *card, const BYTE *apdu, size_t length, BYTE *out )
+{
+    struct card_file *file = card->current_ef ? find_file( card, card->current_ef ) : NULL;
+    size_t offset, lc;
+
+    if (length < 5 || length != 5 + (size_t)apdu[4]) return set_sw( out, 0x67, 0x00 );
+    if (!file) return set_sw( out, 0x69, 0x86 );
+    if (apdu[2] & 0x80) return set_sw( out, 0x6A, 0x81 );
+    offset = apdu[2] << 8 | apdu[3];
+    lc = apdu[4];
+    if (offset + lc > file->size) return set_sw( out, 0x6B, 0x00 );
+    memcpy( file->data + offset, apdu + 5, lc );
+    return set_sw( out, 0x90, 0x00 );
+}
+
+static size_t card_get_response( struct card *card, const BYTE *apdu, size_t length, BYTE *out )
+{
+    size_t le = length == 5 && apdu[4] ? apdu[4] : 256;
+    if (length < 4 || length > 5) return set_sw( out, 0x67, 0x00 );
+    if (!card->response_length) return set_sw( out, 0x69, 0x85 );
+    if (le != card->response_length) return set_sw( out, 0x6C, (BYTE)card->response_length );
+    memcpy( out, card->response, le );
+    card->response_length = 0;
+    return le + set_sw( out + le, 0x90, 0x00 );
+}
+
+/* out must hold 258 bytes */
+static size_t card_process( struct card *card, DWORD protocol, const BYTE *apdu, size_t length, BYTE *out )
+{
+    size_t ret;
+    if (length < 4) return set_sw( out, 0x67, 0x00 );
+    if (apdu[0] & 0xFC) return set_sw( out, 0x6E, 0x00 );
+    if (apdu[1] == 0xC0) return card_get_response( card, apdu, length, out );
+    card->response_length = 0;
+    switch (apdu[1])
+    {
+    case 0xA4: ret = card_select( card, protocol, apdu, length, out ); break;
+    case 0xB0: ret = card_read_binary( card, protocol, apdu, length, out ); break;
+    case 0xD6: ret = card_update_binary( card, apdu, length, out ); break;
+    default: ret = set_sw( out, 0x6D, 0x00 ); break;
+    }
+    return ret;
+}
+
+/*
+ * handles
+ */
+
+/* must be called with fake_mutex held */
+static struct context *find_context( SCARDCONTEXT handle )
+{
+    int i;
+    for (i = 0; i < MAX_CONTEXTS; i++)
+        if (handle && contexts[i].handle == handle) return &contexts[i];
+    return NULL;
+}
+
+/* must be called with fake_mutex held */
+static struct connection *find_connection( SCARDHANDLE handle )
+{
+    int i;
+    for (i = 0; i < MAX_CARDS; i++)
+        if (handle && connections[i].handle == handle) return &connections[i];
+    return NULL;
+}
+
+/* must be called with fake_mutex held */
+static int find_reader( const char *name )
+{
+    int i;
+    for (i = 0; i < reader_count; i++)
+        if (!strcmp( readers[i].name, name )) return i;
+    return -1;
+}
+
+/* must be called with fake_mutex held */
+static DWORD reader_state( int reader )
+{
+    DWORD state = SCARD_STATE_PRESENT | (DWORD)readers[reader].card.events << 16;
+    if (readers[reader].exclusive) state |= SCARD_STATE_EXCLUSIVE;
+    else if (readers[reader].shared) state |= SCARD_STATE_INUSE;
+    return state;
+}
+
+static LONG copy_string( const char *string, size_t length, char *buffer, DWORD *pcchLength )
+{
+    if (!pcchLength) return SCARD_E_INVALID_PARAMETER;
+    if (buffer && *pcchLength == SCARD_AUTOALLOCATE)
+    {
+        char *copy = malloc( length );
+        if (!copy) return SCARD_E_NO_MEMORY;
+        memcpy( copy, string, length );
+        *(char **)buffer = copy;
+    }
+    else if (buffer)
+    {
+        if (*pcchLength < length)
+        {
+            *pcchLength = length;
+            return SCARD_E_INSUFFICIENT_BUFFER;
+        }
+        memcpy( buffer, string, length );
+    }
+    *pcchLength = length;
+    return SCARD_S_SUCCESS;
+}
+
+static void card_latency(void)
+{
+    struct timespec delay;
+    if (!latency_us) return;
+    delay.tv_sec = latency_us / 1000000;
+    delay.tv_nsec = (latency_us % 1000000) * 1000;
+    while (nanosleep( &delay, &delay ) && errno == EINTR);
+}
+
+/*
+ * pcsc-lite API
+ */
+LONG SCardEstablishContext( DWORD dwScope, const void *pvReserved1, const void *pvReserved2, SCARDCONTEXT *phContext )
+{
+    int i;
+    pthread_once( &fake_once, fake_init );
+    if (!phContext) return SCARD_E_INVALID_PARAMETER;
+    pthread_mutex_lock( &fake_mutex );
+    for (i = 0; i < MAX_CONTEXTS; i++)
+    {
+        if (contexts[i].handle) continue;
+        contexts[i].handle = next_handle++;
+        contexts[i].cancelled = 0;
+        *phContext = contexts[i].handle;
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_S_SUCCESS;
+    }
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_E_NO_MEMORY;
+}
+
+LONG SCardReleaseContext( SCARDCONTEXT hContext )
+{
+    struct context *context;
+    int i;
+    pthread_mutex_lock( &fake_mutex );
+    if (!(context = find_context( hContext )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    for (i = 0; i < MAX_CARDS; i++)
+    {
+        struct connection *connection = &connections[i];
+        if (!connection->handle || connection->context != hContext) continue;
+        if (connection->share_mode == SCARD_SHARE_EXCLUSIVE) readers[connection->reader].exclusive = 0;
+        else readers[connection->reader].shared--;
+        connection->handle = 0;
+    }
+    context->handle = 0;
+    context->cancelled = 1;
+    pthread_cond_broadcast( &fake_cond );
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardIsValidContext( SCARDCONTEXT hContext )
+{
+    LONG ret;
+    pthread_mutex_lock( &fake_mutex );
+    ret = find_context( hContext ) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+    pthread_mutex_unlock( &fake_mutex );
+    return ret;
+}
+
+static DWORD choose_protocol( DWORD dwPreferredProtocols )
+{
+    if (dwPreferredProtocols & SCARD_PROTOCOL_T1) return SCARD_PROTOCOL_T1;
+    if (dwPreferredProtocols & SCARD_PROTOCOL_T0) return SCARD_PROTOCOL_T0;
+    return 0;
+}
+
+LONG SCardConnect( SCARDCONTEXT hContext, const char *szReader, DWORD dwShareMode, DWORD dwPreferredProtocols,
+                   SCARDHANDLE *phCard, DWORD *pdwActiveProtocol )
+{
+    struct reader *reader;
+    DWORD protocol = choose_protocol( dwPreferredProtocols );
+    int index, i;
+
+    if (!szReader || !phCard || !pdwActiveProtocol) return SCARD_E_INVALID_PARAMETER;
+    pthread_mutex_lock( &fake_mutex );
+    if (!find_context( hContext ))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    if ((index = find_reader( szReader )) < 0)
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_UNKNOWN_READER;
+    }
+    reader = &readers[index];
+    if (dwShareMode != SCARD_SHARE_DIRECT && !protocol)
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_PROTO_MISMATCH;
+    }
+    if (reader->exclusive || (dwShareMode == SCARD_SHARE_EXCLUSIVE && reader->shared)
+        || (reader->shared && protocol && reader->protocol && protocol != reader->protocol))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_SHARING_VIOLATION;
+    }
+    for (i = 0; i < MAX_CARDS; i++)
+    {
+        if (connections[i].handle) continue;
+        connections[i].handle = next_handle++;
+        connections[i].context = hContext;
+        connections[i].reader = index;
+        connections[i].share_mode = dwShareMode;
+        if (dwShareMode == SCARD_SHARE_EXCLUSIVE) reader->exclusive = 1;
+        else reader->shared++;
+        if (protocol) reader->protocol = protocol;
+        *phCard = connections[i].handle;
+        *pdwActiveProtocol = protocol;
+        pthread_cond_broadcast( &fake_cond );
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_S_SUCCESS;
+    }
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_E_NO_MEMORY;
+}
+
+/* must be called with fake_mutex held */
+static void card_disposition( struct reader *reader, DWORD dwDisposition )
+{
+    if (dwDisposition != SCARD_RESET_CARD && dwDisposition != SCARD_UNPOWER_CARD) return;
+    reader->card.current_df = 0x3F00;
+    reader->card.current_ef = 0;
+    reader->card.response_length = 0;
+    reader->card.events++;
+    pthread_cond_broadcast( &fake_cond );
+}
+
+LONG SCardReconnect( SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization,
+                     DWORD *pdwActiveProtocol )
+{
+    struct connection *connection;
+    DWORD protocol = choose_protocol( dwPreferredProtocols );
+    struct reader *reader;
+
+    if (!pdwActiveProtocol) return SCARD_E_INVALID_PARAMETER;
+    pthread_mutex_lock( &fake_mutex );
+    if (!(connection = find_connection( hCard )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    reader = &readers[connection->reader];
+    if (dwShareMode != connection->share_mode)
+    {
+        if (dwShareMode == SCARD_SHARE_EXCLUSIVE && reader->shared > 1)
+        {
+            pthread_mutex_unlock( &fake_mutex );
+            return SCARD_E_SHARING_VIOLATION;
+        }
+        if (connection->share_mode == SCARD_SHARE_EXCLUSIVE) reader->exclusive = 0;
+        else reader->shared--;
+        if (dwShareMode == SCARD_SHARE_EXCLUSIVE) reader->exclusive = 1;
+        else reader->shared++;
+        connection->share_mode = dwShareMode;
+    }
+    card_disposition( reader, dwInitialization );
+    if (protocol) reader->protocol = protocol;
+    *pdwActiveProtocol = reader->protocol;
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardDisconnect( SCARDHANDLE hCard, DWORD dwDisposition )
+{
+    struct connection *connection;
+    struct reader *reader;
+    pthread_mutex_lock( &fake_mutex );
+    if (!(connection = find_connection( hCard )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    reader = &readers[connection->reader];
+    if (connection->share_mode == SCARD_SHARE_EXCLUSIVE) reader->exclusive = 0;
+    else reader->shared--;
+    if (!reader->exclusive && !reader->shared) reader->protocol = 0;
+    card_disposition( reader, dwDisposition );
+    connection->handle = 0;
+    pthread_cond_broadcast( &fake_cond );
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardBeginTransaction( SCARDHANDLE hCard )
+{
+    LONG ret;
+    pthread_mutex_lock( &fake_mutex );
+    ret = find_connection( hCard ) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+    pthread_mutex_unlock( &fake_mutex );
+    return ret;
+}
+
+LONG SCardEndTransaction( SCARDHANDLE hCard, DWORD dwDisposition )
+{
+    struct connection *connection;
+    pthread_mutex_lock( &fake_mutex );
+    if (!(connection = find_connection( hCard )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    card_disposition( &readers[connection->reader], dwDisposition );
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardStatus( SCARDHANDLE hCard, char *mszReaderName, DWORD *pcchReaderLen, DWORD *pdwState,
+                  DWORD *pdwProtocol, BYTE *pbAtr, DWORD *pcbAtrLen )
+{
+    struct connection *connection;
+    struct reader *reader;
+    char name[sizeof(reader->name) + 1];
+    size_t length;
+    LONG ret;
+
+    pthread_mutex_lock( &fake_mutex );
+    if (!(connection = find_connection( hCard )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    reader = &readers[connection->reader];
+    if (pdwState) *pdwState = SCARD_PRESENT | SCARD_POWERED | SCARD_SPECIFIC;
+    if (pdwProtocol) *pdwProtocol = reader->protocol;
+    length = strlen( reader->name ) + 1;
+    memcpy( name, reader->name, length );
+    name[length++] = 0;
+    pthread_mutex_unlock( &fake_mutex );
+
+    ret = SCARD_S_SUCCESS;
+    if (pcchReaderLen) ret = copy_string( name, length, mszReaderName, pcchReaderLen );
+    if (pcbAtrLen)
+    {
+        LONG atr_ret = copy_string( (const char *)card_atr, sizeof(card_atr), (char *)pbAtr, pcbAtrLen );
+        if (ret == SCARD_S_SUCCESS) ret = atr_ret;
+    }
+    return ret;
+}
+
+/* must be called with fake_mutex held, returns whether a state differs from the known one */
+static int update_states( SCARD_READERSTATE *rgReaderStates, DWORD cReaders, LONG *ret )
+{
+    int changed = 0;
+    DWORD i;
+    for (i = 0; i < cReaders; i++)
+    {
+        SCARD_READERSTATE *state = &rgReaderStates[i];
+        DWORD current = state->dwCurrentState & ~SCARD_STATE_CHANGED, event;
+        int index;
+
+        if (current & SCARD_STATE_IGNORE)
+        {
+            state->dwEventState = SCARD_STATE_IGNORE;
+            continue;
+        }
+        if (!strcmp( state->szReader, PNP_NOTIFICATION ))
+        {
+            event = (DWORD)reader_count << 16;
+            state->cbAtr = 0;
+        }
+        else if ((index = find_reader( state->szReader )) < 0)
+        {
+            event = SCARD_STATE_UNKNOWN | SCARD_STATE_CHANGED | SCARD_STATE_IGNORE;
+            *ret = SCARD_E_UNKNOWN_READER;
+        }
+        else
+        {
+            event = reader_state( index );
+            state->cbAtr = sizeof(card_atr);
+            memcpy( state->rgbAtr, card_atr, sizeof(card_atr) );
+        }
+        if (event != current)
+        {
+            event |= SCARD_STATE_CHANGED;
+            changed = 1;
+        }
+        state->dwEventState = event;
+    }
+    return changed;
+}
+
+LONG SCardGetStatusChange( SCARDCONTEXT hContext, DWORD dwTimeout, SCARD_READERSTATE *rgReaderStates, DWORD cReaders )
+{
+    struct context *context;
+    struct timespec deadline;
+    LONG ret = SCARD_S_SUCCESS;
+
+    if (cReaders && !rgReaderStates) return SCARD_E_INVALID_PARAMETER;
+    if (cReaders > PCSCLITE_MAX_READERS_CONTEXTS) return SCARD_E_INVALID_VALUE;
+    if (dwTimeout != INFINITE)
+    {
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec += dwTimeout / 1000;
+        deadline.tv_nsec += (dwTimeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock( &fake_mutex );
+    if (!(context = find_context( hContext )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    context->cancelled = 0;
+    for (;;)
+    {
+        if (update_states( rgReaderStates, cReaders, &ret ) || ret != SCARD_S_SUCCESS) break;
+        if (!(context = find_context( hContext )) || context->cancelled)
+        {
+            ret = SCARD_E_CANCELLED;
+            break;
+        }
+        if (dwTimeout == INFINITE)
+            pthread_cond_wait( &fake_cond, &fake_mutex );
+        else if (pthread_cond_timedwait( &fake_cond, &fake_mutex, &deadline ) == ETIMEDOUT)
+        {
+            ret = SCARD_E_TIMEOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &fake_mutex );
+    return ret;
+}
+
+LONG SCardControl( SCARDHANDLE hCard, DWORD dwControlCode, const void *pbSendBuffer, DWORD cbSendLength,
+                   void *pbRecvBuffer, DWORD cbRecvLength, DWORD *lpBytesReturned )
+{
+    LONG ret;
+    pthread_mutex_lock( &fake_mutex );
+    ret = find_connection( hCard ) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+    pthread_mutex_unlock( &fake_mutex );
+    /* no reader features */
+    if (ret == SCARD_S_SUCCESS && lpBytesReturned) *lpBytesReturned = 0;
+    return ret;
+}
+
+LONG SCardTransmit( SCARDHANDLE hCard, const SCARD_IO_REQUEST *pioSendPci, const BYTE *pbSendBuffer,
+                    DWORD cbSendLength, SCARD_IO_REQUEST *pioRecvPci, BYTE *pbRecvBuffer, DWORD *pcbRecvLength )
+{
+    struct connection *connection;
+    struct reader *reader;
+    BYTE response[258];
+    size_t length;
+
+    if (!pioSendPci || !pbSendBuffer || !pbRecvBuffer || !pcbRecvLength) return SCARD_E_INVALID_PARAMETER;
+    card_latency();
+    pthread_mutex_lock( &fake_mutex );
+    if (!(connection = find_connection( hCard )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    reader = &readers[connection->reader];
+    if (pioSendPci->dwProtocol != reader->protocol)
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_PROTO_MISMATCH;
+    }
+    length = card_process( &reader->card, reader->protocol, pbSendBuffer, cbSendLength, response );
+    pthread_mutex_unlock( &fake_mutex );
+
+    if (*pcbRecvLength < length)
+    {
+        *pcbRecvLength = length;
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy( pbRecvBuffer, response, length );
+    *pcbRecvLength = length;
+    if (pioRecvPci) pioRecvPci->dwProtocol = pioSendPci->dwProtocol;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardListReaderGroups( SCARDCONTEXT hContext, char *mszGroups, DWORD *pcchGroups )
+{
+    static const char groups[] = "SCard$DefaultReaders\0";
+    if (SCardIsValidContext( hContext ) != SCARD_S_SUCCESS) return SCARD_E_INVALID_HANDLE;
+    return copy_string( groups, sizeof(groups), mszGroups, pcchGroups );
+}
+
+LONG SCardListReaders( SCARDCONTEXT hContext, const char *mszGroups, char *mszReaders, DWORD *pcchReaders )
+{
+    char list[MAX_READERS * sizeof(readers[0].name) + 1];
+    size_t length = 0;
+    int i;
+
+    pthread_once( &fake_once, fake_init );
+    if (SCardIsValidContext( hContext ) != SCARD_S_SUCCESS) return SCARD_E_INVALID_HANDLE;
+    if (!reader_count) return SCARD_E_NO_READERS_AVAILABLE;
+    for (i = 0; i < reader_count; i++)
+    {
+        size_t name_length = strlen( readers[i].name ) + 1;
+        memcpy( list + length, readers[i].name, name_length );
+        length += name_length;
+    }
+    list[length++] = 0;
+    return copy_string( list, length, mszReaders, pcchReaders );
+}
+
+LONG SCardFreeMemory( SCARDCONTEXT hContext, const void *pvMem )
+{
+    free( (void *)pvMem );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardCancel( SCARDCONTEXT hContext )
+{
+    struct context *context;
+    pthread_mutex_lock( &fake_mutex );
+    if (!(context = find_context( hContext )))
+    {
+        pthread_mutex_unlock( &fake_mutex );
+        return SCARD_E_INVALID_HANDLE;
+    }
+    context->cancelled = 1;
+    pthread_cond_broadcast( &fake_cond );
+    pthread_mutex_unlock( &fake_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardGetAttrib( SCARDHANDLE hCard, DWORD dwAttrId, BYTE *pbAttr, DWORD *pcbAttrLen )
+{
+    static const char vendor[] = "FakePCSC";
+    LONG ret;
+    pthread_mutex_lock( &fake_mutex );
+    ret = find_connection( hCard ) ? SCARD_S_SUCCESS : SCARD_E_INVALID_HANDLE;
+    pthread_mutex_unlock( &fake_mutex );
+    if (ret != SCARD_S_SUCCESS) return ret;
+    switch (dwAttrId)
+    {
+    case SCARD_ATTR_ATR_STRING:
+        return copy_string( (const char *)card_atr, sizeof(card_atr), (char *)pbAttr, pcbAttrLen );
+    case SCARD_ATTR_VENDOR_NAME:
+        return copy_string( vendor, sizeof(vendor), (char *)pbAttr, pcbAttrLen );
+    }
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+LONG SCardSetAttrib( SCARDHANDLE hCard, DWORD dwAttrId, const BYTE *pbAttr, DWORD cbAttrLen )
+{
+    LONG ret;
+    pthread_mutex_lock( &fake_mutex );
+    ret = find_connection( hCard ) ? SCARD_E_UNSUPPORTED_FEATURE : SCARD_E_INVALID_HANDLE;
+    pthread_mutex_unlock( &fake_mutex );
+    return ret;
+}
@@ -0,0 +1,95 @@
+/*
+ * WinScard binary trace format
+ *
+ * Copyright 2023 Konstantin Romanov
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __WINE_SCARDTRACE_H
+#define __WINE_SCARDTRACE_H
+
+#include <stdint.h>
+
+/*
+ * The trace file, enabled by WINSCARD_TRACE=<unix file name>, starts with a
+ * scard_trace_header followed by scard_trace_record entries, in the order the
+ * per-thread buffers were flushed. Timestamps are nanoseconds of the monotonic
+ * clock used by Wine for QueryPerformanceCounter.
+ */
+#define SCARD_TRACE_MAGIC   0x52544353  /* "SCTR" */
+#define SCARD_TRACE_VERSION 1
+
+struct scard_trace_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t pid;
+    uint32_t reserved;
+};
+
+/* where the record comes from */
+#define SCARD_TRACE_SOURCE_DLL     0  /* unix call made by winscard.dll */
+#define SCARD_TRACE_SOURCE_PCSC    1  /* exchange made by the unix library with pcsc-lite */
+
+#define SCARD_TRACE_FLAG_APDU      0x01  /* apdu holds the command header */
+#define SCARD_TRACE_FLAG_SW        0x02  /* sw holds the status word of the response */
+
+struct scard_trace_record
+{
+    uint64_t start;        /* ns */
+    uint32_t duration;     /* ns, saturated */
+    uint32_t tid;
+    uint64_t handle;       /* context or card handle, 0 when the call has none */
+    int32_t  result;
+    uint16_t func;         /* index in SCARD_TRACE_FUNC_NAMES */
+    uint8_t  source;
+    uint8_t  flags;
+    uint8_t  apdu[4];      /* CLA INS P1 P2 */
+    uint16_t sw;
+    uint16_t reserved;
+};
+
+/* names of the unix calls, in the order of enum unix_funcs */
+#define SCARD_TRACE_FUNC_NAMES \
+    "SCardEstablishContext", \
+    "SCardReleaseContext", \
+    "SCardIsValidContext", \
+    "SCardConnect", \
+    "SCardReconnect", \
+    "SCardDisconnect", \
+    "SCardBeginTransaction", \
+    "SCardEndTransaction", \
+    "SCardStatus", \
+    "SCardGetStatusChange", \
+    "SCardControl", \
+    "SCardTransmit", \
+    "SCardListReaderGroups", \
+    "SCardListReaders", \
+    "SCardFreeMemory", \
+    "SCardCancel", \
+    "SCardGetAttrib", \
+    "SCardSetAttrib", \
+    "SCardTransmitBatch", \
+    "SCardWaitReaderChange", \
+    "SCardCancelReaderChange", \
+    "trace_write", \
+    "profile_read", \
+    "stats_read", \
+    "process_attach", \
+    "process_detach"
+
+#endif /* __WINE_SCARDTRACE_H */
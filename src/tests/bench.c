@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2023 Konstantin Romanov
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * Benchmarks, only run when WINSCARD_BENCH is set:
+ *   WINSCARD_BENCH=<file>             CSV results, "-" for stdout
+ *   WINSCARD_BENCH_ITERATIONS=<n>     operations per measure, 1000 by default
+ *   WINSCARD_BENCH_THREADS=<n>        most threads of the scaling measure, 8 by default
+ *
+ * They run against pcscd or against the fake library (WINSCARD_PCSCLITE), whose
+ * card holds the 4096 bytes EF 5001 read by the transmit measures. With another
+ * card, READ BINARY may fail but the round trips are still timed.
+ *
+ * Each CSV line is: benchmark,threads,payload,ops,seconds,ops_per_sec,p50_us,p99_us
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "windows.h"
+#include "winscard.h"
+#include "wine/test.h"
+
+#ifndef SCARD_PCI_T0
+static const SCARD_IO_REQUEST bench_T0Pci = { SCARD_PROTOCOL_T0, 8 };
+static const SCARD_IO_REQUEST bench_T1Pci = { SCARD_PROTOCOL_T1, 8 };
+#define SCARD_PCI_T0    (&bench_T0Pci)
+#define SCARD_PCI_T1    (&bench_T1Pci)
+#endif
+
+#define MAX_BENCH_THREADS 64
+
+static FILE *results;
+static DWORD iterations = 1000;
+static DWORD max_threads = 8;
+static LARGE_INTEGER frequency;
+static char reader[256];
+
+static LONGLONG now(void)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+static double ticks_to_us(LONGLONG ticks)
+{
+    return ticks * 1000000.0 / frequency.QuadPart;
+}
+
+static int compare_ticks(const void *a, const void *b)
+{
+    LONGLONG ta = *(const LONGLONG *)a, tb = *(const LONGLONG *)b;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* latencies holds the time of each operation, elapsed the wall time of all of them */
+static void report(const char *benchmark, DWORD threads, DWORD payload, LONGLONG *latencies, DWORD count,
+                   LONGLONG elapsed)
+{
+    double seconds = ticks_to_us(elapsed) / 1000000.0;
+
+    if (!count) return;
+    qsort(latencies, count, sizeof(*latencies), compare_ticks);
+    fprintf(results, "%s,%lu,%lu,%lu,%.6f,%.1f,%.2f,%.2f\n", benchmark, threads, payload, count, seconds,
+            seconds > 0 ? count / seconds : 0.0, ticks_to_us(latencies[count / 2]),
+            ticks_to_us(latencies[count - 1 - count / 100]));
+    fflush(results);
+    trace("%s threads %lu payload %lu: %.1f ops/s\n", benchmark, threads, payload,
+          seconds > 0 ? count / seconds : 0.0);
+}
+
+static const SCARD_IO_REQUEST *protocol_pci(DWORD protocol)
+{
+    return protocol == SCARD_PROTOCOL_T0 ? SCARD_PCI_T0 : SCARD_PCI_T1;
+}
+
+static LONG connect_card(SCARDCONTEXT context, SCARDHANDLE *card, DWORD *protocol)
+{
+    static const BYTE select_ef[] = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x50, 0x01 };
+    BYTE response[258];
+    DWORD length = sizeof(response);
+    LONG ret;
+
+    ret = SCardConnectA(context, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, card, protocol);
+    if (ret != SCARD_S_SUCCESS) return ret;
+    SCardTransmit(*card, protocol_pci(*protocol), select_ef, sizeof(select_ef), NULL, response, &length);
+    return SCARD_S_SUCCESS;
+}
+
+static void bench_transmit(SCARDHANDLE card, DWORD protocol, DWORD payload, LONGLONG *latencies)
+{
+    BYTE apdu[5] = { 0x00, 0xB0, 0x00, 0x00, (BYTE)payload };
+    BYTE response[258];
+    LONGLONG start, begin = now();
+    DWORD i, length;
+
+    for (i = 0; i < iterations; i++)
+    {
+        length = sizeof(response);
+        start = now();
+        SCardTransmit(card, protocol_pci(protocol), apdu, sizeof(apdu), NULL, response, &length);
+        latencies[i] = now() - start;
+    }
+    report("transmit", 1, payload, latencies, iterations, now() - begin);
+}
+
+static void bench_list_readers(SCARDCONTEXT context, LONGLONG *latencies)
+{
+    WCHAR list[4096];
+    LONGLONG start, begin = now();
+    DWORD i, length;
+
+    for (i = 0; i < iterations; i++)
+    {
+        length = ARRAY_SIZE(list);
+        start = now();
+        SCardListReadersW(context, NULL, list, &length);
+        latencies[i] = now() - start;
+    }
+    report("list_readers_w", 1, 0, latencies, iterations, now() - begin);
+}
+
+static void bench_connect(SCARDCONTEXT context, LONGLONG *latencies)
+{
+    SCARDHANDLE card;
+    LONGLONG start, begin = now();
+    DWORD i, count = 0, protocol;
+
+    for (i = 0; i < iterations; i++)
+    {
+        start = now();
+        if (SCardConnectA(context, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                          &card, &protocol) != SCARD_S_SUCCESS) continue;
+        SCardDisconnect(card, SCARD_LEAVE_CARD);
+        latencies[count++] = now() - start;
+    }
+    report("connect_disconnect", 1, 0, latencies, count, now() - begin);
+}
+
+struct wakeup_waiter
+{
+    SCARDCONTEXT context;
+    HANDLE ready;
+    LONG ret;
+    LONGLONG woken;
+};
+
+static DWORD WINAPI wakeup_thread(void *arg)
+{
+    struct wakeup_waiter *waiter = arg;
+    SCARD_READERSTATEA state;
+
+    memset(&state, 0, sizeof(state));
+    state.szReader = reader;
+    SCardGetStatusChangeA(waiter->context, 0, &state, 1);
+    state.dwCurrentState = state.dwEventState & ~SCARD_STATE_CHANGED;
+    SetEvent(waiter->ready);
+    waiter->ret = SCardGetStatusChangeA(waiter->context, INFINITE, &state, 1);
+    waiter->woken = now();
+    return 0;
+}
+
+/*
+ * time from a connection, which makes the reader in use, to the return of
+ * SCardGetStatusChange blocked on the reader state in another thread
+ */
+static void bench_wakeup(SCARDCONTEXT context, LONGLONG *latencies)
+{
+    struct wakeup_waiter waiter;
+    LONGLONG begin = now(), start;
+    DWORD i, count = 0, runs = min(iterations, 100), protocol;
+    SCARDHANDLE card;
+    HANDLE thread;
+    LONG ret;
+
+    /* a context of its own, pcsc-lite serializes the calls on a context */
+    if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &waiter.context) != SCARD_S_SUCCESS) return;
+    waiter.ready = CreateEventW(NULL, FALSE, FALSE, NULL);
+    for (i = 0; i < runs; i++)
+    {
+        thread = CreateThread(NULL, 0, wakeup_thread, &waiter, 0, NULL);
+        WaitForSingleObject(waiter.ready, INFINITE);
+        /* let the thread block in pcsc-lite */
+        Sleep(20);
+        start = now();
+        ret = SCardConnectA(context, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                            &card, &protocol);
+        if (ret != SCARD_S_SUCCESS) SCardCancel(waiter.context);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+        if (ret != SCARD_S_SUCCESS) break;
+        SCardDisconnect(card, SCARD_LEAVE_CARD);
+        if (waiter.ret != SCARD_S_SUCCESS) continue;
+        latencies[count++] = max(waiter.woken - start, 0);
+    }
+    CloseHandle(waiter.ready);
+    SCardReleaseContext(waiter.context);
+    report("status_change_wakeup", 1, 0, latencies, count, now() - begin);
+}
+
+struct scaling_info
+{
+    HANDLE start;
+    LONGLONG *latencies;
+    DWORD count;
+};
+
+static DWORD WINAPI scaling_thread(void *arg)
+{
+    static const BYTE apdu[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+    struct scaling_info *info = arg;
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    BYTE response[258];
+    LONGLONG start;
+    DWORD i, length, protocol;
+
+    if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &context) != SCARD_S_SUCCESS) return 1;
+    if (connect_card(context, &card, &protocol) == SCARD_S_SUCCESS)
+    {
+        WaitForSingleObject(info->start, INFINITE);
+        for (i = 0; i < iterations; i++)
+        {
+            length = sizeof(response);
+            start = now();
+            if (SCardTransmit(card, protocol_pci(protocol), apdu, sizeof(apdu), NULL, response, &length)
+                != SCARD_S_SUCCESS) continue;
+            info->latencies[info->count++] = now() - start;
+        }
+        SCardDisconnect(card, SCARD_LEAVE_CARD);
+    }
+    SCardReleaseContext(context);
+    return 0;
+}
+
+static void bench_scaling(void)
+{
+    struct scaling_info info[MAX_BENCH_THREADS];
+    HANDLE threads[MAX_BENCH_THREADS], start;
+    LONGLONG *latencies, begin;
+    DWORD count, total, i, j;
+
+    if (!(latencies = malloc(sizeof(*latencies) * iterations * max_threads)))
+    {
+        skip("not enough memory for %lu threads\n", max_threads);
+        return;
+    }
+    start = CreateEventW(NULL, TRUE, FALSE, NULL);
+    for (count = 1;; count = min(count * 2, max_threads))
+    {
+        ResetEvent(start);
+        for (i = 0; i < count; i++)
+        {
+            info[i].start = start;
+            info[i].latencies = latencies + i * iterations;
+            info[i].count = 0;
+            threads[i] = CreateThread(NULL, 0, scaling_thread, &info[i], 0, NULL);
+        }
+        /* give the threads time to connect */
+        Sleep(100);
+        begin = now();
+        SetEvent(start);
+        WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+        total = 0;
+        for (i = 0; i < count; i++)
+        {
+            CloseHandle(threads[i]);
+            for (j = 0; j < info[i].count; j++) latencies[total++] = info[i].latencies[j];
+        }
+        report("transmit_scaling", count, 16, latencies, total, now() - begin);
+        if (count == max_threads) break;
+    }
+    CloseHandle(start);
+    free(latencies);
+}
+
+START_TEST(bench)
+{
+    static const DWORD payloads[] = { 1, 16, 128, 255 };
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    DWORD length, protocol, i;
+    LONGLONG *latencies;
+    char value[MAX_PATH];
+    LONG ret;
+
+    if (!GetEnvironmentVariableA("WINSCARD_BENCH", value, sizeof(value)))
+    {
+        skip("WINSCARD_BENCH not set\n");
+        return;
+    }
+    if (!strcmp(value, "-")) results = stdout;
+    else if (!(results = fopen(value, "w")))
+    {
+        skip("cannot open %s\n", value);
+        return;
+    }
+    if (GetEnvironmentVariableA("WINSCARD_BENCH_ITERATIONS", value, sizeof(value)))
+        iterations = max(atoi(value), 1);
+    if (GetEnvironmentVariableA("WINSCARD_BENCH_THREADS", value, sizeof(value)))
+        max_threads = min(max(atoi(value), 1), MAX_BENCH_THREADS);
+    QueryPerformanceFrequency(&frequency);
+
+    ret = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &context);
+    if (ret != SCARD_S_SUCCESS)
+    {
+        skip("no context: %#lx\n", ret);
+        goto done;
+    }
+    /* the first reader */
+    length = sizeof(reader);
+    ret = SCardListReadersA(context, NULL, reader, &length);
+    if (ret != SCARD_S_SUCCESS)
+    {
+        skip("no reader: %#lx\n", ret);
+        SCardReleaseContext(context);
+        goto done;
+    }
+    trace("benchmarking %s\n", reader);
+
+    if (!(latencies = malloc(sizeof(*latencies) * iterations)))
+    {
+        skip("not enough memory for %lu iterations\n", iterations);
+        SCardReleaseContext(context);
+        goto done;
+    }
+    fprintf(results, "benchmark,threads,payload,ops,seconds,ops_per_sec,p50_us,p99_us\n");
+    if (connect_card(context, &card, &protocol) == SCARD_S_SUCCESS)
+    {
+        for (i = 0; i < ARRAY_SIZE(payloads); i++)
+            bench_transmit(card, protocol, payloads[i], latencies);
+        SCardDisconnect(card, SCARD_LEAVE_CARD);
+        bench_connect(context, latencies);
+        bench_scaling();
+    }
+    else skip("no card in %s\n", reader);
+    bench_list_readers(context, latencies);
+    bench_wakeup(context, latencies);
+    free(latencies);
+
+    ret = SCardReleaseContext(context);
+    ok(ret == SCARD_S_SUCCESS, "got %#lx\n", ret);
+done:
+    if (results != stdout) fclose(results);
+}
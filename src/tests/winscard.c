@@ -16,6 +16,8 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 
+#include <stdio.h>
+
 #include "windows.h"
 #include "winscard.h"
 #include "winsmcrd.h"
@@ -51,6 +53,11 @@ static void test_winscardA(void)
     BYTE pbRecvBuffer[10];
     BYTE pbSendBuffer[] = { 0x00, 0xA4, 0x00, 0x00, 0x02, 0x3F, 0x00 };
     DWORD dwSendLength, dwRecvLength;
+    SCARD_TRANSMIT_ITEM batch[2];
+    BYTE pbBatchRecv[2][10];
+    DWORD dwProcessed;
+    DWORD dwState2, dwProt2, dwAtrLen2;
+    BYTE pbAtr2[33];
     
     dwReaders = SCARD_AUTOALLOCATE;
     lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szReaders, &dwReaders);
@@ -59,6 +66,17 @@ static void test_winscardA(void)
         return;
     } else {
         ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+
+        /* later listings may come from the reader cache, they must not differ */
+        for (i = 0; i < 3; i++) {
+            char szList[1024];
+            DWORD dwList = sizeof(szList);
+            lRet = SCardListReadersA(hContext, "SCard$AllReaders\0", szList, &dwList);
+            ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+            ok(dwList == dwReaders, "got %lu, expected %lu\n", dwList, dwReaders);
+            ok(lRet != SCARD_S_SUCCESS || !memcmp(szList, szReaders, dwReaders), "lists differ\n");
+            Sleep(50);
+        }
         
         reader = szReaders;
         while (reader != NULL && *reader != '\0') {
@@ -155,6 +173,25 @@ static void test_winscardA(void)
             trace("%02X ", pbRecvBuffer[i]);
         trace("\n");
 
+        /* exchange the same APDU twice in one batch, using the protocol of the connection */
+        for (i = 0; i < 2; i++)
+        {
+            batch[i].pbSendBuffer = pbSendBuffer;
+            batch[i].cbSendLength = sizeof(pbSendBuffer);
+            batch[i].pbRecvBuffer = pbBatchRecv[i];
+            batch[i].cbRecvLength = sizeof(pbBatchRecv[i]);
+            batch[i].lResult = -1;
+        }
+        dwProcessed = 0;
+        lRet = SCardTransmitBatch(hCard, NULL, batch, 2, SCARD_TRANSMIT_STOP_ON_ERROR, &dwProcessed);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        ok(dwProcessed == 2, "got %lu\n", dwProcessed);
+        for (i = 0; i < 2; i++)
+        {
+            ok(batch[i].lResult == SCARD_S_SUCCESS, "%d: got %#lx\n", i, batch[i].lResult);
+            ok(batch[i].cbRecvLength == dwRecvLength, "%d: got %lu\n", i, batch[i].cbRecvLength);
+        }
+
         /* card reconnect */
         lRet = SCardReconnect(hCard, SCARD_SHARE_SHARED,
                 SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD,
@@ -168,6 +205,19 @@ static void test_winscardA(void)
             pbAtr, &dwAtrLen);
         ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
 
+        /* SCardState agrees with SCardStatusA, from the card state cache or not */
+        for (i = 0; i < 2; i++)
+        {
+            dwAtrLen2 = sizeof(pbAtr2);
+            lRet = SCardState(hCard, &dwState2, &dwProt2, pbAtr2, &dwAtrLen2);
+            ok(lRet == SCARD_S_SUCCESS, "%d: got %#lx\n", i, lRet);
+            ok(dwState2 == dwState, "%d: got state %#lx, expected %#lx\n", i, dwState2, dwState);
+            ok(dwProt2 == dwProt, "%d: got protocol %lu, expected %lu\n", i, dwProt2, dwProt);
+            ok(dwAtrLen2 == dwAtrLen && !memcmp(pbAtr2, pbAtr, dwAtrLen), "%d: ATR differs\n", i);
+            lRet = SCardFlushStatus(hCard);
+            ok(lRet == SCARD_S_SUCCESS, "%d: got %#lx\n", i, lRet);
+        }
+
         /* begin transaction */
         lRet = SCardBeginTransaction(hCard);
         ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
@@ -365,10 +415,558 @@ end:
     }
 }
 
+static void test_events(void)
+{
+    HANDLE event, event2;
+
+    event = SCardAccessStartedEvent();
+    ok(event != NULL, "got NULL\n");
+    SCardReleaseStartedEvent(event);
+
+    event = SCardAccessNewReaderEvent();
+    ok(event != NULL, "got NULL\n");
+    /* every caller gets its own event, so that each of them is woken */
+    event2 = SCardAccessNewReaderEvent();
+    ok(event2 != NULL, "got NULL\n");
+    ok(event2 != event, "got the same event %p\n", event);
+
+    /* no reader is plugged or unplugged during the test */
+    ok(WaitForSingleObject(event, 200) == WAIT_TIMEOUT, "event signaled\n");
+    ok(WaitForSingleObject(event2, 0) == WAIT_TIMEOUT, "event signaled\n");
+
+    SCardReleaseNewReaderEvent(event2);
+    SCardReleaseNewReaderEvent(event);
+
+    event = SCardAccessNewReaderEvent();
+    ok(event != NULL, "got NULL\n");
+    SCardReleaseAllEvents();
+}
+
+static void test_card_types(void)
+{
+    static const BYTE atr[] = { 0x3b, 0x8f, 0x80, 0x01, 0x80, 0x4f, 0x0c, 0xa0, 0x00, 0x00, 0x03, 0x06,
+                                0x03, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x6a };
+    static const GUID provider = { 0x12345678, 0x1234, 0x1234, { 0x12, 0x34, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc } };
+    BYTE mask[sizeof(atr)], other[sizeof(atr)];
+    char szCards[256], szProvider[64];
+    LPSCARD_READERSTATEA lpState;
+    SCARD_ATRMASK atrMask;
+    LPSTR szReaders = NULL;
+    DWORD dwLen, dwReaders = SCARD_AUTOALLOCATE;
+    GUID guid;
+    LONG lRet;
+
+    /* historical bytes are ignored */
+    memset(mask, 0xff, sizeof(mask));
+    memset(mask + 4, 0, 15);
+    lRet = SCardIntroduceCardTypeA(hContext, "Wine Test Card", &provider, NULL, 0, atr, mask, sizeof(atr));
+    if(lRet == SCARD_E_NO_ACCESS)
+    {
+        skip("no access to the smart card database\n");
+        return;
+    }
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+
+    memcpy(other, atr, sizeof(atr));
+    other[10] = 0x42;
+    dwLen = sizeof(szCards);
+    lRet = SCardListCardsA(hContext, other, NULL, 0, szCards, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(dwLen == sizeof("Wine Test Card") + 1 && !strcmp(szCards, "Wine Test Card"), "got %s %lu\n", szCards, dwLen);
+
+    other[0] = 0x3f;
+    dwLen = sizeof(szCards);
+    lRet = SCardListCardsA(hContext, other, NULL, 0, szCards, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(dwLen == 2 && !szCards[0], "got %s %lu\n", szCards, dwLen);
+
+    lRet = SCardGetProviderIdA(hContext, "Wine Test Card", &guid);
+    ok(lRet == SCARD_S_SUCCESS && !memcmp(&guid, &provider, sizeof(guid)), "got %#lx\n", lRet);
+
+    lRet = SCardSetCardTypeProviderNameA(hContext, "Wine Test Card", SCARD_PROVIDER_CSP, "Wine Test CSP");
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    dwLen = sizeof(szProvider);
+    lRet = SCardGetCardTypeProviderNameA(hContext, "Wine Test Card", SCARD_PROVIDER_CSP, szProvider, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS && !strcmp(szProvider, "Wine Test CSP"), "got %#lx %s\n", lRet, szProvider);
+
+    /* no reader needs to hold the card */
+    lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szReaders, &dwReaders);
+    if(lRet == SCARD_S_SUCCESS)
+    {
+        lpState = calloc(1, sizeof(*lpState));
+        lpState->szReader = szReaders;
+        lRet = SCardLocateCardsA(hContext, "Wine Test Card\0", lpState, 1);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        ok(lpState->dwEventState & SCARD_STATE_CHANGED, "got %#lx\n", lpState->dwEventState);
+
+        /* any card with the same first byte, without a card the length only needs to be valid */
+        memset(&atrMask, 0, sizeof(atrMask));
+        atrMask.cbAtr = (lpState->dwEventState & SCARD_STATE_PRESENT) && lpState->cbAtr ? lpState->cbAtr : 2;
+        atrMask.rgbAtr[0] = lpState->rgbAtr[0];
+        atrMask.rgbMask[0] = 0xff;
+        lpState->dwCurrentState = lpState->dwEventState;
+        lRet = SCardLocateCardsByATRA(hContext, &atrMask, 1, lpState, 1);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        if(lpState->dwEventState & SCARD_STATE_PRESENT)
+            ok(lpState->dwEventState & SCARD_STATE_ATRMATCH, "got %#lx\n", lpState->dwEventState);
+        atrMask.cbAtr = 0;
+        lRet = SCardLocateCardsByATRA(hContext, &atrMask, 1, lpState, 1);
+        ok(lRet == SCARD_E_INVALID_PARAMETER, "got %#lx\n", lRet);
+        free(lpState);
+        SCardFreeMemory(hContext, szReaders);
+    }
+
+    lRet = SCardForgetCardTypeA(hContext, "Wine Test Card");
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    lRet = SCardForgetCardTypeA(hContext, "Wine Test Card");
+    ok(lRet == SCARD_E_UNKNOWN_CARD, "got %#lx\n", lRet);
+    lRet = SCardGetProviderIdA(hContext, "Wine Test Card", &guid);
+    ok(lRet == SCARD_E_UNKNOWN_CARD, "got %#lx\n", lRet);
+}
+
+static void test_reader_groups(void)
+{
+    char szGroups[1024], szReaders[1024], *szGroup;
+    LPSTR szAll = NULL;
+    DWORD dwLen, dwAll = SCARD_AUTOALLOCATE;
+    BOOL bFound = FALSE;
+    LONG lRet;
+
+    lRet = SCardIntroduceReaderGroupA(hContext, "Wine Test Group");
+    if(lRet == SCARD_E_NO_ACCESS)
+    {
+        skip("no access to the reader groups\n");
+        return;
+    }
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+
+    dwLen = sizeof(szGroups);
+    lRet = SCardListReaderGroupsA(hContext, szGroups, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    for(szGroup = szGroups; lRet == SCARD_S_SUCCESS && *szGroup; szGroup += strlen(szGroup) + 1)
+        bFound |= !strcmp(szGroup, "Wine Test Group");
+    ok(bFound, "group not listed\n");
+
+    /* no member yet */
+    dwLen = sizeof(szReaders);
+    lRet = SCardListReadersA(hContext, "Wine Test Group\0", szReaders, &dwLen);
+    ok(lRet == SCARD_E_NO_READERS_AVAILABLE, "got %#lx\n", lRet);
+
+    lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szAll, &dwAll);
+    if(lRet == SCARD_S_SUCCESS)
+    {
+        lRet = SCardAddReaderToGroupA(hContext, szAll, "Wine Test Group");
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        dwLen = sizeof(szReaders);
+        lRet = SCardListReadersA(hContext, "Wine Test Group\0", szReaders, &dwLen);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        ok(dwLen == strlen(szAll) + 2 && !strcmp(szReaders, szAll), "got %s %lu\n", szReaders, dwLen);
+
+        lRet = SCardRemoveReaderFromGroupA(hContext, szAll, "Wine Test Group");
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        dwLen = sizeof(szReaders);
+        lRet = SCardListReadersA(hContext, "Wine Test Group\0", szReaders, &dwLen);
+        ok(lRet == SCARD_E_NO_READERS_AVAILABLE, "got %#lx\n", lRet);
+        SCardFreeMemory(hContext, szAll);
+    }
+
+    lRet = SCardForgetReaderGroupA(hContext, "Wine Test Group");
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+}
+
+static void test_reader_aliases(void)
+{
+    SCARD_READERSTATEA states[2];
+    LPSTR szAll = NULL;
+    DWORD dwAll = SCARD_AUTOALLOCATE;
+    LONG lRet;
+
+    lRet = SCardForgetReaderA(hContext, "Wine Test Reader");
+    ok(lRet == SCARD_E_UNKNOWN_READER, "got %#lx\n", lRet);
+
+    lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szAll, &dwAll);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        skip("no reader\n");
+        return;
+    }
+    lRet = SCardIntroduceReaderA(hContext, "Wine Test Reader", szAll);
+    if(lRet == SCARD_E_NO_ACCESS)
+    {
+        skip("no access to the readers database\n");
+        SCardFreeMemory(hContext, szAll);
+        return;
+    }
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+
+    /* the alias is seen as its device */
+    memset(states, 0, sizeof(states));
+    states[0].szReader = szAll;
+    states[1].szReader = "Wine Test Reader";
+    lRet = SCardGetStatusChangeA(hContext, 0, states, 2);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(states[1].dwEventState == states[0].dwEventState, "got %#lx, expected %#lx\n",
+        states[1].dwEventState, states[0].dwEventState);
+    ok(!(states[1].dwEventState & SCARD_STATE_UNKNOWN), "alias not resolved, got %#lx\n", states[1].dwEventState);
+    ok(states[1].cbAtr == states[0].cbAtr && !memcmp(states[1].rgbAtr, states[0].rgbAtr, states[0].cbAtr),
+        "got an ATR of %lu bytes, expected %lu\n", states[1].cbAtr, states[0].cbAtr);
+
+    lRet = SCardForgetReaderA(hContext, "Wine Test Reader");
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    memset(states, 0, sizeof(states));
+    states[0].szReader = "Wine Test Reader";
+    lRet = SCardGetStatusChangeA(hContext, 0, states, 1);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(states[0].dwEventState & SCARD_STATE_UNKNOWN, "got %#lx\n", states[0].dwEventState);
+    SCardFreeMemory(hContext, szAll);
+}
+
+static void test_many_readers(void)
+{
+    SCARD_READERSTATEA states[40];
+    LPSTR szAll = NULL;
+    DWORD i, dwAll = SCARD_AUTOALLOCATE;
+    LONG lRet;
+
+    lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szAll, &dwAll);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        skip("no reader\n");
+        return;
+    }
+
+    /* more states than pcsc-lite takes in one call */
+    memset(states, 0, sizeof(states));
+    for(i = 0; i < ARRAY_SIZE(states); i++)
+        states[i].szReader = szAll;
+    lRet = SCardGetStatusChangeA(hContext, 0, states, ARRAY_SIZE(states));
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    for(i = 1; i < ARRAY_SIZE(states); i++)
+        ok(states[i].dwEventState == states[0].dwEventState, "%lu: got %#lx, expected %#lx\n",
+            i, states[i].dwEventState, states[0].dwEventState);
+
+    for(i = 0; i < ARRAY_SIZE(states); i++)
+        states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+    lRet = SCardGetStatusChangeA(hContext, 100, states, ARRAY_SIZE(states));
+    ok(lRet == SCARD_E_TIMEOUT, "got %#lx\n", lRet);
+    SCardFreeMemory(hContext, szAll);
+}
+
+/* needs the fake library (WINSCARD_PCSCLITE) and WINSCARD_T0_AUTO_RESPONSE=1 */
+static void test_t0_responses(void)
+{
+    static const BYTE select_df[] = { 0x00, 0xA4, 0x04, 0x00, 0x08, 'F', 'A', 'K', 'E', 'P', 'C', 'S', 'C' };
+    static const BYTE select_ef[] = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x50, 0x01 };
+    static const BYTE read_end[] = { 0x00, 0xB0, 0x0F, 0xFA, 0x10 };    /* 16 bytes asked, 6 left */
+    static const BYTE read_past[] = { 0x00, 0xB0, 0x10, 0x00, 0x10 };
+    BYTE response[258], batch_recv[3][32];
+    SCARD_TRANSMIT_ITEM batch[3];
+    LPSTR szAll = NULL;
+    DWORD i, dwLen, dwProtocol, dwProcessed, dwAll = SCARD_AUTOALLOCATE;
+    SCARDHANDLE hCard;
+    LONG lRet;
+
+    lRet = SCardListReadersA(hContext, NULL, (LPSTR)&szAll, &dwAll);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        skip("no reader\n");
+        return;
+    }
+    lRet = SCardConnectA(hContext, szAll, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0, &hCard, &dwProtocol);
+    SCardFreeMemory(hContext, szAll);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        skip("no T=0 card\n");
+        return;
+    }
+
+    /* 61xx: the FCP comes with the answer to SELECT */
+    dwLen = sizeof(response);
+    lRet = SCardTransmit(hCard, SCARD_PCI_T0, select_df, sizeof(select_df), NULL, response, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    if(lRet != SCARD_S_SUCCESS || dwLen < 2 || (response[dwLen - 2] != 0x90 && response[dwLen - 2] != 0x61))
+        skip("not the fake card\n");
+    else if(dwLen == 2)
+        skip("T=0 responses are not chained\n");
+    else
+    {
+        ok(dwLen == 12, "got %lu bytes\n", dwLen);
+        ok(response[0] == 0x62 && response[10] == 0x90 && response[11] == 0x00, "got %02x %02x%02x\n",
+            response[0], response[dwLen - 2], response[dwLen - 1]);
+
+        /* the complete response doesn't fit */
+        dwLen = 4;
+        lRet = SCardTransmit(hCard, SCARD_PCI_T0, select_df, sizeof(select_df), NULL, response, &dwLen);
+        ok(lRet == SCARD_E_INSUFFICIENT_BUFFER, "got %#lx\n", lRet);
+
+        /* 6Cxx: READ BINARY is sent again with the length left in the file */
+        dwLen = sizeof(response);
+        lRet = SCardTransmit(hCard, SCARD_PCI_T0, select_ef, sizeof(select_ef), NULL, response, &dwLen);
+        ok(lRet == SCARD_S_SUCCESS && dwLen == 2 && response[0] == 0x90, "got %#lx, %lu bytes\n", lRet, dwLen);
+        dwLen = sizeof(response);
+        lRet = SCardTransmit(hCard, SCARD_PCI_T0, read_end, sizeof(read_end), NULL, response, &dwLen);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+        ok(dwLen == 8, "got %lu bytes\n", dwLen);
+        for(i = 0; i < 6 && dwLen == 8; i++)
+            ok(response[i] == (BYTE)(0x0FFA + i + 1), "%lu: got %02x\n", i, response[i]);
+        ok(dwLen == 8 && response[6] == 0x90 && response[7] == 0x00, "wrong status word\n");
+
+        /* a batch stopped by a status word, READ BINARY past the end gets 6B00 */
+        memset(batch, 0, sizeof(batch));
+        batch[0].pbSendBuffer = read_end;
+        batch[1].pbSendBuffer = read_past;
+        batch[2].pbSendBuffer = read_end;
+        for(i = 0; i < ARRAY_SIZE(batch); i++)
+        {
+            batch[i].cbSendLength = sizeof(read_end);
+            batch[i].pbRecvBuffer = batch_recv[i];
+            batch[i].cbRecvLength = sizeof(batch_recv[i]);
+        }
+        lRet = SCardTransmitBatch(hCard, SCARD_PCI_T0, batch, ARRAY_SIZE(batch), SCARD_TRANSMIT_STOP_ON_SW, &dwProcessed);
+        ok(lRet == SCARD_W_TRANSMIT_STOPPED, "got %#lx\n", lRet);
+        ok(dwProcessed == 2, "got %lu\n", dwProcessed);
+        ok(batch[0].lResult == SCARD_S_SUCCESS, "got %#lx\n", batch[0].lResult);
+        ok(batch[1].lResult == SCARD_W_TRANSMIT_STOPPED, "got %#lx\n", batch[1].lResult);
+        ok(batch[1].cbRecvLength == 2 && batch_recv[1][0] == 0x6B, "got %lu bytes\n", batch[1].cbRecvLength);
+        ok(batch[2].lResult == SCARD_E_NOT_TRANSACTED, "got %#lx\n", batch[2].lResult);
+    }
+
+    lRet = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+}
+
+/* calls made by the child process, first recorded against the fake library then replayed */
+static void session_calls(void)
+{
+    static const BYTE select_df[] = { 0x00, 0xA4, 0x04, 0x00, 0x08, 'F', 'A', 'K', 'E', 'P', 'C', 'S', 'C' };
+    static const BYTE select_ef[] = { 0x00, 0xA4, 0x00, 0x0C, 0x02, 0x50, 0x01 };
+    static const BYTE read_start[] = { 0x00, 0xB0, 0x00, 0x00, 0x10 };
+    static const BYTE verify[] = { 0x00, 0x20, 0x00, 0x81, 0x06, '1', '2', '3', '4', '5', '6' };
+    BYTE response[258];
+    LPSTR szAll = NULL;
+    DWORD i, dwLen, dwProtocol, dwAll = SCARD_AUTOALLOCATE;
+    SCARDCONTEXT hSession;
+    SCARDHANDLE hCard;
+    LONG lRet;
+
+    lRet = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hSession);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    lRet = SCardListReadersA(hSession, NULL, (LPSTR)&szAll, &dwAll);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        SCardReleaseContext(hSession);
+        return;
+    }
+    lRet = SCardConnectA(hSession, szAll, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &hCard, &dwProtocol);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(dwProtocol == SCARD_PROTOCOL_T1, "got %lu\n", dwProtocol);
+    SCardFreeMemory(hSession, szAll);
+
+    dwLen = sizeof(response);
+    lRet = SCardTransmit(hCard, SCARD_PCI_T1, select_df, sizeof(select_df), NULL, response, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS && dwLen >= 2 && response[dwLen - 2] == 0x90, "got %#lx, %lu bytes\n", lRet, dwLen);
+    dwLen = sizeof(response);
+    lRet = SCardTransmit(hCard, SCARD_PCI_T1, select_ef, sizeof(select_ef), NULL, response, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS && dwLen == 2 && response[0] == 0x90, "got %#lx, %lu bytes\n", lRet, dwLen);
+    dwLen = sizeof(response);
+    lRet = SCardTransmit(hCard, SCARD_PCI_T1, read_start, sizeof(read_start), NULL, response, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS && dwLen == 18, "got %#lx, %lu bytes\n", lRet, dwLen);
+    for(i = 0; i < 16 && dwLen == 18; i++)
+        ok(response[i] == (BYTE)(0x5001 + i), "%lu: got %02x\n", i, response[i]);
+    /* the fake card doesn't know VERIFY, it is only there to be masked */
+    dwLen = sizeof(response);
+    lRet = SCardTransmit(hCard, SCARD_PCI_T1, verify, sizeof(verify), NULL, response, &dwLen);
+    ok(lRet == SCARD_S_SUCCESS && dwLen == 2 && response[0] == 0x6D, "got %#lx, %lu bytes\n", lRet, dwLen);
+
+    lRet = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    lRet = SCardReleaseContext(hSession);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+}
+
+/* the settings are read when the dll is loaded, a child process gets them from the environment */
+static void run_child(const char *szTest)
+{
+    STARTUPINFOA si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    char cmd[MAX_PATH + 32], **argv;
+
+    winetest_get_mainargs(&argv);
+    sprintf(cmd, "\"%s\" winscard %s", argv[0], szTest);
+    ok(CreateProcessA(NULL, cmd, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi), "error %lu\n", GetLastError());
+    wait_child_process(pi.hProcess);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+
+/* needs the fake library (WINSCARD_PCSCLITE) */
+static void test_session_replay(void)
+{
+    char szLibrary[MAX_PATH], szTemp[MAX_PATH], szFile[MAX_PATH], data[65536];
+    DWORD i, dwRead = 0;
+    HANDLE hFile;
+
+    if(!GetEnvironmentVariableA("WINSCARD_PCSCLITE", szLibrary, sizeof(szLibrary)))
+    {
+        skip("needs the fake pcsc-lite library\n");
+        return;
+    }
+    GetTempPathA(sizeof(szTemp), szTemp);
+    GetTempFileNameA(szTemp, "scr", 0, szFile);
+
+    SetEnvironmentVariableA("WINSCARD_RECORD", szFile);
+    run_child("session");
+    SetEnvironmentVariableA("WINSCARD_RECORD", NULL);
+
+    hFile = CreateFileA(szFile, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+    ok(hFile != INVALID_HANDLE_VALUE, "error %lu\n", GetLastError());
+    ReadFile(hFile, data, sizeof(data), &dwRead, NULL);
+    CloseHandle(hFile);
+    ok(dwRead > 8, "got %lu bytes\n", dwRead);
+    for(i = 0; i + 6 <= dwRead; i++)
+        if(!memcmp(data + i, "123456", 6)) break;
+    ok(i + 6 > dwRead, "the PIN was recorded at %lu\n", i);
+
+    /* the same calls get the same answers, with no library behind them */
+    SetEnvironmentVariableA("WINSCARD_PCSCLITE", "nonexistent.so");
+    SetEnvironmentVariableA("WINSCARD_REPLAY", szFile);
+    run_child("session");
+    SetEnvironmentVariableA("WINSCARD_REPLAY", NULL);
+    SetEnvironmentVariableA("WINSCARD_PCSCLITE", szLibrary);
+
+    DeleteFileA(szFile);
+}
+
+/* SCardStatus calls that went to pcsc-lite, from the statistics of the child process */
+static DWORD status_calls(const char *szFile)
+{
+    char data[16384], *line, function[64];
+    DWORD dwRead = 0, tid, count, total = 0;
+    HANDLE hFile;
+
+    ok(SCardDumpStatistics(szFile) == SCARD_S_SUCCESS, "can't write the statistics\n");
+    hFile = CreateFileA(szFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+        return 0;
+    ReadFile(hFile, data, sizeof(data) - 1, &dwRead, NULL);
+    CloseHandle(hFile);
+    data[dwRead] = 0;
+    for(line = strtok(data, "\n"); line; line = strtok(NULL, "\n"))
+    {
+        if(sscanf(line, "call,%lu,%63[^,],%lu", &tid, function, &count) == 3 && !strcmp(function, "SCardStatus"))
+            total += count;
+    }
+    return total;
+}
+
+/* run by the child process with WINSCARD_STATUS_CACHE and WINSCARD_STATS */
+static void status_cache_calls(const char *szFile)
+{
+    BYTE atr[MAX_ATR_SIZE], cached_atr[MAX_ATR_SIZE];
+    DWORD i, dwState, dwProtocol, dwAtrLen, dwCachedState, dwCachedProtocol, dwCachedAtrLen, dwCalls;
+    LPSTR szAll = NULL;
+    DWORD dwAll = SCARD_AUTOALLOCATE;
+    SCARDCONTEXT hCache;
+    SCARDHANDLE hCard;
+    LONG lRet;
+
+    lRet = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &hCache);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    lRet = SCardListReadersA(hCache, NULL, (LPSTR)&szAll, &dwAll);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    if(lRet != SCARD_S_SUCCESS)
+    {
+        SCardReleaseContext(hCache);
+        return;
+    }
+    lRet = SCardConnectA(hCache, szAll, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &hCard, &dwProtocol);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    SCardFreeMemory(hCache, szAll);
+
+    /* the cache answers once the reader watch thread has reported the readers */
+    dwAtrLen = sizeof(atr);
+    lRet = SCardState(hCard, &dwState, &dwProtocol, atr, &dwAtrLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    for(i = 0; i < 20; i++)
+    {
+        Sleep(50);
+        dwCachedAtrLen = sizeof(cached_atr);
+        SCardState(hCard, &dwCachedState, &dwCachedProtocol, cached_atr, &dwCachedAtrLen);
+    }
+
+    dwCalls = status_calls(szFile);
+    ok(dwCalls >= 1, "got %lu calls\n", dwCalls);
+    for(i = 0; i < 10; i++)
+    {
+        dwCachedAtrLen = sizeof(cached_atr);
+        lRet = SCardState(hCard, &dwCachedState, &dwCachedProtocol, cached_atr, &dwCachedAtrLen);
+        ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    }
+    ok(status_calls(szFile) == dwCalls, "cached answers went to pcsc-lite\n");
+    ok(dwCachedState == dwState, "got %#lx, expected %#lx\n", dwCachedState, dwState);
+    ok(dwCachedProtocol == dwProtocol, "got %lu, expected %lu\n", dwCachedProtocol, dwProtocol);
+    ok(dwCachedAtrLen == dwAtrLen && !memcmp(cached_atr, atr, dwAtrLen), "wrong ATR\n");
+
+    /* the next call after a flush asks pcsc-lite, and refills the cache */
+    lRet = SCardFlushStatus(hCard);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    dwCachedAtrLen = sizeof(cached_atr);
+    lRet = SCardState(hCard, &dwCachedState, &dwCachedProtocol, cached_atr, &dwCachedAtrLen);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    ok(status_calls(szFile) == dwCalls + 1, "the flushed state didn't go to pcsc-lite\n");
+    dwCachedAtrLen = sizeof(cached_atr);
+    SCardState(hCard, &dwCachedState, &dwCachedProtocol, cached_atr, &dwCachedAtrLen);
+    ok(status_calls(szFile) == dwCalls + 1, "the refilled cache went to pcsc-lite\n");
+
+    lRet = SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+    lRet = SCardReleaseContext(hCache);
+    ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
+}
+
+/* needs the fake library (WINSCARD_PCSCLITE) */
+static void test_status_cache(void)
+{
+    char szLibrary[MAX_PATH], szTemp[MAX_PATH], szFile[MAX_PATH];
+
+    if(!GetEnvironmentVariableA("WINSCARD_PCSCLITE", szLibrary, sizeof(szLibrary)))
+    {
+        skip("needs the fake pcsc-lite library\n");
+        return;
+    }
+    GetTempPathA(sizeof(szTemp), szTemp);
+    GetTempFileNameA(szTemp, "scs", 0, szFile);
+
+    SetEnvironmentVariableA("WINSCARD_STATUS_CACHE", "60000");
+    SetEnvironmentVariableA("WINSCARD_STATS", szFile);
+    run_child("status_cache");
+    SetEnvironmentVariableA("WINSCARD_STATS", NULL);
+    SetEnvironmentVariableA("WINSCARD_STATUS_CACHE", NULL);
+
+    DeleteFileA(szFile);
+}
+
 START_TEST(winscard)
 {
     //SCARD_SCOPE_SYSTEM
-    LONG lRet = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+    LONG lRet;
+    char **argv, szFile[MAX_PATH];
+    int argc = winetest_get_mainargs(&argv);
+
+    if(argc >= 3 && !strcmp(argv[2], "session"))
+    {
+        session_calls();
+        return;
+    }
+    if(argc >= 3 && !strcmp(argv[2], "status_cache"))
+    {
+        if(GetEnvironmentVariableA("WINSCARD_STATS", szFile, sizeof(szFile)))
+            status_cache_calls(szFile);
+        return;
+    }
+
+    lRet = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
     if(lRet == SCARD_E_NO_SERVICE) 
     {
         skip("pcscd daemon not running\n");
@@ -378,6 +976,14 @@ START_TEST(winscard)
     
     test_winscardA();
     test_winscardW();
+    test_events();
+    test_card_types();
+    test_reader_groups();
+    test_reader_aliases();
+    test_many_readers();
+    test_t0_responses();
+    test_session_replay();
+    test_status_cache();
     
     lRet = SCardReleaseContext(hContext);
     ok(lRet == SCARD_S_SUCCESS, "got %#lx\n", lRet);
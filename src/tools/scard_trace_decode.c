@@ -0,0 +1,115 @@
+/*
+ * Decoder for the WinScard binary trace (WINSCARD_TRACE)
+ *
+ * Copyright 2023 Konstantin Romanov
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Build with make in this directory, or:
+ *   cc -I.. -o scard_trace_decode scard_trace_decode.c
+ * Usage: scard_trace_decode [-s] trace_file
+ *   prints one line per record, sorted by start time with -s
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "scardtrace.h"
+
+static const char * const func_names[] = { SCARD_TRACE_FUNC_NAMES };
+
+static int compare_start( const void *a, const void *b )
+{
+    const struct scard_trace_record *ra = a, *rb = b;
+    if (ra->start != rb->start) return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+static void print_record( const struct scard_trace_record *record, uint64_t origin )
+{
+    const char *func = record->func < sizeof(func_names) / sizeof(func_names[0]) ? func_names[record->func] : "?";
+
+    printf( "%14.6f %8" PRIu32 ".%03" PRIu32 "us %5" PRIu32 " %-4s %-24s %#10" PRIx64 " 0x%08" PRIx32,
+            (record->start - origin) / 1e9, record->duration / 1000, record->duration % 1000, record->tid,
+            record->source == SCARD_TRACE_SOURCE_PCSC ? "pcsc" : "dll", func, record->handle,
+            (uint32_t)record->result );
+    if (record->flags & SCARD_TRACE_FLAG_APDU)
+        printf( " apdu %02X %02X %02X %02X", record->apdu[0], record->apdu[1], record->apdu[2], record->apdu[3] );
+    if (record->flags & SCARD_TRACE_FLAG_SW)
+        printf( " sw %04X", record->sw );
+    printf( "\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+    struct scard_trace_header header;
+    struct scard_trace_record *records = NULL;
+    size_t count = 0, capacity = 0, i;
+    uint64_t origin = UINT64_MAX;
+    int sort = 0, arg = 1;
+    FILE *file;
+
+    if (arg < argc && !strcmp( argv[arg], "-s" ))
+    {
+        sort = 1;
+        arg++;
+    }
+    if (arg + 1 != argc)
+    {
+        fprintf( stderr, "usage: %s [-s] trace_file\n", argv[0] );
+        return 2;
+    }
+    if (!(file = fopen( argv[arg], "rb" )))
+    {
+        perror( argv[arg] );
+        return 1;
+    }
+    if (fread( &header, sizeof(header), 1, file ) != 1 || header.magic != SCARD_TRACE_MAGIC)
+    {
+        fprintf( stderr, "%s: not a winscard trace\n", argv[arg] );
+        return 1;
+    }
+    if (header.version != SCARD_TRACE_VERSION || header.record_size != sizeof(*records))
+    {
+        fprintf( stderr, "%s: unsupported trace version %u\n", argv[arg], header.version );
+        return 1;
+    }
+
+    for (;;)
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4096;
+            if (!(records = realloc( records, capacity * sizeof(*records) )))
+            {
+                fprintf( stderr, "out of memory\n" );
+                return 1;
+            }
+        }
+        if (fread( &records[count], sizeof(*records), 1, file ) != 1) break;
+        if (records[count].start < origin) origin = records[count].start;
+        count++;
+    }
+    fclose( file );
+
+    if (sort) qsort( records, count, sizeof(*records), compare_start );
+    printf( "# pid %u, %zu records\n", header.pid, count );
+    printf( "#      start(s)       duration   tid from function                     handle     result\n" );
+    for (i = 0; i < count; i++) print_record( &records[i], origin );
+    free( records );
+    return 0;
+}
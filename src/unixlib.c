@@ -25,11 +25,26 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT_PROBES 1
+#endif
+#endif
 
 #define __user
 #include "unixlib.h"
@@ -80,16 +95,1408 @@ static void* g_pcscliteHandle = NULL;
    MAKE_FUNCPTR(SCardSetAttrib);
 #undef MAKE_FUNCPTR
 
-static BOOL load_pcsclite(void);
+static BOOL load_pcsclite( struct process_attach_params *params );
+static void session_detach(void);
+
+#define PCSCLITE_SCARD_PROTOCOL_T0    0x00000001
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    /* the clock Wine uses for QueryPerformanceCounter */
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+#else
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ns( uint64_t ns )
+{
+    struct timespec delay;
+    delay.tv_sec = ns / 1000000000;
+    delay.tv_nsec = ns % 1000000000;
+    while (nanosleep( &delay, &delay ) && errno == EINTR);
+}
+
+/*
+ * Layer profile, enabled by WINSCARD_PROFILE=<file>. Every thunk is timed along
+ * with the part its thread spent in libpcsclite, which includes the round trip
+ * to pcscd: the two can't be told apart from the client side. The dll reads
+ * the totals with profile_read, adds its own layers and writes the file.
+ */
+static BOOL profile_enabled = FALSE;
+static __thread uint64_t profile_pcsclite_ns;
+static struct scard_profile_counter profile_counters[unix_process_detach + 1];
+
+static inline uint64_t profile_pcsclite_enter(void)
+{
+    return profile_enabled ? trace_now() : 0;
+}
+
+static inline void profile_pcsclite_leave( uint64_t start )
+{
+    if (start) profile_pcsclite_ns += trace_now() - start;
+}
+
+static void profile_attach(void)
+{
+    const char *file = getenv( "WINSCARD_PROFILE" );
+    profile_enabled = file && *file;
+}
+
+static void profile_record( enum unix_funcs code, uint64_t start, uint64_t pcsclite_ns )
+{
+    struct scard_profile_counter *counter = &profile_counters[code];
+    __atomic_fetch_add( &counter->count, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &counter->thunk_ns, trace_now() - start, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &counter->pcsclite_ns, pcsclite_ns, __ATOMIC_RELAXED );
+}
+
+/*
+ * Fault injection in front of libpcsclite, configured by WINSCARD_FAULTS with
+ * rules separated by ';':
+ *   <function or *>:<option>,<option>...
+ * where the options are
+ *   delay=<us>          added to every call
+ *   jitter=<us>         plus a uniformly distributed part up to this
+ *   spike=<us>          plus this for the share of the calls given by spike_rate
+ *   spike_rate=<0..1>
+ *   error=<code>        returned instead of calling pcsc-lite, for the share of
+ *                       the calls given by rate
+ *   rate=<0..1>         1 by default
+ * The error is reset, removed, no_service, timeout, comm or a numeric code.
+ * A "seed=<n>" rule makes the random draws repeatable. For example
+ *   WINSCARD_FAULTS="SCardTransmit:delay=2000,jitter=500,error=reset,rate=0.01"
+ * The delays happen on the calling thread, and count as pcsc-lite time in the profile.
+ */
+struct fault_rule
+{
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    uint64_t spike_ns;
+    uint64_t spike_threshold;   /* 32 bits random draws below it spike */
+    uint64_t error_threshold;   /* 32 bits random draws below it fail */
+    LONG error;
+};
+
+static BOOL faults_enabled = FALSE;
+static struct fault_rule fault_rules[unix_SCardTransmitBatch];  /* the pcsc-lite functions */
+static uint64_t fault_seed;
+static unsigned int fault_threads = 0;
+static unsigned long fault_errors = 0;
+static __thread uint64_t fault_state;
+
+static uint32_t fault_random(void)
+{
+    /* xorshift64*, one sequence for each thread */
+    if (!fault_state)
+        fault_state = (fault_seed + __atomic_add_fetch( &fault_threads, 1, __ATOMIC_RELAXED )) * 0x9e3779b97f4a7c15ull | 1;
+    fault_state ^= fault_state >> 12;
+    fault_state ^= fault_state << 25;
+    fault_state ^= fault_state >> 27;
+    return (fault_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+/* returns TRUE when the call must fail with *ret instead of reaching pcsc-lite */
+static BOOL fault_inject( enum unix_funcs func, LONG *ret )
+{
+    const struct fault_rule *rule = &fault_rules[func];
+    uint64_t delay = rule->delay_ns;
+
+    if (rule->jitter_ns) delay += ((uint64_t)fault_random() << 32 | fault_random()) % rule->jitter_ns;
+    if (rule->spike_threshold && fault_random() < rule->spike_threshold) delay += rule->spike_ns;
+    if (delay) sleep_ns( delay );
+    if (!rule->error || fault_random() >= rule->error_threshold) return FALSE;
+    __atomic_fetch_add( &fault_errors, 1, __ATOMIC_RELAXED );
+    *ret = rule->error;
+    return TRUE;
+}
+
+static uint64_t fault_threshold( const char *rate )
+{
+    double value = strtod( rate, NULL );
+    if (value <= 0) return 0;
+    if (value >= 1) return (uint64_t)1 << 32;
+    return value * ((uint64_t)1 << 32);
+}
+
+static LONG fault_error( const char *name )
+{
+    static const struct { const char *name; LONG error; } errors[] =
+    {
+        { "reset", SCARD_W_RESET_CARD },
+        { "removed", SCARD_W_REMOVED_CARD },
+        { "no_service", SCARD_E_NO_SERVICE },
+        { "timeout", SCARD_E_TIMEOUT },
+        { "comm", SCARD_F_COMM_ERROR },
+    };
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(errors); i++)
+        if (!strcmp( name, errors[i].name )) return errors[i].error;
+    return strtoul( name, NULL, 0 );
+}
+
+static BOOL fault_parse_option( struct fault_rule *rule, char *option )
+{
+    char *value = strchr( option, '=' );
+
+    if (!value) return FALSE;
+    *value++ = 0;
+    if (!strcmp( option, "delay" )) rule->delay_ns = strtoull( value, NULL, 10 ) * 1000;
+    else if (!strcmp( option, "jitter" )) rule->jitter_ns = strtoull( value, NULL, 10 ) * 1000;
+    else if (!strcmp( option, "spike" )) rule->spike_ns = strtoull( value, NULL, 10 ) * 1000;
+    else if (!strcmp( option, "spike_rate" )) rule->spike_threshold = fault_threshold( value );
+    else if (!strcmp( option, "error" )) rule->error = fault_error( value );
+    else if (!strcmp( option, "rate" )) rule->error_threshold = fault_threshold( value );
+    else return FALSE;
+    return TRUE;
+}
+
+static void fault_attach(void)
+{
+    static const char * const func_names[] = { SCARD_TRACE_FUNC_NAMES };
+    const char *env = getenv( "WINSCARD_FAULTS" );
+    char *spec, *rule_str, *next_rule;
+    unsigned int i;
+
+    if (!env || !*env || !(spec = strdup( env ))) return;
+    for (rule_str = strtok_r( spec, ";", &next_rule ); rule_str; rule_str = strtok_r( NULL, ";", &next_rule ))
+    {
+        struct fault_rule rule = { 0, 0, 0, 0, (uint64_t)1 << 32, SCARD_S_SUCCESS };
+        char *options = strchr( rule_str, ':' ), *option, *next_option;
+
+        if (!strncmp( rule_str, "seed=", 5 ))
+        {
+            fault_seed = strtoull( rule_str + 5, NULL, 0 );
+            continue;
+        }
+        if (!options)
+        {
+            WARN( "invalid fault rule %s\n", debugstr_a(rule_str) );
+            continue;
+        }
+        *options++ = 0;
+        for (option = strtok_r( options, ",", &next_option ); option; option = strtok_r( NULL, ",", &next_option ))
+            if (!fault_parse_option( &rule, option )) WARN( "invalid fault option %s\n", debugstr_a(option) );
+
+        for (i = 0; i < ARRAY_SIZE(fault_rules); i++)
+        {
+            if (strcmp( rule_str, "*" ) && strcmp( rule_str, func_names[i] )) continue;
+            fault_rules[i] = rule;
+            faults_enabled = TRUE;
+        }
+    }
+    free( spec );
+    if (faults_enabled) TRACE( "injecting faults: %s\n", debugstr_a(env) );
+}
+
+/*
+ * Every call to pcsc-lite goes through one of these wrappers, for the fault
+ * injection and the profile. The function pointers are only called here.
+ */
+static inline BOOL pcsclite_enter( enum unix_funcs func, uint64_t *start, LONG *ret )
+{
+    *start = profile_pcsclite_enter();
+    return !faults_enabled || !fault_inject( func, ret );
+}
+
+static LONG pcsc_SCardEstablishContext( DWORD_LITE dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2,
+                                        SCARDCONTEXT *phContext )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardEstablishContext, &start, &ret ))
+        ret = pSCardEstablishContext( dwScope, pvReserved1, pvReserved2, phContext );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardReleaseContext( SCARDCONTEXT hContext )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardReleaseContext, &start, &ret ))
+        ret = pSCardReleaseContext( hContext );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardIsValidContext( SCARDCONTEXT hContext )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardIsValidContext, &start, &ret ))
+        ret = pSCardIsValidContext( hContext );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardConnect( SCARDCONTEXT hContext, LPCSTR szReader, DWORD_LITE dwShareMode,
+                               DWORD_LITE dwPreferredProtocols, SCARDHANDLE *phCard, DWORD_LITE *pdwActiveProtocol )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardConnect, &start, &ret ))
+        ret = pSCardConnect( hContext, szReader, dwShareMode, dwPreferredProtocols, phCard, pdwActiveProtocol );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardReconnect( SCARDHANDLE hCard, DWORD_LITE dwShareMode, DWORD_LITE dwPreferredProtocols,
+                                 DWORD_LITE dwInitialization, DWORD_LITE *pdwActiveProtocol )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardReconnect, &start, &ret ))
+        ret = pSCardReconnect( hCard, dwShareMode, dwPreferredProtocols, dwInitialization, pdwActiveProtocol );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardDisconnect( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardDisconnect, &start, &ret ))
+        ret = pSCardDisconnect( hCard, dwDisposition );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardBeginTransaction( SCARDHANDLE hCard )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardBeginTransaction, &start, &ret ))
+        ret = pSCardBeginTransaction( hCard );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardEndTransaction( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardEndTransaction, &start, &ret ))
+        ret = pSCardEndTransaction( hCard, dwDisposition );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardStatus( SCARDHANDLE hCard, LPSTR mszReaderName, DWORD_LITE *pcchReaderLen, DWORD_LITE *pdwState,
+                              DWORD_LITE *pdwProtocol, LPBYTE pbAtr, DWORD_LITE *pcbAtrLen )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardStatus, &start, &ret ))
+        ret = pSCardStatus( hCard, mszReaderName, pcchReaderLen, pdwState, pdwProtocol, pbAtr, pcbAtrLen );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardGetStatusChange( SCARDCONTEXT hContext, DWORD_LITE dwTimeout,
+                                       SCARD_READERSTATE_LITE *rgReaderStates, DWORD_LITE cReaders )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardGetStatusChange, &start, &ret ))
+        ret = pSCardGetStatusChange( hContext, dwTimeout, rgReaderStates, cReaders );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardControl( SCARDHANDLE hCard, DWORD_LITE dwControlCode, LPCVOID pbSendBuffer,
+                               DWORD_LITE cbSendLength, LPVOID pbRecvBuffer, DWORD_LITE cbRecvLength,
+                               DWORD_LITE *lpBytesReturned )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardControl, &start, &ret ))
+        ret = pSCardControl( hCard, dwControlCode, pbSendBuffer, cbSendLength, pbRecvBuffer, cbRecvLength,
+                             lpBytesReturned );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardTransmit( SCARDHANDLE hCard, const SCARD_IO_REQUEST_LITE *pioSendPci, LPCBYTE pbSendBuffer,
+                                DWORD_LITE cbSendLength, SCARD_IO_REQUEST_LITE *pioRecvPci, LPBYTE pbRecvBuffer,
+                                DWORD_LITE *pcbRecvLength )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardTransmit, &start, &ret ))
+        ret = pSCardTransmit( hCard, pioSendPci, pbSendBuffer, cbSendLength, pioRecvPci, pbRecvBuffer, pcbRecvLength );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardListReaderGroups( SCARDCONTEXT hContext, LPSTR mszGroups, DWORD_LITE *pcchGroups )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardListReaderGroups, &start, &ret ))
+        ret = pSCardListReaderGroups( hContext, mszGroups, pcchGroups );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardListReaders( SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, DWORD_LITE *pcchReaders )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardListReaders, &start, &ret ))
+        ret = pSCardListReaders( hContext, mszGroups, mszReaders, pcchReaders );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardFreeMemory( SCARDCONTEXT hContext, LPCVOID pvMem )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardFreeMemory, &start, &ret ))
+        ret = pSCardFreeMemory( hContext, pvMem );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardCancel( SCARDCONTEXT hContext )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardCancel, &start, &ret ))
+        ret = pSCardCancel( hContext );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardGetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPBYTE pbAttr, DWORD_LITE *pcbAttrLen )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardGetAttrib, &start, &ret ))
+        ret = pSCardGetAttrib( hCard, dwAttrId, pbAttr, pcbAttrLen );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+static LONG pcsc_SCardSetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPCBYTE pbAttr, DWORD_LITE cbAttrLen )
+{
+    uint64_t start;
+    LONG ret;
+    if (pcsclite_enter( unix_SCardSetAttrib, &start, &ret ))
+        ret = pSCardSetAttrib( hCard, dwAttrId, pbAttr, cbAttrLen );
+    profile_pcsclite_leave( start );
+    return ret;
+}
+
+/*
+ * Binary trace, enabled by WINSCARD_TRACE=<file>, see scardtrace.h.
+ * Each thread fills its own buffer of records, written to the file with a
+ * single write() when it is full, when the thread exits or when the library
+ * is detached. The dll buffers its own records and sends them through
+ * trace_write. The buffer list is locked when a thread starts or stops
+ * tracing, and each buffer has a lock of its own, only contended when
+ * trace_detach flushes the buffers of the threads still running.
+ * All the records carry the kernel thread id, see trace_thread_id.
+ */
+#define TRACE_BUFFER_RECORDS 1024
+
+struct trace_buffer
+{
+    struct trace_buffer *next;
+    pthread_mutex_t lock;
+    uint32_t tid;
+    unsigned int count;
+    struct scard_trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+static int trace_fd = -1;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *trace_buffers = NULL;
+
+/* the dll records the same id, it calls trace_write from the thread it traces */
+static uint32_t trace_thread_id(void)
+{
+#ifdef __linux__
+    return syscall( SYS_gettid );
+#else
+    return 0;
+#endif
+}
+
+static void trace_write_records( const struct scard_trace_record *records, size_t count )
+{
+    size_t size = count * sizeof(*records);
+    while (size)
+    {
+        ssize_t ret = write( trace_fd, records, size );
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) break;
+        records = (const struct scard_trace_record *)((const char *)records + ret);
+        size -= ret;
+    }
+}
+
+/* must be called with the buffer lock held */
+static void trace_flush( struct trace_buffer *buffer )
+{
+    if (buffer->count && trace_fd >= 0) trace_write_records( buffer->records, buffer->count );
+    buffer->count = 0;
+}
+
+/* must be called with trace_mutex held */
+static void trace_unlink( struct trace_buffer *buffer )
+{
+    struct trace_buffer **prev;
+    for (prev = &trace_buffers; *prev; prev = &(*prev)->next)
+    {
+        if (*prev != buffer) continue;
+        *prev = buffer->next;
+        break;
+    }
+}
+
+static void trace_thread_exit( void *arg )
+{
+    struct trace_buffer *buffer = arg;
+    pthread_mutex_lock( &trace_mutex );
+    trace_unlink( buffer );
+    pthread_mutex_lock( &buffer->lock );
+    trace_flush( buffer );
+    pthread_mutex_unlock( &buffer->lock );
+    pthread_mutex_unlock( &trace_mutex );
+    pthread_mutex_destroy( &buffer->lock );
+    free( buffer );
+}
+
+/* copy a record to the buffer of the calling thread */
+static void trace_append( const struct scard_trace_record *record )
+{
+    struct trace_buffer *buffer = pthread_getspecific( trace_key );
+    if (!buffer)
+    {
+        if (!(buffer = calloc( 1, sizeof(*buffer) ))) return;
+        pthread_mutex_init( &buffer->lock, NULL );
+        buffer->tid = trace_thread_id();
+        pthread_mutex_lock( &trace_mutex );
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+        pthread_mutex_unlock( &trace_mutex );
+        pthread_setspecific( trace_key, buffer );
+    }
+    pthread_mutex_lock( &buffer->lock );
+    if (buffer->count == TRACE_BUFFER_RECORDS) trace_flush( buffer );
+    buffer->records[buffer->count] = *record;
+    buffer->records[buffer->count++].tid = buffer->tid;
+    pthread_mutex_unlock( &buffer->lock );
+}
+
+/* exchange an APDU with pcsc-lite, recording it when tracing */
+static LONG traced_transmit( SCARDHANDLE hCard, const SCARD_IO_REQUEST_LITE *pioSendPci, LPCBYTE pbSendBuffer,
+   DWORD_LITE cbSendLength, SCARD_IO_REQUEST_LITE *pioRecvPci, LPBYTE pbRecvBuffer, DWORD_LITE *pcbRecvLength )
+{
+   struct scard_trace_record record;
+   uint64_t start, end;
+   LONG ret;
+
+   if (trace_fd < 0)
+      return pcsc_SCardTransmit( hCard, pioSendPci, pbSendBuffer, cbSendLength, pioRecvPci, pbRecvBuffer, pcbRecvLength );
+
+   start = trace_now();
+   ret = pcsc_SCardTransmit( hCard, pioSendPci, pbSendBuffer, cbSendLength, pioRecvPci, pbRecvBuffer, pcbRecvLength );
+   end = trace_now();
+   memset( &record, 0, sizeof(record) );
+   record.start = start;
+   record.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+   record.handle = hCard;
+   record.result = ret;
+   record.func = unix_SCardTransmit;
+   record.source = SCARD_TRACE_SOURCE_PCSC;
+   if (cbSendLength >= 4)
+   {
+      memcpy( record.apdu, pbSendBuffer, 4 );
+      record.flags |= SCARD_TRACE_FLAG_APDU;
+   }
+   if (ret == SCARD_S_SUCCESS && pcbRecvLength && *pcbRecvLength >= 2)
+   {
+      record.sw = pbRecvBuffer[*pcbRecvLength - 2] << 8 | pbRecvBuffer[*pcbRecvLength - 1];
+      record.flags |= SCARD_TRACE_FLAG_SW;
+   }
+   trace_append( &record );
+   return ret;
+}
+
+static void trace_attach(void)
+{
+   const char *file = getenv( "WINSCARD_TRACE" );
+   struct scard_trace_header header;
+
+   if (!file || !*file) return;
+   if (pthread_key_create( &trace_key, trace_thread_exit )) return;
+   if ((trace_fd = open( file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 )) < 0)
+   {
+      WARN( "can't create trace file %s, errno %d\n", debugstr_a(file), errno );
+      pthread_key_delete( trace_key );
+      return;
+   }
+   memset( &header, 0, sizeof(header) );
+   header.magic = SCARD_TRACE_MAGIC;
+   header.version = SCARD_TRACE_VERSION;
+   header.record_size = sizeof(struct scard_trace_record);
+   header.pid = getpid();
+   if (write( trace_fd, &header, sizeof(header) ) != sizeof(header))
+      WARN( "can't write trace file header\n" );
+}
+
+/*
+ * Flush the buffers of all the threads, holding each buffer lock so that no
+ * record is being added or written meanwhile, then close the file. The
+ * buffers of the threads still running stay allocated: they may be waiting
+ * for their lock, and find the file closed when they get it.
+ */
+static void trace_detach(void)
+{
+   struct trace_buffer *buffer;
+   int fd = trace_fd;
+
+   if (fd < 0) return;
+   pthread_mutex_lock( &trace_mutex );
+   for (buffer = trace_buffers; buffer; buffer = buffer->next) pthread_mutex_lock( &buffer->lock );
+   for (buffer = trace_buffers; buffer; buffer = buffer->next) trace_flush( buffer );
+   trace_fd = -1;
+   for (buffer = trace_buffers; buffer; buffer = buffer->next) pthread_mutex_unlock( &buffer->lock );
+   pthread_mutex_unlock( &trace_mutex );
+   close( fd );
+   pthread_key_delete( trace_key );
+}
+
+/* T=0 GET RESPONSE / 6Cxx handling, enabled by WINSCARD_T0_AUTO_RESPONSE=1 */
+static BOOL t0_auto_response = FALSE;
+static unsigned long t0_round_trips_saved = 0;
+
+#define PCSCLITE_SCARD_SCOPE_SYSTEM      0x0002
+#define PCSCLITE_SCARD_STATE_UNAWARE     0x0000
+#define PCSCLITE_SCARD_STATE_IGNORE      0x0001
+#define PCSCLITE_SCARD_STATE_CHANGED     0x0002
+#define PCSCLITE_INFINITE                0xFFFFFFFF
+#define PCSCLITE_PNP_NOTIFICATION        "\\\\?PnP?\\Notification"
+
+/*
+ * Sharded SCardGetStatusChange.
+ * pcsc-lite refuses more than PCSCLITE_MAX_READERS_CONTEXTS readers in one call.
+ * Larger arrays are split in shards of that size: a first pass without waiting
+ * answers when a reader has already changed, otherwise each shard waits in a
+ * worker thread, on the private context of the worker. Idle workers are kept for
+ * the next waits, up to SHARD_WORKER_POOL of them. The first shard to return
+ * cancels the others and one last pass without waiting fills every state.
+ * A wait is registered before its first pass, so that cancelling the application
+ * context at any time ends it and cancels the private contexts of its shards.
+ * The workers are not Wine threads: they must not use the debug channels.
+ */
+#define PCSCLITE_MAX_READERS_CONTEXTS    16
+#define SHARD_POLL_TIMEOUT               1      /* ms, some pcsc-lite versions wait forever with 0 */
+#define SHARD_WORKER_POOL                16
+
+struct status_shard;
+
+struct shard_worker
+{
+    struct shard_worker *next;          /* in the idle list */
+    pthread_t thread;
+    SCARDCONTEXT hContext;              /* private context */
+    struct status_shard *shard;         /* to wait for, NULL when idle */
+    BOOL quit;
+};
 
+struct status_shard
+{
+    struct status_wait *wait;
+    struct shard_worker *worker;
+    SCARD_READERSTATE_LITE *states;
+    DWORD_LITE count;
+    BOOL done;
+    LONG ret;
+};
+
+struct status_wait
+{
+    struct status_wait *next;
+    SCARDCONTEXT hContext;              /* application context */
+    DWORD_LITE dwTimeout;
+    BOOL cancelled;                     /* by SCardCancel on the application context */
+    struct status_shard *winner;        /* first shard to return */
+    unsigned int shard_count;
+    struct status_shard shards[1];
+};
+
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static struct status_wait *status_waits = NULL;
+static struct shard_worker *idle_workers = NULL;
+static unsigned int idle_worker_count = 0;
+static BOOL shard_workers_released = FALSE;
+
+/* must be called with shard_mutex held, FALSE when the worker should exit */
+static BOOL keep_shard_worker( struct shard_worker *worker )
+{
+    if (shard_workers_released || idle_worker_count >= SHARD_WORKER_POOL) return FALSE;
+    worker->next = idle_workers;
+    idle_workers = worker;
+    idle_worker_count++;
+    return TRUE;
+}
+
+static void *shard_worker_thread( void *arg )
+{
+    struct shard_worker *worker = arg;
+    struct status_shard *shard;
+    BOOL quit;
+    LONG ret;
+
+    pthread_mutex_lock( &shard_mutex );
+    for (;;)
+    {
+        while (!worker->shard && !worker->quit) pthread_cond_wait( &worker_cond, &shard_mutex );
+        if (!(shard = worker->shard)) break;
+        pthread_mutex_unlock( &shard_mutex );
+
+        ret = pcsc_SCardGetStatusChange( worker->hContext, shard->wait->dwTimeout, shard->states, shard->count );
+
+        pthread_mutex_lock( &shard_mutex );
+        shard->ret = ret;
+        shard->done = TRUE;
+        if (!shard->wait->winner) shard->wait->winner = shard;
+        pthread_cond_broadcast( &shard_cond );
+        worker->shard = NULL;
+        if (!keep_shard_worker( worker )) break;
+    }
+    quit = worker->quit;
+    pthread_mutex_unlock( &shard_mutex );
+
+    /* an idle worker is joined and freed by release_shard_workers */
+    if (quit) return NULL;
+    pcsc_SCardReleaseContext( worker->hContext );
+    pthread_detach( pthread_self() );
+    free( worker );
+    return NULL;
+}
+
+static LONG get_shard_worker( struct shard_worker **ret )
+{
+    struct shard_worker *worker;
+
+    pthread_mutex_lock( &shard_mutex );
+    if ((worker = idle_workers))
+    {
+        idle_workers = worker->next;
+        idle_worker_count--;
+    }
+    pthread_mutex_unlock( &shard_mutex );
+    if ((*ret = worker)) return SCARD_S_SUCCESS;
+
+    if (!(worker = calloc( 1, sizeof(*worker) ))) return SCARD_E_NO_MEMORY;
+    if (pcsc_SCardEstablishContext( PCSCLITE_SCARD_SCOPE_SYSTEM, NULL, NULL, &worker->hContext ) != SCARD_S_SUCCESS)
+    {
+        free( worker );
+        return SCARD_E_NO_SERVICE;
+    }
+    if (pthread_create( &worker->thread, NULL, shard_worker_thread, worker ))
+    {
+        pcsc_SCardReleaseContext( worker->hContext );
+        free( worker );
+        return SCARD_E_NO_MEMORY;
+    }
+    *ret = worker;
+    return SCARD_S_SUCCESS;
+}
+
+static void release_shard_workers(void)
+{
+    struct shard_worker *worker, *next;
+
+    pthread_mutex_lock( &shard_mutex );
+    worker = idle_workers;
+    idle_workers = NULL;
+    idle_worker_count = 0;
+    shard_workers_released = TRUE;
+    for (next = worker; next; next = next->next) next->quit = TRUE;
+    pthread_cond_broadcast( &worker_cond );
+    pthread_mutex_unlock( &shard_mutex );
+
+    for (; worker; worker = next)
+    {
+        next = worker->next;
+        pthread_join( worker->thread, NULL );
+        pcsc_SCardReleaseContext( worker->hContext );
+        free( worker );
+    }
+}
+
+/* one call without waiting for each shard, on the application context */
+static LONG poll_shards( SCARDCONTEXT hContext, DWORD_LITE dwTimeout, SCARD_READERSTATE_LITE *states, DWORD_LITE count )
+{
+    LONG ret = SCARD_E_TIMEOUT, shard_ret;
+    DWORD_LITE i;
+
+    for (i = 0; i < count; i += PCSCLITE_MAX_READERS_CONTEXTS)
+    {
+        shard_ret = pcsc_SCardGetStatusChange( hContext, dwTimeout, states + i,
+                                              min( count - i, PCSCLITE_MAX_READERS_CONTEXTS ) );
+        if (shard_ret == SCARD_S_SUCCESS) ret = SCARD_S_SUCCESS;
+        else if (shard_ret != SCARD_E_TIMEOUT) return shard_ret;
+    }
+    return ret;
+}
+
+/* must be called with shard_mutex held */
+static void cancel_shards( struct status_wait *wait )
+{
+    unsigned int i;
+    for (i = 0; i < wait->shard_count; i++)
+        if (wait->shards[i].worker && !wait->shards[i].done) pcsc_SCardCancel( wait->shards[i].worker->hContext );
+}
+
+/* SCardCancel for a context and the waits sharded from it */
+static LONG cancel_context( SCARDCONTEXT hContext )
+{
+    struct status_wait *wait;
+    pthread_mutex_lock( &shard_mutex );
+    for (wait = status_waits; wait; wait = wait->next)
+    {
+        if (wait->hContext != hContext) continue;
+        wait->cancelled = TRUE;
+        cancel_shards( wait );
+    }
+    pthread_cond_broadcast( &shard_cond );
+    pthread_mutex_unlock( &shard_mutex );
+    return pcsc_SCardCancel( hContext );
+}
+
+static struct status_wait *add_status_wait( SCARDCONTEXT hContext, DWORD_LITE dwTimeout, DWORD_LITE count )
+{
+    unsigned int shard_count = (count + PCSCLITE_MAX_READERS_CONTEXTS - 1) / PCSCLITE_MAX_READERS_CONTEXTS;
+    struct status_wait *wait;
+
+    if (!(wait = calloc( 1, sizeof(*wait) + (shard_count - 1) * sizeof(wait->shards[0]) ))) return NULL;
+    wait->hContext = hContext;
+    wait->dwTimeout = dwTimeout;
+    wait->shard_count = shard_count;
+    pthread_mutex_lock( &shard_mutex );
+    wait->next = status_waits;
+    status_waits = wait;
+    pthread_mutex_unlock( &shard_mutex );
+    return wait;
+}
+
+static void remove_status_wait( struct status_wait *wait )
+{
+    struct status_wait **prev;
+    pthread_mutex_lock( &shard_mutex );
+    for (prev = &status_waits; *prev; prev = &(*prev)->next)
+    {
+        if (*prev != wait) continue;
+        *prev = wait->next;
+        break;
+    }
+    pthread_mutex_unlock( &shard_mutex );
+    free( wait );
+}
+
+static LONG wait_shards( struct status_wait *wait, SCARD_READERSTATE_LITE *states, DWORD_LITE count )
+{
+    unsigned int i, launched;
+    LONG ret, start_error = SCARD_S_SUCCESS;
+
+    for (i = 0; i < wait->shard_count; i++)
+    {
+        struct status_shard *shard = &wait->shards[i];
+        struct shard_worker *worker;
+
+        shard->wait = wait;
+        shard->states = states + i * PCSCLITE_MAX_READERS_CONTEXTS;
+        shard->count = min( count - i * PCSCLITE_MAX_READERS_CONTEXTS, PCSCLITE_MAX_READERS_CONTEXTS );
+        if ((start_error = get_shard_worker( &worker )) != SCARD_S_SUCCESS) break;
+        pthread_mutex_lock( &shard_mutex );
+        shard->worker = worker;
+        worker->shard = shard;
+        pthread_cond_broadcast( &worker_cond );
+        pthread_mutex_unlock( &shard_mutex );
+    }
+    launched = i;
+
+    pthread_mutex_lock( &shard_mutex );
+    /* nothing to wait for if a shard couldn't start */
+    if (launched < wait->shard_count) wait->cancelled = TRUE;
+    for (;;)
+    {
+        BOOL running = FALSE;
+        for (i = 0; i < launched; i++) running |= !wait->shards[i].done;
+        if (!running) break;
+        if (wait->winner || wait->cancelled)
+        {
+            struct timespec deadline;
+            /* a shard may be just about to enter its wait, keep cancelling until they all leave */
+            cancel_shards( wait );
+            clock_gettime( CLOCK_REALTIME, &deadline );
+            deadline.tv_nsec += 10000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait( &shard_cond, &shard_mutex, &deadline );
+        }
+        else pthread_cond_wait( &shard_cond, &shard_mutex );
+    }
+    if (wait->winner && !(wait->cancelled && wait->winner->ret == SCARD_E_CANCELLED)) ret = wait->winner->ret;
+    else if (start_error != SCARD_S_SUCCESS) ret = start_error;
+    else ret = SCARD_E_CANCELLED;
+    pthread_mutex_unlock( &shard_mutex );
+
+    /* the cancelled shards didn't update their states */
+    if (ret == SCARD_S_SUCCESS) ret = poll_shards( wait->hContext, SHARD_POLL_TIMEOUT, states, count );
+    return ret;
+}
+
+/* SCardGetStatusChange for any number of readers */
+static LONG get_status_change( SCARDCONTEXT hContext, DWORD_LITE dwTimeout, SCARD_READERSTATE_LITE *states, DWORD_LITE count )
+{
+    struct status_wait *wait;
+    LONG ret;
+
+    if (count <= PCSCLITE_MAX_READERS_CONTEXTS)
+        return pcsc_SCardGetStatusChange( hContext, dwTimeout, states, count );
+    if (!dwTimeout) return poll_shards( hContext, 0, states, count );
+
+    if (!(wait = add_status_wait( hContext, dwTimeout, count ))) return SCARD_E_NO_MEMORY;
+    ret = poll_shards( hContext, SHARD_POLL_TIMEOUT, states, count );
+    if (ret == SCARD_E_TIMEOUT)
+    {
+        BOOL cancelled;
+        /* pcsc-lite forgets a cancel that came before the call, the wait didn't */
+        pthread_mutex_lock( &shard_mutex );
+        cancelled = wait->cancelled;
+        pthread_mutex_unlock( &shard_mutex );
+        ret = cancelled ? SCARD_E_CANCELLED : wait_shards( wait, states, count );
+    }
+    remove_status_wait( wait );
+    return ret;
+}
+
+/*
+ * Reader state monitor.
+ * Keeps one blocking SCardGetStatusChange open on a private context for each
+ * application context that polls with dwTimeout == 0 and publishes the reader
+ * states in a snapshot, so that these polls don't need to reach pcscd.
+ * The monitor thread is not a Wine thread: it must not use the debug channels.
+ */
+struct reader_snapshot
+{
+    char *szReader;
+    DWORD_LITE dwEventState;
+    DWORD_LITE cbAtr;
+    unsigned char rgbAtr[MAX_ATR_SIZE];
+};
+
+struct reader_monitor
+{
+    struct reader_monitor *next;
+    SCARDCONTEXT hContext;           /* application context */
+    SCARDCONTEXT hMonitorContext;    /* private context of the monitor thread */
+    pthread_t thread;
+    BOOL stop;
+    BOOL exited;
+    BOOL valid;                      /* the snapshot reflects the current states */
+    unsigned int generation;         /* bumped each time the snapshot changes */
+    unsigned int readers_generation; /* bumped each time the list of readers changes */
+    unsigned int waiters;            /* threads blocked in SCardWaitReaderChange */
+    DWORD_LITE count;
+    struct reader_snapshot *readers; /* last entry is the PnP notification reader */
+};
+
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+static struct reader_monitor *monitor_list = NULL;
+
+static void free_snapshot( struct reader_snapshot *readers, DWORD_LITE count )
+{
+    DWORD_LITE i;
+    if (!readers) return;
+    for (i = 0; i < count; i++) free( readers[i].szReader );
+    free( readers );
+}
+
+/* must be called with monitor_mutex held */
+static void monitor_publish( struct reader_monitor *monitor, const SCARD_READERSTATE_LITE *states, DWORD_LITE count )
+{
+    BOOL readers_changed = !monitor->valid || monitor->count != count;
+    DWORD_LITE i;
+    if (monitor->count != count)
+    {
+        struct reader_snapshot *readers = calloc( count, sizeof(*readers) );
+        if (!readers)
+        {
+            monitor->valid = FALSE;
+            return;
+        }
+        free_snapshot( monitor->readers, monitor->count );
+        monitor->readers = readers;
+        monitor->count = count;
+    }
+    for (i = 0; i < count; i++)
+    {
+        struct reader_snapshot *reader = &monitor->readers[i];
+        if (!reader->szReader || strcmp( reader->szReader, states[i].szReader ))
+        {
+            free( reader->szReader );
+            if (!(reader->szReader = strdup( states[i].szReader )))
+            {
+                monitor->valid = FALSE;
+                return;
+            }
+            readers_changed = TRUE;
+        }
+        reader->dwEventState = states[i].dwEventState & ~PCSCLITE_SCARD_STATE_CHANGED;
+        reader->cbAtr = states[i].cbAtr;
+        memcpy( reader->rgbAtr, states[i].rgbAtr, sizeof(reader->rgbAtr) );
+    }
+    monitor->valid = TRUE;
+    monitor->generation++;
+    if (readers_changed) monitor->readers_generation++;
+    pthread_cond_broadcast( &monitor_cond );
+}
+
+/* build the state array for every reader known by pcscd plus the PnP notification reader */
+static LONG monitor_list_readers( SCARDCONTEXT hContext, char **list, SCARD_READERSTATE_LITE **states, DWORD_LITE *count )
+{
+    DWORD_LITE length = 0, n = 0;
+    SCARD_READERSTATE_LITE *st;
+    char *names = NULL, *name;
+    LONG ret;
+
+    ret = pcsc_SCardListReaders( hContext, NULL, NULL, &length );
+    if (ret == SCARD_S_SUCCESS && length)
+    {
+        if (!(names = malloc( length ))) return SCARD_E_NO_MEMORY;
+        ret = pcsc_SCardListReaders( hContext, NULL, names, &length );
+    }
+    if (ret == SCARD_E_NO_READERS_AVAILABLE)
+    {
+        free( names );
+        names = NULL;
+        ret = SCARD_S_SUCCESS;
+    }
+    if (ret != SCARD_S_SUCCESS)
+    {
+        free( names );
+        return ret;
+    }
+
+    for (name = names; name && *name; name += strlen( name ) + 1) n++;
+    if (!(st = calloc( n + 1, sizeof(*st) )))
+    {
+        free( names );
+        return SCARD_E_NO_MEMORY;
+    }
+    n = 0;
+    for (name = names; name && *name; name += strlen( name ) + 1)
+        st[n++].szReader = name;
+    st[n].szReader = PCSCLITE_PNP_NOTIFICATION;
+    st[n].dwCurrentState = n << 16;
+
+    free( *list );
+    free( *states );
+    *list = names;
+    *states = st;
+    *count = n + 1;
+    return SCARD_S_SUCCESS;
+}
+
+static void *monitor_thread( void *arg )
+{
+    struct reader_monitor *monitor = arg;
+    SCARD_READERSTATE_LITE *states = NULL;
+    SCARDCONTEXT hContext = 0;
+    char *names = NULL;
+    DWORD_LITE i, count = 0;
+    BOOL relist = TRUE;
+    LONG ret;
+
+    if (pcsc_SCardEstablishContext( PCSCLITE_SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext ) != SCARD_S_SUCCESS)
+        goto done;
+    pthread_mutex_lock( &monitor_mutex );
+    monitor->hMonitorContext = hContext;
+    pthread_mutex_unlock( &monitor_mutex );
+
+    while (!monitor->stop)
+    {
+        if (relist)
+        {
+            if (monitor_list_readers( hContext, &names, &states, &count ) != SCARD_S_SUCCESS) break;
+            relist = FALSE;
+        }
+
+        ret = get_status_change( hContext, PCSCLITE_INFINITE, states, count );
+        if (ret == SCARD_E_TIMEOUT) continue;
+        if (ret == SCARD_E_UNKNOWN_READER)
+        {
+            /* a reader went away between the listing and the wait */
+            relist = TRUE;
+            continue;
+        }
+        if (ret != SCARD_S_SUCCESS) break;
+
+        pthread_mutex_lock( &monitor_mutex );
+        monitor_publish( monitor, states, count );
+        pthread_mutex_unlock( &monitor_mutex );
+
+        if (states[count - 1].dwEventState & PCSCLITE_SCARD_STATE_CHANGED)
+            relist = TRUE;
+        for (i = 0; i < count; i++)
+            states[i].dwCurrentState = states[i].dwEventState & ~PCSCLITE_SCARD_STATE_CHANGED;
+    }
+
+done:
+    pthread_mutex_lock( &monitor_mutex );
+    monitor->valid = FALSE;
+    monitor->exited = TRUE;
+    pthread_cond_broadcast( &monitor_cond );
+    pthread_mutex_unlock( &monitor_mutex );
+    free( states );
+    free( names );
+    return NULL;
+}
+
+/* must be called with monitor_mutex held */
+static struct reader_monitor *find_monitor( SCARDCONTEXT hContext )
+{
+    struct reader_monitor *monitor;
+    for (monitor = monitor_list; monitor; monitor = monitor->next)
+        if (monitor->hContext == hContext) return monitor;
+    return NULL;
+}
+
+/* must be called with monitor_mutex held */
+static struct reader_monitor *create_monitor( SCARDCONTEXT hContext )
+{
+    struct reader_monitor *monitor = calloc( 1, sizeof(*monitor) );
+    if (!monitor) return NULL;
+    monitor->hContext = hContext;
+    if (pthread_create( &monitor->thread, NULL, monitor_thread, monitor ))
+    {
+        WARN( "failed to start the reader monitor\n" );
+        free( monitor );
+        return NULL;
+    }
+    return monitor;
+}
+
+/* must be called with monitor_mutex held */
+static struct reader_monitor *start_monitor( SCARDCONTEXT hContext )
+{
+    struct reader_monitor *monitor = create_monitor( hContext );
+    if (!monitor) return NULL;
+    monitor->next = monitor_list;
+    monitor_list = monitor;
+    return monitor;
+}
+
+/*
+ * Must be called with monitor_mutex held, the mutex is released while waiting for the thread.
+ * The monitor is taken out of the list of the application contexts if it is there.
+ */
+static void stop_monitor( struct reader_monitor *monitor )
+{
+    struct reader_monitor **prev;
+    for (prev = &monitor_list; *prev; prev = &(*prev)->next)
+    {
+        if (*prev != monitor) continue;
+        *prev = monitor->next;
+        break;
+    }
+
+    monitor->stop = TRUE;
+    while (!monitor->exited)
+    {
+        struct timespec deadline;
+        /* the thread may be just about to enter its wait, keep cancelling until it leaves */
+        if (monitor->hMonitorContext) cancel_context( monitor->hMonitorContext );
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait( &monitor_cond, &monitor_mutex, &deadline );
+    }
+    while (monitor->waiters) pthread_cond_wait( &monitor_cond, &monitor_mutex );
+    pthread_mutex_unlock( &monitor_mutex );
+    pthread_join( monitor->thread, NULL );
+    if (monitor->hMonitorContext) pcsc_SCardReleaseContext( monitor->hMonitorContext );
+    free_snapshot( monitor->readers, monitor->count );
+    free( monitor );
+    pthread_mutex_lock( &monitor_mutex );
+}
+
+/* must be called with monitor_mutex held */
+static struct reader_monitor *get_monitor( SCARDCONTEXT hContext )
+{
+    struct reader_monitor *monitor = find_monitor( hContext );
+    if (monitor && monitor->exited)
+    {
+        /* pcscd went away, try again with a new thread */
+        stop_monitor( monitor );
+        monitor = NULL;
+    }
+    if (!monitor) monitor = start_monitor( hContext );
+    return monitor;
+}
+
+static void watch_context( SCARDCONTEXT hContext )
+{
+    pthread_mutex_lock( &monitor_mutex );
+    get_monitor( hContext );
+    pthread_mutex_unlock( &monitor_mutex );
+}
+
+static void release_monitor( SCARDCONTEXT hContext )
+{
+    struct reader_monitor *monitor;
+    pthread_mutex_lock( &monitor_mutex );
+    if ((monitor = find_monitor( hContext ))) stop_monitor( monitor );
+    pthread_mutex_unlock( &monitor_mutex );
+}
+
+static void release_hotplug_monitor(void);
+
+static void release_all_monitors(void)
+{
+    pthread_mutex_lock( &monitor_mutex );
+    while (monitor_list) stop_monitor( monitor_list );
+    pthread_mutex_unlock( &monitor_mutex );
+    release_hotplug_monitor();
+}
+
+/*
+ * Answer a dwTimeout == 0 SCardGetStatusChange from the snapshot of the
+ * context monitor. Returns FALSE when the call has to go to pcscd.
+ */
+static BOOL monitor_get_status( SCARDCONTEXT hContext, SCARD_READERSTATE_LITE *states, DWORD_LITE count, LONG *ret )
+{
+    struct reader_monitor *monitor;
+    BOOL changed = FALSE;
+    DWORD_LITE i, j;
+
+    pthread_mutex_lock( &monitor_mutex );
+    if (!(monitor = find_monitor( hContext )) || !monitor->valid)
+    {
+        pthread_mutex_unlock( &monitor_mutex );
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        struct reader_snapshot *reader = NULL;
+        if (states[i].dwCurrentState & PCSCLITE_SCARD_STATE_IGNORE) continue;
+        for (j = 0; j < monitor->count; j++)
+        {
+            if (strcmp( monitor->readers[j].szReader, states[i].szReader )) continue;
+            reader = &monitor->readers[j];
+            break;
+        }
+        if (!reader)
+        {
+            /* unknown to the monitor, let pcscd answer */
+            pthread_mutex_unlock( &monitor_mutex );
+            return FALSE;
+        }
+        states[i].dwEventState = reader->dwEventState;
+        states[i].cbAtr = reader->cbAtr;
+        memcpy( states[i].rgbAtr, reader->rgbAtr, sizeof(states[i].rgbAtr) );
+        if (states[i].dwCurrentState == PCSCLITE_SCARD_STATE_UNAWARE
+            || (states[i].dwCurrentState & ~PCSCLITE_SCARD_STATE_CHANGED) != reader->dwEventState)
+        {
+            states[i].dwEventState |= PCSCLITE_SCARD_STATE_CHANGED;
+            changed = TRUE;
+        }
+    }
+    pthread_mutex_unlock( &monitor_mutex );
+
+    *ret = changed ? SCARD_S_SUCCESS : SCARD_E_TIMEOUT;
+    return TRUE;
+}
+
+/*
+ * Hot-plug notifications, used by SCardAccessNewReaderEvent.
+ * They come from a monitor that isn't bound to any application context and
+ * is kept out of the monitor list, so that no SCardGetStatusChange is ever
+ * answered from its snapshot.
+ */
+static struct reader_monitor *hotplug_monitor = NULL;
+static unsigned int reader_change_cancel_seq = 0;
+
+/* must be called with monitor_mutex held */
+static struct reader_monitor *get_hotplug_monitor(void)
+{
+    if (hotplug_monitor && hotplug_monitor->exited)
+    {
+        /* pcscd went away, try again with a new thread */
+        struct reader_monitor *monitor = hotplug_monitor;
+        hotplug_monitor = NULL;
+        stop_monitor( monitor );
+    }
+    if (!hotplug_monitor) hotplug_monitor = create_monitor( 0 );
+    return hotplug_monitor;
+}
+
+/* must be called with monitor_mutex held */
+static void stop_hotplug_monitor(void)
+{
+    struct reader_monitor *monitor = hotplug_monitor;
+    hotplug_monitor = NULL;
+    if (monitor) stop_monitor( monitor );
+}
+
+static void release_hotplug_monitor(void)
+{
+    pthread_mutex_lock( &monitor_mutex );
+    stop_hotplug_monitor();
+    pthread_mutex_unlock( &monitor_mutex );
+}
+
+static LONG pcsclite_SCardWaitReaderChange( void *args )
+{
+    struct SCardWaitReaderChange_params *params = args;
+    struct reader_monitor *monitor;
+    unsigned int cancel_seq;
+    LONG ret = SCARD_S_SUCCESS;
+
+    if (!pSCardGetStatusChange) return SCARD_F_INTERNAL_ERROR;
+    pthread_mutex_lock( &monitor_mutex );
+    cancel_seq = reader_change_cancel_seq;
+    if (!(monitor = get_hotplug_monitor()))
+    {
+        pthread_mutex_unlock( &monitor_mutex );
+        return SCARD_E_NO_MEMORY;
+    }
+    /* a generation of 0 only waits for the first snapshot */
+    monitor->waiters++;
+    while (!monitor->exited && cancel_seq == reader_change_cancel_seq
+           && (!monitor->valid || (monitor->readers_generation == *params->pdwGeneration
+               && (!params->pdwStateGeneration || monitor->generation == *params->pdwStateGeneration))))
+        pthread_cond_wait( &monitor_cond, &monitor_mutex );
+    monitor->waiters--;
+
+    if (cancel_seq != reader_change_cancel_seq) ret = SCARD_E_CANCELLED;
+    else if (monitor->exited) ret = SCARD_E_NO_SERVICE;
+    else
+    {
+        *params->pdwGeneration = monitor->readers_generation;
+        if (params->pdwStateGeneration)
+        {
+            /* the last snapshot entry is the PnP notification reader */
+            DWORD_LITE i, count = monitor->count - 1;
+            for (i = 0; i < count && i < *params->pcStates; i++)
+            {
+                snprintf( params->states[i].szReader, sizeof(params->states[i].szReader), "%s",
+                          monitor->readers[i].szReader );
+                params->states[i].dwEventState = monitor->readers[i].dwEventState;
+            }
+            *params->pcStates = count;
+            *params->pdwStateGeneration = monitor->generation;
+        }
+    }
+    pthread_cond_broadcast( &monitor_cond );
+    pthread_mutex_unlock( &monitor_mutex );
+    return ret;
+}
+
+/* wake up the waiters and stop the hot-plug monitor until the next wait */
+static LONG pcsclite_SCardCancelReaderChange( void *args )
+{
+    pthread_mutex_lock( &monitor_mutex );
+    reader_change_cancel_seq++;
+    pthread_cond_broadcast( &monitor_cond );
+    stop_hotplug_monitor();
+    pthread_mutex_unlock( &monitor_mutex );
+    return SCARD_S_SUCCESS;
+}
+
+/* write the records of the dll, a call without records tells whether tracing is on */
+static LONG pcsclite_trace_write( void *args )
+{
+    struct trace_write_params *params = args;
+    LONG ret = SCARD_S_SUCCESS;
+    /* trace_detach may be closing the file */
+    pthread_mutex_lock( &trace_mutex );
+    if (trace_fd < 0) ret = SCARD_E_UNSUPPORTED_FEATURE;
+    else if (params->count) trace_write_records( params->records, params->count );
+    pthread_mutex_unlock( &trace_mutex );
+    params->tid = trace_thread_id();
+    return ret;
+}
+
+static LONG pcsclite_profile_read( void *args )
+{
+    struct profile_read_params *params = args;
+    unsigned int i;
+    if (!profile_enabled) return SCARD_E_UNSUPPORTED_FEATURE;
+    for (i = 0; i <= unix_process_detach; i++)
+    {
+        params->counters[i].count = __atomic_load_n( &profile_counters[i].count, __ATOMIC_RELAXED );
+        params->counters[i].thunk_ns = __atomic_load_n( &profile_counters[i].thunk_ns, __ATOMIC_RELAXED );
+        params->counters[i].pcsclite_ns = __atomic_load_n( &profile_counters[i].pcsclite_ns, __ATOMIC_RELAXED );
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static LONG pcsclite_stats_read( void *args )
+{
+    struct stats_read_params *params = args;
+    if (!t0_auto_response) return SCARD_E_UNSUPPORTED_FEATURE;
+    params->t0_round_trips_saved = __atomic_load_n( &t0_round_trips_saved, __ATOMIC_RELAXED );
+    return SCARD_S_SUCCESS;
+}
+
+/* called once by the dll, on the first call that needs pcsc-lite */
 static LONG pcsclite_process_attach( void *args )
 {
-   if (!load_pcsclite()) return SCARD_F_INTERNAL_ERROR;
+   struct process_attach_params *params = args;
+   const char *env = getenv( "WINSCARD_T0_AUTO_RESPONSE" );
+   ULONGLONG start = trace_now();
+   BOOL loaded;
+
+   t0_auto_response = env && atoi( env );
+   if (params->found_size) params->found_library[0] = 0;
+#ifdef HAVE_SDT_PROBES
+   STAP_PROBE( winscard, load_pcsclite_entry );
+   loaded = load_pcsclite( params );
+   STAP_PROBE2( winscard, load_pcsclite_return, loaded, g_pcscliteHandle );
+#else
+   loaded = load_pcsclite( params );
+#endif
+   params->load_ns = trace_now() - start;
+   if (!loaded) return SCARD_F_INTERNAL_ERROR;
+   trace_attach();
+   profile_attach();
+   fault_attach();
    return SCARD_S_SUCCESS;
 }
 
 static LONG pcsclite_process_detach( void *args )
 {
+    if (faults_enabled)
+        TRACE( "%lu errors injected\n", fault_errors );
+    release_all_monitors();
+    release_shard_workers();
+    trace_detach();
+    session_detach();
     if (g_pcscliteHandle) dlclose( g_pcscliteHandle );
     g_pcscliteHandle = NULL;
     return SCARD_S_SUCCESS;
@@ -99,28 +1506,29 @@ static LONG pcsclite_SCardEstablishContext( void *args )
 {
     struct SCardEstablishContext_params *params = args;
     if (!pSCardEstablishContext) return SCARD_F_INTERNAL_ERROR;
-    return pSCardEstablishContext( params->dwScope, params->pvReserved1, params->pvReserved2, params->phContext );
+    return pcsc_SCardEstablishContext( params->dwScope, params->pvReserved1, params->pvReserved2, params->phContext );
 }
 
 static LONG pcsclite_SCardReleaseContext( void *args )
 {
     struct SCardReleaseContext_params *params = args;
     if (!pSCardReleaseContext) return SCARD_F_INTERNAL_ERROR;
-    return pSCardReleaseContext( params->hContext );
+    release_monitor( params->hContext );
+    return pcsc_SCardReleaseContext( params->hContext );
 }
 
 static LONG pcsclite_SCardIsValidContext( void *args )
 {
     struct SCardIsValidContext_params *params = args;
     if (!pSCardIsValidContext) return SCARD_F_INTERNAL_ERROR;
-    return pSCardIsValidContext( params->hContext );
+    return pcsc_SCardIsValidContext( params->hContext );
 }
 
 static LONG pcsclite_SCardConnect( void *args )
 {
     struct SCardConnect_params *params = args;
     if (!pSCardConnect) return SCARD_F_INTERNAL_ERROR;
-    return pSCardConnect( params->hContext, params->szReader, params->dwShareMode, params->dwPreferredProtocols,
+    return pcsc_SCardConnect( params->hContext, params->szReader, params->dwShareMode, params->dwPreferredProtocols,
         params->phCard, params->pdwActiveProtocol );
 }
 
@@ -128,158 +1536,1148 @@ static LONG pcsclite_SCardReconnect( void *args )
 {
    struct SCardReconnect_params *params = args;
    if (!pSCardReconnect) return SCARD_F_INTERNAL_ERROR;
-   return pSCardReconnect( params->hCard, params->dwShareMode, params->dwPreferredProtocols, params->dwInitialization, params->pdwActiveProtocol );
+   return pcsc_SCardReconnect( params->hCard, params->dwShareMode, params->dwPreferredProtocols, params->dwInitialization, params->pdwActiveProtocol );
 }
 
 static LONG pcsclite_SCardDisconnect( void *args )
 {
    struct SCardDisconnect_params *params = args;
    if (!pSCardDisconnect) return SCARD_F_INTERNAL_ERROR;
-   return pSCardDisconnect( params->hCard, params->dwDisposition );
+   return pcsc_SCardDisconnect( params->hCard, params->dwDisposition );
 }
 
 static LONG pcsclite_SCardBeginTransaction( void *args )
 {
    struct SCardBeginTransaction_params *params = args;
    if (!pSCardBeginTransaction) return SCARD_F_INTERNAL_ERROR;
-   return pSCardBeginTransaction( params->hCard );
+   return pcsc_SCardBeginTransaction( params->hCard );
 }
 
 static LONG pcsclite_SCardEndTransaction( void *args )
 {
    struct SCardEndTransaction_params *params = args;
    if (!pSCardEndTransaction) return SCARD_F_INTERNAL_ERROR;
-   return pSCardEndTransaction( params->hCard, params->dwDisposition );
+   return pcsc_SCardEndTransaction( params->hCard, params->dwDisposition );
 }
 
 static LONG pcsclite_SCardStatus( void *args )
 {
    struct SCardStatus_params *params = args;
    if (!pSCardStatus) return SCARD_F_INTERNAL_ERROR;
-   return pSCardStatus( params->hCard, params->mszReaderName, params->pcchReaderLen, params->pdwState, params->pdwProtocol, 
+   return pcsc_SCardStatus( params->hCard, params->mszReaderName, params->pcchReaderLen, params->pdwState, params->pdwProtocol, 
     params->pbAtr, params->pcbAtrLen );
 }
 
 static LONG pcsclite_SCardGetStatusChange( void *args )
 {
    struct SCardGetStatusChange_params *params = args;
+   LONG ret;
    if (!pSCardGetStatusChange) return SCARD_F_INTERNAL_ERROR;
-   return pSCardGetStatusChange( params->hContext, params->dwTimeout, params->rgReaderStates, params->cReaders );
+   if (params->dwTimeout)
+      return get_status_change( params->hContext, params->dwTimeout, params->rgReaderStates, params->cReaders );
+
+   if (monitor_get_status( params->hContext, params->rgReaderStates, params->cReaders, &ret ))
+      return ret;
+   ret = get_status_change( params->hContext, 0, params->rgReaderStates, params->cReaders );
+   /* the context is polled, serve the next polls from a monitor */
+   if (ret == SCARD_S_SUCCESS || ret == SCARD_E_TIMEOUT) watch_context( params->hContext );
+   return ret;
 }
 
 static LONG pcsclite_SCardControl( void *args )
 {
    struct SCardControl_params *params = args;
    if (!pSCardControl) return SCARD_F_INTERNAL_ERROR;
-   return pSCardControl( params->hCard, params->dwControlCode, params->pbSendBuffer, params->cbSendLength,
+   return pcsc_SCardControl( params->hCard, params->dwControlCode, params->pbSendBuffer, params->cbSendLength,
     params->pbRecvBuffer, params->cbRecvLength, params->lpBytesReturned );
 }
 
+#define T0_MAX_EXCHANGES 64
+
+/*
+ * Exchange an APDU and, for T=0 cards, chain the GET RESPONSE commands asked
+ * by a 61xx status word and resend the command with the right Le on 6Cxx,
+ * so the caller gets the complete response in one call
+ */
+static LONG transmit_apdu( SCARDHANDLE hCard, const SCARD_IO_REQUEST_LITE *pioSendPci, LPCBYTE pbSendBuffer,
+   DWORD_LITE cbSendLength, SCARD_IO_REQUEST_LITE *pioRecvPci, LPBYTE pbRecvBuffer, DWORD_LITE *pcbRecvLength )
+{
+   BYTE command[5], response[258];
+   LPCBYTE cmd = pbSendBuffer;
+   DWORD_LITE cmdLength = cbSendLength, total = 0, length;
+   unsigned long saved = 0;
+   LONG ret;
+   int i;
+
+   if (!t0_auto_response || !pioSendPci || pioSendPci->dwProtocol != PCSCLITE_SCARD_PROTOCOL_T0
+      || !pbRecvBuffer || !pcbRecvLength || cbSendLength < 4)
+      return traced_transmit( hCard, pioSendPci, pbSendBuffer, cbSendLength, pioRecvPci, pbRecvBuffer, pcbRecvLength );
+
+   for (i = 0; i < T0_MAX_EXCHANGES; i++)
+   {
+      length = sizeof(response);
+      ret = traced_transmit( hCard, pioSendPci, cmd, cmdLength, pioRecvPci, response, &length );
+      if (ret != SCARD_S_SUCCESS) return ret;
+
+      if (length == 2 && response[0] == 0x6C && cmdLength == 5)
+      {
+         /* wrong Le: send the same command again with the length given by the card,
+          * cmd is already command after a GET RESPONSE */
+         if (cmd != command) memcpy( command, cmd, 5 );
+         command[4] = response[1];
+         cmd = command;
+         saved++;
+         continue;
+      }
+
+      if (length >= 2 && response[length - 2] == 0x61)
+      {
+         /* keep the data received so far and fetch the remaining bytes */
+         length -= 2;
+         if (total + length > *pcbRecvLength) goto too_small;
+         memcpy( pbRecvBuffer + total, response, length );
+         total += length;
+
+         /* keep the logical channel, of the first or further interindustry class */
+         command[0] = (pbSendBuffer[0] & 0x40) ? 0x40 | (pbSendBuffer[0] & 0x0F) : pbSendBuffer[0] & 0x03;
+         command[1] = 0xC0;
+         command[2] = command[3] = 0x00;
+         command[4] = response[length + 1];
+         cmd = command;
+         cmdLength = 5;
+         saved++;
+         continue;
+      }
+
+      if (total + length > *pcbRecvLength) goto too_small;
+      memcpy( pbRecvBuffer + total, response, length );
+      *pcbRecvLength = total + length;
+      if (saved) __atomic_add_fetch( &t0_round_trips_saved, saved, __ATOMIC_RELAXED );
+      return SCARD_S_SUCCESS;
+   }
+   return SCARD_F_COMM_ERROR;
+
+too_small:
+   *pcbRecvLength = total + length;
+   return SCARD_E_INSUFFICIENT_BUFFER;
+}
+
 static LONG pcsclite_SCardTransmit( void *args )
 {
    struct SCardTransmit_params *params = args;
    if (!pSCardTransmit) return SCARD_F_INTERNAL_ERROR;
-   return pSCardTransmit( params->hCard, params->pioSendPci, params->pbSendBuffer, params->cbSendLength,
+   return transmit_apdu( params->hCard, params->pioSendPci, params->pbSendBuffer, params->cbSendLength,
     params->pioRecvPci, params->pbRecvBuffer, params->pcbRecvLength );
 }
 
+/* send a list of APDUs in one unix call, see SCardTransmitBatch */
+static LONG pcsclite_SCardTransmitBatch( void *args )
+{
+   struct SCardTransmitBatch_params *params = args;
+   LONG ret = SCARD_S_SUCCESS;
+   DWORD_LITE i;
+   if (!pSCardTransmit) return SCARD_F_INTERNAL_ERROR;
+   for (i = 0; i < params->cItems; i++)
+   {
+      SCARD_TRANSMIT_ITEM_LITE *item = &params->rgItems[i];
+      item->lResult = transmit_apdu( params->hCard, params->pioSendPci, item->pbSendBuffer, item->cbSendLength,
+         NULL, item->pbRecvBuffer, &item->cbRecvLength );
+      if (item->lResult != SCARD_S_SUCCESS)
+      {
+         if (params->dwFlags & SCARD_TRANSMIT_STOP_ON_ERROR)
+         {
+            ret = item->lResult;
+            i++;
+            break;
+         }
+         continue;
+      }
+      if ((params->dwFlags & SCARD_TRANSMIT_STOP_ON_SW) && (item->cbRecvLength < 2
+         || item->pbRecvBuffer[item->cbRecvLength - 2] != 0x90 || item->pbRecvBuffer[item->cbRecvLength - 1] != 0x00))
+      {
+         item->lResult = ret = SCARD_W_TRANSMIT_STOPPED;
+         i++;
+         break;
+      }
+   }
+   if (params->pcProcessed) *params->pcProcessed = i;
+   return ret;
+}
+
 static LONG pcsclite_SCardListReaderGroups( void *args )
 {
    struct SCardListReaderGroups_params *params = args;
    if (!pSCardListReaderGroups) return SCARD_F_INTERNAL_ERROR;
-   return pSCardListReaderGroups( params->hContext, params->mszGroups, params->pcchGroups );
+   return pcsc_SCardListReaderGroups( params->hContext, params->mszGroups, params->pcchGroups );
 }
 
 static LONG pcsclite_SCardListReaders( void *args )
 {
    struct SCardListReaders_params *params = args;
    if (!pSCardListReaders) return SCARD_F_INTERNAL_ERROR;
-   return pSCardListReaders( params->hContext, params->mszGroups, params->mszReaders, params->pcchReaders );
+   return pcsc_SCardListReaders( params->hContext, params->mszGroups, params->mszReaders, params->pcchReaders );
 }
 
 static LONG pcsclite_SCardFreeMemory( void *args )
 {
    struct SCardFreeMemory_params *params = args;
    if (!pSCardFreeMemory) return SCARD_F_INTERNAL_ERROR;
-   return pSCardFreeMemory( params->hContext, params->pvMem );
+   return pcsc_SCardFreeMemory( params->hContext, params->pvMem );
 }
 
 static LONG pcsclite_SCardCancel( void *args )
 {
    struct SCardCancel_params *params = args;
    if (!pSCardCancel) return SCARD_F_INTERNAL_ERROR;
-   return pSCardCancel( params->hContext );
+   return cancel_context( params->hContext );
 }
 
 static LONG pcsclite_SCardGetAttrib( void *args )
 {
    struct SCardGetAttrib_params *params = args;
    if (!pSCardGetAttrib) return SCARD_F_INTERNAL_ERROR;
-   return pSCardGetAttrib( params->hCard, params->dwAttrId, params->pbAttr, params->pcbAttrLen );
+   return pcsc_SCardGetAttrib( params->hCard, params->dwAttrId, params->pbAttr, params->pcbAttrLen );
 }
 
 static LONG pcsclite_SCardSetAttrib( void *args )
 {
    struct SCardSetAttrib_params *params = args;
    if (!pSCardSetAttrib) return SCARD_F_INTERNAL_ERROR;
-   return pSCardSetAttrib( params->hCard, params->dwAttrId, params->pbAttr, params->cbAttrLen );
+   return pcsc_SCardSetAttrib( params->hCard, params->dwAttrId, params->pbAttr, params->cbAttrLen );
+}
+
+/*
+ * USDT probes for perf/bpftrace/SystemTap, compiled when sys/sdt.h is available.
+ * Every thunk gets a winscard:<function>_entry probe with the handle and one
+ * input argument, and a winscard:<function>_return probe with the handle, one
+ * output argument and the result. Without a tracer attached a probe is a nop.
+ * The arguments are, per function (entry / return, 0 when there is none):
+ *
+ *   SCardEstablishContext   dwScope / new context, handle is 0
+ *   SCardConnect            preferred protocols / active protocol
+ *   SCardReconnect          preferred protocols / active protocol
+ *   SCardDisconnect         disposition / 0
+ *   SCardEndTransaction     disposition / 0
+ *   SCardStatus             reader buffer size in chars / ATR length in bytes
+ *   SCardGetStatusChange    number of readers / timeout in ms
+ *   SCardControl            input bytes / output bytes
+ *   SCardTransmit           command bytes / response bytes
+ *   SCardListReaderGroups   buffer size in chars / groups length in chars
+ *   SCardListReaders        buffer size in chars / readers length in chars
+ *   SCardGetAttrib          attribute id / attribute bytes
+ *   SCardSetAttrib          attribute id / attribute bytes
+ *   SCardTransmitBatch      number of commands / number processed
+ *   SCardWaitReaderChange   generation seen / current generation, handle is 0
+ *   trace_write             number of records / 0, handle is 0
+ *
+ * The other functions only have the handle, or no argument at all.
+ */
+#ifdef HAVE_SDT_PROBES
+
+#define OPT(p) ((p) ? *(p) : 0)
+
+#define PROBED_THUNK( func, handle, in_arg, out_arg ) \
+static LONG probed_##func( void *args ) \
+{ \
+    struct func##_params *params = args; \
+    LONG ret; \
+    STAP_PROBE2( winscard, func##_entry, (handle), (in_arg) ); \
+    ret = pcsclite_##func( args ); \
+    STAP_PROBE3( winscard, func##_return, (handle), (out_arg), ret ); \
+    return ret; \
 }
 
+#define PROBED_THUNK_NOARGS( func ) \
+static LONG probed_##func( void *args ) \
+{ \
+    LONG ret; \
+    STAP_PROBE( winscard, func##_entry ); \
+    ret = pcsclite_##func( args ); \
+    STAP_PROBE1( winscard, func##_return, ret ); \
+    return ret; \
+}
+
+PROBED_THUNK( SCardEstablishContext, 0, params->dwScope, OPT(params->phContext) )
+PROBED_THUNK( SCardReleaseContext, params->hContext, 0, 0 )
+PROBED_THUNK( SCardIsValidContext, params->hContext, 0, 0 )
+PROBED_THUNK( SCardConnect, params->hContext, params->dwPreferredProtocols, OPT(params->pdwActiveProtocol) )
+PROBED_THUNK( SCardReconnect, params->hCard, params->dwPreferredProtocols, OPT(params->pdwActiveProtocol) )
+PROBED_THUNK( SCardDisconnect, params->hCard, params->dwDisposition, 0 )
+PROBED_THUNK( SCardBeginTransaction, params->hCard, 0, 0 )
+PROBED_THUNK( SCardEndTransaction, params->hCard, params->dwDisposition, 0 )
+PROBED_THUNK( SCardStatus, params->hCard, OPT(params->pcchReaderLen), OPT(params->pcbAtrLen) )
+PROBED_THUNK( SCardGetStatusChange, params->hContext, params->cReaders, params->dwTimeout )
+PROBED_THUNK( SCardControl, params->hCard, params->cbSendLength, OPT(params->lpBytesReturned) )
+PROBED_THUNK( SCardTransmit, params->hCard, params->cbSendLength, OPT(params->pcbRecvLength) )
+PROBED_THUNK( SCardListReaderGroups, params->hContext, OPT(params->pcchGroups), OPT(params->pcchGroups) )
+PROBED_THUNK( SCardListReaders, params->hContext, OPT(params->pcchReaders), OPT(params->pcchReaders) )
+PROBED_THUNK( SCardFreeMemory, params->hContext, 0, 0 )
+PROBED_THUNK( SCardCancel, params->hContext, 0, 0 )
+PROBED_THUNK( SCardGetAttrib, params->hCard, params->dwAttrId, OPT(params->pcbAttrLen) )
+PROBED_THUNK( SCardSetAttrib, params->hCard, params->dwAttrId, params->cbAttrLen )
+PROBED_THUNK( SCardTransmitBatch, params->hCard, params->cItems, OPT(params->pcProcessed) )
+PROBED_THUNK( SCardWaitReaderChange, 0, OPT(params->pdwGeneration), OPT(params->pdwGeneration) )
+PROBED_THUNK_NOARGS( SCardCancelReaderChange )
+PROBED_THUNK( trace_write, 0, params->count, 0 )
+PROBED_THUNK_NOARGS( profile_read )
+PROBED_THUNK_NOARGS( stats_read )
+PROBED_THUNK_NOARGS( process_attach )
+PROBED_THUNK_NOARGS( process_detach )
+
+#define PROBED(func) probed_##func
+
+#else
+
+#define PROBED(func) pcsclite_##func
+
+#endif /* HAVE_SDT_PROBES */
+
+#define PROFILED_THUNK( func ) \
+static LONG profiled_##func( void *args ) \
+{ \
+    uint64_t start, pcsclite_ns; \
+    LONG ret; \
+    if (!profile_enabled) return PROBED(func)( args ); \
+    start = trace_now(); \
+    pcsclite_ns = profile_pcsclite_ns; \
+    ret = PROBED(func)( args ); \
+    profile_record( unix_##func, start, profile_pcsclite_ns - pcsclite_ns ); \
+    return ret; \
+}
+
+PROFILED_THUNK( SCardEstablishContext )
+PROFILED_THUNK( SCardReleaseContext )
+PROFILED_THUNK( SCardIsValidContext )
+PROFILED_THUNK( SCardConnect )
+PROFILED_THUNK( SCardReconnect )
+PROFILED_THUNK( SCardDisconnect )
+PROFILED_THUNK( SCardBeginTransaction )
+PROFILED_THUNK( SCardEndTransaction )
+PROFILED_THUNK( SCardStatus )
+PROFILED_THUNK( SCardGetStatusChange )
+PROFILED_THUNK( SCardControl )
+PROFILED_THUNK( SCardTransmit )
+PROFILED_THUNK( SCardListReaderGroups )
+PROFILED_THUNK( SCardListReaders )
+PROFILED_THUNK( SCardFreeMemory )
+PROFILED_THUNK( SCardCancel )
+PROFILED_THUNK( SCardGetAttrib )
+PROFILED_THUNK( SCardSetAttrib )
+PROFILED_THUNK( SCardTransmitBatch )
+PROFILED_THUNK( SCardWaitReaderChange )
+PROFILED_THUNK( SCardCancelReaderChange )
+
+/* the calls made by the dll for its own needs are not profiled */
+#define THUNK(func) profiled_##func
+#define UNPROFILED_THUNK(func) PROBED(func)
+
 const unixlib_entry_t __wine_unix_call_funcs[] =
 {
-   pcsclite_SCardEstablishContext,
-   pcsclite_SCardReleaseContext,
-   pcsclite_SCardIsValidContext,
-   pcsclite_SCardConnect,
-   pcsclite_SCardReconnect,
-   pcsclite_SCardDisconnect,
-   pcsclite_SCardBeginTransaction,
-   pcsclite_SCardEndTransaction,
-   pcsclite_SCardStatus,
-   pcsclite_SCardGetStatusChange,
-   pcsclite_SCardControl,
-   pcsclite_SCardTransmit,
-   pcsclite_SCardListReaderGroups,
-   pcsclite_SCardListReaders,
-   pcsclite_SCardFreeMemory,
-   pcsclite_SCardCancel,
-   pcsclite_SCardGetAttrib,    
-   pcsclite_SCardSetAttrib,
-   pcsclite_process_attach,
-   pcsclite_process_detach,
+   THUNK(SCardEstablishContext),
+   THUNK(SCardReleaseContext),
+   THUNK(SCardIsValidContext),
+   THUNK(SCardConnect),
+   THUNK(SCardReconnect),
+   THUNK(SCardDisconnect),
+   THUNK(SCardBeginTransaction),
+   THUNK(SCardEndTransaction),
+   THUNK(SCardStatus),
+   THUNK(SCardGetStatusChange),
+   THUNK(SCardControl),
+   THUNK(SCardTransmit),
+   THUNK(SCardListReaderGroups),
+   THUNK(SCardListReaders),
+   THUNK(SCardFreeMemory),
+   THUNK(SCardCancel),
+   THUNK(SCardGetAttrib),
+   THUNK(SCardSetAttrib),
+   THUNK(SCardTransmitBatch),
+   THUNK(SCardWaitReaderChange),
+   THUNK(SCardCancelReaderChange),
+   UNPROFILED_THUNK(trace_write),
+   UNPROFILED_THUNK(profile_read),
+   UNPROFILED_THUNK(stats_read),
+   UNPROFILED_THUNK(process_attach),
+   UNPROFILED_THUNK(process_detach),
+};
+
+/*
+ * Recording and replay of pcsc-lite sessions.
+ * WINSCARD_RECORD=<file> writes every call made to libpcsclite with its
+ * results and timings. WINSCARD_REPLAY=<file> serves the calls from such a
+ * file instead of loading libpcsclite, at full speed or, with
+ * WINSCARD_REPLAY_TIMING=1, taking the time the recorded calls took.
+ * A replayed call gets the first unused record of the same function on the
+ * same handle, so threads may interleave differently from the recording.
+ * Once the session is exhausted, the calls releasing something succeed,
+ * SCardGetStatusChange times out and the others get SCARD_E_NO_SERVICE.
+ *
+ * A recording holds everything read from the cards, personal data included,
+ * so the file is created readable by its owner only. The data of the commands
+ * carrying a PIN, VERIFY, CHANGE REFERENCE DATA and RESET RETRY COUNTER, is
+ * replaced by 0xFF bytes, their header and Lc are kept. Other secrets, keys
+ * sent to the card or PINs hidden in proprietary commands, are not masked:
+ * keep recordings away from shared places.
+ *
+ * The file starts with a session_header, followed by session_record entries,
+ * each one followed by its blobs, a uint32_t length and the data, padded to
+ * 8 bytes. Numbers are stored as uint64_t blobs.
+ */
+#define SESSION_MAGIC   0x43524353  /* "SCRC" */
+#define SESSION_VERSION 1
+
+struct session_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
 };
 
-static BOOL load_pcsclite(void)
+struct session_record
 {
-   if(!g_pcscliteHandle)
-   {
-        /* try to load pcsc-lite */
-#ifdef __APPLE__
-        g_pcscliteHandle = dlopen("/System/Library/Frameworks/PCSC.framework/PCSC",RTLD_LAZY | RTLD_GLOBAL);
-#else
-        g_pcscliteHandle = dlopen("libpcsclite.so",RTLD_LAZY | RTLD_GLOBAL);
-        if(!g_pcscliteHandle)
+    uint32_t size;          /* bytes of blobs following the record */
+    uint16_t func;          /* enum unix_funcs */
+    uint16_t blobs;
+    int32_t  result;
+    uint32_t reserved;
+    uint64_t handle;        /* context or card handle, 0 for SCardEstablishContext */
+    uint64_t start;         /* ns since the start of the recording */
+    uint64_t duration;      /* ns */
+};
+
+struct session_writer
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    unsigned int blobs;
+};
+
+static FILE *record_file = NULL;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t record_origin;
+
+#define MAKE_ORIGINAL_FUNCPTR(f) static typeof(f) * original_p##f
+   MAKE_ORIGINAL_FUNCPTR(SCardEstablishContext);
+   MAKE_ORIGINAL_FUNCPTR(SCardReleaseContext);
+   MAKE_ORIGINAL_FUNCPTR(SCardIsValidContext);
+   MAKE_ORIGINAL_FUNCPTR(SCardConnect);
+   MAKE_ORIGINAL_FUNCPTR(SCardReconnect);
+   MAKE_ORIGINAL_FUNCPTR(SCardDisconnect);
+   MAKE_ORIGINAL_FUNCPTR(SCardBeginTransaction);
+   MAKE_ORIGINAL_FUNCPTR(SCardEndTransaction);
+   MAKE_ORIGINAL_FUNCPTR(SCardStatus);
+   MAKE_ORIGINAL_FUNCPTR(SCardGetStatusChange);
+   MAKE_ORIGINAL_FUNCPTR(SCardControl);
+   MAKE_ORIGINAL_FUNCPTR(SCardTransmit);
+   MAKE_ORIGINAL_FUNCPTR(SCardListReaderGroups);
+   MAKE_ORIGINAL_FUNCPTR(SCardListReaders);
+   MAKE_ORIGINAL_FUNCPTR(SCardFreeMemory);
+   MAKE_ORIGINAL_FUNCPTR(SCardCancel);
+   MAKE_ORIGINAL_FUNCPTR(SCardGetAttrib);
+   MAKE_ORIGINAL_FUNCPTR(SCardSetAttrib);
+#undef MAKE_ORIGINAL_FUNCPTR
+
+static BOOL session_blob( struct session_writer *writer, const void *data, uint32_t length )
+{
+    if (writer->size + sizeof(length) + length > writer->capacity)
+    {
+        size_t capacity = max( writer->capacity * 2, writer->size + sizeof(length) + length + 256 );
+        unsigned char *ptr = realloc( writer->data, capacity );
+        if (!ptr) return FALSE;
+        writer->data = ptr;
+        writer->capacity = capacity;
+    }
+    memcpy( writer->data + writer->size, &length, sizeof(length) );
+    if (length) memcpy( writer->data + writer->size + sizeof(length), data, length );
+    writer->size += sizeof(length) + length;
+    writer->blobs++;
+    return TRUE;
+}
+
+static void session_value( struct session_writer *writer, uint64_t value )
+{
+    session_blob( writer, &value, sizeof(value) );
+}
+
+/* an output buffer and its length, the data is only kept when the call succeeded */
+static void session_out( struct session_writer *writer, LONG ret, const void *buffer, const DWORD_LITE *length )
+{
+    session_value( writer, length ? *length : 0 );
+    session_blob( writer, buffer, ret == SCARD_S_SUCCESS && buffer && length ? *length : 0 );
+}
+
+static LONG session_write( enum unix_funcs func, uint64_t handle, LONG ret, uint64_t start, uint64_t end,
+                           struct session_writer *writer )
+{
+    static const unsigned char padding[8];
+    struct session_record record;
+    size_t pad = -writer->size & 7;
+
+    memset( &record, 0, sizeof(record) );
+    record.size = writer->size + pad;
+    record.func = func;
+    record.blobs = writer->blobs;
+    record.result = ret;
+    record.handle = handle;
+    record.start = start - record_origin;
+    record.duration = end - start;
+    pthread_mutex_lock( &record_mutex );
+    if (record_file)
+    {
+        fwrite( &record, sizeof(record), 1, record_file );
+        if (writer->size) fwrite( writer->data, writer->size, 1, record_file );
+        if (pad) fwrite( padding, pad, 1, record_file );
+    }
+    pthread_mutex_unlock( &record_mutex );
+    free( writer->data );
+    return ret;
+}
+
+/* declarations only, the call is timed before anything is recorded */
+#define RECORDED_CALL( f, ... ) \
+    uint64_t start = trace_now(); \
+    LONG ret = original_p##f( __VA_ARGS__ ); \
+    uint64_t end = trace_now(); \
+    struct session_writer writer = { NULL, 0, 0, 0 }
+
+static LONG record_SCardEstablishContext( DWORD_LITE dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2,
+                                          SCARDCONTEXT *phContext )
+{
+    RECORDED_CALL( SCardEstablishContext, dwScope, pvReserved1, pvReserved2, phContext );
+    session_value( &writer, ret == SCARD_S_SUCCESS ? *phContext : 0 );
+    return session_write( unix_SCardEstablishContext, 0, ret, start, end, &writer );
+}
+
+static LONG record_SCardReleaseContext( SCARDCONTEXT hContext )
+{
+    RECORDED_CALL( SCardReleaseContext, hContext );
+    return session_write( unix_SCardReleaseContext, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardIsValidContext( SCARDCONTEXT hContext )
+{
+    RECORDED_CALL( SCardIsValidContext, hContext );
+    return session_write( unix_SCardIsValidContext, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardConnect( SCARDCONTEXT hContext, LPCSTR szReader, DWORD_LITE dwShareMode,
+                                 DWORD_LITE dwPreferredProtocols, SCARDHANDLE *phCard, DWORD_LITE *pdwActiveProtocol )
+{
+    RECORDED_CALL( SCardConnect, hContext, szReader, dwShareMode, dwPreferredProtocols, phCard, pdwActiveProtocol );
+    session_blob( &writer, szReader, szReader ? strlen( szReader ) + 1 : 0 );
+    session_value( &writer, ret == SCARD_S_SUCCESS ? *phCard : 0 );
+    session_value( &writer, ret == SCARD_S_SUCCESS ? *pdwActiveProtocol : 0 );
+    return session_write( unix_SCardConnect, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardReconnect( SCARDHANDLE hCard, DWORD_LITE dwShareMode, DWORD_LITE dwPreferredProtocols,
+                                   DWORD_LITE dwInitialization, DWORD_LITE *pdwActiveProtocol )
+{
+    RECORDED_CALL( SCardReconnect, hCard, dwShareMode, dwPreferredProtocols, dwInitialization, pdwActiveProtocol );
+    session_value( &writer, ret == SCARD_S_SUCCESS ? *pdwActiveProtocol : 0 );
+    return session_write( unix_SCardReconnect, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardDisconnect( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    RECORDED_CALL( SCardDisconnect, hCard, dwDisposition );
+    return session_write( unix_SCardDisconnect, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardBeginTransaction( SCARDHANDLE hCard )
+{
+    RECORDED_CALL( SCardBeginTransaction, hCard );
+    return session_write( unix_SCardBeginTransaction, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardEndTransaction( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    RECORDED_CALL( SCardEndTransaction, hCard, dwDisposition );
+    return session_write( unix_SCardEndTransaction, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardStatus( SCARDHANDLE hCard, LPSTR mszReaderName, DWORD_LITE *pcchReaderLen, DWORD_LITE *pdwState,
+                                DWORD_LITE *pdwProtocol, LPBYTE pbAtr, DWORD_LITE *pcbAtrLen )
+{
+    RECORDED_CALL( SCardStatus, hCard, mszReaderName, pcchReaderLen, pdwState, pdwProtocol, pbAtr, pcbAtrLen );
+    session_out( &writer, ret, mszReaderName, pcchReaderLen );
+    session_value( &writer, ret == SCARD_S_SUCCESS && pdwState ? *pdwState : 0 );
+    session_value( &writer, ret == SCARD_S_SUCCESS && pdwProtocol ? *pdwProtocol : 0 );
+    session_out( &writer, ret, pbAtr, pcbAtrLen );
+    return session_write( unix_SCardStatus, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardGetStatusChange( SCARDCONTEXT hContext, DWORD_LITE dwTimeout,
+                                         SCARD_READERSTATE_LITE *rgReaderStates, DWORD_LITE cReaders )
+{
+    RECORDED_CALL( SCardGetStatusChange, hContext, dwTimeout, rgReaderStates, cReaders );
+    DWORD_LITE i;
+    session_value( &writer, cReaders );
+    for (i = 0; i < cReaders; i++)
+    {
+        session_value( &writer, rgReaderStates[i].dwEventState );
+        session_blob( &writer, rgReaderStates[i].rgbAtr, min( rgReaderStates[i].cbAtr, MAX_ATR_SIZE ) );
+    }
+    return session_write( unix_SCardGetStatusChange, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardControl( SCARDHANDLE hCard, DWORD_LITE dwControlCode, LPCVOID pbSendBuffer,
+                                 DWORD_LITE cbSendLength, LPVOID pbRecvBuffer, DWORD_LITE cbRecvLength,
+                                 DWORD_LITE *lpBytesReturned )
+{
+    RECORDED_CALL( SCardControl, hCard, dwControlCode, pbSendBuffer, cbSendLength, pbRecvBuffer, cbRecvLength,
+                   lpBytesReturned );
+    session_value( &writer, dwControlCode );
+    session_blob( &writer, pbSendBuffer, pbSendBuffer ? cbSendLength : 0 );
+    session_out( &writer, ret, pbRecvBuffer, lpBytesReturned );
+    return session_write( unix_SCardControl, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardTransmit( SCARDHANDLE hCard, const SCARD_IO_REQUEST_LITE *pioSendPci, LPCBYTE pbSendBuffer,
+                                  DWORD_LITE cbSendLength, SCARD_IO_REQUEST_LITE *pioRecvPci, LPBYTE pbRecvBuffer,
+                                  DWORD_LITE *pcbRecvLength )
+{
+    RECORDED_CALL( SCardTransmit, hCard, pioSendPci, pbSendBuffer, cbSendLength, pioRecvPci, pbRecvBuffer,
+                   pcbRecvLength );
+    if (session_blob( &writer, pbSendBuffer, pbSendBuffer ? cbSendLength : 0 ) && cbSendLength > 5 &&
+        (pbSendBuffer[1] == 0x20 || pbSendBuffer[1] == 0x24 || pbSendBuffer[1] == 0x2C))
+        memset( writer.data + writer.size - (cbSendLength - 5), 0xff, cbSendLength - 5 );  /* PIN */
+    session_value( &writer, pioRecvPci ? pioRecvPci->dwProtocol : 0 );
+    session_out( &writer, ret, pbRecvBuffer, pcbRecvLength );
+    return session_write( unix_SCardTransmit, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardListReaderGroups( SCARDCONTEXT hContext, LPSTR mszGroups, DWORD_LITE *pcchGroups )
+{
+    RECORDED_CALL( SCardListReaderGroups, hContext, mszGroups, pcchGroups );
+    session_out( &writer, ret, mszGroups, pcchGroups );
+    return session_write( unix_SCardListReaderGroups, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardListReaders( SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders,
+                                     DWORD_LITE *pcchReaders )
+{
+    RECORDED_CALL( SCardListReaders, hContext, mszGroups, mszReaders, pcchReaders );
+    session_out( &writer, ret, mszReaders, pcchReaders );
+    return session_write( unix_SCardListReaders, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardFreeMemory( SCARDCONTEXT hContext, LPCVOID pvMem )
+{
+    RECORDED_CALL( SCardFreeMemory, hContext, pvMem );
+    return session_write( unix_SCardFreeMemory, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardCancel( SCARDCONTEXT hContext )
+{
+    RECORDED_CALL( SCardCancel, hContext );
+    return session_write( unix_SCardCancel, hContext, ret, start, end, &writer );
+}
+
+static LONG record_SCardGetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPBYTE pbAttr, DWORD_LITE *pcbAttrLen )
+{
+    RECORDED_CALL( SCardGetAttrib, hCard, dwAttrId, pbAttr, pcbAttrLen );
+    session_value( &writer, dwAttrId );
+    session_out( &writer, ret, pbAttr, pcbAttrLen );
+    return session_write( unix_SCardGetAttrib, hCard, ret, start, end, &writer );
+}
+
+static LONG record_SCardSetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPCBYTE pbAttr, DWORD_LITE cbAttrLen )
+{
+    RECORDED_CALL( SCardSetAttrib, hCard, dwAttrId, pbAttr, cbAttrLen );
+    session_value( &writer, dwAttrId );
+    return session_write( unix_SCardSetAttrib, hCard, ret, start, end, &writer );
+}
+
+#undef RECORDED_CALL
+
+static void record_attach(void)
+{
+    const char *file = getenv( "WINSCARD_RECORD" );
+    struct session_header header;
+    int fd;
+
+    if (!file || !*file) return;
+    if ((fd = open( file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 )) < 0 ||
+        !(record_file = fdopen( fd, "wb" )))
+    {
+        WARN( "can't create session file %s, errno %d\n", debugstr_a(file), errno );
+        if (fd >= 0) close( fd );
+        return;
+    }
+    memset( &header, 0, sizeof(header) );
+    header.magic = SESSION_MAGIC;
+    header.version = SESSION_VERSION;
+    fwrite( &header, sizeof(header), 1, record_file );
+    record_origin = trace_now();
+
+#define RECORD_FUNCPTR(f) original_p##f = p##f; p##f = record_##f
+    RECORD_FUNCPTR(SCardEstablishContext);
+    RECORD_FUNCPTR(SCardReleaseContext);
+    RECORD_FUNCPTR(SCardIsValidContext);
+    RECORD_FUNCPTR(SCardConnect);
+    RECORD_FUNCPTR(SCardReconnect);
+    RECORD_FUNCPTR(SCardDisconnect);
+    RECORD_FUNCPTR(SCardBeginTransaction);
+    RECORD_FUNCPTR(SCardEndTransaction);
+    RECORD_FUNCPTR(SCardStatus);
+    RECORD_FUNCPTR(SCardGetStatusChange);
+    RECORD_FUNCPTR(SCardControl);
+    RECORD_FUNCPTR(SCardTransmit);
+    RECORD_FUNCPTR(SCardListReaderGroups);
+    RECORD_FUNCPTR(SCardListReaders);
+    RECORD_FUNCPTR(SCardFreeMemory);
+    RECORD_FUNCPTR(SCardCancel);
+    RECORD_FUNCPTR(SCardGetAttrib);
+    RECORD_FUNCPTR(SCardSetAttrib);
+#undef RECORD_FUNCPTR
+    TRACE( "recording pcsc-lite session to %s\n", debugstr_a(file) );
+}
+
+/*
+ * replay
+ */
+struct session_entry
+{
+    const struct session_record *record;
+    int next;               /* next entry of the same function, -1 at the end */
+    BOOL used;
+};
+
+struct session_cursor
+{
+    const unsigned char *ptr;
+    const unsigned char *end;
+};
+
+static unsigned char *replay_data = NULL;
+static struct session_entry *replay_entries = NULL;
+static int replay_first[unix_process_detach + 1];  /* first entry of each function that may be unused */
+static BOOL replay_timing = FALSE;
+static unsigned long replay_misses = 0;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static BOOL replay_next( enum unix_funcs func, uint64_t handle, struct session_cursor *cursor, LONG *ret )
+{
+    const struct session_record *record = NULL;
+    int i;
+
+    pthread_mutex_lock( &replay_mutex );
+    for (i = replay_first[func]; i >= 0; i = replay_entries[i].next)
+    {
+        if (replay_entries[i].used || replay_entries[i].record->handle != handle) continue;
+        replay_entries[i].used = TRUE;
+        record = replay_entries[i].record;
+        break;
+    }
+    while (replay_first[func] >= 0 && replay_entries[replay_first[func]].used)
+        replay_first[func] = replay_entries[replay_first[func]].next;
+    if (!record) replay_misses++;
+    pthread_mutex_unlock( &replay_mutex );
+
+    if (!record) return FALSE;
+    cursor->ptr = (const unsigned char *)(record + 1);
+    cursor->end = cursor->ptr + record->size;
+    *ret = record->result;
+    if (replay_timing && record->duration) sleep_ns( record->duration );
+    return TRUE;
+}
+
+static const void *replay_blob( struct session_cursor *cursor, uint32_t *length )
+{
+    const void *data;
+    uint32_t size;
+    if (cursor->end - cursor->ptr < sizeof(size)) size = 0;
+    else
+    {
+        memcpy( &size, cursor->ptr, sizeof(size) );
+        cursor->ptr += sizeof(size);
+        if (size > cursor->end - cursor->ptr) size = cursor->end - cursor->ptr;
+    }
+    data = cursor->ptr;
+    cursor->ptr += size;
+    if (length) *length = size;
+    return data;
+}
+
+static uint64_t replay_value( struct session_cursor *cursor )
+{
+    uint64_t value = 0;
+    uint32_t size;
+    const void *data = replay_blob( cursor, &size );
+    if (size == sizeof(value)) memcpy( &value, data, sizeof(value) );
+    return value;
+}
+
+/* output buffer recorded by session_out */
+static LONG replay_out( struct session_cursor *cursor, LONG ret, void *buffer, DWORD_LITE *length )
+{
+    uint64_t recorded = replay_value( cursor );
+    uint32_t size;
+    const void *data = replay_blob( cursor, &size );
+
+    if (!length) return ret;
+    if (buffer && size)
+    {
+        if (*length < size)
         {
-            /* error occured. Trying libpcsclite.so.1*/
-            g_pcscliteHandle = dlopen("libpcsclite.so.1",RTLD_LAZY | RTLD_GLOBAL);
+            *length = recorded;
+            return SCARD_E_INSUFFICIENT_BUFFER;
         }
-        if(!g_pcscliteHandle)
+        memcpy( buffer, data, size );
+    }
+    *length = recorded;
+    return ret;
+}
+
+static LONG replay_SCardEstablishContext( DWORD_LITE dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2,
+                                          SCARDCONTEXT *phContext )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardEstablishContext, 0, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    *phContext = replay_value( &cursor );
+    return ret;
+}
+
+static LONG replay_SCardReleaseContext( SCARDCONTEXT hContext )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardReleaseContext, hContext, &cursor, &ret )) return SCARD_S_SUCCESS;
+    return ret;
+}
+
+static LONG replay_SCardIsValidContext( SCARDCONTEXT hContext )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardIsValidContext, hContext, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    return ret;
+}
+
+static LONG replay_SCardConnect( SCARDCONTEXT hContext, LPCSTR szReader, DWORD_LITE dwShareMode,
+                                 DWORD_LITE dwPreferredProtocols, SCARDHANDLE *phCard, DWORD_LITE *pdwActiveProtocol )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardConnect, hContext, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    replay_blob( &cursor, NULL );
+    *phCard = replay_value( &cursor );
+    *pdwActiveProtocol = replay_value( &cursor );
+    return ret;
+}
+
+static LONG replay_SCardReconnect( SCARDHANDLE hCard, DWORD_LITE dwShareMode, DWORD_LITE dwPreferredProtocols,
+                                   DWORD_LITE dwInitialization, DWORD_LITE *pdwActiveProtocol )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardReconnect, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    *pdwActiveProtocol = replay_value( &cursor );
+    return ret;
+}
+
+static LONG replay_SCardDisconnect( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardDisconnect, hCard, &cursor, &ret )) return SCARD_S_SUCCESS;
+    return ret;
+}
+
+static LONG replay_SCardBeginTransaction( SCARDHANDLE hCard )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardBeginTransaction, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    return ret;
+}
+
+static LONG replay_SCardEndTransaction( SCARDHANDLE hCard, DWORD_LITE dwDisposition )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardEndTransaction, hCard, &cursor, &ret )) return SCARD_S_SUCCESS;
+    return ret;
+}
+
+static LONG replay_SCardStatus( SCARDHANDLE hCard, LPSTR mszReaderName, DWORD_LITE *pcchReaderLen, DWORD_LITE *pdwState,
+                                DWORD_LITE *pdwProtocol, LPBYTE pbAtr, DWORD_LITE *pcbAtrLen )
+{
+    struct session_cursor cursor;
+    uint64_t state, protocol;
+    LONG ret;
+    if (!replay_next( unix_SCardStatus, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    ret = replay_out( &cursor, ret, mszReaderName, pcchReaderLen );
+    state = replay_value( &cursor );
+    protocol = replay_value( &cursor );
+    if (pdwState) *pdwState = state;
+    if (pdwProtocol) *pdwProtocol = protocol;
+    return replay_out( &cursor, ret, pbAtr, pcbAtrLen );
+}
+
+static LONG replay_SCardGetStatusChange( SCARDCONTEXT hContext, DWORD_LITE dwTimeout,
+                                         SCARD_READERSTATE_LITE *rgReaderStates, DWORD_LITE cReaders )
+{
+    struct session_cursor cursor;
+    DWORD_LITE count, i;
+    LONG ret;
+
+    /* an endless wait would never end, a monitor polling with it has to stop */
+    if (!replay_next( unix_SCardGetStatusChange, hContext, &cursor, &ret ))
+        return dwTimeout == PCSCLITE_INFINITE ? SCARD_E_NO_SERVICE : SCARD_E_TIMEOUT;
+    count = replay_value( &cursor );
+    for (i = 0; i < count; i++)
+    {
+        uint64_t event = replay_value( &cursor );
+        uint32_t size;
+        const void *atr = replay_blob( &cursor, &size );
+        if (i >= cReaders) continue;
+        rgReaderStates[i].dwEventState = event;
+        rgReaderStates[i].cbAtr = min( size, MAX_ATR_SIZE );
+        memcpy( rgReaderStates[i].rgbAtr, atr, rgReaderStates[i].cbAtr );
+    }
+    return ret;
+}
+
+static LONG replay_SCardControl( SCARDHANDLE hCard, DWORD_LITE dwControlCode, LPCVOID pbSendBuffer,
+                                 DWORD_LITE cbSendLength, LPVOID pbRecvBuffer, DWORD_LITE cbRecvLength,
+                                 DWORD_LITE *lpBytesReturned )
+{
+    struct session_cursor cursor;
+    uint64_t recorded;
+    uint32_t size;
+    const void *data;
+    LONG ret;
+
+    if (!replay_next( unix_SCardControl, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    replay_value( &cursor );
+    replay_blob( &cursor, NULL );
+    recorded = replay_value( &cursor );
+    data = replay_blob( &cursor, &size );
+    if (size > cbRecvLength) return SCARD_E_INSUFFICIENT_BUFFER;
+    if (pbRecvBuffer) memcpy( pbRecvBuffer, data, size );
+    if (lpBytesReturned) *lpBytesReturned = recorded;
+    return ret;
+}
+
+static LONG replay_SCardTransmit( SCARDHANDLE hCard, const SCARD_IO_REQUEST_LITE *pioSendPci, LPCBYTE pbSendBuffer,
+                                  DWORD_LITE cbSendLength, SCARD_IO_REQUEST_LITE *pioRecvPci, LPBYTE pbRecvBuffer,
+                                  DWORD_LITE *pcbRecvLength )
+{
+    struct session_cursor cursor;
+    uint64_t protocol;
+    LONG ret;
+    if (!replay_next( unix_SCardTransmit, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    replay_blob( &cursor, NULL );
+    protocol = replay_value( &cursor );
+    if (pioRecvPci) pioRecvPci->dwProtocol = protocol;
+    return replay_out( &cursor, ret, pbRecvBuffer, pcbRecvLength );
+}
+
+static LONG replay_SCardListReaderGroups( SCARDCONTEXT hContext, LPSTR mszGroups, DWORD_LITE *pcchGroups )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardListReaderGroups, hContext, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    return replay_out( &cursor, ret, mszGroups, pcchGroups );
+}
+
+static LONG replay_SCardListReaders( SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders,
+                                     DWORD_LITE *pcchReaders )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardListReaders, hContext, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    return replay_out( &cursor, ret, mszReaders, pcchReaders );
+}
+
+static LONG replay_SCardFreeMemory( SCARDCONTEXT hContext, LPCVOID pvMem )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardFreeMemory, hContext, &cursor, &ret )) return SCARD_S_SUCCESS;
+    return ret;
+}
+
+static LONG replay_SCardCancel( SCARDCONTEXT hContext )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardCancel, hContext, &cursor, &ret )) return SCARD_S_SUCCESS;
+    return ret;
+}
+
+static LONG replay_SCardGetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPBYTE pbAttr, DWORD_LITE *pcbAttrLen )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardGetAttrib, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    replay_value( &cursor );
+    return replay_out( &cursor, ret, pbAttr, pcbAttrLen );
+}
+
+static LONG replay_SCardSetAttrib( SCARDHANDLE hCard, DWORD_LITE dwAttrId, LPCBYTE pbAttr, DWORD_LITE cbAttrLen )
+{
+    struct session_cursor cursor;
+    LONG ret;
+    if (!replay_next( unix_SCardSetAttrib, hCard, &cursor, &ret )) return SCARD_E_NO_SERVICE;
+    return ret;
+}
+
+static BOOL replay_load( const char *file )
+{
+    const struct session_header *header;
+    int last[unix_process_detach + 1];
+    size_t size = 0, capacity = 0, offset, count = 0;
+    FILE *f;
+    int i;
+
+    if (!(f = fopen( file, "rb" ))) return FALSE;
+    for (;;)
+    {
+        unsigned char *data;
+        size_t ret;
+        if (size == capacity)
         {
+            capacity = capacity ? capacity * 2 : 65536;
+            if (!(data = realloc( replay_data, capacity ))) break;
+            replay_data = data;
+        }
+        if (!(ret = fread( replay_data + size, 1, capacity - size, f ))) break;
+        size += ret;
+    }
+    fclose( f );
+
+    header = (const struct session_header *)replay_data;
+    if (size < sizeof(*header) || header->magic != SESSION_MAGIC || header->version != SESSION_VERSION) return FALSE;
+
+    /* index the records, keeping them in order for each function */
+    for (offset = sizeof(*header); offset + sizeof(struct session_record) <= size; count++)
+        offset += sizeof(struct session_record) + ((const struct session_record *)(replay_data + offset))->size;
+    if (!(replay_entries = calloc( count + 1, sizeof(*replay_entries) ))) return FALSE;
+    for (i = 0; i <= unix_process_detach; i++) replay_first[i] = last[i] = -1;
+    for (i = 0, offset = sizeof(*header); i < count; i++)
+    {
+        const struct session_record *record = (const struct session_record *)(replay_data + offset);
+        offset += sizeof(*record) + record->size;
+        if (offset > size || record->func >= unix_SCardTransmitBatch) break;
+        replay_entries[i].record = record;
+        replay_entries[i].next = -1;
+        if (last[record->func] < 0) replay_first[record->func] = i;
+        else replay_entries[last[record->func]].next = i;
+        last[record->func] = i;
+    }
+    TRACE( "replaying %d calls from %s\n", i, debugstr_a(file) );
+    return TRUE;
+}
+
+static BOOL replay_attach( const char *file )
+{
+    const char *timing = getenv( "WINSCARD_REPLAY_TIMING" );
+
+    if (!replay_load( file ))
+    {
+        ERR( "can't replay session file %s\n", debugstr_a(file) );
+        return FALSE;
+    }
+    replay_timing = timing && atoi( timing );
+
+#define REPLAY_FUNCPTR(f) p##f = replay_##f
+    REPLAY_FUNCPTR(SCardEstablishContext);
+    REPLAY_FUNCPTR(SCardReleaseContext);
+    REPLAY_FUNCPTR(SCardIsValidContext);
+    REPLAY_FUNCPTR(SCardConnect);
+    REPLAY_FUNCPTR(SCardReconnect);
+    REPLAY_FUNCPTR(SCardDisconnect);
+    REPLAY_FUNCPTR(SCardBeginTransaction);
+    REPLAY_FUNCPTR(SCardEndTransaction);
+    REPLAY_FUNCPTR(SCardStatus);
+    REPLAY_FUNCPTR(SCardGetStatusChange);
+    REPLAY_FUNCPTR(SCardControl);
+    REPLAY_FUNCPTR(SCardTransmit);
+    REPLAY_FUNCPTR(SCardListReaderGroups);
+    REPLAY_FUNCPTR(SCardListReaders);
+    REPLAY_FUNCPTR(SCardFreeMemory);
+    REPLAY_FUNCPTR(SCardCancel);
+    REPLAY_FUNCPTR(SCardGetAttrib);
+    REPLAY_FUNCPTR(SCardSetAttrib);
+#undef REPLAY_FUNCPTR
+    return TRUE;
+}
+
+static void session_detach(void)
+{
+    pthread_mutex_lock( &record_mutex );
+    if (record_file) fclose( record_file );
+    record_file = NULL;
+    pthread_mutex_unlock( &record_mutex );
+
+    if (!replay_data) return;
+    if (replay_misses) WARN( "%lu calls were not in the replayed session\n", replay_misses );
+    free( replay_entries );
+    free( replay_data );
+    replay_entries = NULL;
+    replay_data = NULL;
+}
+
+/* where to look for pcsc-lite, in order */
+static const char * const pcsclite_names[] =
+{
+#ifdef __APPLE__
+    "/System/Library/Frameworks/PCSC.framework/PCSC",
+#else
+    "libpcsclite.so",
+    "libpcsclite.so.1",
 #ifdef __LP64__
-            g_pcscliteHandle = dlopen("/lib/x86_64-linux-gnu/libpcsclite.so.1",RTLD_LAZY | RTLD_GLOBAL);
+    "/lib/x86_64-linux-gnu/libpcsclite.so.1",
+    "/usr/lib/x86_64-linux-gnu/libpcsclite.so.1",
 #else
-            g_pcscliteHandle = dlopen("/lib/i386-linux-gnu/libpcsclite.so.1",RTLD_LAZY | RTLD_GLOBAL);
-#endif    
+    "/lib/i386-linux-gnu/libpcsclite.so.1",
+    "/usr/lib/i386-linux-gnu/libpcsclite.so.1",
+#endif
+#endif
+};
+
+static BOOL load_pcsclite( struct process_attach_params *params )
+{
+   const char *replay = getenv( "WINSCARD_REPLAY" );
+   const char *found = NULL;
+   unsigned int i;
+
+   /* a replayed session needs no pcsc-lite */
+   if (replay && *replay) return replay_attach( replay );
+
+   if(!g_pcscliteHandle)
+   {
+        const char *override = getenv( "WINSCARD_PCSCLITE" );
+
+        if (!override || !*override) override = params->library;
+        /* a stand-in library, such as fakepcsc, never falls back to the real one */
+        if (override && *override)
+        {
+            if (!(g_pcscliteHandle = dlopen( override, RTLD_LAZY | RTLD_GLOBAL )))
+            {
+                ERR( "failed to load %s: %s\n", debugstr_a(override), debugstr_a(dlerror()) );
+                return FALSE;
+            }
         }
-         if(!g_pcscliteHandle)
+        /* saves the failing attempts made before the search reaches it */
+        else if (params->cached_library && *params->cached_library)
         {
-#ifdef __LP64__
-            g_pcscliteHandle = dlopen("/usr/lib/x86_64-linux-gnu/libpcsclite.so.1",RTLD_LAZY | RTLD_GLOBAL);
-#else
-            g_pcscliteHandle = dlopen("/usr/lib/i386-linux-gnu/libpcsclite.so.1",RTLD_LAZY | RTLD_GLOBAL);
-#endif    
+            if ((g_pcscliteHandle = dlopen( params->cached_library, RTLD_LAZY | RTLD_GLOBAL )))
+                found = params->cached_library;
+            else
+                WARN( "cached %s failed to load, searching again\n", debugstr_a(params->cached_library) );
+        }
+        /* try to load pcsc-lite */
+        for (i = 0; !override && !g_pcscliteHandle && i < ARRAY_SIZE(pcsclite_names); i++)
+        {
+            if ((g_pcscliteHandle = dlopen( pcsclite_names[i], RTLD_LAZY | RTLD_GLOBAL )))
+                found = pcsclite_names[i];
         }
-#endif
       TRACE("g_pcscliteHandle: %p\n", g_pcscliteHandle);
         if(!g_pcscliteHandle)
         {
@@ -318,6 +2716,9 @@ static BOOL load_pcsclite(void)
    LOAD_FUNCPTR( SCardGetAttrib)    
    LOAD_FUNCPTR( SCardSetAttrib)
 #undef LOAD_FUNCPTR
+   if (found && params->found_size && strlen( found ) < params->found_size)
+       strcpy( params->found_library, found );
+   record_attach();
    return TRUE;
 fail:
    dlclose( g_pcscliteHandle );
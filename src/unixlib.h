@@ -25,6 +25,7 @@
 #include "winbase.h"
 #include "winternl.h"
 #include "wine/unixlib.h"
+#include "scardtrace.h"
 
 #ifndef __unixlib_h__
 #define __unixlib_h__
@@ -98,6 +99,22 @@ typedef const SCARD_IO_REQUEST_LITE *LPCSCARD_IO_REQUEST_LITE;
 
 #endif
 
+typedef struct
+{
+        LPCBYTE pbSendBuffer;
+        DWORD_LITE cbSendLength;
+        LPBYTE pbRecvBuffer;
+        DWORD_LITE cbRecvLength;     /**< in: buffer size, out: response length */
+        LONG lResult;
+}
+SCARD_TRANSMIT_ITEM_LITE, *LPSCARD_TRANSMIT_ITEM_LITE;
+
+#ifndef SCARD_TRANSMIT_STOP_ON_ERROR
+#define SCARD_TRANSMIT_STOP_ON_ERROR       0x00000001
+#define SCARD_TRANSMIT_STOP_ON_SW          0x00000002
+#define SCARD_W_TRANSMIT_STOPPED           ((LONG)0x801000F0)
+#endif
+
 enum unix_funcs
 {
     unix_SCardEstablishContext,
@@ -118,6 +135,12 @@ enum unix_funcs
     unix_SCardCancel,
     unix_SCardGetAttrib,    
     unix_SCardSetAttrib,
+    unix_SCardTransmitBatch,
+    unix_SCardWaitReaderChange,
+    unix_SCardCancelReaderChange,
+    unix_trace_write,
+    unix_profile_read,
+    unix_stats_read,
     unix_process_attach,
     unix_process_detach,
 };
@@ -217,6 +240,68 @@ struct SCardTransmit_params
     DWORD_LITE *pcbRecvLength;
 };
 
+struct SCardTransmitBatch_params
+{
+    SCARDHANDLE hCard;
+    const SCARD_IO_REQUEST_LITE *pioSendPci;
+    SCARD_TRANSMIT_ITEM_LITE *rgItems;
+    DWORD_LITE cItems;
+    DWORD_LITE dwFlags;
+    DWORD_LITE *pcProcessed;
+};
+
+#define SCARD_READER_STATE_NAME 128
+
+/* state of a reader as last seen by the reader monitor */
+struct scard_reader_state
+{
+    char szReader[SCARD_READER_STATE_NAME];
+    DWORD_LITE dwEventState;
+};
+
+struct SCardWaitReaderChange_params
+{
+    DWORD_LITE *pdwGeneration;          /* in: reader list seen last, out: current one */
+    DWORD_LITE *pdwStateGeneration;     /* NULL, or also wait for reader state changes */
+    struct scard_reader_state *states;  /* receives the reader states with pdwStateGeneration */
+    DWORD_LITE *pcStates;               /* in: size of states, out: number of readers */
+};
+
+struct trace_write_params
+{
+    const struct scard_trace_record *records;
+    DWORD_LITE count;
+    DWORD_LITE tid;  /* out: thread id of the caller, as recorded by the unix library */
+};
+
+/* time spent by the unix library in one of its calls, see profile_read */
+struct scard_profile_counter
+{
+    ULONGLONG count;
+    ULONGLONG thunk_ns;     /* whole call, as seen from the unix side */
+    ULONGLONG pcsclite_ns;  /* part spent in libpcsclite and pcscd */
+};
+
+struct profile_read_params
+{
+    struct scard_profile_counter *counters;  /* unix_process_detach + 1 entries */
+};
+
+/* counters of the unix library written with the call statistics */
+struct stats_read_params
+{
+    ULONGLONG t0_round_trips_saved;  /* GET RESPONSE and resent commands issued for the application */
+};
+
+struct process_attach_params
+{
+    const char *library;         /* explicit library to load, NULL to search for pcsc-lite */
+    const char *cached_library;  /* where the search found pcsc-lite last time, or NULL */
+    char *found_library;         /* receives where the search found it, empty if not searched */
+    DWORD_LITE found_size;
+    ULONGLONG load_ns;           /* time taken to load the library and resolve its functions */
+};
+
 struct SCardListReaderGroups_params
 {
     SCARDCONTEXT hContext;
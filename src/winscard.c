@@ -17,11 +17,15 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
  */
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "windef.h"
 #include "winbase.h"
+#include "winreg.h"
 #include "ntuser.h"
 #include "wine/unixlib.h"
 #include "wine/debug.h"
+#include "wine/list.h"
 
 #include "winscard.h"
 #include "unixlib.h"
@@ -59,7 +63,93 @@ lite_proto2ms_proto(DWORD_LITE dwProtocol)
 HANDLE g_startedEvent = NULL;
 
 
-#define WINSCARD_CALL( func, params ) WINE_UNIX_CALL( unix_ ## func, params )
+static BOOL stats_enabled = FALSE;
+static BOOL trace_enabled = FALSE;
+static BOOL profile_enabled = FALSE;
+static LONG InstrumentedCall(enum unix_funcs code, void *params, SCARDHANDLE hCard, const BYTE *pbApdu, DWORD cbApdu);
+
+/*
+ * pcsc-lite is loaded by the first call that needs it rather than by DllMain,
+ * processes only linking to winscard don't pay for the dlopen/dlsym calls
+ */
+static INIT_ONCE unix_init_once = INIT_ONCE_STATIC_INIT;
+static LONG unix_loaded = FALSE;
+static BOOL WINAPI LoadUnixLibrary(INIT_ONCE *once, void *param, void **context);
+
+static inline void EnsureUnixLoaded(void)
+{
+    if(!ReadAcquire(&unix_loaded))
+        InitOnceExecuteOnce(&unix_init_once, LoadUnixLibrary, NULL, NULL);
+}
+
+#define WINSCARD_CALL( func, params ) \
+    (EnsureUnixLoaded(), (stats_enabled || trace_enabled || profile_enabled) ? InstrumentedCall( unix_ ## func, params, 0, NULL, 0 ) \
+        : WINE_UNIX_CALL( unix_ ## func, params ))
+
+/* same as WINSCARD_CALL, also accounting the exchange to the reader and the APDU INS byte */
+#define WINSCARD_CALL_APDU( func, params, hCard, pbApdu, cbApdu ) \
+    (EnsureUnixLoaded(), (stats_enabled || trace_enabled || profile_enabled) ? InstrumentedCall( unix_ ## func, params, hCard, pbApdu, cbApdu ) \
+        : WINE_UNIX_CALL( unix_ ## func, params ))
+
+/* the exported functions timed by the layer profile */
+enum profile_api
+{
+    profile_SCardEstablishContext,
+    profile_SCardReleaseContext,
+    profile_SCardIsValidContext,
+    profile_SCardListReaderGroupsA,
+    profile_SCardListReaderGroupsW,
+    profile_SCardListReadersA,
+    profile_SCardListReadersW,
+    profile_SCardConnectA,
+    profile_SCardConnectW,
+    profile_SCardReconnect,
+    profile_SCardDisconnect,
+    profile_SCardBeginTransaction,
+    profile_SCardEndTransaction,
+    profile_SCardStatusA,
+    profile_SCardStatusW,
+    profile_SCardGetStatusChangeA,
+    profile_SCardGetStatusChangeW,
+    profile_SCardControl,
+    profile_SCardTransmit,
+    profile_SCardTransmitBatch,
+    profile_SCardCancel,
+    profile_SCardGetAttrib,
+    profile_SCardSetAttrib,
+    profile_api_count
+};
+
+struct profile_frame
+{
+    int api;                /* -1 when not profiling */
+    LONGLONG start;
+    ULONGLONG unix_ticks;   /* unix call time of the thread when entering */
+};
+
+/* a profiled function starts with ProfileEnter and returns through ProfileLeave */
+static struct profile_frame ProfileEnter(enum profile_api api);
+static LONG ProfileLeave(struct profile_frame *frame, LONG lRet);
+
+static void init_stats(void);
+static void release_stats(void);
+static void init_profile(void);
+static void release_profile(void);
+static void init_status_cache(void);
+static void init_trace(void);
+static void release_trace(void);
+static void release_handles(void);
+static void release_reader_cache(void);
+static void release_reader_names(void);
+static void release_card_types(void);
+static void release_reader_groups(void);
+static void release_reader_aliases(void);
+
+/* startup costs, reported by the layer profile */
+static ULONGLONG dll_attach_ticks;
+static LARGE_INTEGER dll_attach_frequency;
+static ULONGLONG pcsclite_load_ns;
+static char pcsclite_library[MAX_PATH];
 
 BOOL WINAPI DllMain (HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 {
@@ -72,16 +162,33 @@ BOOL WINAPI DllMain (HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
     switch (fdwReason) {
         case DLL_PROCESS_ATTACH:
         {
+            LARGE_INTEGER start, end;
+            QueryPerformanceFrequency(&dll_attach_frequency);
+            QueryPerformanceCounter(&start);
             DisableThreadLibraryCalls(hinstDLL);
             __wine_init_unix_call();
-            if(!WINSCARD_CALL( process_attach, NULL )) 
-                WARN("Winscard loading failed.");
+            init_stats();
+            init_profile();
+            init_status_cache();
             g_startedEvent = CreateEventA(NULL,TRUE,TRUE,NULL);
+            QueryPerformanceCounter(&end);
+            dll_attach_ticks = end.QuadPart - start.QuadPart;
+            TRACE("attached in %I64u us\n", dll_attach_ticks * 1000000 / dll_attach_frequency.QuadPart);
             break;
         }
         case DLL_PROCESS_DETACH:
         {
-            WINSCARD_CALL( process_detach, NULL );
+            release_trace();
+            release_profile();
+            if(unix_loaded)
+                WINE_UNIX_CALL( unix_process_detach, NULL );
+            release_stats();
+            release_handles();
+            release_reader_cache();
+            release_reader_names();
+            release_card_types();
+            release_reader_groups();
+            release_reader_aliases();
             CloseHandle(g_startedEvent);
             break;
         }
@@ -89,6 +196,63 @@ BOOL WINAPI DllMain (HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
     return TRUE;
 }
 
+/*
+ * HKCU\Software\Wine\WinSCard
+ *   Library:        library loaded instead of pcsc-lite, as WINSCARD_PCSCLITE does
+ *   CachedLibrary:  where pcsc-lite was found by the last search, tried first
+ */
+static const char winscard_key[] = "Software\\Wine\\WinSCard";
+
+static DWORD RegGetString(HKEY hKey, const char *name, char *buffer, DWORD size)
+{
+    DWORD type, len = size - 1;
+    if(RegQueryValueExA(hKey, name, NULL, &type, (BYTE *)buffer, &len) || type != REG_SZ)
+        len = 0;
+    buffer[len] = 0;
+    return len;
+}
+
+static void UpdateCachedLibrary(const char *library)
+{
+    HKEY hKey;
+    if(RegCreateKeyExA(HKEY_CURRENT_USER, winscard_key, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL))
+        return;
+    RegSetValueExA(hKey, "CachedLibrary", 0, REG_SZ, (const BYTE *)library, strlen(library) + 1);
+    RegCloseKey(hKey);
+}
+
+static BOOL WINAPI LoadUnixLibrary(INIT_ONCE *once, void *param, void **context)
+{
+    struct process_attach_params params = { NULL, NULL, pcsclite_library, sizeof(pcsclite_library), 0 };
+    char library[MAX_PATH], cached[MAX_PATH];
+    HKEY hKey;
+    LONG lRet;
+
+    library[0] = cached[0] = 0;
+    if(!RegOpenKeyExA(HKEY_CURRENT_USER, winscard_key, 0, KEY_QUERY_VALUE, &hKey))
+    {
+        if(RegGetString(hKey, "Library", library, sizeof(library)))
+            params.library = library;
+        if(RegGetString(hKey, "CachedLibrary", cached, sizeof(cached)))
+            params.cached_library = cached;
+        RegCloseKey(hKey);
+    }
+
+    lRet = WINE_UNIX_CALL( unix_process_attach, &params );
+    pcsclite_load_ns = params.load_ns;
+    if(lRet != SCARD_S_SUCCESS)
+        WARN("Winscard loading failed.\n");
+    else
+        TRACE("%s loaded in %I64u us\n", debugstr_a(pcsclite_library[0] ? pcsclite_library : library),
+            params.load_ns / 1000);
+    if(pcsclite_library[0] && strcmp(pcsclite_library, cached))
+        UpdateCachedLibrary(pcsclite_library);
+
+    init_trace();
+    WriteRelease(&unix_loaded, TRUE);
+    return TRUE;
+}
+
 static LPVOID SCardAllocate(DWORD dwLength)
 {
     if(!dwLength)
@@ -102,395 +266,3538 @@ static void SCardFree(LPVOID ptr)
 }
 
 /*
- * Convert a wide-char multi-string to an ANSI multi-string
+ * Handles registry.
+ * Keeps what is known about the application contexts and card handles, so that
+ * SCardTransmit with a NULL pioSendPci, the statistics and the attributes that
+ * don't need the card read it instead of asking pcsc-lite. It is an open
+ * addressing table of fixed size: handles that don't fit are simply not cached.
+ * Card handles are forgotten with the context they were connected on, as
+ * pcsc-lite drops them on SCardReleaseContext without telling us.
+ * Writers are serialized by handle_cs and make handle_table_seq odd while they
+ * change the table, readers copy their entry without any lock and start again
+ * if the sequence changed meanwhile, or take handle_cs if a writer is busy.
  */
-static LONG ConvertListToANSI(LPCWSTR szListW,LPSTR* pszListA,LPDWORD pdwLength)
+#define HANDLE_TABLE_SIZE 512   /* power of two */
+#define HANDLE_TABLE_MAX  (HANDLE_TABLE_SIZE * 3 / 4)
+
+enum handle_kind
 {
-    if(!szListW)
+    HANDLE_FREE,
+    HANDLE_DELETED,
+    HANDLE_CONTEXT,
+    HANDLE_CARD,
+};
+
+struct handle_entry
+{
+    ULONG_PTR handle;
+    DWORD kind;
+    SCARDCONTEXT hContext;  /* context of a card handle */
+    DWORD dwReaderId;    /* interned reader name id, 0 when unknown */
+    DWORD dwShareMode;
+    DWORD dwProtocol;    /* MS protocol value, 0 when unknown */
+    DWORD dwState;       /* last state given by SCardStatus, 0 when unknown */
+    DWORD cbAtr;         /* 0 when unknown */
+    BYTE rgbAtr[MAX_ATR_SIZE];
+    ULONGLONG ullStatusTime;  /* tick count of the SCardStatus call */
+    LONG lReaderSerial;       /* reader state serial before that call, see the card state cache */
+};
+
+static struct handle_entry handle_table[HANDLE_TABLE_SIZE];
+static LONG handle_table_seq = 0;
+static DWORD handle_table_used = 0;  /* live and deleted entries */
+static DWORD handle_table_live = 0;
+
+static CRITICAL_SECTION handle_cs;
+static CRITICAL_SECTION_DEBUG handle_cs_debug =
+{
+    0, 0, &handle_cs,
+    { &handle_cs_debug.ProcessLocksList, &handle_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": handle_cs") }
+};
+static CRITICAL_SECTION handle_cs = { &handle_cs_debug, -1, 0, 0, 0, 0 };
+
+static DWORD HashHandle(ULONG_PTR handle, DWORD kind)
+{
+    return ((DWORD) (((ULONGLONG) handle * 0x9e3779b97f4a7c15ull) >> 40) ^ kind) & (HANDLE_TABLE_SIZE - 1);
+}
+
+/* may run concurrently with a writer, the result is only valid if the sequence didn't change */
+static struct handle_entry *find_handle(ULONG_PTR handle, DWORD kind)
+{
+    DWORD i, dwSlot = HashHandle(handle, kind);
+    for(i = 0; i < HANDLE_TABLE_SIZE; i++, dwSlot = (dwSlot + 1) & (HANDLE_TABLE_SIZE - 1))
     {
-        *pszListA = NULL;
-        *pdwLength = 0;
+        struct handle_entry *entry = &handle_table[dwSlot];
+        if(entry->kind == HANDLE_FREE)
+            break;
+        if(entry->kind == kind && entry->handle == handle)
+            return entry;
     }
-    else if(!*szListW) /* empty multi-string case */
+    return NULL;
+}
+
+static void handle_write_begin(void)
+{
+    EnterCriticalSection(&handle_cs);
+    WriteNoFence(&handle_table_seq, handle_table_seq + 1);
+    MemoryBarrier();
+}
+
+static void handle_write_end(void)
+{
+    WriteRelease(&handle_table_seq, handle_table_seq + 1);
+    LeaveCriticalSection(&handle_cs);
+}
+
+/* must be called between handle_write_begin and handle_write_end */
+static void handle_table_rehash(void)
+{
+    struct handle_entry *entries;
+    DWORD i, count = 0;
+    if(!(entries = SCardAllocate(handle_table_live * sizeof(*entries))) && handle_table_live)
+        return;
+    for(i = 0; i < HANDLE_TABLE_SIZE; i++)
+        if(handle_table[i].kind >= HANDLE_CONTEXT)
+            entries[count++] = handle_table[i];
+    memset(handle_table, 0, sizeof(handle_table));
+    for(i = 0; i < count; i++)
     {
-        *pdwLength = 2;
-        *pszListA = (LPSTR) SCardAllocate(2);
-        if(!*pszListA)
-            return SCARD_E_NO_MEMORY;
-        *pszListA[0] = '\0';
-        *pszListA[1] = '\0';
+        DWORD dwSlot = HashHandle(entries[i].handle, entries[i].kind);
+        while(handle_table[dwSlot].kind != HANDLE_FREE)
+            dwSlot = (dwSlot + 1) & (HANDLE_TABLE_SIZE - 1);
+        handle_table[dwSlot] = entries[i];
     }
-    else
+    handle_table_used = count;
+    SCardFree(entries);
+}
+
+/* must be called between handle_write_begin and handle_write_end */
+static struct handle_entry *add_handle(ULONG_PTR handle, DWORD kind)
+{
+    struct handle_entry *entry, *deleted = NULL;
+    DWORD dwSlot;
+
+    if((entry = find_handle(handle, kind)))
+        return entry;
+    if(handle_table_live >= HANDLE_TABLE_MAX)
+        return NULL;
+    if(handle_table_used >= HANDLE_TABLE_MAX)
     {
-        LPSTR szStr = NULL;
-        int wlen = 0, alen = 0, totallen = 0;    
-        LPCWSTR szListWPtr = szListW;
-        
-        /* compute size of wide-char multi-string */
-        while (*szListWPtr)
-        {
-            wlen = lstrlenW (szListWPtr) + 1;
+        handle_table_rehash();
+        if(handle_table_used >= HANDLE_TABLE_MAX)
+            return NULL;
+    }
+    for(dwSlot = HashHandle(handle, kind); handle_table[dwSlot].kind != HANDLE_FREE;
+        dwSlot = (dwSlot + 1) & (HANDLE_TABLE_SIZE - 1))
+    {
+        if(!deleted && handle_table[dwSlot].kind == HANDLE_DELETED)
+            deleted = &handle_table[dwSlot];
+    }
+    if(!(entry = deleted))
+    {
+        entry = &handle_table[dwSlot];
+        handle_table_used++;
+    }
+    handle_table_live++;
+    memset(entry, 0, sizeof(*entry));
+    entry->handle = handle;
+    entry->kind = kind;
+    return entry;
+}
 
-            totallen += wlen;
-            szListWPtr += wlen;
-        }
-        
-        totallen++;
-        
-        alen = WideCharToMultiByte(CP_ACP, 0, szListW, totallen, NULL, 0, NULL, NULL);
-        if (alen == 0)
-            return SCARD_F_INTERNAL_ERROR;
-        
-        /* allocate memory */
-        szStr = (LPSTR) SCardAllocate (alen);
-        if(!szStr)
-            return SCARD_E_NO_MEMORY;
-        
-        /* perform the conversion */
-        alen = WideCharToMultiByte(CP_ACP, 0, szListW, totallen, szStr, alen, NULL, NULL);
-        if (alen == 0)
-        {
-            SCardFree (szStr);
-            return SCARD_F_INTERNAL_ERROR;
-        }
-        
-        *pszListA = szStr;
-        *pdwLength = alen;
+/* copies the entry of a handle, returns FALSE when it isn't known */
+static BOOL handle_lookup(ULONG_PTR handle, DWORD kind, struct handle_entry *copy)
+{
+    const struct handle_entry *entry;
+    LONG seq;
+    int i;
+
+    for(i = 0; i < 4; i++)
+    {
+        if((seq = ReadAcquire(&handle_table_seq)) & 1)
+            break;
+        if((entry = find_handle(handle, kind)))
+            *copy = *entry;
+        MemoryBarrier();
+        if(ReadNoFence(&handle_table_seq) == seq)
+            return entry != NULL;
     }
-    
-    return SCARD_S_SUCCESS;
+
+    EnterCriticalSection(&handle_cs);
+    if((entry = find_handle(handle, kind)))
+        *copy = *entry;
+    LeaveCriticalSection(&handle_cs);
+    return entry != NULL;
 }
 
-/*
- * Convert a ANSII multi-string to a wide-char multi-string
- */
-static LONG ConvertListToWideChar(LPCSTR szListA,LPWSTR* pszListW,LPDWORD pdwLength)
+static void handle_set_connected(SCARDCONTEXT hContext, SCARDHANDLE hCard, DWORD dwReaderId, DWORD dwShareMode,
+    DWORD dwProtocol)
 {
-    if(!szListA)
+    struct handle_entry *entry;
+    handle_write_begin();
+    if((entry = add_handle(hCard, HANDLE_CARD)))
     {
-        *pszListW = NULL;
-        *pdwLength = 0;
+        entry->hContext = hContext;
+        entry->dwReaderId = dwReaderId;
+        entry->dwShareMode = dwShareMode;
+        entry->dwProtocol = dwProtocol;
     }
-    else if(!*szListA) /* empty multi-string case */
+    handle_write_end();
+}
+
+static void handle_set_protocol(SCARDHANDLE hCard, DWORD dwProtocol)
+{
+    struct handle_entry *entry;
+    handle_write_begin();
+    if((entry = find_handle(hCard, HANDLE_CARD)))
     {
-        *pdwLength = 2;
-        *pszListW = (LPWSTR) SCardAllocate(2*sizeof(WCHAR));
-        if(!*pszListW)
-            return SCARD_E_NO_MEMORY;
-        *pszListW[0] = '\0';
-        *pszListW[1] = '\0';
+        entry->dwProtocol = dwProtocol;
+        /* the card was reset or reconnected, its state has to be asked again */
+        if(!dwProtocol)
+            entry->dwState = entry->cbAtr = 0;
     }
-    else
+    handle_write_end();
+}
+
+static void handle_set_reconnected(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwProtocol)
+{
+    struct handle_entry *entry;
+    handle_write_begin();
+    if((entry = find_handle(hCard, HANDLE_CARD)))
     {
-        LPWSTR szStr = NULL;
-        int wlen = 0, alen = 0, totallen = 0;    
-        LPCSTR szListAPtr = szListA;
-        
-        /* compute size of ANSI multi-string */
-        while (*szListAPtr)
-        {
-            alen = lstrlenA (szListAPtr) + 1;
+        entry->dwShareMode = dwShareMode;
+        entry->dwProtocol = dwProtocol;
+        entry->dwState = entry->cbAtr = 0;
+    }
+    handle_write_end();
+}
 
-            totallen += alen;
-            szListAPtr += alen;
-        }
-        
-        totallen++;
-        
-        wlen = MultiByteToWideChar(CP_ACP, 0, szListA, totallen, NULL, 0);
-        if (wlen == 0)
-            return SCARD_F_INTERNAL_ERROR;
-        
-        /* allocate memory */
-        szStr = (LPWSTR) SCardAllocate (wlen * sizeof (WCHAR));
-        if(!szStr)
-            return SCARD_E_NO_MEMORY;
-        
-        /* perform the conversion */
-        wlen = MultiByteToWideChar(CP_ACP, 0, szListA, totallen, szStr, wlen);
-        if (wlen == 0)
+static void handle_set_status(SCARDHANDLE hCard, DWORD dwState, DWORD dwProtocol, const BYTE *pbAtr, DWORD cbAtr,
+    LONG lReaderSerial, ULONGLONG ullTime)
+{
+    struct handle_entry *entry;
+    handle_write_begin();
+    if((entry = find_handle(hCard, HANDLE_CARD)))
+    {
+        entry->dwState = dwState;
+        entry->lReaderSerial = lReaderSerial;
+        entry->ullStatusTime = ullTime;
+        if(dwProtocol)
+            entry->dwProtocol = dwProtocol;
+        entry->cbAtr = min(cbAtr, sizeof(entry->rgbAtr));
+        memcpy(entry->rgbAtr, pbAtr, entry->cbAtr);
+    }
+    handle_write_end();
+}
+
+/* forget the card state of hCard, or of every handle when it is 0 */
+static void handle_flush_status(SCARDHANDLE hCard)
+{
+    DWORD i;
+    handle_write_begin();
+    for(i = 0; i < HANDLE_TABLE_SIZE; i++)
+    {
+        struct handle_entry *entry = &handle_table[i];
+        if(entry->kind == HANDLE_CARD && (!hCard || entry->handle == hCard))
+            entry->dwState = entry->cbAtr = 0;
+    }
+    handle_write_end();
+}
+
+static DWORD handle_get_reader(SCARDHANDLE hCard)
+{
+    struct handle_entry entry;
+    return handle_lookup(hCard, HANDLE_CARD, &entry) ? entry.dwReaderId : 0;
+}
+
+static BOOL handle_get_protocol(SCARDHANDLE hCard, LPDWORD pdwProtocol)
+{
+    struct handle_entry entry;
+    if(!handle_lookup(hCard, HANDLE_CARD, &entry) || !entry.dwProtocol)
+        return FALSE;
+    *pdwProtocol = entry.dwProtocol;
+    return TRUE;
+}
+
+/* must be called between handle_write_begin and handle_write_end */
+static void delete_handle(struct handle_entry *entry)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->kind = HANDLE_DELETED;
+    handle_table_live--;
+}
+
+static void remove_handle(ULONG_PTR handle, DWORD kind)
+{
+    struct handle_entry *entry;
+    handle_write_begin();
+    if((entry = find_handle(handle, kind)))
+        delete_handle(entry);
+    handle_write_end();
+}
+
+static void handle_remove(SCARDHANDLE hCard)
+{
+    remove_handle(hCard, HANDLE_CARD);
+}
+
+/* returns FALSE when the table is full */
+static BOOL context_add(SCARDCONTEXT hContext)
+{
+    BOOL bRet;
+    handle_write_begin();
+    bRet = add_handle(hContext, HANDLE_CONTEXT) != NULL;
+    handle_write_end();
+    return bRet;
+}
+
+/* forgets the context and the card handles connected on it, returns FALSE when the context wasn't known */
+static BOOL context_remove(SCARDCONTEXT hContext)
+{
+    BOOL bRet = FALSE;
+    DWORD i;
+    handle_write_begin();
+    for(i = 0; i < HANDLE_TABLE_SIZE; i++)
+    {
+        struct handle_entry *entry = &handle_table[i];
+        if(entry->kind == HANDLE_CONTEXT && entry->handle == hContext)
         {
-            SCardFree (szStr);
-            return SCARD_F_INTERNAL_ERROR;
+            delete_handle(entry);
+            bRet = TRUE;
         }
-        
-        *pszListW = szStr;
-        *pdwLength = wlen;
+        else if(entry->kind == HANDLE_CARD && entry->hContext == hContext)
+            delete_handle(entry);
     }
-    
-    return SCARD_S_SUCCESS;
+    handle_write_end();
+    return bRet;
 }
 
+static BOOL context_is_known(SCARDCONTEXT hContext)
+{
+    struct handle_entry entry;
+    return handle_lookup(hContext, HANDLE_CONTEXT, &entry);
+}
 
 /*
- * translate PCSC-lite errors to equivalent MS ones
- * Actually, the only difference is for SCARD_W_INSERTED_CARD(0x8010006A) and
- * SCARD_E_UNSUPPORTED_FEATURE (0x8010001F)
+ * Forget the cached protocol when pcsc-lite reports that the card was reset
+ * or removed: it will be renegotiated by the next SCardReconnect
  */
+static void handle_check_result(SCARDHANDLE hCard, LONG lRet)
+{
+    if(lRet == SCARD_E_INVALID_HANDLE)
+        handle_remove(hCard);
+    else if(lRet == SCARD_W_RESET_CARD || lRet == SCARD_W_REMOVED_CARD
+        || lRet == SCARD_W_UNPOWERED_CARD || lRet == SCARD_E_NO_SMARTCARD)
+        handle_set_protocol(hCard, 0);
+}
 
-#define PCSCLITE_SCARD_W_INSERTED_CARD                      0x8010006A
-#define PCSCLITE_SCARD_E_UNSUPPORTED_FEATURE                0x8010001F
+static void release_handles(void)
+{
+    handle_write_begin();
+    memset(handle_table, 0, sizeof(handle_table));
+    handle_table_used = handle_table_live = 0;
+    handle_write_end();
+}
 
-static LONG TranslateToWin32(LONG lRet)
+/*
+ * Reader names intern table.
+ * Each reader name gets a stable id and both its ANSI and wide-char forms,
+ * stored as multi-strings of a single name, so that the wide-char APIs don't
+ * convert them on every call. Only the names pcsc-lite answered with are added,
+ * by a reader list, the monitor or a successful connection, so that the table
+ * holds the readers seen by the process; the names given by the application
+ * are looked up without being added. Names are only freed when the dll is unloaded.
+ */
+#define MAX_READER_NAMES 256
+#define READER_NAME_BUCKETS 64
+
+struct reader_name
 {
-    if(lRet == PCSCLITE_SCARD_E_UNSUPPORTED_FEATURE)
-        return SCARD_E_UNSUPPORTED_FEATURE;
-    else if(lRet == PCSCLITE_SCARD_W_INSERTED_CARD)
-        return SCARD_F_UNKNOWN_ERROR; /* FIXME: is there a better WIN32 error code */
+    struct reader_name *nextA;  /* hash chains */
+    struct reader_name *nextW;
+    DWORD id;                   /* 1 based */
+    LPSTR szA;                  /* double null terminated */
+    DWORD cchA;                 /* including the first null */
+    LPWSTR szW;
+    DWORD cchW;
+};
+
+static struct reader_name *reader_names[MAX_READER_NAMES];
+static DWORD reader_names_count = 0;
+static struct reader_name *reader_names_a[READER_NAME_BUCKETS];
+static struct reader_name *reader_names_w[READER_NAME_BUCKETS];
+static SRWLOCK reader_names_lock = SRWLOCK_INIT;
+
+static DWORD HashNameA(LPCSTR szName)
+{
+    DWORD hash = 2166136261u;
+    while(*szName)
+        hash = (hash ^ (BYTE) *szName++) * 16777619u;
+    return hash % READER_NAME_BUCKETS;
+}
+
+static DWORD HashNameW(LPCWSTR szName)
+{
+    DWORD hash = 2166136261u;
+    while(*szName)
+        hash = (hash ^ *szName++) * 16777619u;
+    return hash % READER_NAME_BUCKETS;
+}
+
+/* must be called with reader_names_lock held */
+static struct reader_name *FindNameA(LPCSTR szName, DWORD dwHash)
+{
+    struct reader_name *name;
+    for(name = reader_names_a[dwHash]; name; name = name->nextA)
+        if(!strcmp(name->szA, szName))
+            return name;
+    return NULL;
+}
+
+/* must be called with reader_names_lock held */
+static struct reader_name *FindNameW(LPCWSTR szName, DWORD dwHash)
+{
+    struct reader_name *name;
+    for(name = reader_names_w[dwHash]; name; name = name->nextW)
+        if(!lstrcmpW(name->szW, szName))
+            return name;
+    return NULL;
+}
+
+/* must be called with reader_names_lock held exclusively */
+static const struct reader_name *AddName(LPCSTR szNameA, LPCWSTR szNameW)
+{
+    struct reader_name *name;
+    int cchA, cchW;
+    DWORD dwHashA, dwHashW;
+
+    if(reader_names_count >= MAX_READER_NAMES)
+        return NULL;
+    cchA = szNameA ? strlen(szNameA) + 1 : WideCharToMultiByte(CP_ACP,0,szNameW,-1,NULL,0,NULL,NULL);
+    cchW = szNameW ? lstrlenW(szNameW) + 1 : MultiByteToWideChar(CP_ACP,0,szNameA,-1,NULL,0);
+    if(!cchA || !cchW)
+        return NULL;
+    name = (struct reader_name *) SCardAllocate(sizeof(*name) + (cchA + 1) + (cchW + 1) * sizeof(WCHAR));
+    if(!name)
+        return NULL;
+    name->szW = (LPWSTR) (name + 1);
+    name->szA = (LPSTR) (name->szW + cchW + 1);
+    if(szNameW)
+        memcpy(name->szW, szNameW, cchW * sizeof(WCHAR));
     else
-        return lRet;
+        MultiByteToWideChar(CP_ACP,0,szNameA,-1,name->szW,cchW);
+    if(szNameA)
+        memcpy(name->szA, szNameA, cchA);
+    else
+        WideCharToMultiByte(CP_ACP,0,szNameW,-1,name->szA,cchA,NULL,NULL);
+    name->szA[cchA] = 0;
+    name->szW[cchW] = 0;
+    name->cchA = cchA;
+    name->cchW = cchW;
+
+    /* the other form may already be known under a different spelling */
+    dwHashA = HashNameA(name->szA);
+    dwHashW = HashNameW(name->szW);
+    if(FindNameA(name->szA, dwHashA) || FindNameW(name->szW, dwHashW))
+    {
+        SCardFree(name);
+        return NULL;
+    }
+    name->nextA = reader_names_a[dwHashA];
+    reader_names_a[dwHashA] = name;
+    name->nextW = reader_names_w[dwHashW];
+    reader_names_w[dwHashW] = name;
+    reader_names[reader_names_count++] = name;
+    name->id = reader_names_count;
+    return name;
 }
-    
+
+static const struct reader_name *InternReaderA(LPCSTR szReader)
+{
+    struct reader_name *name;
+    const struct reader_name *added;
+    DWORD dwHash;
+    if(!szReader || !*szReader)
+        return NULL;
+    dwHash = HashNameA(szReader);
+    AcquireSRWLockShared(&reader_names_lock);
+    name = FindNameA(szReader, dwHash);
+    ReleaseSRWLockShared(&reader_names_lock);
+    if(name)
+        return name;
+    AcquireSRWLockExclusive(&reader_names_lock);
+    if(!(added = FindNameA(szReader, dwHash)))
+        added = AddName(szReader, NULL);
+    ReleaseSRWLockExclusive(&reader_names_lock);
+    return added;
+}
+
+static const struct reader_name *InternReaderW(LPCWSTR szReader)
+{
+    struct reader_name *name;
+    const struct reader_name *added;
+    DWORD dwHash;
+    if(!szReader || !*szReader)
+        return NULL;
+    dwHash = HashNameW(szReader);
+    AcquireSRWLockShared(&reader_names_lock);
+    name = FindNameW(szReader, dwHash);
+    ReleaseSRWLockShared(&reader_names_lock);
+    if(name)
+        return name;
+    AcquireSRWLockExclusive(&reader_names_lock);
+    if(!(added = FindNameW(szReader, dwHash)))
+        added = AddName(NULL, szReader);
+    ReleaseSRWLockExclusive(&reader_names_lock);
+    return added;
+}
+
+static void InternReaderList(LPCSTR mszReaders)
+{
+    for(; mszReaders && *mszReaders; mszReaders += strlen(mszReaders) + 1)
+        InternReaderA(mszReaders);
+}
+
+static const struct reader_name *ReaderNameById(DWORD id)
+{
+    const struct reader_name *name = NULL;
+    AcquireSRWLockShared(&reader_names_lock);
+    if(id && id <= reader_names_count)
+        name = reader_names[id - 1];
+    ReleaseSRWLockShared(&reader_names_lock);
+    return name;
+}
+
+/* interned name of a reader, without adding it */
+static const struct reader_name *LookupReaderA(LPCSTR szReader)
+{
+    struct reader_name *name;
+    if(!szReader || !*szReader)
+        return NULL;
+    AcquireSRWLockShared(&reader_names_lock);
+    name = FindNameA(szReader, HashNameA(szReader));
+    ReleaseSRWLockShared(&reader_names_lock);
+    return name;
+}
+
+static const struct reader_name *LookupReaderW(LPCWSTR szReader)
+{
+    struct reader_name *name;
+    if(!szReader || !*szReader)
+        return NULL;
+    AcquireSRWLockShared(&reader_names_lock);
+    name = FindNameW(szReader, HashNameW(szReader));
+    ReleaseSRWLockShared(&reader_names_lock);
+    return name;
+}
+
+static DWORD ReaderNamesCount(void)
+{
+    DWORD count;
+    AcquireSRWLockShared(&reader_names_lock);
+    count = reader_names_count;
+    ReleaseSRWLockShared(&reader_names_lock);
+    return count;
+}
+
+static void release_reader_names(void)
+{
+    DWORD i;
+    AcquireSRWLockExclusive(&reader_names_lock);
+    for(i = 0; i < reader_names_count; i++)
+        SCardFree(reader_names[i]);
+    reader_names_count = 0;
+    memset(reader_names_a, 0, sizeof(reader_names_a));
+    memset(reader_names_w, 0, sizeof(reader_names_w));
+    ReleaseSRWLockExclusive(&reader_names_lock);
+}
+
+/*
+ * Call statistics, enabled by setting WINSCARD_STATS to the name of the file
+ * they are written to when the last context is released or SCardDumpStatistics
+ * is called. They are not written when the dll is unloaded, DllMain runs under
+ * the loader lock.
+ * Each thread counts in its own block, only linked once in the global list, so
+ * that no lock is taken on the call path. Latencies are kept in log2 histograms
+ * of microseconds per unix call and per reader and INS byte for the APDUs.
+ */
+#define STATS_BUCKETS 24
+#define STATS_APDU_SLOTS 128
+#define STATS_NO_INS 0x100
+
+struct stats_counter
+{
+    ULONGLONG count;
+    ULONGLONG errors;
+    ULONGLONG total_us;
+    ULONGLONG max_us;
+    DWORD buckets[STATS_BUCKETS];   /* bucket n: latency < 2^n us */
+};
+
+struct stats_apdu
+{
+    DWORD key;                      /* (reader id << 9 | INS) + 1, 0 when free */
+    struct stats_counter counter;
+};
+
+struct thread_stats
+{
+    struct thread_stats *next;
+    DWORD tid;
+    struct stats_counter calls[unix_process_detach + 1];
+    struct stats_apdu apdus[STATS_APDU_SLOTS];
+    struct stats_counter other_apdus; /* when apdus is full */
+};
+
+static const char * const unix_func_names[] = { SCARD_TRACE_FUNC_NAMES };
+C_ASSERT( ARRAY_SIZE(unix_func_names) == unix_process_detach + 1 );
+
+static char stats_file[MAX_PATH];
+static DWORD stats_tls = TLS_OUT_OF_INDEXES;
+static LARGE_INTEGER qpc_frequency;
+static struct thread_stats *stats_list = NULL;
+
+static void init_stats(void)
+{
+    DWORD dwLen = GetEnvironmentVariableA("WINSCARD_STATS", stats_file, sizeof(stats_file));
+    if(!dwLen || dwLen >= sizeof(stats_file))
+    {
+        stats_file[0] = 0;
+        return;
+    }
+    if((stats_tls = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+        return;
+    QueryPerformanceFrequency(&qpc_frequency);
+    stats_enabled = TRUE;
+    TRACE("statistics written to %s\n", debugstr_a(stats_file));
+}
+
+static struct thread_stats *get_thread_stats(void)
+{
+    struct thread_stats *stats = TlsGetValue(stats_tls);
+    if(!stats)
+    {
+        if(!(stats = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*stats))))
+            return NULL;
+        stats->tid = GetCurrentThreadId();
+        /* the blocks outlive their threads, they are only freed with the dll */
+        do
+            stats->next = stats_list;
+        while(InterlockedCompareExchangePointer((void **) &stats_list, stats, stats->next) != stats->next);
+        TlsSetValue(stats_tls, stats);
+    }
+    return stats;
+}
+
+static void StatsCount(struct stats_counter *counter, ULONGLONG us, LONG lRet)
+{
+    DWORD bucket = 0;
+    while(bucket < STATS_BUCKETS - 1 && (us >> bucket))
+        bucket++;
+    counter->count++;
+    if(lRet != SCARD_S_SUCCESS)
+        counter->errors++;
+    counter->total_us += us;
+    if(us > counter->max_us)
+        counter->max_us = us;
+    counter->buckets[bucket]++;
+}
+
+static struct stats_counter *StatsFindApdu(struct thread_stats *stats, DWORD dwReaderId, DWORD dwIns)
+{
+    DWORD key = (dwReaderId << 9 | dwIns) + 1, i, slot = (key * 2654435761u) % STATS_APDU_SLOTS;
+    for(i = 0; i < STATS_APDU_SLOTS; i++, slot = (slot + 1) % STATS_APDU_SLOTS)
+    {
+        if(stats->apdus[slot].key == key)
+            return &stats->apdus[slot].counter;
+        if(!stats->apdus[slot].key)
+        {
+            stats->apdus[slot].key = key;
+            return &stats->apdus[slot].counter;
+        }
+    }
+    return &stats->other_apdus;
+}
+
+static void StatsRecord(enum unix_funcs code, SCARDHANDLE hCard, const BYTE *pbApdu, DWORD cbApdu, ULONGLONG ticks, LONG lRet)
+{
+    struct thread_stats *stats = get_thread_stats();
+    ULONGLONG us = ticks * 1000000 / qpc_frequency.QuadPart;
+    if(!stats)
+        return;
+    StatsCount(&stats->calls[code], us, lRet);
+    if(pbApdu)
+        StatsCount(StatsFindApdu(stats, handle_get_reader(hCard), cbApdu >= 2 ? pbApdu[1] : STATS_NO_INS), us, lRet);
+}
+
+static void StatsWrite(HANDLE hFile, const char *format, ...)
+{
+    char buffer[512];
+    DWORD dwWritten;
+    va_list args;
+    int len;
+    va_start(args, format);
+    len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if(len > 0)
+        WriteFile(hFile, buffer, min(len, sizeof(buffer) - 1), &dwWritten, NULL);
+}
+
+static void StatsWriteCounter(HANDLE hFile, const struct stats_counter *counter)
+{
+    char buffer[STATS_BUCKETS * 11 + 1], *ptr = buffer;
+    DWORD i;
+    for(i = 0; i < STATS_BUCKETS; i++)
+        ptr += sprintf(ptr, "%s%lu", i ? ";" : "", counter->buckets[i]);
+    StatsWrite(hFile, "%I64u,%I64u,%I64u,%I64u,%s\n", counter->count, counter->errors,
+        counter->total_us, counter->max_us, buffer);
+}
+
+/*
+ * The file is made of comma separated records:
+ *   reader,<id>,<name>
+ *   call,<tid>,<function>,<count>,<errors>,<total us>,<max us>,<histogram>
+ *   apdu,<tid>,<reader id>,<INS or none>,<count>,<errors>,<total us>,<max us>,<histogram>
+ *   t0,<round trips saved by the T=0 auto response of the unix library>
+ * where histogram lists the number of calls that took less than 2^n us, separated by ';'
+ */
+static LONG StatsDump(LPCSTR szFileName)
+{
+    struct stats_read_params unix_stats;
+    struct thread_stats *stats;
+    HANDLE hFile;
+    DWORD i;
+
+    hFile = CreateFileA(szFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        WARN("can't create %s, error %lu\n", debugstr_a(szFileName), GetLastError());
+        return SCARD_F_UNKNOWN_ERROR;
+    }
+
+    StatsWrite(hFile, "# winscard statistics, process %lu\n", GetCurrentProcessId());
+    AcquireSRWLockShared(&reader_names_lock);
+    for(i = 0; i < reader_names_count; i++)
+        StatsWrite(hFile, "reader,%lu,%s\n", reader_names[i]->id, reader_names[i]->szA);
+    ReleaseSRWLockShared(&reader_names_lock);
+
+    for(stats = stats_list; stats; stats = stats->next)
+    {
+        for(i = 0; i <= unix_process_detach; i++)
+        {
+            if(!stats->calls[i].count)
+                continue;
+            StatsWrite(hFile, "call,%lu,%s,", stats->tid, unix_func_names[i]);
+            StatsWriteCounter(hFile, &stats->calls[i]);
+        }
+        for(i = 0; i < STATS_APDU_SLOTS; i++)
+        {
+            DWORD key = stats->apdus[i].key - 1;
+            if(!stats->apdus[i].key)
+                continue;
+            if((key & 0x1ff) == STATS_NO_INS)
+                StatsWrite(hFile, "apdu,%lu,%lu,none,", stats->tid, key >> 9);
+            else
+                StatsWrite(hFile, "apdu,%lu,%lu,%02lX,", stats->tid, key >> 9, key & 0xff);
+            StatsWriteCounter(hFile, &stats->apdus[i].counter);
+        }
+        if(stats->other_apdus.count)
+        {
+            StatsWrite(hFile, "apdu,%lu,other,other,", stats->tid);
+            StatsWriteCounter(hFile, &stats->other_apdus);
+        }
+    }
+    /* only when WINSCARD_T0_AUTO_RESPONSE is set */
+    if(WINE_UNIX_CALL( unix_stats_read, &unix_stats ) == SCARD_S_SUCCESS)
+        StatsWrite(hFile, "t0,%I64u\n", unix_stats.t0_round_trips_saved);
+    CloseHandle(hFile);
+    return SCARD_S_SUCCESS;
+}
+
+static void release_stats(void)
+{
+    struct thread_stats *stats, *next;
+    if(!stats_enabled)
+        return;
+    stats_enabled = FALSE;
+    for(stats = stats_list; stats; stats = next)
+    {
+        next = stats->next;
+        HeapFree(GetProcessHeap(), 0, stats);
+    }
+    stats_list = NULL;
+    TlsFree(stats_tls);
+}
+
+/*
+ * Wine extension: write the call statistics to szFileName,
+ * or to the file given by WINSCARD_STATS when it is NULL
+ */
+LONG WINAPI SCardDumpStatistics(LPCSTR szFileName)
+{
+    TRACE("%s\n", debugstr_a(szFileName));
+    if(!stats_enabled)
+        return SCARD_E_UNSUPPORTED_FEATURE;
+    return StatsDump(szFileName ? szFileName : stats_file);
+}
+
+/*
+ * Binary trace, enabled by WINSCARD_TRACE, see scardtrace.h.
+ * The file belongs to the unix library: each thread fills its own buffer of
+ * records and hands it over with a single trace_write call when it is full.
+ * Records carry the thread id of the unix library, not GetCurrentThreadId,
+ * so that they match the ones it writes itself. The buffer of a thread is
+ * flushed and freed by a fiber local storage callback when the thread exits,
+ * the DLL gets no DLL_THREAD_DETACH.
+ */
+#define TRACE_BUFFER_RECORDS 1024
+
+struct thread_trace
+{
+    struct list entry;
+    DWORD tid;
+    DWORD count;
+    struct scard_trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+static DWORD trace_fls = FLS_OUT_OF_INDEXES;
+static struct list trace_list = LIST_INIT(trace_list);
+
+static CRITICAL_SECTION trace_cs;
+static CRITICAL_SECTION_DEBUG trace_cs_debug =
+{
+    0, 0, &trace_cs,
+    { &trace_cs_debug.ProcessLocksList, &trace_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": trace_cs") }
+};
+static CRITICAL_SECTION trace_cs = { &trace_cs_debug, -1, 0, 0, 0, 0 };
+
+static void WINAPI TraceThreadExit(void *data);
+
+static void init_trace(void)
+{
+    struct trace_write_params params = { NULL, 0 };
+    /* the unix library knows whether the file could be created */
+    if(WINE_UNIX_CALL( unix_trace_write, &params ) != SCARD_S_SUCCESS)
+        return;
+    if((trace_fls = FlsAlloc(TraceThreadExit)) == FLS_OUT_OF_INDEXES)
+        return;
+    QueryPerformanceFrequency(&qpc_frequency);
+    trace_enabled = TRUE;
+    TRACE("binary trace enabled\n");
+}
+
+static void TraceFlush(struct thread_trace *trace)
+{
+    struct trace_write_params params = { trace->records, trace->count };
+    if(trace->count)
+        WINE_UNIX_CALL( unix_trace_write, &params );
+    trace->count = 0;
+}
+
+/* flushes and frees the buffer of a thread */
+static void WINAPI TraceThreadExit(void *data)
+{
+    struct thread_trace *trace = data;
+    if(!trace)
+        return;
+    TraceFlush(trace);
+    EnterCriticalSection(&trace_cs);
+    list_remove(&trace->entry);
+    LeaveCriticalSection(&trace_cs);
+    HeapFree(GetProcessHeap(), 0, trace);
+}
+
+static struct thread_trace *get_thread_trace(void)
+{
+    struct thread_trace *trace = FlsGetValue(trace_fls);
+    if(!trace)
+    {
+        struct trace_write_params params = { NULL, 0 };
+        if(!(trace = HeapAlloc(GetProcessHeap(), 0, sizeof(*trace))))
+            return NULL;
+        WINE_UNIX_CALL( unix_trace_write, &params );
+        trace->tid = params.tid;
+        trace->count = 0;
+        EnterCriticalSection(&trace_cs);
+        list_add_tail(&trace_list, &trace->entry);
+        LeaveCriticalSection(&trace_cs);
+        FlsSetValue(trace_fls, trace);
+    }
+    return trace;
+}
+
+static ULONGLONG TicksToNs(ULONGLONG ticks)
+{
+    return ticks / qpc_frequency.QuadPart * 1000000000 + ticks % qpc_frequency.QuadPart * 1000000000 / qpc_frequency.QuadPart;
+}
+
+static void TraceRecord(enum unix_funcs code, void *params, SCARDHANDLE hCard, const BYTE *pbApdu, DWORD cbApdu,
+        ULONGLONG start, ULONGLONG ticks, LONG lRet)
+{
+    struct thread_trace *trace = get_thread_trace();
+    struct scard_trace_record *record;
+    ULONGLONG duration = TicksToNs(ticks);
+    if(!trace)
+        return;
+    if(trace->count == TRACE_BUFFER_RECORDS)
+        TraceFlush(trace);
+    record = &trace->records[trace->count++];
+    memset(record, 0, sizeof(*record));
+    record->start = TicksToNs(start);
+    record->duration = duration > 0xffffffff ? 0xffffffff : duration;
+    record->tid = trace->tid;
+    record->result = lRet;
+    record->func = code;
+    record->source = SCARD_TRACE_SOURCE_DLL;
+
+    /* all the parameters structures start with the context or card handle, but these */
+    if(code == unix_SCardEstablishContext)
+        record->handle = lRet == SCARD_S_SUCCESS ? *((struct SCardEstablishContext_params *) params)->phContext : 0;
+    else if(pbApdu)
+        record->handle = hCard;
+    else if(params && code != unix_SCardWaitReaderChange && code != unix_trace_write)
+        record->handle = *(const SCARDHANDLE *) params;
+
+    if(pbApdu && cbApdu >= 4)
+    {
+        memcpy(record->apdu, pbApdu, 4);
+        record->flags |= SCARD_TRACE_FLAG_APDU;
+    }
+    if(code == unix_SCardTransmit && lRet == SCARD_S_SUCCESS)
+    {
+        const struct SCardTransmit_params *transmit = params;
+        if(transmit->pcbRecvLength && *transmit->pcbRecvLength >= 2)
+        {
+            const BYTE *sw = transmit->pbRecvBuffer + *transmit->pcbRecvLength - 2;
+            record->sw = sw[0] << 8 | sw[1];
+            record->flags |= SCARD_TRACE_FLAG_SW;
+        }
+    }
+}
+
+static void release_trace(void)
+{
+    struct thread_trace *trace, *next;
+    if(!trace_enabled)
+        return;
+    trace_enabled = FALSE;
+    /* runs the callback of the threads still alive */
+    FlsFree(trace_fls);
+    LIST_FOR_EACH_ENTRY_SAFE(trace, next, &trace_list, struct thread_trace, entry)
+        TraceThreadExit(trace);
+}
+
+/*
+ * Layer profile, enabled by setting WINSCARD_PROFILE to the name of the file
+ * it is written to when the last context is released or SCardDumpProfile is
+ * called, like the statistics. The functions that start with ProfileEnter
+ * measure their whole duration and the part spent in unix calls,
+ * the rest is the marshalling done here. The unix library times the same calls
+ * from its side and the part spent in libpcsclite, which includes pcscd, so
+ * that each unix call splits into the __wine_unix_call transition, the unix
+ * side of the bridge and pcsc-lite.
+ */
+struct profile_api_counter
+{
+    ULONGLONG count;
+    ULONGLONG ticks;        /* whole function */
+    ULONGLONG unix_ticks;   /* unix calls made by the function */
+};
+
+struct thread_profile
+{
+    struct thread_profile *next;
+    ULONGLONG unix_ticks;   /* all the unix calls made by the thread */
+    struct profile_api_counter apis[profile_api_count];
+    ULONGLONG call_count[unix_process_detach + 1];
+    ULONGLONG call_ticks[unix_process_detach + 1];
+};
+
+static const char * const profile_api_names[] =
+{
+    "SCardEstablishContext", "SCardReleaseContext", "SCardIsValidContext",
+    "SCardListReaderGroupsA", "SCardListReaderGroupsW", "SCardListReadersA", "SCardListReadersW",
+    "SCardConnectA", "SCardConnectW", "SCardReconnect", "SCardDisconnect",
+    "SCardBeginTransaction", "SCardEndTransaction", "SCardStatusA", "SCardStatusW",
+    "SCardGetStatusChangeA", "SCardGetStatusChangeW", "SCardControl", "SCardTransmit",
+    "SCardTransmitBatch", "SCardCancel", "SCardGetAttrib", "SCardSetAttrib",
+};
+C_ASSERT( ARRAY_SIZE(profile_api_names) == profile_api_count );
+
+static char profile_file[MAX_PATH];
+static DWORD profile_tls = TLS_OUT_OF_INDEXES;
+static struct thread_profile *profile_list = NULL;
+
+static void init_profile(void)
+{
+    DWORD dwLen = GetEnvironmentVariableA("WINSCARD_PROFILE", profile_file, sizeof(profile_file));
+    if(!dwLen || dwLen >= sizeof(profile_file))
+    {
+        profile_file[0] = 0;
+        return;
+    }
+    if((profile_tls = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+        return;
+    QueryPerformanceFrequency(&qpc_frequency);
+    profile_enabled = TRUE;
+    TRACE("layer profile written to %s\n", debugstr_a(profile_file));
+}
+
+static struct thread_profile *get_thread_profile(void)
+{
+    struct thread_profile *profile = TlsGetValue(profile_tls);
+    if(!profile)
+    {
+        if(!(profile = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*profile))))
+            return NULL;
+        do
+            profile->next = profile_list;
+        while(InterlockedCompareExchangePointer((void **) &profile_list, profile, profile->next) != profile->next);
+        TlsSetValue(profile_tls, profile);
+    }
+    return profile;
+}
+
+static struct profile_frame ProfileEnter(enum profile_api api)
+{
+    struct profile_frame frame = { -1, 0, 0 };
+    struct thread_profile *profile;
+    LARGE_INTEGER now;
+    if(!profile_enabled || !(profile = get_thread_profile()))
+        return frame;
+    QueryPerformanceCounter(&now);
+    frame.api = api;
+    frame.start = now.QuadPart;
+    frame.unix_ticks = profile->unix_ticks;
+    return frame;
+}
+
+static LONG ProfileLeave(struct profile_frame *frame, LONG lRet)
+{
+    struct thread_profile *profile;
+    struct profile_api_counter *counter;
+    LARGE_INTEGER now;
+    if(frame->api < 0 || !profile_enabled || !(profile = get_thread_profile()))
+        return lRet;
+    QueryPerformanceCounter(&now);
+    counter = &profile->apis[frame->api];
+    counter->count++;
+    counter->ticks += now.QuadPart - frame->start;
+    counter->unix_ticks += profile->unix_ticks - frame->unix_ticks;
+    return lRet;
+}
+
+static void ProfileRecordCall(enum unix_funcs code, ULONGLONG ticks)
+{
+    struct thread_profile *profile = get_thread_profile();
+    if(!profile)
+        return;
+    profile->unix_ticks += ticks;
+    profile->call_count[code]++;
+    profile->call_ticks[code] += ticks;
+}
+
+static double TicksToUs(ULONGLONG ticks)
+{
+    return ticks * 1000000.0 / qpc_frequency.QuadPart;
+}
+
+/*
+ * The file is made of comma separated records, times are in microseconds:
+ *   startup,<DllMain>,<pcsc-lite loading>,<library found by the search>
+ *   api,<function>,<count>,<total>,<winscard.dll>,<unix calls>
+ *   call,<function>,<count>,<total>,<transition>,<unix library>,<pcsc-lite>
+ * The unix library side of the calls is missing when pcsc-lite could not be loaded.
+ */
+static LONG ProfileDump(LPCSTR szFileName)
+{
+    struct scard_profile_counter unix_counters[unix_process_detach + 1];
+    struct profile_read_params params = { unix_counters };
+    struct profile_api_counter apis[profile_api_count];
+    ULONGLONG call_count[unix_process_detach + 1], call_ticks[unix_process_detach + 1];
+    struct thread_profile *profile;
+    HANDLE hFile;
+    DWORD i;
+
+    memset(unix_counters, 0, sizeof(unix_counters));
+    if(unix_loaded)
+        WINE_UNIX_CALL( unix_profile_read, &params );
+    memset(apis, 0, sizeof(apis));
+    memset(call_count, 0, sizeof(call_count));
+    memset(call_ticks, 0, sizeof(call_ticks));
+    for(profile = profile_list; profile; profile = profile->next)
+    {
+        for(i = 0; i < profile_api_count; i++)
+        {
+            apis[i].count += profile->apis[i].count;
+            apis[i].ticks += profile->apis[i].ticks;
+            apis[i].unix_ticks += profile->apis[i].unix_ticks;
+        }
+        for(i = 0; i <= unix_process_detach; i++)
+        {
+            call_count[i] += profile->call_count[i];
+            call_ticks[i] += profile->call_ticks[i];
+        }
+    }
+
+    hFile = CreateFileA(szFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE)
+    {
+        WARN("can't create %s, error %lu\n", debugstr_a(szFileName), GetLastError());
+        return SCARD_F_UNKNOWN_ERROR;
+    }
+    StatsWrite(hFile, "# winscard layer profile, process %lu\n", GetCurrentProcessId());
+    StatsWrite(hFile, "startup,%.1f,%.1f,%s\n", dll_attach_ticks * 1000000.0 / dll_attach_frequency.QuadPart,
+        pcsclite_load_ns / 1000.0, unix_loaded ? pcsclite_library : "");
+    for(i = 0; i < profile_api_count; i++)
+    {
+        if(!apis[i].count)
+            continue;
+        StatsWrite(hFile, "api,%s,%I64u,%.1f,%.1f,%.1f\n", profile_api_names[i], apis[i].count,
+            TicksToUs(apis[i].ticks), TicksToUs(apis[i].ticks - apis[i].unix_ticks), TicksToUs(apis[i].unix_ticks));
+    }
+    for(i = 0; i <= unix_process_detach; i++)
+    {
+        double total, thunk, pcsclite;
+        if(!call_count[i])
+            continue;
+        total = TicksToUs(call_ticks[i]);
+        thunk = unix_counters[i].thunk_ns / 1000.0;
+        pcsclite = unix_counters[i].pcsclite_ns / 1000.0;
+        StatsWrite(hFile, "call,%s,%I64u,%.1f,%.1f,%.1f,%.1f\n", unix_func_names[i], call_count[i],
+            total, total - thunk, thunk - pcsclite, pcsclite);
+    }
+    CloseHandle(hFile);
+    return SCARD_S_SUCCESS;
+}
+
+static void release_profile(void)
+{
+    struct thread_profile *profile, *next;
+    if(!profile_enabled)
+        return;
+    profile_enabled = FALSE;
+    for(profile = profile_list; profile; profile = next)
+    {
+        next = profile->next;
+        HeapFree(GetProcessHeap(), 0, profile);
+    }
+    profile_list = NULL;
+    TlsFree(profile_tls);
+}
+
+/*
+ * Wine extension: write the layer profile to szFileName,
+ * or to the file given by WINSCARD_PROFILE when it is NULL
+ */
+LONG WINAPI SCardDumpProfile(LPCSTR szFileName)
+{
+    TRACE("%s\n", debugstr_a(szFileName));
+    if(!profile_enabled)
+        return SCARD_E_UNSUPPORTED_FEATURE;
+    return ProfileDump(szFileName ? szFileName : profile_file);
+}
+
+static LONG InstrumentedCall(enum unix_funcs code, void *params, SCARDHANDLE hCard, const BYTE *pbApdu, DWORD cbApdu)
+{
+    LARGE_INTEGER start, end;
+    LONG lRet;
+
+    QueryPerformanceCounter(&start);
+    lRet = WINE_UNIX_CALL( code, params );
+    QueryPerformanceCounter(&end);
+
+    if(stats_enabled)
+        StatsRecord(code, hCard, pbApdu, cbApdu, end.QuadPart - start.QuadPart, lRet);
+    if(trace_enabled)
+        TraceRecord(code, params, hCard, pbApdu, cbApdu, start.QuadPart, end.QuadPart - start.QuadPart, lRet);
+    if(profile_enabled)
+        ProfileRecordCall(code, end.QuadPart - start.QuadPart);
+    return lRet;
+}
+
+/*
+ * Convert a wide-char multi-string to an ANSI multi-string
+ */
+static LONG ConvertListToANSI(LPCWSTR szListW,LPSTR* pszListA,LPDWORD pdwLength)
+{
+    if(!szListW)
+    {
+        *pszListA = NULL;
+        *pdwLength = 0;
+    }
+    else if(!*szListW) /* empty multi-string case */
+    {
+        *pdwLength = 2;
+        *pszListA = (LPSTR) SCardAllocate(2);
+        if(!*pszListA)
+            return SCARD_E_NO_MEMORY;
+        *pszListA[0] = '\0';
+        *pszListA[1] = '\0';
+    }
+    else
+    {
+        LPSTR szStr = NULL;
+        int wlen = 0, alen = 0, totallen = 0;    
+        LPCWSTR szListWPtr = szListW;
+        
+        /* compute size of wide-char multi-string */
+        while (*szListWPtr)
+        {
+            wlen = lstrlenW (szListWPtr) + 1;
+
+            totallen += wlen;
+            szListWPtr += wlen;
+        }
+        
+        totallen++;
+        
+        alen = WideCharToMultiByte(CP_ACP, 0, szListW, totallen, NULL, 0, NULL, NULL);
+        if (alen == 0)
+            return SCARD_F_INTERNAL_ERROR;
+        
+        /* allocate memory */
+        szStr = (LPSTR) SCardAllocate (alen);
+        if(!szStr)
+            return SCARD_E_NO_MEMORY;
+        
+        /* perform the conversion */
+        alen = WideCharToMultiByte(CP_ACP, 0, szListW, totallen, szStr, alen, NULL, NULL);
+        if (alen == 0)
+        {
+            SCardFree (szStr);
+            return SCARD_F_INTERNAL_ERROR;
+        }
+        
+        *pszListA = szStr;
+        *pdwLength = alen;
+    }
+    
+    return SCARD_S_SUCCESS;
+}
+
+/*
+ * Convert a ANSII multi-string to a wide-char multi-string
+ */
+static LONG ConvertListToWideChar(LPCSTR szListA,LPWSTR* pszListW,LPDWORD pdwLength)
+{
+    if(!szListA)
+    {
+        *pszListW = NULL;
+        *pdwLength = 0;
+    }
+    else if(!*szListA) /* empty multi-string case */
+    {
+        *pdwLength = 2;
+        *pszListW = (LPWSTR) SCardAllocate(2*sizeof(WCHAR));
+        if(!*pszListW)
+            return SCARD_E_NO_MEMORY;
+        *pszListW[0] = '\0';
+        *pszListW[1] = '\0';
+    }
+    else
+    {
+        LPWSTR szStr = NULL;
+        int wlen = 0, alen = 0, totallen = 0;    
+        LPCSTR szListAPtr = szListA;
+        
+        /* compute size of ANSI multi-string */
+        while (*szListAPtr)
+        {
+            alen = lstrlenA (szListAPtr) + 1;
+
+            totallen += alen;
+            szListAPtr += alen;
+        }
+        
+        totallen++;
+        
+        wlen = MultiByteToWideChar(CP_ACP, 0, szListA, totallen, NULL, 0);
+        if (wlen == 0)
+            return SCARD_F_INTERNAL_ERROR;
+        
+        /* allocate memory */
+        szStr = (LPWSTR) SCardAllocate (wlen * sizeof (WCHAR));
+        if(!szStr)
+            return SCARD_E_NO_MEMORY;
+        
+        /* perform the conversion */
+        wlen = MultiByteToWideChar(CP_ACP, 0, szListA, totallen, szStr, wlen);
+        if (wlen == 0)
+        {
+            SCardFree (szStr);
+            return SCARD_F_INTERNAL_ERROR;
+        }
+        
+        *pszListW = szStr;
+        *pdwLength = wlen;
+    }
+    
+    return SCARD_S_SUCCESS;
+}
+
+
+/*
+ * translate PCSC-lite errors to equivalent MS ones
+ * Actually, the only difference is for SCARD_W_INSERTED_CARD(0x8010006A) and
+ * SCARD_E_UNSUPPORTED_FEATURE (0x8010001F)
+ */
+
+#define PCSCLITE_SCARD_W_INSERTED_CARD                      0x8010006A
+#define PCSCLITE_SCARD_E_UNSUPPORTED_FEATURE                0x8010001F
+
+static LONG TranslateToWin32(LONG lRet)
+{
+    if(lRet == PCSCLITE_SCARD_E_UNSUPPORTED_FEATURE)
+        return SCARD_E_UNSUPPORTED_FEATURE;
+    else if(lRet == PCSCLITE_SCARD_W_INSERTED_CARD)
+        return SCARD_F_UNKNOWN_ERROR; /* FIXME: is there a better WIN32 error code */
+    else
+        return lRet;
+}
+    
+
+/*
+ * SCARD_AUTOALLOCATE support.
+ * The buffer is allocated from the size of the previous answers and filled by
+ * a single pcsc-lite call, then handed to the caller as is. The call is only
+ * repeated when the data outgrew the buffer since the previous answer.
+ */
+typedef LONG (*FILL_BUFFER_FUNC)(void *params, LPBYTE buffer, DWORD_LITE *length);
+
+static DWORD groups_size_hint = 256;
+static DWORD readers_size_hint = 1024;
+static DWORD status_size_hint = 256;
+static DWORD attrib_size_hint = 264;
+
+static LONG AllocateAndFill(FILL_BUFFER_FUNC fill, void *params, DWORD *pdwSizeHint, LPBYTE *ppBuffer, DWORD_LITE *pdwLength)
+{
+    DWORD_LITE dwSize = *pdwSizeHint;
+    for(;;)
+    {
+        DWORD_LITE dwLength = dwSize;
+        LPBYTE pBuffer = (LPBYTE) SCardAllocate((DWORD) dwSize);
+        LONG lRet;
+        if(!pBuffer)
+            return SCARD_E_NO_MEMORY;
+        lRet = fill(params, pBuffer, &dwLength);
+        if(lRet == SCARD_S_SUCCESS)
+        {
+            *ppBuffer = pBuffer;
+            *pdwLength = dwLength;
+            return lRet;
+        }
+        SCardFree(pBuffer);
+        if(lRet != SCARD_E_INSUFFICIENT_BUFFER || dwLength <= dwSize)
+            return lRet;
+        /* grown in the meantime, remember it for the next calls */
+        dwSize = dwLength;
+        if(dwSize > *pdwSizeHint)
+            *pdwSizeHint = (DWORD) dwSize;
+    }
+}
+
+static LONG FillReaderGroups(void *params, LPBYTE buffer, DWORD_LITE *length)
+{
+    struct SCardListReaderGroups_params *p = params;
+    p->mszGroups = (LPSTR) buffer;
+    p->pcchGroups = length;
+    return WINSCARD_CALL( SCardListReaderGroups, p );
+}
+
+static LONG FillReaders(void *params, LPBYTE buffer, DWORD_LITE *length)
+{
+    struct SCardListReaders_params *p = params;
+    p->mszReaders = (LPSTR) buffer;
+    p->pcchReaders = length;
+    return WINSCARD_CALL( SCardListReaders, p );
+}
+
+static LONG FillStatus(void *params, LPBYTE buffer, DWORD_LITE *length)
+{
+    struct SCardStatus_params *p = params;
+    p->mszReaderName = (LPSTR) buffer;
+    p->pcchReaderLen = length;
+    *p->pcbAtrLen = MAX_ATR_SIZE;
+    return WINSCARD_CALL( SCardStatus, p );
+}
+
+static LONG FillAttrib(void *params, LPBYTE buffer, DWORD_LITE *length)
+{
+    struct SCardGetAttrib_params *p = params;
+    p->pbAttr = buffer;
+    p->pcbAttrLen = length;
+    return WINSCARD_CALL( SCardGetAttrib, p );
+}
+
+/*
+ * Card state cache, enabled by setting WINSCARD_STATUS_CACHE to the maximum
+ * age in milliseconds of its answers. SCardStatus and SCardState are answered
+ * from the handles registry as long as the reader watch thread hasn't seen the
+ * state of the reader change since pcsc-lite was asked. SCardFlushStatus makes
+ * the next call for a handle go to pcsc-lite.
+ */
+static DWORD status_max_age = 0;
+static LONG reader_state_serial[MAX_READER_NAMES];       /* by reader id - 1, 0 until the reader is seen */
+static DWORD_LITE reader_event_state[MAX_READER_NAMES];  /* only used by the watch thread */
+
+static void init_status_cache(void)
+{
+    char value[16];
+    DWORD dwLen = GetEnvironmentVariableA("WINSCARD_STATUS_CACHE", value, sizeof(value));
+    if(!dwLen || dwLen >= sizeof(value))
+        return;
+    status_max_age = strtoul(value, NULL, 10);
+    if(status_max_age)
+        TRACE("card states cached for up to %lu ms\n", status_max_age);
+}
+
+/* called by the watch thread with the reader states of the unix monitor */
+static void ReaderStatesUpdate(const struct scard_reader_state *states, DWORD count)
+{
+    DWORD i;
+    for(i = 0; i < count; i++)
+    {
+        const struct reader_name *name = InternReaderA(states[i].szReader);
+        if(!name)
+            continue;
+        if(!reader_state_serial[name->id - 1] || reader_event_state[name->id - 1] != states[i].dwEventState)
+        {
+            reader_event_state[name->id - 1] = states[i].dwEventState;
+            InterlockedIncrement(&reader_state_serial[name->id - 1]);
+        }
+    }
+}
+
+/* nothing is known of the readers while pcscd can't be reached */
+static void ReaderStatesReset(void)
+{
+    DWORD i;
+    for(i = 0; i < MAX_READER_NAMES; i++)
+        if(reader_state_serial[i])
+            InterlockedIncrement(&reader_state_serial[i]);
+}
+
+/*
+  * events functions
+  */
+  
+/*
+ * Each SCardAccessNewReaderEvent caller gets its own auto-reset event, all of
+ * them are signaled by a thread waiting for the unix reader monitor to report
+ * a change of the reader list, so no waiter misses it
+ */
+struct new_reader_event
+{
+    struct list entry;
+    HANDLE hEvent;
+};
+
+static struct list new_reader_events = LIST_INIT(new_reader_events);
+static HANDLE reader_watch_thread = NULL;
+static BOOL reader_watch_stop = FALSE;
+static BOOL reader_watch_for_cache = FALSE;
+
+/*
+ * Incremented by the watch thread each time the list of readers changes,
+ * 0 while nobody watches it: cached reader lists are only valid for the
+ * generation they were built in
+ */
+static LONG reader_list_generation = 0;
+static LONG reader_list_serial = 0;
+
+/* contexts of the application, the watch started for the caches stops with the last one */
+static LONG context_count = 0;
+
+static CRITICAL_SECTION event_cs;
+static CRITICAL_SECTION_DEBUG event_cs_debug =
+{
+    0, 0, &event_cs,
+    { &event_cs_debug.ProcessLocksList, &event_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": event_cs") }
+};
+static CRITICAL_SECTION event_cs = { &event_cs_debug, -1, 0, 0, 0, 0 };
+
+/* protects new_reader_events, also taken by the watch thread */
+static CRITICAL_SECTION new_reader_cs;
+static CRITICAL_SECTION_DEBUG new_reader_cs_debug =
+{
+    0, 0, &new_reader_cs,
+    { &new_reader_cs_debug.ProcessLocksList, &new_reader_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": new_reader_cs") }
+};
+static CRITICAL_SECTION new_reader_cs = { &new_reader_cs_debug, -1, 0, 0, 0, 0 };
+
+static void SignalNewReaderEvents(void)
+{
+    struct new_reader_event *event;
+    EnterCriticalSection(&new_reader_cs);
+    LIST_FOR_EACH_ENTRY(event, &new_reader_events, struct new_reader_event, entry)
+        SetEvent(event->hEvent);
+    LeaveCriticalSection(&new_reader_cs);
+}
+
+static DWORD WINAPI reader_watch_proc(LPVOID arg)
+{
+    HMODULE hModule = NULL;
+    DWORD_LITE dwGeneration = 0, dwStateGeneration = 0, cStates = 0;
+    struct SCardWaitReaderChange_params params = { &dwGeneration, NULL, NULL, &cStates };
+    struct scard_reader_state *states = NULL;
+
+    /* keep the dll loaded while the thread runs */
+    GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR) reader_watch_proc, &hModule);
+    /* the card state cache also needs to know when the state of a reader changes */
+    if(status_max_age && (states = HeapAlloc(GetProcessHeap(), 0, MAX_READER_NAMES * sizeof(*states))))
+    {
+        params.pdwStateGeneration = &dwStateGeneration;
+        params.states = states;
+    }
+    while(!reader_watch_stop)
+    {
+        DWORD_LITE dwPrevious = dwGeneration;
+        LONG lRet;
+        cStates = MAX_READER_NAMES;
+        lRet = WINSCARD_CALL( SCardWaitReaderChange, &params );
+        if(reader_watch_stop)
+            break;
+        if(lRet == SCARD_S_SUCCESS)
+        {
+            if(states)
+                ReaderStatesUpdate(states, min(cStates, MAX_READER_NAMES));
+            if(dwGeneration == dwPrevious)
+                continue;
+            InterlockedExchange(&reader_list_generation, InterlockedIncrement(&reader_list_serial));
+            /* the first answer only gives the current list */
+            if(dwPrevious)
+                SignalNewReaderEvents();
+        }
+        else if(lRet != SCARD_E_CANCELLED)
+        {
+            /* pcscd is not reachable, try again later */
+            InterlockedExchange(&reader_list_generation, 0);
+            ReaderStatesReset();
+            dwGeneration = dwStateGeneration = 0;
+            Sleep(1000);
+        }
+    }
+    InterlockedExchange(&reader_list_generation, 0);
+    ReaderStatesReset();
+    HeapFree(GetProcessHeap(), 0, states);
+    TRACE("reader watch thread exiting\n");
+    FreeLibraryAndExitThread(hModule, 0);
+    return 0;
+}
+
+/* must be called with event_cs held */
+static BOOL start_reader_watch(void)
+{
+    if(reader_watch_thread)
+        return TRUE;
+    reader_watch_stop = FALSE;
+    return (reader_watch_thread = CreateThread(NULL,0,reader_watch_proc,NULL,0,NULL)) != NULL;
+}
+
+/* must be called with event_cs held */
+static void stop_reader_watch(void)
+{
+    reader_watch_stop = TRUE;
+    do
+        WINSCARD_CALL( SCardCancelReaderChange, NULL );
+    while(WaitForSingleObject(reader_watch_thread, 100) == WAIT_TIMEOUT);
+    CloseHandle(reader_watch_thread);
+    reader_watch_thread = NULL;
+    reader_watch_for_cache = FALSE;
+    EnterCriticalSection(&new_reader_cs);
+    while(!list_empty(&new_reader_events))
+    {
+        struct new_reader_event *event = LIST_ENTRY(list_head(&new_reader_events), struct new_reader_event, entry);
+        list_remove(&event->entry);
+        CloseHandle(event->hEvent);
+        HeapFree(GetProcessHeap(), 0, event);
+    }
+    LeaveCriticalSection(&new_reader_cs);
+}
+
+HANDLE WINAPI SCardAccessNewReaderEvent(void)
+{
+    struct new_reader_event *event;
+    HANDLE hEvent = NULL;
+    TRACE("\n");
+    if(!(event = HeapAlloc(GetProcessHeap(), 0, sizeof(*event))))
+        return NULL;
+    if(!(event->hEvent = CreateEventA(NULL,FALSE,FALSE,NULL)))
+    {
+        HeapFree(GetProcessHeap(), 0, event);
+        return NULL;
+    }
+    EnterCriticalSection(&event_cs);
+    if(start_reader_watch())
+    {
+        EnterCriticalSection(&new_reader_cs);
+        list_add_tail(&new_reader_events, &event->entry);
+        LeaveCriticalSection(&new_reader_cs);
+        hEvent = event->hEvent;
+    }
+    LeaveCriticalSection(&event_cs);
+    if(!hEvent)
+    {
+        CloseHandle(event->hEvent);
+        HeapFree(GetProcessHeap(), 0, event);
+    }
+    TRACE(" returned %p\n",hEvent);
+    return hEvent;
+}
+
+void WINAPI SCardReleaseNewReaderEvent(HANDLE hNewReaderEventHandle)
+{
+    struct new_reader_event *event, *found = NULL;
+    TRACE("%p\n",hNewReaderEventHandle);
+    EnterCriticalSection(&event_cs);
+    EnterCriticalSection(&new_reader_cs);
+    LIST_FOR_EACH_ENTRY(event, &new_reader_events, struct new_reader_event, entry)
+    {
+        if(event->hEvent == hNewReaderEventHandle)
+        {
+            list_remove(&event->entry);
+            found = event;
+            break;
+        }
+    }
+    LeaveCriticalSection(&new_reader_cs);
+    if(found)
+    {
+        CloseHandle(found->hEvent);
+        HeapFree(GetProcessHeap(), 0, found);
+        if(list_empty(&new_reader_events) && !reader_watch_for_cache)
+            stop_reader_watch();
+    }
+    else
+        WARN("unknown event %p\n",hNewReaderEventHandle);
+    LeaveCriticalSection(&event_cs);
+}
+
+/*
+ * Start the watch thread the reader and card state caches rely on, TRUE once
+ * it reported the reader list. The thread holds a reference on the dll, so it
+ * only runs while the application has contexts.
+ */
+static BOOL CacheWatchActive(void)
+{
+    if(ReadNoFence(&reader_list_generation))
+        return TRUE;
+    EnterCriticalSection(&event_cs);
+    if(!reader_watch_for_cache && ReadNoFence(&context_count))
+        reader_watch_for_cache = start_reader_watch();
+    LeaveCriticalSection(&event_cs);
+    return FALSE;
+}
+
+/* the last context was released, the new reader event may still need the thread */
+static void StopCacheWatch(void)
+{
+    EnterCriticalSection(&event_cs);
+    if(reader_watch_for_cache && list_empty(&new_reader_events) && !ReadNoFence(&context_count))
+        stop_reader_watch();
+    else
+        reader_watch_for_cache = FALSE;
+    LeaveCriticalSection(&event_cs);
+}
+
+void WINAPI SCardReleaseAllEvents(void)
+{
+    TRACE("\n");
+    EnterCriticalSection(&event_cs);
+    if(reader_watch_thread)
+        stop_reader_watch();
+    LeaveCriticalSection(&event_cs);
+}
+
+/*
+ * Reader list cache.
+ * SCardListReaders answers for the whole set of readers are kept in both
+ * ANSI and wide-char forms until the watch thread reports a change of the
+ * list. The thread is started by the first listing and runs until the last
+ * context is released. The list is fetched from pcscd outside of cache_cs,
+ * which is only held to read or publish it.
+ */
+struct reader_cache
+{
+    LONG generation;    /* reader_list_generation the lists were built in, 0 when empty */
+    LONG lResult;       /* SCARD_S_SUCCESS or SCARD_E_NO_READERS_AVAILABLE */
+    LPSTR mszReadersA;
+    DWORD cchReadersA;
+    LPWSTR mszReadersW;
+    DWORD cchReadersW;
+};
+
+static struct reader_cache reader_cache;
+
+static CRITICAL_SECTION cache_cs;
+static CRITICAL_SECTION_DEBUG cache_cs_debug =
+{
+    0, 0, &cache_cs,
+    { &cache_cs_debug.ProcessLocksList, &cache_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": cache_cs") }
+};
+static CRITICAL_SECTION cache_cs = { &cache_cs_debug, -1, 0, 0, 0, 0 };
+
+static LONG ConvertListToWideChar(LPCSTR szListA,LPWSTR* pszListW,LPDWORD pdwLength);
+
+/* the cache only holds the complete list */
+static BOOL IsAllReadersGroupA(LPCSTR mszGroups)
+{
+    if(!mszGroups || !*mszGroups)
+        return TRUE;
+    if(strcmp(mszGroups, "SCard$AllReaders") && strcmp(mszGroups, "SCard$DefaultReaders"))
+        return FALSE;
+    return !mszGroups[strlen(mszGroups) + 1];
+}
+
+static BOOL IsAllReadersGroupW(LPCWSTR mszGroups)
+{
+    if(!mszGroups || !*mszGroups)
+        return TRUE;
+    if(lstrcmpW(mszGroups, L"SCard$AllReaders") && lstrcmpW(mszGroups, L"SCard$DefaultReaders"))
+        return FALSE;
+    return !mszGroups[lstrlenW(mszGroups) + 1];
+}
+
+/* copy a cached multi-string using the usual length/SCARD_AUTOALLOCATE conventions */
+static LONG CopyCachedList(LPCVOID pSrc, DWORD cchSrc, DWORD cbChar, LPVOID pDst, LPDWORD pcchDst)
+{
+    LONG lRet = SCARD_S_SUCCESS;
+    if(!pDst)
+        ;
+    else if(*pcchDst == SCARD_AUTOALLOCATE)
+    {
+        LPVOID pList = SCardAllocate(cchSrc * cbChar);
+        if(!pList)
+            return SCARD_E_NO_MEMORY;
+        memcpy(pList, pSrc, cchSrc * cbChar);
+        *(LPVOID*) pDst = pList;
+    }
+    else if(*pcchDst < cchSrc)
+        lRet = SCARD_E_INSUFFICIENT_BUFFER;
+    else
+        memcpy(pDst, pSrc, cchSrc * cbChar);
+    *pcchDst = cchSrc;
+    return lRet;
+}
+
+static void ReaderCacheFlush(void)
+{
+    SCardFree(reader_cache.mszReadersA);
+    SCardFree(reader_cache.mszReadersW);
+    memset(&reader_cache, 0, sizeof(reader_cache));
+}
+
+/*
+ * Enter cache_cs with the list of the current generation in the cache, which is
+ * fetched first if needed. Returns FALSE, without the lock, when the list can't be cached.
+ */
+static BOOL ReaderCacheLock(SCARDCONTEXT hContext)
+{
+    struct SCardListReaders_params params = { hContext, NULL, NULL, NULL };
+    LPBYTE pbList = NULL;
+    DWORD_LITE dwListLength = 0;
+    LPWSTR szListW = NULL;
+    DWORD dwLengthW = 0;
+    LONG lGeneration, lRet;
+
+    /* nothing to compare with until the first answer of the watch thread */
+    if(!context_is_known(hContext) || !CacheWatchActive())
+        return FALSE;
+
+    EnterCriticalSection(&cache_cs);
+    if(reader_cache.generation && reader_cache.generation == ReadNoFence(&reader_list_generation))
+        return TRUE;
+    LeaveCriticalSection(&cache_cs);
+
+    if(!(lGeneration = ReadNoFence(&reader_list_generation)))
+        return FALSE;
+    lRet = AllocateAndFill(FillReaders, &params, &readers_size_hint, &pbList, &dwListLength);
+    if(lRet == SCARD_S_SUCCESS)
+    {
+        InternReaderList((LPCSTR) pbList);
+        lRet = ConvertListToWideChar((LPCSTR) pbList, &szListW, &dwLengthW);
+    }
+    else if(lRet != SCARD_E_NO_READERS_AVAILABLE)
+        return FALSE;
+    else
+        dwListLength = 0;
+    if(lRet != SCARD_S_SUCCESS && lRet != SCARD_E_NO_READERS_AVAILABLE)
+    {
+        SCardFree(pbList);
+        return FALSE;
+    }
+
+    EnterCriticalSection(&cache_cs);
+    if(reader_cache.generation == lGeneration)
+    {
+        /* published by another thread meanwhile */
+        SCardFree(pbList);
+        SCardFree(szListW);
+        return TRUE;
+    }
+    ReaderCacheFlush();
+    reader_cache.lResult = lRet;
+    reader_cache.mszReadersA = (LPSTR) pbList;
+    reader_cache.cchReadersA = (DWORD) dwListLength;
+    reader_cache.mszReadersW = szListW;
+    reader_cache.cchReadersW = dwLengthW;
+    /* the list may have changed while it was fetched, keep it for this generation only */
+    reader_cache.generation = lGeneration;
+    return TRUE;
+}
+
+static void release_reader_cache(void)
+{
+    EnterCriticalSection(&cache_cs);
+    ReaderCacheFlush();
+    LeaveCriticalSection(&cache_cs);
+}
+
+static BOOL ReaderCacheGetA(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders, LONG *plRet)
+{
+    if(!IsAllReadersGroupA(mszGroups) || !ReaderCacheLock(hContext))
+        return FALSE;
+    if(reader_cache.lResult != SCARD_S_SUCCESS)
+        *plRet = reader_cache.lResult;
+    else
+        *plRet = CopyCachedList(reader_cache.mszReadersA, reader_cache.cchReadersA, sizeof(CHAR), mszReaders, pcchReaders);
+    LeaveCriticalSection(&cache_cs);
+    return TRUE;
+}
+
+static BOOL ReaderCacheGetW(SCARDCONTEXT hContext, LPCWSTR mszGroups, LPWSTR mszReaders, LPDWORD pcchReaders, LONG *plRet)
+{
+    if(!IsAllReadersGroupW(mszGroups) || !ReaderCacheLock(hContext))
+        return FALSE;
+    if(reader_cache.lResult != SCARD_S_SUCCESS)
+        *plRet = reader_cache.lResult;
+    else
+        *plRet = CopyCachedList(reader_cache.mszReadersW, reader_cache.cchReadersW, sizeof(WCHAR), mszReaders, pcchReaders);
+    LeaveCriticalSection(&cache_cs);
+    return TRUE;
+}
+
+HANDLE WINAPI SCardAccessStartedEvent()
+{
+    return g_startedEvent;
+}
+
+void WINAPI SCardReleaseStartedEvent(HANDLE hStartedEventHandle)
+{
+    /* do nothing  because we don't implement yet reference couting for the event handle*/
+}
+
+LONG WINAPI SCardFreeMemory( SCARDCONTEXT hContext,LPCVOID pvMem)
+{
+    if(pvMem)
+        SCardFree((void*) pvMem);
+    return SCARD_S_SUCCESS;
+}
+
+/*
+ * Smart card database.
+ * Card types are kept where Windows keeps them, one key per card under
+ * HKLM\SOFTWARE\Microsoft\Cryptography\Calais\SmartCards, and indexed in memory
+ * when they are first needed. The index is read again when the database key
+ * was changed, by another process for instance, checking it once a second at most.
+ * ATRs and masks are held in 64-bit words with the ATR already masked, so that
+ * matching an ATR against a card type takes a few and/xor instead of a byte loop.
+ */
+#define ATR_WORDS 5     /* 40 bytes, enough for the 36 bytes of SCARD_ATRMASK */
+#define CARD_TYPES_CHECK_INTERVAL 1000
+#define CARD_TYPES_KEY L"SOFTWARE\\Microsoft\\Cryptography\\Calais\\SmartCards"
+
+struct atr_pattern
+{
+    ULONGLONG atr[ATR_WORDS];   /* ATR & mask */
+    ULONGLONG mask[ATR_WORDS];
+    DWORD cbAtr;
+};
+
+struct card_type
+{
+    struct atr_pattern pattern;
+    LPWSTR szNameW;
+    LPSTR szNameA;
+    GUID guidPrimaryProvider;
+    DWORD dwInterfaceCount;
+    GUID *rgguidInterfaces;
+};
+
+
+static struct card_type *card_types = NULL;
+static DWORD card_types_count = 0, card_types_capacity = 0;
+static BOOL card_types_loaded = FALSE;
+static FILETIME card_types_time;        /* last write time of the database key when it was read */
+static ULONGLONG card_types_checked = 0;
+static SRWLOCK card_types_lock = SRWLOCK_INIT;
+
+static void AtrToWords(const BYTE *pbAtr, DWORD cbAtr, ULONGLONG *pWords)
+{
+    BYTE bytes[ATR_WORDS * sizeof(ULONGLONG)];
+    memset(bytes, 0, sizeof(bytes));
+    memcpy(bytes, pbAtr, min(cbAtr, sizeof(bytes)));
+    memcpy(pWords, bytes, sizeof(bytes));
+}
+
+/* a NULL mask compares every byte */
+static void MakeAtrPattern(struct atr_pattern *pattern, const BYTE *pbAtr, const BYTE *pbMask, DWORD cbAtr)
+{
+    DWORD i;
+    AtrToWords(pbAtr, cbAtr, pattern->atr);
+    if(pbMask)
+        AtrToWords(pbMask, cbAtr, pattern->mask);
+    else
+    {
+        BYTE ones[ATR_WORDS * sizeof(ULONGLONG)];
+        memset(ones, 0, sizeof(ones));
+        memset(ones, 0xff, min(cbAtr, sizeof(ones)));
+        AtrToWords(ones, sizeof(ones), pattern->mask);
+    }
+    for(i = 0; i < ATR_WORDS; i++)
+        pattern->atr[i] &= pattern->mask[i];
+    pattern->cbAtr = cbAtr;
+}
+
+static BOOL AtrMatches(const struct atr_pattern *pattern, const ULONGLONG *pAtr, DWORD cbAtr)
+{
+    ULONGLONG diff = 0;
+    DWORD i;
+    if(pattern->cbAtr != cbAtr)
+        return FALSE;
+    for(i = 0; i < ATR_WORDS; i++)
+        diff |= (pAtr[i] & pattern->mask[i]) ^ pattern->atr[i];
+    return !diff;
+}
+
+/* length of an ATR given without it, from its interface bytes, 0 if it doesn't look like one */
+static DWORD AtrLength(const BYTE *pbAtr)
+{
+    DWORD dwLen = 2, dwHistorical = pbAtr[1] & 0x0f;
+    BYTE bIndicator = pbAtr[1] >> 4;
+    BOOL bChecksum = FALSE;
+
+    while(bIndicator)
+    {
+        dwLen += !!(bIndicator & 1) + !!(bIndicator & 2) + !!(bIndicator & 4);
+        if(!(bIndicator & 8) || dwLen >= MAX_ATR_SIZE)
+            break;
+        /* TDi: protocols other than T=0 add a check byte */
+        if(pbAtr[dwLen] & 0x0f)
+            bChecksum = TRUE;
+        bIndicator = pbAtr[dwLen++] >> 4;
+    }
+    dwLen += dwHistorical + bChecksum;
+    return dwLen <= MAX_ATR_SIZE ? dwLen : 0;
+}
+
+static void CardTypeFree(struct card_type *card)
+{
+    SCardFree(card->szNameW);
+    SCardFree(card->szNameA);
+    SCardFree(card->rgguidInterfaces);
+}
+
+/* must be called with card_types_lock held */
+static struct card_type *FindCardType(LPCWSTR szName)
+{
+    DWORD i;
+    for(i = 0; i < card_types_count; i++)
+        if(!lstrcmpiW(card_types[i].szNameW, szName))
+            return &card_types[i];
+    return NULL;
+}
+
+/* must be called with card_types_lock held exclusively, replaces a card of the same name */
+static BOOL AddCardType(LPCWSTR szName, const GUID *pguidPrimaryProvider, const GUID *rgguidInterfaces,
+    DWORD dwInterfaceCount, const BYTE *pbAtr, const BYTE *pbAtrMask, DWORD cbAtrLen)
+{
+    struct card_type card, *old;
+    int cchA, cchW = lstrlenW(szName) + 1;
+
+    memset(&card, 0, sizeof(card));
+    MakeAtrPattern(&card.pattern, pbAtr, pbAtrMask, cbAtrLen);
+    if(pguidPrimaryProvider)
+        card.guidPrimaryProvider = *pguidPrimaryProvider;
+    cchA = WideCharToMultiByte(CP_ACP,0,szName,-1,NULL,0,NULL,NULL);
+    card.szNameW = SCardAllocate(cchW * sizeof(WCHAR));
+    card.szNameA = SCardAllocate(cchA);
+    if(dwInterfaceCount)
+        card.rgguidInterfaces = SCardAllocate(dwInterfaceCount * sizeof(GUID));
+    if(!card.szNameW || !card.szNameA || (dwInterfaceCount && !card.rgguidInterfaces))
+    {
+        CardTypeFree(&card);
+        return FALSE;
+    }
+    memcpy(card.szNameW, szName, cchW * sizeof(WCHAR));
+    WideCharToMultiByte(CP_ACP,0,szName,-1,card.szNameA,cchA,NULL,NULL);
+    if(dwInterfaceCount)
+        memcpy(card.rgguidInterfaces, rgguidInterfaces, dwInterfaceCount * sizeof(GUID));
+    card.dwInterfaceCount = dwInterfaceCount;
+
+    if((old = FindCardType(szName)))
+    {
+        CardTypeFree(old);
+        *old = card;
+        return TRUE;
+    }
+    if(card_types_count == card_types_capacity)
+    {
+        DWORD dwCapacity = card_types_capacity ? card_types_capacity * 2 : 16;
+        struct card_type *types = card_types ? HeapReAlloc(GetProcessHeap(), 0, card_types, dwCapacity * sizeof(*types))
+            : SCardAllocate(dwCapacity * sizeof(*types));
+        if(!types)
+        {
+            CardTypeFree(&card);
+            return FALSE;
+        }
+        card_types = types;
+        card_types_capacity = dwCapacity;
+    }
+    card_types[card_types_count++] = card;
+    return TRUE;
+}
+
+/* must be called with card_types_lock held exclusively */
+static void RemoveCardType(struct card_type *card)
+{
+    CardTypeFree(card);
+    *card = card_types[--card_types_count];
+}
+
+/* must be called with card_types_lock held exclusively */
+static void LoadCardType(HKEY hDatabase, LPCWSTR szName)
+{
+    BYTE pbAtr[sizeof(((SCARD_ATRMASK *) 0)->rgbAtr)], pbMask[sizeof(pbAtr)];
+    DWORD cbAtr = sizeof(pbAtr), cbMask = sizeof(pbMask), cbGuid = sizeof(GUID), cbInterfaces = 0;
+    GUID guidPrimary, *pInterfaces = NULL;
+    HKEY hKey;
+
+    if(RegOpenKeyExW(hDatabase, szName, 0, KEY_QUERY_VALUE, &hKey))
+        return;
+    if(RegQueryValueExW(hKey, L"ATR", NULL, NULL, pbAtr, &cbAtr) || !cbAtr)
+        goto done;
+    if(RegQueryValueExW(hKey, L"ATRMask", NULL, NULL, pbMask, &cbMask) || cbMask != cbAtr)
+        memset(pbMask, 0xff, sizeof(pbMask));
+    if(RegQueryValueExW(hKey, L"Primary Provider", NULL, NULL, (BYTE *) &guidPrimary, &cbGuid) || cbGuid != sizeof(GUID))
+        memset(&guidPrimary, 0, sizeof(guidPrimary));
+    if(!RegQueryValueExW(hKey, L"Supported Interfaces", NULL, NULL, NULL, &cbInterfaces)
+        && cbInterfaces >= sizeof(GUID) && (pInterfaces = SCardAllocate(cbInterfaces)))
+    {
+        if(RegQueryValueExW(hKey, L"Supported Interfaces", NULL, NULL, (BYTE *) pInterfaces, &cbInterfaces))
+            cbInterfaces = 0;
+    }
+    else
+        cbInterfaces = 0;
+    AddCardType(szName, &guidPrimary, pInterfaces, cbInterfaces / sizeof(GUID), pbAtr, pbMask, cbAtr);
+    SCardFree(pInterfaces);
+done:
+    RegCloseKey(hKey);
+}
+
+/* must be called with card_types_lock held exclusively */
+static void LoadCardTypes(HKEY hDatabase)
+{
+    WCHAR szName[256];
+    DWORD i, cchName;
+
+    while(card_types_count)
+        RemoveCardType(&card_types[card_types_count - 1]);
+    RegQueryInfoKeyW(hDatabase, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &card_types_time);
+    for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hDatabase, i, szName, &cchName, NULL, NULL, NULL, NULL); i++)
+        LoadCardType(hDatabase, szName);
+    TRACE("%lu card types\n", card_types_count);
+}
+
+/* acquire card_types_lock shared, with an index that is up to date with the registry */
+static void LockCardTypes(void)
+{
+    ULONGLONG ullNow = GetTickCount64();
+    FILETIME ftWrite;
+    HKEY hKey;
+
+    AcquireSRWLockShared(&card_types_lock);
+    if(card_types_loaded && ullNow - card_types_checked < CARD_TYPES_CHECK_INTERVAL)
+        return;
+    ReleaseSRWLockShared(&card_types_lock);
+
+    AcquireSRWLockExclusive(&card_types_lock);
+    card_types_checked = ullNow;
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, CARD_TYPES_KEY, 0, KEY_READ, &hKey))
+    {
+        if(!card_types_loaded
+            || RegQueryInfoKeyW(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &ftWrite)
+            || memcmp(&ftWrite, &card_types_time, sizeof(ftWrite)))
+            LoadCardTypes(hKey);
+        RegCloseKey(hKey);
+    }
+    card_types_loaded = TRUE;
+    ReleaseSRWLockExclusive(&card_types_lock);
+    AcquireSRWLockShared(&card_types_lock);
+}
+
+static void release_card_types(void)
+{
+    AcquireSRWLockExclusive(&card_types_lock);
+    while(card_types_count)
+        RemoveCardType(&card_types[card_types_count - 1]);
+    SCardFree(card_types);
+    card_types = NULL;
+    card_types_capacity = 0;
+    card_types_loaded = FALSE;
+    ReleaseSRWLockExclusive(&card_types_lock);
+}
+
+static BOOL CardSupportsInterfaces(const struct card_type *card, LPCGUID rgguidInterfaces, DWORD cguidInterfaceCount)
+{
+    DWORD i, j;
+    for(i = 0; i < cguidInterfaceCount; i++)
+    {
+        for(j = 0; j < card->dwInterfaceCount; j++)
+            if(!memcmp(&card->rgguidInterfaces[j], &rgguidInterfaces[i], sizeof(GUID)))
+                break;
+        if(j == card->dwInterfaceCount)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* multi-string of the card types matching pbAtr and supporting the interfaces, in both forms */
+static LONG ListCardTypes(const BYTE *pbAtr, LPCGUID rgguidInterfaces, DWORD cguidInterfaceCount,
+    BOOL bWide, LPVOID mszCards, LPDWORD pcchCards)
+{
+    ULONGLONG atr[ATR_WORDS];
+    DWORD i, cbAtr = 0, cchList = 1, cbChar = bWide ? sizeof(WCHAR) : 1;
+    LPBYTE pList, p;
+    LONG lRet;
+
+    if(pbAtr)
+    {
+        cbAtr = AtrLength(pbAtr);
+        AtrToWords(pbAtr, cbAtr, atr);
+    }
+
+    LockCardTypes();
+    /* first pass for the length, second one to copy the names */
+    for(i = 0; i < card_types_count; i++)
+    {
+        const struct card_type *card = &card_types[i];
+        if((pbAtr && !AtrMatches(&card->pattern, atr, cbAtr))
+            || !CardSupportsInterfaces(card, rgguidInterfaces, cguidInterfaceCount))
+            continue;
+        cchList += bWide ? lstrlenW(card->szNameW) + 1 : strlen(card->szNameA) + 1;
+    }
+    /* an empty list is made of two nulls */
+    cchList = max(cchList, 2);
+    if(!(pList = p = SCardAllocate(cchList * cbChar)))
+    {
+        ReleaseSRWLockShared(&card_types_lock);
+        return SCARD_E_NO_MEMORY;
+    }
+    for(i = 0; i < card_types_count; i++)
+    {
+        const struct card_type *card = &card_types[i];
+        DWORD cb;
+        if((pbAtr && !AtrMatches(&card->pattern, atr, cbAtr))
+            || !CardSupportsInterfaces(card, rgguidInterfaces, cguidInterfaceCount))
+            continue;
+        cb = bWide ? (lstrlenW(card->szNameW) + 1) * sizeof(WCHAR) : strlen(card->szNameA) + 1;
+        memcpy(p, bWide ? (LPCVOID) card->szNameW : (LPCVOID) card->szNameA, cb);
+        p += cb;
+    }
+    ReleaseSRWLockShared(&card_types_lock);
+    memset(p, 0, pList + cchList * cbChar - p);
+
+    lRet = CopyCachedList(pList, cchList, cbChar, mszCards, pcchCards);
+    SCardFree(pList);
+    return lRet;
+}
+
+static LONG IntroduceCardType(LPCWSTR szCardName, LPCGUID pguidPrimaryProvider, LPCGUID rgguidInterfaces,
+    DWORD dwInterfaceCount, const BYTE *pbAtr, const BYTE *pbAtrMask, DWORD cbAtrLen)
+{
+    HKEY hDatabase, hKey;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    if(!szCardName || !*szCardName || !pbAtr || !cbAtrLen || cbAtrLen > sizeof(((SCARD_ATRMASK *) 0)->rgbAtr)
+        || (dwInterfaceCount && !rgguidInterfaces))
+        return SCARD_E_INVALID_PARAMETER;
+
+    AcquireSRWLockExclusive(&card_types_lock);
+    if(RegCreateKeyExW(HKEY_LOCAL_MACHINE, CARD_TYPES_KEY, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hDatabase, NULL))
+    {
+        ReleaseSRWLockExclusive(&card_types_lock);
+        return SCARD_E_NO_ACCESS;
+    }
+    if(RegCreateKeyExW(hDatabase, szCardName, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL))
+        lRet = SCARD_E_NO_ACCESS;
+    else
+    {
+        BYTE pbMask[sizeof(((SCARD_ATRMASK *) 0)->rgbMask)];
+        if(!pbAtrMask)
+        {
+            memset(pbMask, 0xff, cbAtrLen);
+            pbAtrMask = pbMask;
+        }
+        RegSetValueExW(hKey, L"ATR", 0, REG_BINARY, pbAtr, cbAtrLen);
+        RegSetValueExW(hKey, L"ATRMask", 0, REG_BINARY, pbAtrMask, cbAtrLen);
+        if(pguidPrimaryProvider)
+            RegSetValueExW(hKey, L"Primary Provider", 0, REG_BINARY, (const BYTE *) pguidPrimaryProvider, sizeof(GUID));
+        if(dwInterfaceCount)
+            RegSetValueExW(hKey, L"Supported Interfaces", 0, REG_BINARY, (const BYTE *) rgguidInterfaces,
+                dwInterfaceCount * sizeof(GUID));
+        else
+            RegDeleteValueW(hKey, L"Supported Interfaces");
+        RegCloseKey(hKey);
+
+        if(!card_types_loaded)
+        {
+            LoadCardTypes(hDatabase);
+            card_types_loaded = TRUE;
+        }
+        else if(!AddCardType(szCardName, pguidPrimaryProvider, rgguidInterfaces, dwInterfaceCount,
+            pbAtr, pbAtrMask, cbAtrLen))
+            lRet = SCARD_E_NO_MEMORY;
+        /* our own change doesn't need to be read again */
+        RegQueryInfoKeyW(hDatabase, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &card_types_time);
+    }
+    RegCloseKey(hDatabase);
+    ReleaseSRWLockExclusive(&card_types_lock);
+    return lRet;
+}
+
+static LONG ForgetCardType(LPCWSTR szCardName)
+{
+    struct card_type *card;
+    HKEY hDatabase;
+    LONG lRet;
+
+    if(!szCardName || !*szCardName)
+        return SCARD_E_INVALID_PARAMETER;
+    AcquireSRWLockExclusive(&card_types_lock);
+    if(RegOpenKeyExW(HKEY_LOCAL_MACHINE, CARD_TYPES_KEY, 0, KEY_ALL_ACCESS, &hDatabase))
+        lRet = SCARD_E_UNKNOWN_CARD;
+    else
+    {
+        lRet = RegDeleteTreeW(hDatabase, szCardName) ? SCARD_E_UNKNOWN_CARD : SCARD_S_SUCCESS;
+        if((card = FindCardType(szCardName)))
+            RemoveCardType(card);
+        RegQueryInfoKeyW(hDatabase, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &card_types_time);
+        RegCloseKey(hDatabase);
+    }
+    ReleaseSRWLockExclusive(&card_types_lock);
+    return lRet;
+}
+
+/* registry value holding the name of a provider of a card type */
+static LPCWSTR CardProviderValue(DWORD dwProviderId)
+{
+    switch(dwProviderId)
+    {
+    case SCARD_PROVIDER_CSP: return L"Crypto Provider";
+    case SCARD_PROVIDER_KSP: return L"Smart Card Key Storage Provider";
+    case SCARD_PROVIDER_CARD_MODULE: return L"80000001";
+    }
+    return NULL;
+}
+
+static LONG OpenCardTypeKey(LPCWSTR szCardName, REGSAM access, HKEY *phKey)
+{
+    HKEY hDatabase;
+    LONG lRet;
+    if(RegOpenKeyExW(HKEY_LOCAL_MACHINE, CARD_TYPES_KEY, 0, access, &hDatabase))
+        return SCARD_E_UNKNOWN_CARD;
+    lRet = RegOpenKeyExW(hDatabase, szCardName, 0, access, phKey) ? SCARD_E_UNKNOWN_CARD : SCARD_S_SUCCESS;
+    RegCloseKey(hDatabase);
+    return lRet;
+}
+
+/* provider name of a card type, the primary provider is given as its GUID string */
+static LONG GetCardTypeProviderName(LPCWSTR szCardName, DWORD dwProviderId, LPWSTR *pszProvider)
+{
+    LPCWSTR szValue;
+    DWORD cbProvider = 0;
+    HKEY hKey;
+    LONG lRet;
+
+    if(!szCardName)
+        return SCARD_E_INVALID_PARAMETER;
+    if(dwProviderId == SCARD_PROVIDER_PRIMARY)
+    {
+        const struct card_type *card;
+        char szGuid[39];
+        LockCardTypes();
+        if((card = FindCardType(szCardName)))
+        {
+            const GUID *guid = &card->guidPrimaryProvider;
+            sprintf(szGuid, "{%08lX-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+                (unsigned long) guid->Data1, guid->Data2, guid->Data3, guid->Data4[0], guid->Data4[1],
+                guid->Data4[2], guid->Data4[3], guid->Data4[4], guid->Data4[5], guid->Data4[6], guid->Data4[7]);
+        }
+        ReleaseSRWLockShared(&card_types_lock);
+        if(!card)
+            return SCARD_E_UNKNOWN_CARD;
+        if(!(*pszProvider = SCardAllocate(sizeof(szGuid) * sizeof(WCHAR))))
+            return SCARD_E_NO_MEMORY;
+        MultiByteToWideChar(CP_ACP,0,szGuid,-1,*pszProvider,sizeof(szGuid));
+        return SCARD_S_SUCCESS;
+    }
+    if(!(szValue = CardProviderValue(dwProviderId)))
+        return SCARD_E_INVALID_PARAMETER;
+
+    if((lRet = OpenCardTypeKey(szCardName, KEY_QUERY_VALUE, &hKey)) != SCARD_S_SUCCESS)
+        return lRet;
+    if(RegQueryValueExW(hKey, szValue, NULL, NULL, NULL, &cbProvider) || !cbProvider)
+        lRet = SCARD_E_UNKNOWN_CARD;
+    else if(!(*pszProvider = SCardAllocate(cbProvider + sizeof(WCHAR))))
+        lRet = SCARD_E_NO_MEMORY;
+    else if(RegQueryValueExW(hKey, szValue, NULL, NULL, (BYTE *) *pszProvider, &cbProvider))
+    {
+        SCardFree(*pszProvider);
+        lRet = SCARD_E_UNKNOWN_CARD;
+    }
+    else
+        (*pszProvider)[cbProvider / sizeof(WCHAR)] = 0;
+    RegCloseKey(hKey);
+    return lRet;
+}
+
+static LONG SetCardTypeProviderName(LPCWSTR szCardName, DWORD dwProviderId, LPCWSTR szProvider)
+{
+    LPCWSTR szValue = CardProviderValue(dwProviderId);
+    HKEY hKey;
+    LONG lRet;
+
+    if(!szCardName || !szProvider || !szValue)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = OpenCardTypeKey(szCardName, KEY_ALL_ACCESS, &hKey)) != SCARD_S_SUCCESS)
+        return lRet;
+    if(RegSetValueExW(hKey, szValue, 0, REG_SZ, (const BYTE *) szProvider, (lstrlenW(szProvider) + 1) * sizeof(WCHAR)))
+        lRet = SCARD_E_NO_ACCESS;
+    RegCloseKey(hKey);
+    return lRet;
+}
+
+/* converted card, provider, reader or group name, to be freed with SCardFree */
+static LONG NameToWide(LPCSTR szName, LPWSTR *pszNameW)
+{
+    int cch;
+    *pszNameW = NULL;
+    if(!szName)
+        return SCARD_S_SUCCESS;
+    if(!(cch = MultiByteToWideChar(CP_ACP,0,szName,-1,NULL,0)))
+        return SCARD_E_INVALID_PARAMETER;
+    if(!(*pszNameW = SCardAllocate(cch * sizeof(WCHAR))))
+        return SCARD_E_NO_MEMORY;
+    MultiByteToWideChar(CP_ACP,0,szName,-1,*pszNameW,cch);
+    return SCARD_S_SUCCESS;
+}
+
+/*
+ * One GetStatusChange snapshot of the readers, flagging with SCARD_STATE_ATRMATCH
+ * those holding a card that matches one of the patterns.
+ * SCARD_READERSTATEA and SCARD_READERSTATEW only differ by the type of szReader.
+ */
+static LONG LocateCards(SCARDCONTEXT hContext, const struct atr_pattern *patterns, DWORD cPatterns,
+    LPSCARD_READERSTATEA rgReaderStates, DWORD cReaders, BOOL bWide)
+{
+    LPSCARD_READERSTATEA pStates;
+    DWORD i, j;
+    LONG lRet;
+
+    if(!rgReaderStates && cReaders)
+        return SCARD_E_INVALID_PARAMETER;
+    if(!cReaders)
+        return SCardIsValidContext(hContext);
+    if(!(pStates = SCardAllocate(cReaders * sizeof(*pStates))))
+        return SCARD_E_NO_MEMORY;
+    memcpy(pStates, rgReaderStates, cReaders * sizeof(*pStates));
+    for(i = 0; i < cReaders; i++)
+        pStates[i].dwCurrentState = rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE;
+
+    if(bWide)
+        lRet = SCardGetStatusChangeW(hContext, 0, (LPSCARD_READERSTATEW) pStates, cReaders);
+    else
+        lRet = SCardGetStatusChangeA(hContext, 0, pStates, cReaders);
+    if(lRet == SCARD_E_TIMEOUT)
+        lRet = SCARD_S_SUCCESS;
+
+    for(i = 0; i < cReaders && lRet == SCARD_S_SUCCESS; i++)
+    {
+        DWORD dwEventState = pStates[i].dwEventState & ~(SCARD_STATE_CHANGED | SCARD_STATE_ATRMATCH);
+        if(rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE)
+            continue;
+        if(dwEventState & SCARD_STATE_PRESENT)
+        {
+            ULONGLONG atr[ATR_WORDS];
+            AtrToWords(pStates[i].rgbAtr, pStates[i].cbAtr, atr);
+            for(j = 0; j < cPatterns; j++)
+            {
+                if(!AtrMatches(&patterns[j], atr, pStates[i].cbAtr))
+                    continue;
+                dwEventState |= SCARD_STATE_ATRMATCH;
+                break;
+            }
+        }
+        if(dwEventState != (rgReaderStates[i].dwCurrentState & ~SCARD_STATE_CHANGED))
+            dwEventState |= SCARD_STATE_CHANGED;
+        rgReaderStates[i].dwEventState = dwEventState;
+        rgReaderStates[i].cbAtr = pStates[i].cbAtr;
+        memcpy(rgReaderStates[i].rgbAtr, pStates[i].rgbAtr, sizeof(rgReaderStates[i].rgbAtr));
+    }
+    SCardFree(pStates);
+    return lRet;
+}
+
+/* SCardLocateCards for the card types named in mszCards, unknown names are ignored */
+static LONG LocateCardTypes(SCARDCONTEXT hContext, LPCVOID mszCards, BOOL bWide,
+    LPSCARD_READERSTATEA rgReaderStates, DWORD cReaders)
+{
+    struct atr_pattern *patterns = NULL;
+    DWORD cPatterns = 0;
+    LONG lRet;
+
+    if(!mszCards)
+        return SCARD_E_INVALID_PARAMETER;
+    LockCardTypes();
+    if(card_types_count && !(patterns = SCardAllocate(card_types_count * sizeof(*patterns))))
+    {
+        ReleaseSRWLockShared(&card_types_lock);
+        return SCARD_E_NO_MEMORY;
+    }
+    if(bWide)
+    {
+        LPCWSTR szCard;
+        const struct card_type *card;
+        for(szCard = mszCards; *szCard; szCard += lstrlenW(szCard) + 1)
+            if((card = FindCardType(szCard)))
+                patterns[cPatterns++] = card->pattern;
+    }
+    else
+    {
+        LPCSTR szCard;
+        DWORD i;
+        for(szCard = mszCards; *szCard; szCard += strlen(szCard) + 1)
+            for(i = 0; i < card_types_count; i++)
+                if(!lstrcmpiA(card_types[i].szNameA, szCard))
+                {
+                    patterns[cPatterns++] = card_types[i].pattern;
+                    break;
+                }
+    }
+    ReleaseSRWLockShared(&card_types_lock);
+
+    lRet = LocateCards(hContext, patterns, cPatterns, rgReaderStates, cReaders, bWide);
+    SCardFree(patterns);
+    return lRet;
+}
+
+/*
+ *  smart cards database functions
+ */
+
+LONG WINAPI SCardListCardsA(
+        SCARDCONTEXT hContext,
+        const BYTE* pbAtr,
+        LPCGUID rgquidInterfaces,
+        DWORD cguidInterfaceCount,
+        LPSTR mszCards,
+        LPDWORD pcchCards)
+{
+    TRACE("0x%08X, %p, %p, %#lx, %p, %p\n",(unsigned int) hContext,pbAtr,rgquidInterfaces,cguidInterfaceCount,mszCards,pcchCards);
+
+    if(!pcchCards || (cguidInterfaceCount && !rgquidInterfaces))
+        return SCARD_E_INVALID_PARAMETER;
+    return ListCardTypes(pbAtr, rgquidInterfaces, cguidInterfaceCount, FALSE, mszCards, pcchCards);
+}
+
+LONG WINAPI SCardListCardsW(
+          SCARDCONTEXT hContext,
+          const BYTE* pbAtr,
+          LPCGUID rgquidInterfaces,
+          DWORD cguidInterfaceCount,
+      LPWSTR mszCards,
+      LPDWORD pcchCards)
+{
+    TRACE("0x%08X, %p, %p, %#lx, %p, %p\n",(unsigned int)hContext,pbAtr,rgquidInterfaces,cguidInterfaceCount,mszCards,pcchCards);
+
+    if(!pcchCards || (cguidInterfaceCount && !rgquidInterfaces))
+        return SCARD_E_INVALID_PARAMETER;
+    return ListCardTypes(pbAtr, rgquidInterfaces, cguidInterfaceCount, TRUE, mszCards, pcchCards);
+}
+    
+LONG WINAPI SCardListInterfacesA(
+        SCARDCONTEXT hContext,
+        LPCSTR szCard,
+        LPGUID pguidInterfaces,
+        LPDWORD pcguidInterfaces)
+{
+    LPWSTR szCardW;
+    LONG lRet;
+
+    TRACE("0x%08X %s %p %p\n",(unsigned int)hContext,debugstr_a(szCard),pguidInterfaces,pcguidInterfaces);
+
+    if(!szCard)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCard, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = SCardListInterfacesW(hContext, szCardW, pguidInterfaces, pcguidInterfaces);
+    SCardFree(szCardW);
+    return lRet;
+}
+
+LONG WINAPI SCardListInterfacesW(
+        SCARDCONTEXT hContext,
+        LPCWSTR szCard,
+        LPGUID pguidInterfaces,
+        LPDWORD pcguidInterfaces)
+{
+    const struct card_type *card;
+    LONG lRet;
+
+    TRACE("0x%08X %s %p %p\n",(unsigned int)hContext,debugstr_w(szCard),pguidInterfaces,pcguidInterfaces);
+
+    if(!szCard || !pcguidInterfaces)
+        return SCARD_E_INVALID_PARAMETER;
+    LockCardTypes();
+    if(!(card = FindCardType(szCard)))
+        lRet = SCARD_E_UNKNOWN_CARD;
+    else
+        lRet = CopyCachedList(card->rgguidInterfaces, card->dwInterfaceCount, sizeof(GUID), pguidInterfaces, pcguidInterfaces);
+    ReleaseSRWLockShared(&card_types_lock);
+    return lRet;
+}
+  
+LONG WINAPI SCardGetProviderIdA(
+    SCARDCONTEXT hContext,
+    LPCSTR szCard,
+    LPGUID pguidProviderId)
+{
+    LPWSTR szCardW;
+    LONG lRet;
+
+    TRACE("0x%08X %s %p\n",(unsigned int)hContext,debugstr_a(szCard),pguidProviderId);
+
+    if(!szCard || !pguidProviderId)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCard, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = SCardGetProviderIdW(hContext, szCardW, pguidProviderId);
+    SCardFree(szCardW);
+    return lRet;
+}
+    
+LONG WINAPI SCardGetProviderIdW(
+    SCARDCONTEXT hContext,
+    LPCWSTR szCard,
+    LPGUID pguidProviderId)
+{
+    const struct card_type *card;
+
+    TRACE("0x%08X %s %p\n",(unsigned int)hContext,debugstr_w(szCard),pguidProviderId);
+
+    if(!szCard || !pguidProviderId)
+        return SCARD_E_INVALID_PARAMETER;
+    LockCardTypes();
+    if((card = FindCardType(szCard)))
+        *pguidProviderId = card->guidPrimaryProvider;
+    ReleaseSRWLockShared(&card_types_lock);
+    return card ? SCARD_S_SUCCESS : SCARD_E_UNKNOWN_CARD;
+}
+    
+LONG WINAPI SCardGetCardTypeProviderNameA(
+    SCARDCONTEXT hContext,
+    LPCSTR szCardName,
+    DWORD dwProviderId,
+    LPSTR szProvider,
+    LPDWORD pcchProvider)
+{
+    LPWSTR szCardW, szProviderW = NULL;
+    LONG lRet;
+
+    TRACE("0x%08X %s %#lx %p %p\n",(unsigned int)hContext,debugstr_a(szCardName),dwProviderId,szProvider,pcchProvider);
+
+    if(!szCardName || !pcchProvider)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCardName, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = GetCardTypeProviderName(szCardW, dwProviderId, &szProviderW);
+    SCardFree(szCardW);
+    if(lRet == SCARD_S_SUCCESS)
+    {
+        int cch = WideCharToMultiByte(CP_ACP,0,szProviderW,-1,NULL,0,NULL,NULL);
+        LPSTR szProviderA = SCardAllocate(cch);
+        if(!szProviderA)
+            lRet = SCARD_E_NO_MEMORY;
+        else
+        {
+            WideCharToMultiByte(CP_ACP,0,szProviderW,-1,szProviderA,cch,NULL,NULL);
+            lRet = CopyCachedList(szProviderA, cch, 1, szProvider, pcchProvider);
+            SCardFree(szProviderA);
+        }
+        SCardFree(szProviderW);
+    }
+    return lRet;
+}
+    
+LONG WINAPI SCardGetCardTypeProviderNameW(
+    SCARDCONTEXT hContext,
+    LPCWSTR szCardName,
+    DWORD dwProviderId,
+    LPWSTR szProvider,
+    LPDWORD pcchProvider)
+{
+    LPWSTR szProviderW = NULL;
+    LONG lRet;
+
+    TRACE("0x%08X %s %#lx %p %p\n",(unsigned int)hContext,debugstr_w(szCardName),dwProviderId,szProvider,pcchProvider);
+
+    if(!pcchProvider)
+        return SCARD_E_INVALID_PARAMETER;
+    lRet = GetCardTypeProviderName(szCardName, dwProviderId, &szProviderW);
+    if(lRet == SCARD_S_SUCCESS)
+    {
+        lRet = CopyCachedList(szProviderW, lstrlenW(szProviderW) + 1, sizeof(WCHAR), szProvider, pcchProvider);
+        SCardFree(szProviderW);
+    }
+    return lRet;
+}
+
 
 /*
-  * events functions
-  */
-  
-HANDLE WINAPI SCardAccessNewReaderEvent(void)
+ * Reader groups.
+ * pcsc-lite has no reader groups, so they are kept here, where Windows keeps
+ * them: each reader key under HKLM\SOFTWARE\Microsoft\Cryptography\Calais\Readers
+ * lists the groups of the reader in its Groups value, and groups introduced
+ * without readers have a key under Calais\ReaderGroups. The table holds the
+ * members of each group as a bitmap of interned reader ids, so that filtering
+ * a reader list costs one bit test per reader. Readers of the registry that
+ * were not seen yet have no id, so the table is read again when new names
+ * were interned. Like the card database, it is also read again when the keys
+ * were changed, by another process for instance, checking it once a second at
+ * most: a Groups value only changes the write time of its reader key, so the
+ * latest write time of the reader keys is taken along with the two parents.
+ */
+#define MAX_READER_GROUPS 64
+#define READER_GROUPS_CHECK_INTERVAL 1000
+#define READERS_KEY L"SOFTWARE\\Microsoft\\Cryptography\\Calais\\Readers"
+#define READER_GROUPS_KEY L"SOFTWARE\\Microsoft\\Cryptography\\Calais\\ReaderGroups"
+
+struct reader_group
+{
+    LPSTR szA;
+    LPWSTR szW;
+    DWORD members[MAX_READER_NAMES / 32];   /* bit id - 1 for each member reader */
+};
+
+static struct reader_group reader_groups[MAX_READER_GROUPS];
+static DWORD reader_groups_count = 0;
+static BOOL reader_groups_loaded = FALSE;
+static DWORD reader_groups_names = 0;  /* count of interned names when the table was read */
+static FILETIME reader_groups_time;     /* latest write time of the keys when the table was read */
+static ULONGLONG reader_groups_checked = 0;
+static SRWLOCK reader_groups_lock = SRWLOCK_INIT;
+
+/* groups every reader belongs to */
+static const WCHAR *builtin_groups[] =
+{
+    L"SCard$AllReaders", L"SCard$DefaultReaders", L"SCard$LocalReaders", L"SCard$SystemReaders"
+};
+
+static BOOL IsBuiltinGroupW(LPCWSTR szGroup)
+{
+    DWORD i;
+    for(i = 0; i < ARRAY_SIZE(builtin_groups); i++)
+        if(!lstrcmpiW(szGroup, builtin_groups[i]))
+            return TRUE;
+    return FALSE;
+}
+
+static BOOL IsBuiltinGroupA(LPCSTR szGroup)
+{
+    WCHAR szGroupW[32];
+    if(!MultiByteToWideChar(CP_ACP,0,szGroup,-1,szGroupW,ARRAY_SIZE(szGroupW)))
+        return FALSE;
+    return IsBuiltinGroupW(szGroupW);
+}
+
+/* must be called with reader_groups_lock held */
+static struct reader_group *FindGroupW(LPCWSTR szGroup)
+{
+    DWORD i;
+    for(i = 0; i < reader_groups_count; i++)
+        if(!lstrcmpiW(reader_groups[i].szW, szGroup))
+            return &reader_groups[i];
+    return NULL;
+}
+
+/* must be called with reader_groups_lock held */
+static struct reader_group *FindGroupA(LPCSTR szGroup)
+{
+    DWORD i;
+    for(i = 0; i < reader_groups_count; i++)
+        if(!lstrcmpiA(reader_groups[i].szA, szGroup))
+            return &reader_groups[i];
+    return NULL;
+}
+
+/* must be called with reader_groups_lock held exclusively */
+static struct reader_group *AddGroup(LPCWSTR szGroup)
+{
+    struct reader_group *group;
+    int cchA, cchW = lstrlenW(szGroup) + 1;
+
+    if((group = FindGroupW(szGroup)))
+        return group;
+    if(reader_groups_count >= MAX_READER_GROUPS)
+        return NULL;
+    cchA = WideCharToMultiByte(CP_ACP,0,szGroup,-1,NULL,0,NULL,NULL);
+    group = &reader_groups[reader_groups_count];
+    memset(group, 0, sizeof(*group));
+    group->szW = SCardAllocate(cchW * sizeof(WCHAR));
+    group->szA = SCardAllocate(cchA);
+    if(!group->szW || !group->szA)
+    {
+        SCardFree(group->szW);
+        SCardFree(group->szA);
+        return NULL;
+    }
+    memcpy(group->szW, szGroup, cchW * sizeof(WCHAR));
+    WideCharToMultiByte(CP_ACP,0,szGroup,-1,group->szA,cchA,NULL,NULL);
+    reader_groups_count++;
+    return group;
+}
+
+static void SetMember(struct reader_group *group, DWORD id, BOOL bMember)
+{
+    if(bMember)
+        group->members[(id - 1) / 32] |= 1u << ((id - 1) % 32);
+    else
+        group->members[(id - 1) / 32] &= ~(1u << ((id - 1) % 32));
+}
+
+static BOOL IsMember(const DWORD *members, DWORD id)
+{
+    return (members[(id - 1) / 32] >> ((id - 1) % 32)) & 1;
+}
+
+/* must be called with reader_groups_lock held exclusively */
+static void FreeReaderGroups(void)
+{
+    DWORD i;
+    for(i = 0; i < reader_groups_count; i++)
+    {
+        SCardFree(reader_groups[i].szA);
+        SCardFree(reader_groups[i].szW);
+    }
+    reader_groups_count = 0;
+    reader_groups_loaded = FALSE;
+}
+
+static void LatestTime(FILETIME *pftLatest, const FILETIME *pft)
+{
+    if(CompareFileTime(pft, pftLatest) > 0)
+        *pftLatest = *pft;
+}
+
+/* latest write time of the reader group keys and of the reader keys holding the Groups values */
+static void ReaderGroupsWriteTime(FILETIME *pftWrite)
+{
+    WCHAR szName[256];
+    DWORD i, cchName;
+    FILETIME ft;
+    HKEY hKey;
+
+    memset(pftWrite, 0, sizeof(*pftWrite));
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READER_GROUPS_KEY, 0, KEY_READ, &hKey))
+    {
+        if(!RegQueryInfoKeyW(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &ft))
+            LatestTime(pftWrite, &ft);
+        RegCloseKey(hKey);
+    }
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, KEY_READ, &hKey))
+    {
+        if(!RegQueryInfoKeyW(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &ft))
+            LatestTime(pftWrite, &ft);
+        for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hKey, i, szName, &cchName, NULL, NULL, NULL, &ft); i++)
+            LatestTime(pftWrite, &ft);
+        RegCloseKey(hKey);
+    }
+}
+
+/* must be called with reader_groups_lock held exclusively */
+static void LoadReaderGroups(DWORD dwNames)
+{
+    WCHAR szName[256];
+    DWORD i, cchName;
+    HKEY hKey;
+
+    FreeReaderGroups();
+    /* taken first, so that a change while the keys are read isn't missed */
+    ReaderGroupsWriteTime(&reader_groups_time);
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READER_GROUPS_KEY, 0, KEY_READ, &hKey))
+    {
+        for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hKey, i, szName, &cchName, NULL, NULL, NULL, NULL); i++)
+            AddGroup(szName);
+        RegCloseKey(hKey);
+    }
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, KEY_READ, &hKey))
+    {
+        for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hKey, i, szName, &cchName, NULL, NULL, NULL, NULL); i++)
+        {
+            const struct reader_name *reader;
+            struct reader_group *group;
+            DWORD cbGroups = 0;
+            LPWSTR mszGroups, szGroup;
+
+            if(RegGetValueW(hKey, szName, L"Groups", RRF_RT_REG_MULTI_SZ, NULL, NULL, &cbGroups) || !cbGroups)
+                continue;
+            /* groups are listed for readers not seen yet as well, only keep their names */
+            reader = LookupReaderW(szName);
+            if(!(mszGroups = SCardAllocate(cbGroups + 2 * sizeof(WCHAR))))
+                continue;
+            memset(mszGroups, 0, cbGroups + 2 * sizeof(WCHAR));
+            if(!RegGetValueW(hKey, szName, L"Groups", RRF_RT_REG_MULTI_SZ, NULL, mszGroups, &cbGroups))
+                for(szGroup = mszGroups; *szGroup; szGroup += lstrlenW(szGroup) + 1)
+                    if(!IsBuiltinGroupW(szGroup) && (group = AddGroup(szGroup)) && reader)
+                        SetMember(group, reader->id, TRUE);
+            SCardFree(mszGroups);
+        }
+        RegCloseKey(hKey);
+    }
+    reader_groups_loaded = TRUE;
+    reader_groups_names = dwNames;
+    TRACE("%lu reader groups\n", reader_groups_count);
+}
+
+static void EnsureReaderGroups(void)
+{
+    DWORD dwNames = ReaderNamesCount();
+    ULONGLONG ullNow = GetTickCount64();
+    FILETIME ftWrite;
+    BOOL bLoaded;
+
+    AcquireSRWLockShared(&reader_groups_lock);
+    bLoaded = reader_groups_loaded && reader_groups_names == dwNames
+        && ullNow - reader_groups_checked < READER_GROUPS_CHECK_INTERVAL;
+    ReleaseSRWLockShared(&reader_groups_lock);
+    if(bLoaded)
+        return;
+    AcquireSRWLockExclusive(&reader_groups_lock);
+    bLoaded = reader_groups_loaded && reader_groups_names == dwNames;
+    if(bLoaded && ullNow - reader_groups_checked >= READER_GROUPS_CHECK_INTERVAL)
+    {
+        reader_groups_checked = ullNow;
+        ReaderGroupsWriteTime(&ftWrite);
+        bLoaded = !memcmp(&ftWrite, &reader_groups_time, sizeof(ftWrite));
+    }
+    if(!bLoaded)
+    {
+        reader_groups_checked = ullNow;
+        LoadReaderGroups(dwNames);
+    }
+    ReleaseSRWLockExclusive(&reader_groups_lock);
+}
+
+static void release_reader_groups(void)
+{
+    AcquireSRWLockExclusive(&reader_groups_lock);
+    FreeReaderGroups();
+    ReleaseSRWLockExclusive(&reader_groups_lock);
+}
+
+/*
+ * Add or remove a group in the Groups value of a reader, which needs not be
+ * known here, must be called with reader_groups_lock held exclusively.
+ */
+static LONG EditReaderGroups(HKEY hReaders, LPCWSTR szReader, LPCWSTR szGroup, BOOL bMember)
+{
+    WCHAR mszGroups[1024];
+    DWORD cbGroups = sizeof(mszGroups) - 2 * sizeof(WCHAR), cch = 0, cchOld;
+    LPCWSTR szOld;
+    BOOL bFound = FALSE;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    memset(mszGroups, 0, sizeof(mszGroups));
+    if(RegGetValueW(hReaders, szReader, L"Groups", RRF_RT_REG_MULTI_SZ, NULL, mszGroups, &cbGroups))
+        memset(mszGroups, 0, sizeof(mszGroups));
+    /* the names are moved down over the group, step with the length taken before */
+    for(szOld = mszGroups; *szOld; szOld += cchOld)
+    {
+        cchOld = lstrlenW(szOld) + 1;
+        if(!lstrcmpiW(szOld, szGroup))
+        {
+            bFound = TRUE;
+            continue;
+        }
+        memmove(mszGroups + cch, szOld, cchOld * sizeof(WCHAR));
+        cch += cchOld;
+    }
+    if(bFound == bMember)
+        return SCARD_S_SUCCESS;
+    if(bMember)
+    {
+        DWORD cchGroup = lstrlenW(szGroup) + 1;
+        if(cch + cchGroup + 1 > ARRAY_SIZE(mszGroups))
+            return SCARD_E_NO_MEMORY;
+        memcpy(mszGroups + cch, szGroup, cchGroup * sizeof(WCHAR));
+        cch += cchGroup;
+    }
+    mszGroups[cch++] = 0;
+
+    if(cch > 1)
+    {
+        HKEY hKey;
+        if(RegCreateKeyExW(hReaders, szReader, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL))
+            lRet = SCARD_E_NO_ACCESS;
+        else
+        {
+            if(RegSetValueExW(hKey, L"Groups", 0, REG_MULTI_SZ, (const BYTE *) mszGroups, cch * sizeof(WCHAR)))
+                lRet = SCARD_E_NO_ACCESS;
+            RegCloseKey(hKey);
+        }
+    }
+    else
+        RegDeleteKeyValueW(hReaders, szReader, L"Groups");
+    return lRet;
+}
+
+static LONG IntroduceReaderGroup(LPCWSTR szGroupName)
+{
+    HKEY hKey;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    if(!szGroupName || !*szGroupName)
+        return SCARD_E_INVALID_VALUE;
+    if(IsBuiltinGroupW(szGroupName))
+        return SCARD_S_SUCCESS;
+    EnsureReaderGroups();
+    AcquireSRWLockExclusive(&reader_groups_lock);
+    if(RegCreateKeyExW(HKEY_LOCAL_MACHINE, READER_GROUPS_KEY, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL))
+        lRet = SCARD_E_NO_ACCESS;
+    else
+    {
+        HKEY hGroup;
+        if(RegCreateKeyExW(hKey, szGroupName, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hGroup, NULL))
+            lRet = SCARD_E_NO_ACCESS;
+        else
+        {
+            RegCloseKey(hGroup);
+            if(!AddGroup(szGroupName))
+                lRet = SCARD_E_NO_MEMORY;
+        }
+        RegCloseKey(hKey);
+        /* our own change doesn't need to be read again */
+        ReaderGroupsWriteTime(&reader_groups_time);
+    }
+    ReleaseSRWLockExclusive(&reader_groups_lock);
+    return lRet;
+}
+
+static LONG ForgetReaderGroup(LPCWSTR szGroupName)
+{
+    struct reader_group *group;
+    WCHAR szName[256];
+    DWORD i, cchName;
+    HKEY hKey;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    if(!szGroupName || !*szGroupName)
+        return SCARD_E_INVALID_VALUE;
+    EnsureReaderGroups();
+    AcquireSRWLockExclusive(&reader_groups_lock);
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READER_GROUPS_KEY, 0, KEY_ALL_ACCESS, &hKey))
+    {
+        RegDeleteTreeW(hKey, szGroupName);
+        RegCloseKey(hKey);
+    }
+    /* the readers of the group, seen or not, leave it */
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, KEY_ALL_ACCESS, &hKey))
+    {
+        for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hKey, i, szName, &cchName, NULL, NULL, NULL, NULL); i++)
+        {
+            LONG lEdit = EditReaderGroups(hKey, szName, szGroupName, FALSE);
+            if(lEdit != SCARD_S_SUCCESS)
+                lRet = lEdit;
+        }
+        RegCloseKey(hKey);
+    }
+    if((group = FindGroupW(szGroupName)))
+    {
+        SCardFree(group->szA);
+        SCardFree(group->szW);
+        *group = reader_groups[--reader_groups_count];
+    }
+    ReaderGroupsWriteTime(&reader_groups_time);
+    ReleaseSRWLockExclusive(&reader_groups_lock);
+    return lRet;
+}
+
+static LONG SetReaderGroup(LPCWSTR szReaderName, LPCWSTR szGroupName, BOOL bMember)
+{
+    const struct reader_name *reader;
+    struct reader_group *group;
+    HKEY hReaders;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    if(!szReaderName || !*szReaderName || !szGroupName || !*szGroupName)
+        return SCARD_E_INVALID_VALUE;
+    if(IsBuiltinGroupW(szGroupName))
+        return SCARD_S_SUCCESS;
+    EnsureReaderGroups();
+    AcquireSRWLockExclusive(&reader_groups_lock);
+    group = bMember ? AddGroup(szGroupName) : FindGroupW(szGroupName);
+    if(!group && bMember)
+        lRet = SCARD_E_NO_MEMORY;
+    else if(RegCreateKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hReaders, NULL))
+        lRet = SCARD_E_NO_ACCESS;
+    else
+    {
+        lRet = EditReaderGroups(hReaders, szReaderName, szGroupName, bMember);
+        RegCloseKey(hReaders);
+        /* a reader not seen yet gets its bit when the table is read again */
+        if(lRet == SCARD_S_SUCCESS && group && (reader = LookupReaderW(szReaderName)))
+            SetMember(group, reader->id, bMember);
+        ReaderGroupsWriteTime(&reader_groups_time);
+    }
+    ReleaseSRWLockExclusive(&reader_groups_lock);
+    return lRet;
+}
+
+/*
+ * Keep the readers of a list that belong to one of the groups, in place.
+ * Returns the new length of the list, 1 when no reader is left.
+ */
+static DWORD FilterReaderList(LPVOID mszReaders, LPCVOID mszGroups, BOOL bWide)
+{
+    DWORD members[MAX_READER_NAMES / 32], i, cchOut = 0;
+    LPWSTR szOutW = mszReaders;
+    LPSTR szOutA = mszReaders;
+
+    memset(members, 0, sizeof(members));
+    EnsureReaderGroups();
+    AcquireSRWLockShared(&reader_groups_lock);
+    if(bWide)
+    {
+        LPCWSTR szGroup;
+        for(szGroup = mszGroups; *szGroup; szGroup += lstrlenW(szGroup) + 1)
+        {
+            const struct reader_group *group;
+            if(IsBuiltinGroupW(szGroup))
+                memset(members, 0xff, sizeof(members));
+            else if((group = FindGroupW(szGroup)))
+                for(i = 0; i < ARRAY_SIZE(members); i++)
+                    members[i] |= group->members[i];
+        }
+    }
+    else
+    {
+        LPCSTR szGroup;
+        for(szGroup = mszGroups; *szGroup; szGroup += strlen(szGroup) + 1)
+        {
+            const struct reader_group *group;
+            if(IsBuiltinGroupA(szGroup))
+                memset(members, 0xff, sizeof(members));
+            else if((group = FindGroupA(szGroup)))
+                for(i = 0; i < ARRAY_SIZE(members); i++)
+                    members[i] |= group->members[i];
+        }
+    }
+    ReleaseSRWLockShared(&reader_groups_lock);
+
+    if(bWide)
+    {
+        LPCWSTR szReader;
+        DWORD cch;
+        /* the names are moved down over the ones left out, step with the length taken before */
+        for(szReader = mszReaders; *szReader; szReader += cch)
+        {
+            const struct reader_name *name = LookupReaderW(szReader);
+            cch = lstrlenW(szReader) + 1;
+            if(!name || !IsMember(members, name->id))
+                continue;
+            memmove(szOutW + cchOut, szReader, cch * sizeof(WCHAR));
+            cchOut += cch;
+        }
+        szOutW[cchOut++] = 0;
+    }
+    else
+    {
+        LPCSTR szReader;
+        DWORD cch;
+        for(szReader = mszReaders; *szReader; szReader += cch)
+        {
+            const struct reader_name *name = LookupReaderA(szReader);
+            cch = strlen(szReader) + 1;
+            if(!name || !IsMember(members, name->id))
+                continue;
+            memmove(szOutA + cchOut, szReader, cch);
+            cchOut += cch;
+        }
+        szOutA[cchOut++] = 0;
+    }
+    return cchOut;
+}
+
+/* SCardListReaders for groups other than the ones of all the readers */
+static LONG ListGroupReaders(SCARDCONTEXT hContext, LPCVOID mszGroups, BOOL bWide, LPVOID mszReaders, LPDWORD pcchReaders)
+{
+    LPVOID pList = NULL;
+    DWORD cchList = SCARD_AUTOALLOCATE;
+    LONG lRet;
+
+    if(bWide)
+        lRet = SCardListReadersW(hContext, NULL, (LPWSTR) &pList, &cchList);
+    else
+        lRet = SCardListReadersA(hContext, NULL, (LPSTR) &pList, &cchList);
+    if(lRet != SCARD_S_SUCCESS)
+        return lRet;
+
+    /* the readers need their ids before the groups are read */
+    if(bWide)
+    {
+        LPCWSTR szReader;
+        for(szReader = pList; *szReader; szReader += lstrlenW(szReader) + 1)
+            InternReaderW(szReader);
+    }
+    else
+        InternReaderList(pList);
+    cchList = FilterReaderList(pList, mszGroups, bWide);
+    if(cchList <= 1)
+        lRet = SCARD_E_NO_READERS_AVAILABLE;
+    else
+        lRet = CopyCachedList(pList, cchList, bWide ? sizeof(WCHAR) : sizeof(CHAR), mszReaders, pcchReaders);
+    SCardFree(pList);
+    return lRet;
+}
+
+/* append the groups kept here to a list of groups, returns a new list to be freed with SCardFree */
+static LPSTR AddLocalGroups(LPCSTR mszGroups, LPDWORD pcchGroups)
+{
+    DWORD i, cch = 0, cchList;
+    LPCSTR szGroup;
+    LPSTR pList, p;
+
+    EnsureReaderGroups();
+    AcquireSRWLockShared(&reader_groups_lock);
+    for(szGroup = mszGroups; szGroup && *szGroup; szGroup += strlen(szGroup) + 1)
+        cch += strlen(szGroup) + 1;
+    cchList = cch + 1;
+    for(i = 0; i < reader_groups_count; i++)
+        cchList += strlen(reader_groups[i].szA) + 1;
+    if((pList = SCardAllocate(cchList)))
+    {
+        memcpy(pList, mszGroups, cch);
+        p = pList + cch;
+        for(i = 0; i < reader_groups_count; i++)
+        {
+            DWORD cchGroup = strlen(reader_groups[i].szA) + 1;
+            memcpy(p, reader_groups[i].szA, cchGroup);
+            p += cchGroup;
+        }
+        *p++ = 0;
+        *pcchGroups = p - pList;
+    }
+    ReleaseSRWLockShared(&reader_groups_lock);
+    return pList;
+}
+
+/*
+ * Reader aliases.
+ * SCardIntroduceReader gives a stable name to a pcsc-lite reader, whose names
+ * end with index and slot numbers that change with the order the readers are
+ * plugged in. As on Windows, the device of an alias is the Device value of the
+ * alias key under Calais\Readers, kept here without these numbers and looked
+ * for in the reader list when the alias is used. Aliases are hashed like the
+ * interned reader names, and remember the reader found for their device until
+ * the watch thread reports a new reader list.
+ */
+#define MAX_READER_ALIASES 64
+
+struct reader_alias
+{
+    struct reader_alias *nextA;  /* hash chains */
+    struct reader_alias *nextW;
+    LPSTR szA;
+    LPWSTR szW;
+    LPSTR szDeviceA;    /* pcsc-lite name without the index and slot numbers */
+    const struct reader_name *device;  /* reader of the device, NULL when it isn't plugged */
+    LONG lDeviceGeneration;            /* reader list generation of device, 0 when unknown */
+};
+
+static struct reader_alias *reader_aliases_a[READER_NAME_BUCKETS];
+static struct reader_alias *reader_aliases_w[READER_NAME_BUCKETS];
+static LONG reader_aliases_count = 0;
+static INIT_ONCE reader_aliases_once = INIT_ONCE_STATIC_INIT;
+static SRWLOCK reader_aliases_lock = SRWLOCK_INIT;
+
+static BOOL IsHexDigitA(CHAR c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+}
+
+/* length of a pcsc-lite reader name without its " %02X %02X" index and slot */
+static int DeviceLengthA(LPCSTR szReader)
+{
+    int cch = strlen(szReader);
+    if(cch > 6 && szReader[cch - 6] == ' ' && IsHexDigitA(szReader[cch - 5]) && IsHexDigitA(szReader[cch - 4])
+        && szReader[cch - 3] == ' ' && IsHexDigitA(szReader[cch - 2]) && IsHexDigitA(szReader[cch - 1]))
+        return cch - 6;
+    return cch;
+}
+
+/* must be called with reader_aliases_lock held */
+static struct reader_alias *FindAliasA(LPCSTR szName)
+{
+    struct reader_alias *alias;
+    for(alias = reader_aliases_a[HashNameA(szName)]; alias; alias = alias->nextA)
+        if(!strcmp(alias->szA, szName))
+            return alias;
+    return NULL;
+}
+
+/* must be called with reader_aliases_lock held */
+static struct reader_alias *FindAliasW(LPCWSTR szName)
+{
+    struct reader_alias *alias;
+    for(alias = reader_aliases_w[HashNameW(szName)]; alias; alias = alias->nextW)
+        if(!lstrcmpW(alias->szW, szName))
+            return alias;
+    return NULL;
+}
+
+static void FreeReaderAlias(struct reader_alias *alias)
+{
+    SCardFree(alias->szA);
+    SCardFree(alias->szW);
+    SCardFree(alias->szDeviceA);
+    SCardFree(alias);
+}
+
+/* must be called with reader_aliases_lock held exclusively */
+static void RemoveReaderAlias(struct reader_alias *alias)
+{
+    struct reader_alias **prev;
+    for(prev = &reader_aliases_a[HashNameA(alias->szA)]; *prev != alias; prev = &(*prev)->nextA);
+    *prev = alias->nextA;
+    for(prev = &reader_aliases_w[HashNameW(alias->szW)]; *prev != alias; prev = &(*prev)->nextW);
+    *prev = alias->nextW;
+    reader_aliases_count--;
+    FreeReaderAlias(alias);
+}
+
+/*
+ * Set the device of an alias, a NULL device removes the alias.
+ * Must be called with reader_aliases_lock held exclusively, returns FALSE
+ * when there is no alias to remove or no memory to add it.
+ */
+static BOOL SetReaderAlias(LPCWSTR szAlias, LPCSTR szDevice, int cchDevice)
+{
+    struct reader_alias *alias = FindAliasW(szAlias), *added;
+    LPSTR szDeviceA;
+    DWORD dwHash;
+    int cchA, cchW;
+
+    if(!szDevice)
+    {
+        if(!alias)
+            return FALSE;
+        RemoveReaderAlias(alias);
+        return TRUE;
+    }
+    if(!(szDeviceA = SCardAllocate(cchDevice + 1)))
+        return FALSE;
+    memcpy(szDeviceA, szDevice, cchDevice);
+    szDeviceA[cchDevice] = 0;
+    if(alias)
+    {
+        SCardFree(alias->szDeviceA);
+        alias->szDeviceA = szDeviceA;
+        alias->lDeviceGeneration = 0;
+        return TRUE;
+    }
+
+    if(reader_aliases_count >= MAX_READER_ALIASES || !(added = SCardAllocate(sizeof(*added))))
+    {
+        SCardFree(szDeviceA);
+        return FALSE;
+    }
+    memset(added, 0, sizeof(*added));
+    cchW = lstrlenW(szAlias) + 1;
+    cchA = WideCharToMultiByte(CP_ACP,0,szAlias,-1,NULL,0,NULL,NULL);
+    added->szDeviceA = szDeviceA;
+    added->szW = SCardAllocate(cchW * sizeof(WCHAR));
+    added->szA = SCardAllocate(cchA);
+    if(!added->szW || !added->szA)
+    {
+        FreeReaderAlias(added);
+        return FALSE;
+    }
+    memcpy(added->szW, szAlias, cchW * sizeof(WCHAR));
+    WideCharToMultiByte(CP_ACP,0,szAlias,-1,added->szA,cchA,NULL,NULL);
+    dwHash = HashNameA(added->szA);
+    added->nextA = reader_aliases_a[dwHash];
+    reader_aliases_a[dwHash] = added;
+    dwHash = HashNameW(added->szW);
+    added->nextW = reader_aliases_w[dwHash];
+    reader_aliases_w[dwHash] = added;
+    reader_aliases_count++;
+    return TRUE;
+}
+
+static BOOL WINAPI LoadReaderAliases(INIT_ONCE *once, void *param, void **context)
+{
+    WCHAR szName[256], szDevice[256];
+    CHAR szDeviceA[256];
+    DWORD i, cchName, cbDevice;
+    HKEY hKey;
+
+    if(RegOpenKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, KEY_READ, &hKey))
+        return TRUE;
+    AcquireSRWLockExclusive(&reader_aliases_lock);
+    for(i = 0; cchName = ARRAY_SIZE(szName), !RegEnumKeyExW(hKey, i, szName, &cchName, NULL, NULL, NULL, NULL); i++)
+    {
+        cbDevice = sizeof(szDevice);
+        if(RegGetValueW(hKey, szName, L"Device", RRF_RT_REG_SZ, NULL, szDevice, &cbDevice) || !szDevice[0]
+            || !lstrcmpW(szName, szDevice)
+            || !WideCharToMultiByte(CP_ACP,0,szDevice,-1,szDeviceA,sizeof(szDeviceA),NULL,NULL))
+            continue;
+        /* a device written with its numbers still finds its reader */
+        SetReaderAlias(szName, szDeviceA, DeviceLengthA(szDeviceA));
+    }
+    TRACE("%ld reader aliases\n", reader_aliases_count);
+    ReleaseSRWLockExclusive(&reader_aliases_lock);
+    RegCloseKey(hKey);
+    return TRUE;
+}
+
+static void release_reader_aliases(void)
 {
-    FIXME("stub\n");
-    SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
-    return NULL;
+    DWORD i;
+    AcquireSRWLockExclusive(&reader_aliases_lock);
+    for(i = 0; i < READER_NAME_BUCKETS; i++)
+        while(reader_aliases_w[i])
+            RemoveReaderAlias(reader_aliases_w[i]);
+    ReleaseSRWLockExclusive(&reader_aliases_lock);
 }
 
-HANDLE WINAPI SCardAccessStartedEvent()
+/* the reader of the current list with the name of a device */
+static const struct reader_name *FindAliasDevice(SCARDCONTEXT hContext, LPCSTR szDevice)
 {
-    return g_startedEvent;
+    LPSTR mszReaders = NULL;
+    DWORD cchReaders = SCARD_AUTOALLOCATE;
+    const struct reader_name *name = NULL;
+    int cchDevice = strlen(szDevice);
+    LPCSTR szReader;
+
+    if(SCardListReadersA(hContext, NULL, (LPSTR) &mszReaders, &cchReaders) != SCARD_S_SUCCESS)
+        return NULL;
+    for(szReader = mszReaders; *szReader && !name; szReader += strlen(szReader) + 1)
+        if(DeviceLengthA(szReader) == cchDevice && !memcmp(szReader, szDevice, cchDevice))
+            name = LookupReaderA(szReader);
+    SCardFree(mszReaders);
+    return name;
 }
 
-void WINAPI SCardReleaseStartedEvent(HANDLE hStartedEventHandle)
+/* the reader an alias given by either of its names stands for, NULL if it is not an alias */
+static const struct reader_name *ResolveAlias(SCARDCONTEXT hContext, LPCSTR szAliasA, LPCWSTR szAliasW)
 {
-    /* do nothing  because we don't implement yet reference couting for the event handle*/
+    struct reader_alias *alias;
+    const struct reader_name *device = NULL;
+    CHAR szDevice[256];
+    BOOL bAlias = FALSE;
+    LONG lGeneration;
+
+    InitOnceExecuteOnce(&reader_aliases_once, LoadReaderAliases, NULL, NULL);
+    if(!ReadNoFence(&reader_aliases_count))
+        return NULL;
+    /* read before the reader list, a change meanwhile makes the lookup stale */
+    lGeneration = ReadAcquire(&reader_list_generation);
+    AcquireSRWLockShared(&reader_aliases_lock);
+    alias = szAliasA ? FindAliasA(szAliasA) : FindAliasW(szAliasW);
+    if(alias && lGeneration && alias->lDeviceGeneration == lGeneration)
+        device = alias->device;
+    else if(alias && strlen(alias->szDeviceA) < sizeof(szDevice))
+    {
+        strcpy(szDevice, alias->szDeviceA);
+        bAlias = TRUE;
+    }
+    ReleaseSRWLockShared(&reader_aliases_lock);
+    if(!bAlias)
+        return device;
+
+    device = FindAliasDevice(hContext, szDevice);
+    if(lGeneration)
+    {
+        AcquireSRWLockExclusive(&reader_aliases_lock);
+        /* the alias may have been changed meanwhile */
+        alias = szAliasA ? FindAliasA(szAliasA) : FindAliasW(szAliasW);
+        if(alias && !strcmp(alias->szDeviceA, szDevice))
+        {
+            alias->device = device;
+            alias->lDeviceGeneration = lGeneration;
+        }
+        ReleaseSRWLockExclusive(&reader_aliases_lock);
+    }
+    return device;
 }
 
-LONG WINAPI SCardFreeMemory( SCARDCONTEXT hContext,LPCVOID pvMem)
+/* pcsc-lite name of a reader given by its name or an alias */
+static LPCSTR ResolveReaderA(SCARDCONTEXT hContext, LPCSTR szReader)
 {
-    if(pvMem)
-        SCardFree((void*) pvMem);
-    return SCARD_S_SUCCESS;
+    const struct reader_name *device;
+    if(!szReader || !*szReader || !(device = ResolveAlias(hContext, szReader, NULL)))
+        return szReader;
+    return device->szA;
 }
 
-/*
- *  smart cards database functions. Almost all of them are stubs
- */
+/* interned name of a reader given by its name or an alias, NULL if it is not known */
+static const struct reader_name *ResolveReaderW(SCARDCONTEXT hContext, LPCWSTR szReader)
+{
+    const struct reader_name *device;
+    if(szReader && *szReader && (device = ResolveAlias(hContext, NULL, szReader)))
+        return device;
+    return LookupReaderW(szReader);
+}
 
-LONG WINAPI SCardListCardsA(
-        SCARDCONTEXT hContext,
-        const BYTE* pbAtr,
-        LPCGUID rgquidInterfaces,
-        DWORD cguidInterfaceCount,
-        LPSTR mszCards,
-        LPDWORD pcchCards)
+static LONG IntroduceReader(LPCWSTR szReaderName, LPCWSTR szDeviceName)
 {
-    TRACE("0x%08X, %p, %p, %#lx, %p, %p - stub\n",(unsigned int) hContext,pbAtr,rgquidInterfaces,cguidInterfaceCount,mszCards,pcchCards);
-    
-    /* we simuate the fact that no cards are enregistred on the system by returning an empty multi-string*/
-    if(!pcchCards)
-        return SCARD_E_INVALID_PARAMETER;
-    else if(!mszCards)
-        *pcchCards = 2;    
+    const struct reader_alias *alias;
+    CHAR szDevice[256];
+    WCHAR szDeviceW[256];
+    HKEY hReaders, hKey;
+    int cchDevice = 0;
+    LONG lRet = SCARD_S_SUCCESS;
+
+    if(!szReaderName || !*szReaderName || !szDeviceName || !*szDeviceName || !lstrcmpW(szReaderName, szDeviceName))
+        return SCARD_E_INVALID_VALUE;
+    InitOnceExecuteOnce(&reader_aliases_once, LoadReaderAliases, NULL, NULL);
+
+    AcquireSRWLockExclusive(&reader_aliases_lock);
+    /* aliases of aliases point to the device */
+    if((alias = FindAliasW(szDeviceName)))
+    {
+        if(strlen(alias->szDeviceA) < sizeof(szDevice))
+            cchDevice = strlen(strcpy(szDevice, alias->szDeviceA));
+    }
+    else if(WideCharToMultiByte(CP_ACP,0,szDeviceName,-1,szDevice,sizeof(szDevice),NULL,NULL))
+        cchDevice = DeviceLengthA(szDevice);
+    if(!cchDevice)
+        lRet = SCARD_E_INVALID_VALUE;
+    else if(RegCreateKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hReaders, NULL))
+        lRet = SCARD_E_NO_ACCESS;
     else
     {
-        DWORD len = *pcchCards;
-        if(SCARD_AUTOALLOCATE == len)
-        {
-            if(!mszCards)
-                return SCARD_E_INVALID_PARAMETER;
-            else
-            {
-                /* allocate memory */
-                LPSTR* pmszCards = (LPSTR*) mszCards;
-                LPSTR szResult = (LPSTR) SCardAllocate(2);
-                if(!szResult)
-                    return SCARD_E_NO_MEMORY;
-                szResult[0] = '\0';
-                szResult[1] = '\0';
-                *pcchCards = 2;
-                *pmszCards = szResult;
-            }
-        }
+        szDevice[cchDevice] = 0;
+        MultiByteToWideChar(CP_ACP,0,szDevice,-1,szDeviceW,ARRAY_SIZE(szDeviceW));
+        if(RegCreateKeyExW(hReaders, szReaderName, 0, NULL, 0, KEY_ALL_ACCESS, NULL, &hKey, NULL))
+            lRet = SCARD_E_NO_ACCESS;
         else
         {
-            if(len < 2)
-            {
-                *pcchCards = 2;
-                return SCARD_E_INSUFFICIENT_BUFFER;
-            }
-            else
-            {
-                /* return a empty multi string */
-                mszCards[0] = '\0';
-                mszCards[1] = '\0';
-                *pcchCards = 2;
-            }                
+            if(RegSetValueExW(hKey, L"Device", 0, REG_SZ, (const BYTE *) szDeviceW, (lstrlenW(szDeviceW) + 1) * sizeof(WCHAR)))
+                lRet = SCARD_E_NO_ACCESS;
+            RegCloseKey(hKey);
         }
+        RegCloseKey(hReaders);
+        if(lRet == SCARD_S_SUCCESS && !SetReaderAlias(szReaderName, szDevice, cchDevice))
+            lRet = SCARD_E_NO_MEMORY;
     }
-    
-    return SCARD_S_SUCCESS;
+    ReleaseSRWLockExclusive(&reader_aliases_lock);
+    return lRet;
 }
 
-LONG WINAPI SCardListCardsW(
-          SCARDCONTEXT hContext,
-          const BYTE* pbAtr,
-          LPCGUID rgquidInterfaces,
-          DWORD cguidInterfaceCount,
-      LPWSTR mszCards,
-      LPDWORD pcchCards)
+/* forget an alias or a reader with groups, the reader leaves all its groups */
+static LONG ForgetReader(LPCWSTR szReaderName)
 {
-    TRACE("0x%08X, %p, %p, %#lx, %p, %p - stub\n",(unsigned int)hContext,pbAtr,rgquidInterfaces,cguidInterfaceCount,mszCards,pcchCards);
-    
-    /* we simuate the fact that no cards are enregistred on the system by returning an empty multi-string*/    
-    if(!pcchCards)
-        return SCARD_E_INVALID_PARAMETER;
-    else if(!mszCards)
-        *pcchCards = 2;
-    else
+    const struct reader_name *reader;
+    BOOL bKnown;
+    HKEY hReaders;
+    DWORD i;
+
+    if(!szReaderName || !*szReaderName)
+        return SCARD_E_INVALID_VALUE;
+    InitOnceExecuteOnce(&reader_aliases_once, LoadReaderAliases, NULL, NULL);
+    EnsureReaderGroups();
+
+    AcquireSRWLockExclusive(&reader_aliases_lock);
+    bKnown = SetReaderAlias(szReaderName, NULL, 0);
+    ReleaseSRWLockExclusive(&reader_aliases_lock);
+
+    if((reader = LookupReaderW(szReaderName)))
     {
-        DWORD len = *pcchCards;
-        if(SCARD_AUTOALLOCATE == len)
-        {
-            if(!mszCards)
-                return SCARD_E_INVALID_PARAMETER;
-            else
-            {
-                /* allocate memory */
-                LPWSTR* pmszCards = (LPWSTR*) mszCards;
-                LPWSTR szResult = (LPWSTR) SCardAllocate(2*sizeof(WCHAR));
-                if(!szResult)
-                    return SCARD_E_NO_MEMORY;
-                szResult[0] = '\0';
-                szResult[1] = '\0';
-                *pcchCards = 2;
-                *pmszCards = szResult;
-            }
-        }
-        else
+        AcquireSRWLockExclusive(&reader_groups_lock);
+        for(i = 0; i < reader_groups_count; i++)
         {
-            if(len < 2)
-            {
-                *pcchCards = 2;
-                return SCARD_E_INSUFFICIENT_BUFFER;
-            }
-            else
-            {
-                /* return a empty multi string */
-                mszCards[0] = '\0';
-                mszCards[1] = '\0';
-                *pcchCards = 2;
-            }                
+            if(!IsMember(reader_groups[i].members, reader->id))
+                continue;
+            SetMember(&reader_groups[i], reader->id, FALSE);
+            bKnown = TRUE;
         }
+        ReleaseSRWLockExclusive(&reader_groups_lock);
     }
-    
-    return SCARD_S_SUCCESS;    
-}
-    
-LONG WINAPI SCardListInterfacesA(
-        SCARDCONTEXT hContext,
-        LPCSTR szCard,
-        LPGUID pguidInterfaces,
-        LPDWORD pcguidInterfaces)
-{
-    FIXME("0x%08X %s %p %p - stub\n",(unsigned int)hContext,debugstr_a(szCard),pguidInterfaces,pcguidInterfaces);
-    
-    return SCARD_E_UNKNOWN_CARD;
-}
 
-LONG WINAPI SCardListInterfacesW(
-        SCARDCONTEXT hContext,
-        LPCWSTR szCard,
-        LPGUID pguidInterfaces,
-        LPDWORD pcguidInterfaces)
-{    
-    FIXME("0x%08X %s %p %p - stub\n",(unsigned int)hContext,debugstr_w(szCard),pguidInterfaces,pcguidInterfaces);
-    
-    return SCARD_E_UNKNOWN_CARD;    
-}
-  
-LONG WINAPI SCardGetProviderIdA(
-    SCARDCONTEXT hContext,
-    LPCSTR szCard,
-    LPGUID pguidProviderId)
-{
-    FIXME("0x%08X %s %p - stub\n",(unsigned int)hContext,debugstr_a(szCard),pguidProviderId);
-    
-    if(!pguidProviderId)
-        return SCARD_E_INVALID_PARAMETER;
-    
-    return SCARD_E_UNKNOWN_CARD;
-}
-    
-LONG WINAPI SCardGetProviderIdW(
-    SCARDCONTEXT hContext,
-    LPCWSTR szCard,
-    LPGUID pguidProviderId)
-{
-    FIXME("0x%08X %s %p - stub\n",(unsigned int)hContext,debugstr_w(szCard),pguidProviderId);
-    
-    if(!pguidProviderId)
-        return SCARD_E_INVALID_PARAMETER;
-    
-    return SCARD_E_UNKNOWN_CARD;    
-}
-    
-LONG WINAPI SCardGetCardTypeProviderNameA(
-    SCARDCONTEXT hContext,
-    LPCSTR szCardName,
-    DWORD dwProviderId,
-    LPSTR szProvider,
-    LPDWORD pcchProvider)
-{
-    FIXME("0x%08X %s %#lx %p %p - stub\n",(unsigned int)hContext,debugstr_a(szCardName),dwProviderId,szProvider,pcchProvider);
-    
-    return SCARD_E_UNKNOWN_CARD;
-}
-    
-LONG WINAPI SCardGetCardTypeProviderNameW(
-    SCARDCONTEXT hContext,
-    LPCWSTR szCardName,
-    DWORD dwProviderId,
-    LPWSTR szProvider,
-    LPDWORD pcchProvider)
-{
-    FIXME("0x%08X %s %#lx %p %p - stub\n",(unsigned int)hContext,debugstr_w(szCardName),dwProviderId,szProvider,pcchProvider);
-    
-    return SCARD_E_UNKNOWN_CARD;    
+    if(!RegOpenKeyExW(HKEY_LOCAL_MACHINE, READERS_KEY, 0, KEY_ALL_ACCESS, &hReaders))
+    {
+        bKnown |= !RegDeleteTreeW(hReaders, szReaderName);
+        RegCloseKey(hReaders);
+    }
+    return bKnown ? SCARD_S_SUCCESS : SCARD_E_UNKNOWN_READER;
 }
 
-
 LONG WINAPI SCardIntroduceReaderGroupA(
     SCARDCONTEXT hContext,
     LPCSTR szGroupName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_a(szGroupName));
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    LPWSTR szGroupW;
+    LONG lRet;
+
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_a(szGroupName));
+
+    if((lRet = NameToWide(szGroupName, &szGroupW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = IntroduceReaderGroup(szGroupW);
+    SCardFree(szGroupW);
+    return lRet;
 }
     
 LONG WINAPI SCardIntroduceReaderGroupW(
     SCARDCONTEXT hContext,
     LPCWSTR szGroupName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_w(szGroupName));
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_w(szGroupName));
+
+    return IntroduceReaderGroup(szGroupName);
 }
 
 LONG WINAPI SCardForgetReaderGroupA(
     SCARDCONTEXT hContext,
     LPCSTR szGroupName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_a(szGroupName));
-    
-    return SCARD_S_SUCCESS;    
+    LPWSTR szGroupW;
+    LONG lRet;
+
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_a(szGroupName));
+
+    if((lRet = NameToWide(szGroupName, &szGroupW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = ForgetReaderGroup(szGroupW);
+    SCardFree(szGroupW);
+    return lRet;
 }
     
 LONG WINAPI SCardForgetReaderGroupW(
     SCARDCONTEXT hContext,
     LPCWSTR szGroupName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_w(szGroupName));
-    
-    return SCARD_S_SUCCESS;        
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_w(szGroupName));
+
+    return ForgetReaderGroup(szGroupName);
 }
 
 
@@ -499,9 +3806,20 @@ LONG WINAPI SCardIntroduceReaderA(
     LPCSTR szReaderName,
     LPCSTR szDeviceName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int)hContext,debugstr_a(szReaderName),debugstr_a(szDeviceName));
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    LPWSTR szReaderW, szDeviceW;
+    LONG lRet;
+
+    TRACE("0x%08X %s %s\n",(unsigned int)hContext,debugstr_a(szReaderName),debugstr_a(szDeviceName));
+
+    if((lRet = NameToWide(szReaderName, &szReaderW)) != SCARD_S_SUCCESS)
+        return lRet;
+    if((lRet = NameToWide(szDeviceName, &szDeviceW)) == SCARD_S_SUCCESS)
+    {
+        lRet = IntroduceReader(szReaderW, szDeviceW);
+        SCardFree(szDeviceW);
+    }
+    SCardFree(szReaderW);
+    return lRet;
 }
     
 LONG WINAPI SCardIntroduceReaderW(
@@ -509,18 +3827,25 @@ LONG WINAPI SCardIntroduceReaderW(
     LPCWSTR szReaderName,
     LPCWSTR szDeviceName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int)hContext,debugstr_w(szReaderName),debugstr_w(szDeviceName));
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %s %s\n",(unsigned int)hContext,debugstr_w(szReaderName),debugstr_w(szDeviceName));
+
+    return IntroduceReader(szReaderName, szDeviceName);
 }
 
 LONG WINAPI SCardForgetReaderA(
     SCARDCONTEXT hContext,
     LPCSTR szReaderName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_a(szReaderName));
-    
-    return SCARD_S_SUCCESS;        
+    LPWSTR szReaderW;
+    LONG lRet;
+
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_a(szReaderName));
+
+    if((lRet = NameToWide(szReaderName, &szReaderW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = ForgetReader(szReaderW);
+    SCardFree(szReaderW);
+    return lRet;
 }
 
 
@@ -528,9 +3853,26 @@ LONG WINAPI SCardForgetReaderW(
     SCARDCONTEXT hContext,
     LPCWSTR szReaderName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int)hContext,debugstr_w(szReaderName));
-    
-    return SCARD_S_SUCCESS;    
+    TRACE("0x%08X %s\n",(unsigned int)hContext,debugstr_w(szReaderName));
+
+    return ForgetReader(szReaderName);
+}
+
+/* SCardAddReaderToGroupA and SCardRemoveReaderFromGroupA */
+static LONG SetReaderGroupA(LPCSTR szReaderName, LPCSTR szGroupName, BOOL bMember)
+{
+    LPWSTR szReaderW, szGroupW;
+    LONG lRet;
+
+    if((lRet = NameToWide(szReaderName, &szReaderW)) != SCARD_S_SUCCESS)
+        return lRet;
+    if((lRet = NameToWide(szGroupName, &szGroupW)) == SCARD_S_SUCCESS)
+    {
+        lRet = SetReaderGroup(szReaderW, szGroupW, bMember);
+        SCardFree(szGroupW);
+    }
+    SCardFree(szReaderW);
+    return lRet;
 }
 
 LONG WINAPI SCardAddReaderToGroupA(
@@ -538,9 +3880,9 @@ LONG WINAPI SCardAddReaderToGroupA(
     LPCSTR szReaderName,
     LPCSTR szGroupName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int) hContext, debugstr_a( szReaderName), debugstr_a(szGroupName));
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    TRACE("0x%08X %s %s\n",(unsigned int) hContext, debugstr_a( szReaderName), debugstr_a(szGroupName));
+
+    return SetReaderGroupA(szReaderName, szGroupName, TRUE);
 }
     
 LONG WINAPI SCardAddReaderToGroupW(
@@ -548,9 +3890,9 @@ LONG WINAPI SCardAddReaderToGroupW(
     LPCWSTR szReaderName,
     LPCWSTR szGroupName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int) hContext, debugstr_w( szReaderName), debugstr_w(szGroupName));
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %s %s\n",(unsigned int) hContext, debugstr_w( szReaderName), debugstr_w(szGroupName));
+
+    return SetReaderGroup(szReaderName, szGroupName, TRUE);
 }
 
 LONG WINAPI SCardRemoveReaderFromGroupA(
@@ -558,9 +3900,9 @@ LONG WINAPI SCardRemoveReaderFromGroupA(
     LPCSTR szReaderName,
     LPCSTR szGroupName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int) hContext, debugstr_a( szReaderName), debugstr_a(szGroupName));
-    
-    return SCARD_S_SUCCESS;    
+    TRACE("0x%08X %s %s\n",(unsigned int) hContext, debugstr_a( szReaderName), debugstr_a(szGroupName));
+
+    return SetReaderGroupA(szReaderName, szGroupName, FALSE);
 }
     
 LONG WINAPI SCardRemoveReaderFromGroupW(
@@ -568,9 +3910,9 @@ LONG WINAPI SCardRemoveReaderFromGroupW(
     LPCWSTR szReaderName,
     LPCWSTR szGroupName)
 {
-    FIXME("0x%08X %s %s - stub\n",(unsigned int) hContext, debugstr_w( szReaderName), debugstr_w(szGroupName));
-    
-    return SCARD_S_SUCCESS;        
+    TRACE("0x%08X %s %s\n",(unsigned int) hContext, debugstr_w( szReaderName), debugstr_w(szGroupName));
+
+    return SetReaderGroup(szReaderName, szGroupName, FALSE);
 }
 
 
@@ -584,9 +3926,18 @@ LONG WINAPI SCardIntroduceCardTypeA(
     const BYTE* pbAtrMask,
     DWORD cbAtrLen)
 {
-    FIXME("0x%08X %s %p %p %#lx %p %p %#lx - stub\n",(unsigned int) hContext, debugstr_a(szCardName),pguidPrimaryProvider,rgguidInterfaces,dwInterfaceCount,pbAtr,pbAtrMask,cbAtrLen);
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    LPWSTR szCardW;
+    LONG lRet;
+
+    TRACE("0x%08X %s %p %p %#lx %p %p %#lx\n",(unsigned int) hContext, debugstr_a(szCardName),pguidPrimaryProvider,rgguidInterfaces,dwInterfaceCount,pbAtr,pbAtrMask,cbAtrLen);
+
+    if(!szCardName)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCardName, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = IntroduceCardType(szCardW, pguidPrimaryProvider, rgguidInterfaces, dwInterfaceCount, pbAtr, pbAtrMask, cbAtrLen);
+    SCardFree(szCardW);
+    return lRet;
 }
     
 LONG WINAPI SCardIntroduceCardTypeW(
@@ -599,9 +3950,9 @@ LONG WINAPI SCardIntroduceCardTypeW(
     const BYTE* pbAtrMask,
     DWORD cbAtrLen)
 {
-    FIXME("0x%08X %s %p %p %#lx %p %p %#lx - stub\n",(unsigned int) hContext, debugstr_w(szCardName),pguidPrimaryProvider,rgguidInterfaces,dwInterfaceCount,pbAtr,pbAtrMask,cbAtrLen);
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %s %p %p %#lx %p %p %#lx\n",(unsigned int) hContext, debugstr_w(szCardName),pguidPrimaryProvider,rgguidInterfaces,dwInterfaceCount,pbAtr,pbAtrMask,cbAtrLen);
+
+    return IntroduceCardType(szCardName, pguidPrimaryProvider, rgguidInterfaces, dwInterfaceCount, pbAtr, pbAtrMask, cbAtrLen);
 }
     
 
@@ -611,9 +3962,22 @@ LONG WINAPI SCardSetCardTypeProviderNameA(
     DWORD dwProviderId,
     LPCSTR szProvider)
 {
-    FIXME("0x%08X %s %#lx %s - stub\n",(unsigned int) hContext, debugstr_a(szCardName),dwProviderId,debugstr_a(szProvider));
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    LPWSTR szCardW, szProviderW;
+    LONG lRet;
+
+    TRACE("0x%08X %s %#lx %s\n",(unsigned int) hContext, debugstr_a(szCardName),dwProviderId,debugstr_a(szProvider));
+
+    if(!szCardName || !szProvider)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCardName, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    if((lRet = NameToWide(szProvider, &szProviderW)) == SCARD_S_SUCCESS)
+    {
+        lRet = SetCardTypeProviderName(szCardW, dwProviderId, szProviderW);
+        SCardFree(szProviderW);
+    }
+    SCardFree(szCardW);
+    return lRet;
 }
     
 LONG WINAPI SCardSetCardTypeProviderNameW(
@@ -622,27 +3986,36 @@ LONG WINAPI SCardSetCardTypeProviderNameW(
     DWORD dwProviderId,
     LPCWSTR szProvider)
 {
-    FIXME("0x%08X %s %#lx %s - stub\n",(unsigned int) hContext, debugstr_w(szCardName),dwProviderId,debugstr_w(szProvider));
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %s %#lx %s\n",(unsigned int) hContext, debugstr_w(szCardName),dwProviderId,debugstr_w(szProvider));
+
+    return SetCardTypeProviderName(szCardName, dwProviderId, szProvider);
 }
 
 LONG WINAPI SCardForgetCardTypeA(
     SCARDCONTEXT hContext,
     LPCSTR szCardName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int) hContext, debugstr_a(szCardName));
-    
-    return SCARD_E_UNKNOWN_CARD;
+    LPWSTR szCardW;
+    LONG lRet;
+
+    TRACE("0x%08X %s\n",(unsigned int) hContext, debugstr_a(szCardName));
+
+    if(!szCardName)
+        return SCARD_E_INVALID_PARAMETER;
+    if((lRet = NameToWide(szCardName, &szCardW)) != SCARD_S_SUCCESS)
+        return lRet;
+    lRet = ForgetCardType(szCardW);
+    SCardFree(szCardW);
+    return lRet;
 }
     
 LONG WINAPI SCardForgetCardTypeW(
     SCARDCONTEXT hContext,
     LPCWSTR szCardName)
 {
-    FIXME("0x%08X %s - stub\n",(unsigned int) hContext, debugstr_w(szCardName));
-    
-    return SCARD_E_UNKNOWN_CARD;    
+    TRACE("0x%08X %s\n",(unsigned int) hContext, debugstr_w(szCardName));
+
+    return ForgetCardType(szCardName);
 }
     
 LONG WINAPI SCardLocateCardsA(
@@ -651,9 +4024,9 @@ LONG WINAPI SCardLocateCardsA(
     LPSCARD_READERSTATEA rgReaderStates,
     DWORD cReaders)
 {
-    FIXME("0x%08X %s %p %#lx - stub\n",(unsigned int) hContext, debugstr_a(mszCards),rgReaderStates,cReaders);
-    
-    return SCARD_E_UNKNOWN_CARD;
+    TRACE("0x%08X %s %p %#lx\n",(unsigned int) hContext, debugstr_a(mszCards),rgReaderStates,cReaders);
+
+    return LocateCardTypes(hContext, mszCards, FALSE, rgReaderStates, cReaders);
 }
     
 LONG WINAPI SCardLocateCardsW(
@@ -662,9 +4035,33 @@ LONG WINAPI SCardLocateCardsW(
     LPSCARD_READERSTATEW rgReaderStates,
     DWORD cReaders)
 {
-    FIXME("0x%08X %s %p %#lx - stub\n",(unsigned int) hContext, debugstr_w(mszCards),rgReaderStates,cReaders);
-    
-    return SCARD_E_UNKNOWN_CARD;    
+    TRACE("0x%08X %s %p %#lx\n",(unsigned int) hContext, debugstr_w(mszCards),rgReaderStates,cReaders);
+
+    return LocateCardTypes(hContext, mszCards, TRUE, (LPSCARD_READERSTATEA) rgReaderStates, cReaders);
+}
+
+/* SCardLocateCardsByATR, each SCARD_ATRMASK gives a pattern */
+static LONG LocateCardsByAtr(SCARDCONTEXT hContext, const SCARD_ATRMASK *rgAtrMasks, DWORD cAtrs,
+    LPSCARD_READERSTATEA rgReaderStates, DWORD cReaders, BOOL bWide)
+{
+    struct atr_pattern stack_patterns[8], *patterns = stack_patterns;
+    DWORD i;
+    LONG lRet;
+
+    if(!rgAtrMasks && cAtrs)
+        return SCARD_E_INVALID_PARAMETER;
+    for(i = 0; i < cAtrs; i++)
+        if(!rgAtrMasks[i].cbAtr || rgAtrMasks[i].cbAtr > sizeof(rgAtrMasks[i].rgbAtr))
+            return SCARD_E_INVALID_PARAMETER;
+    if(cAtrs > ARRAY_SIZE(stack_patterns) && !(patterns = SCardAllocate(cAtrs * sizeof(*patterns))))
+        return SCARD_E_NO_MEMORY;
+    for(i = 0; i < cAtrs; i++)
+        MakeAtrPattern(&patterns[i], rgAtrMasks[i].rgbAtr, rgAtrMasks[i].rgbMask, rgAtrMasks[i].cbAtr);
+
+    lRet = LocateCards(hContext, patterns, cAtrs, rgReaderStates, cReaders, bWide);
+    if(patterns != stack_patterns)
+        SCardFree(patterns);
+    return lRet;
 }
 
 LONG WINAPI SCardLocateCardsByATRA(
@@ -674,9 +4071,9 @@ LONG WINAPI SCardLocateCardsByATRA(
     LPSCARD_READERSTATEA rgReaderStates,
     DWORD cReaders)
 {
-    FIXME("0x%08X %p %#lx %p %#lx - stub\n",(unsigned int) hContext, rgAtrMasks, cAtrs, rgReaderStates,  cReaders);
-    
-    return SCARD_F_UNKNOWN_ERROR;
+    TRACE("0x%08X %p %#lx %p %#lx\n",(unsigned int) hContext, rgAtrMasks, cAtrs, rgReaderStates,  cReaders);
+
+    return LocateCardsByAtr(hContext, rgAtrMasks, cAtrs, rgReaderStates, cReaders, FALSE);
 }
     
 LONG WINAPI SCardLocateCardsByATRW(
@@ -686,9 +4083,9 @@ LONG WINAPI SCardLocateCardsByATRW(
     LPSCARD_READERSTATEW rgReaderStates,
     DWORD cReaders)
 {
-    FIXME("0x%08X %p %#lx %p %#lx - stub\n",(unsigned int) hContext, rgAtrMasks, cAtrs, rgReaderStates,  cReaders);
-    
-    return SCARD_F_UNKNOWN_ERROR;    
+    TRACE("0x%08X %p %#lx %p %#lx\n",(unsigned int) hContext, rgAtrMasks, cAtrs, rgReaderStates,  cReaders);
+
+    return LocateCardsByAtr(hContext, rgAtrMasks, cAtrs, (LPSCARD_READERSTATEA) rgReaderStates, cReaders, TRUE);
 }
 
 LONG WINAPI SCardListReaderGroupsA(
@@ -696,6 +4093,7 @@ LONG WINAPI SCardListReaderGroupsA(
         LPSTR mszGroups, 
         LPDWORD pcchGroups)
 {    
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardListReaderGroupsA);
     LONG lRet = SCARD_F_UNKNOWN_ERROR;
     DWORD_LITE len ;
     struct SCardListReaderGroups_params params;
@@ -704,60 +4102,29 @@ LONG WINAPI SCardListReaderGroupsA(
     
     if(!pcchGroups)
         lRet = SCARD_E_INVALID_PARAMETER;
-    else if(mszGroups && *pcchGroups == SCARD_AUTOALLOCATE)
+    else
     {
-        LPSTR* pmszGroups = (LPSTR*) mszGroups;
-        LPSTR szList = NULL;
-        len = 0;
-        
-        /* ask for the length */
-        params.hContext = hContext;
-        params.mszGroups = NULL;
-        params.pcchGroups = &len;
-        lRet = WINSCARD_CALL( SCardListReaderGroups, &params );
+        LPBYTE pbList = NULL;
 
+        params.hContext = hContext;
+        lRet = AllocateAndFill(FillReaderGroups, &params, &groups_size_hint, &pbList, &len);
         if(SCARD_S_SUCCESS == lRet)
         {
-            /* allocate memory for the list */
-            szList = (LPSTR) SCardAllocate((DWORD) len);
-            if(!szList)
+            /* pcsc-lite only knows SCard$DefaultReaders, add the groups kept here */
+            DWORD cchList;
+            LPSTR mszList = AddLocalGroups((LPCSTR) pbList, &cchList);
+            if(!mszList)
                 lRet = SCARD_E_NO_MEMORY;
             else
             {
-                /* fill the list */
-                params.hContext = hContext;
-                params.mszGroups = szList;
-                params.pcchGroups = &len;
-                lRet = WINSCARD_CALL( SCardListReaderGroups, &params );
-                if(SCARD_S_SUCCESS != lRet)
-                    SCardFree(szList);
-                else
-                {
-                    *pmszGroups = szList;
-                    *pcchGroups = (DWORD) len;        
-                }
+                lRet = CopyCachedList(mszList, cchList, sizeof(CHAR), mszGroups, pcchGroups);
+                SCardFree(mszList);
             }
-        }  
-    }
-    else
-    {
-        params.hContext = hContext;
-        params.mszGroups = mszGroups;
-
-        if (pcchGroups)
-        {
-            len = *pcchGroups;
-            params.pcchGroups = &len;
-        } 
-        else 
-            params.pcchGroups = NULL;
-
-        lRet = WINSCARD_CALL( SCardListReaderGroups, &params );
-        if (pcchGroups)
-            *pcchGroups = len;
+            SCardFree(pbList);
+        }
     }
     
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
         
 LONG WINAPI SCardListReaderGroupsW(
@@ -765,6 +4132,7 @@ LONG WINAPI SCardListReaderGroupsW(
         LPWSTR mszGroups, 
         LPDWORD pcchGroups)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardListReaderGroupsW);
     LONG lRet = SCARD_F_UNKNOWN_ERROR;
     LPSTR szList = NULL;
     LPWSTR szListW = NULL;
@@ -833,7 +4201,7 @@ LONG WINAPI SCardListReaderGroupsW(
 end_label:    
     if(szListW)
         SCardFree(szListW);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
     
 }
 
@@ -843,40 +4211,27 @@ LONG WINAPI SCardListReadersA(
         LPSTR mszReaders, 
         LPDWORD pcchReaders)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardListReadersA);
     LONG lRet;
     TRACE("0x%p %s %s %ld\n",(void*)hContext, debugstr_a(mszGroups), debugstr_a(mszReaders), (pcchReaders==NULL?0:*pcchReaders));
     if(!pcchReaders)
-        lRet = SCARD_E_INVALID_PARAMETER;    
-    else if(mszReaders && SCARD_AUTOALLOCATE == *pcchReaders)
-    {
-        /* get list from pcsc-lite */
-        LPSTR* pmszReaders = (LPSTR*) mszReaders;
-        LPSTR szList = NULL;
-        DWORD_LITE dwListLength = 0;
-        struct SCardListReaders_params params = { hContext, mszGroups, NULL, &dwListLength };
-        lRet = WINSCARD_CALL( SCardListReaders, &params );
-
-        if(SCARD_S_SUCCESS != lRet && lRet != SCARD_E_INSUFFICIENT_BUFFER)
-            goto end_label;
-        
-        szList = (LPSTR)SCardAllocate((DWORD) dwListLength);
-        if(!szList)
-        {
-            lRet = SCARD_E_NO_MEMORY;
-            goto end_label;
-        }
-        
-        params.hContext = hContext;
-        params.mszReaders = szList;
-        params.pcchReaders = &dwListLength;
-
-        lRet = WINSCARD_CALL( SCardListReaders, &params );
-
-        if(SCARD_S_SUCCESS != lRet)
-            SCardFree(szList);
-        else
+        lRet = SCARD_E_INVALID_PARAMETER;    
+    else if(!IsAllReadersGroupA(mszGroups))
+        lRet = ListGroupReaders(hContext, mszGroups, FALSE, mszReaders, pcchReaders);
+    else if(ReaderCacheGetA(hContext, mszGroups, mszReaders, pcchReaders, &lRet))
+        TRACE(" answered from the reader cache\n");
+    else if(mszReaders && SCARD_AUTOALLOCATE == *pcchReaders)
+    {
+        /* get list from pcsc-lite */
+        LPSTR* pmszReaders = (LPSTR*) mszReaders;
+        LPBYTE pbList = NULL;
+        DWORD_LITE dwListLength = 0;
+        struct SCardListReaders_params params = { hContext, mszGroups, NULL, NULL };
+        lRet = AllocateAndFill(FillReaders, &params, &readers_size_hint, &pbList, &dwListLength);
+        if(SCARD_S_SUCCESS == lRet)
         {
-            *pmszReaders = szList;
+            InternReaderList((LPCSTR) pbList);
+            *pmszReaders = (LPSTR) pbList;
             *pcchReaders = dwListLength;
         }
     }
@@ -889,14 +4244,15 @@ LONG WINAPI SCardListReadersA(
             params.pcchReaders = &dwListLength;
             lRet = WINSCARD_CALL( SCardListReaders, &params );
             *pcchReaders = dwListLength;
+            if(SCARD_S_SUCCESS == lRet)
+                InternReaderList(mszReaders);
         }
         else
             lRet = WINSCARD_CALL( SCardListReaders, &params );        
     }
     
-end_label:
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardListReadersW(
@@ -905,6 +4261,7 @@ LONG WINAPI SCardListReadersW(
         LPWSTR mszReaders, 
         LPDWORD pcchReaders)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardListReadersW);
     LONG lRet;
     TRACE("0x%p %s %s %p\n",(void*) hContext,debugstr_w(mszGroups),debugstr_w(mszReaders),pcchReaders);
 
@@ -912,6 +4269,10 @@ LONG WINAPI SCardListReadersW(
         lRet = SCARD_E_INVALID_PARAMETER;
     // else if(!liteSCardListReaders)
     //     lRet = SCARD_F_INTERNAL_ERROR;
+    else if(!IsAllReadersGroupW(mszGroups))
+        lRet = ListGroupReaders(hContext, mszGroups, TRUE, mszReaders, pcchReaders);
+    else if(ReaderCacheGetW(hContext, mszGroups, mszReaders, pcchReaders, &lRet))
+        TRACE(" answered from the reader cache\n");
     else
     {
         /* call the ANSI version */
@@ -983,7 +4344,7 @@ LONG WINAPI SCardListReadersW(
             SCardFree(szListW);
     }
 end_label:    
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 /*
@@ -991,6 +4352,7 @@ end_label:
  */
 LONG WINAPI SCardEstablishContext(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2, LPSCARDCONTEXT phContext)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardEstablishContext);
     LONG lRet;
     struct SCardEstablishContext_params params = { dwScope, pvReserved1, pvReserved2, phContext};
     TRACE("%#lx %p %p %p\n",dwScope,pvReserved1,pvReserved2,phContext);
@@ -998,30 +4360,45 @@ LONG WINAPI SCardEstablishContext(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pv
     if(!phContext)
         lRet = SCARD_E_INVALID_PARAMETER;
     else
+    {
         lRet = WINSCARD_CALL( SCardEstablishContext, &params );
+        if(lRet == SCARD_S_SUCCESS && context_add(*phContext))
+            InterlockedIncrement(&context_count);
+    }
 
     TRACE("returned %#lx  hContext %p\n", lRet, (void*)*params.phContext);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardReleaseContext(SCARDCONTEXT hContext)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardReleaseContext);
     LONG lRet;
+    BOOL bLast = FALSE;
     struct SCardReleaseContext_params params = { hContext };
     TRACE("0x%p\n", (void*)hContext);
 
+    if(context_remove(hContext) && (bLast = !InterlockedDecrement(&context_count)))
+        StopCacheWatch();
     lRet = WINSCARD_CALL( SCardReleaseContext, &params );
 
+    /* the end of the session for most applications */
+    if(bLast && stats_enabled)
+        StatsDump(stats_file);
+    if(bLast && profile_enabled)
+        ProfileDump(profile_file);
+
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardIsValidContext(SCARDCONTEXT hContext)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardIsValidContext);
     struct SCardIsValidContext_params params = { hContext };
     TRACE("0x%p\n", (void*)hContext);
 
-    return TranslateToWin32(WINSCARD_CALL( SCardIsValidContext, &params ));
+    return ProfileLeave(&profile_frame, TranslateToWin32(WINSCARD_CALL( SCardIsValidContext, &params )));
 }
 
 LONG WINAPI SCardConnectA(SCARDCONTEXT hContext,
@@ -1031,13 +4408,17 @@ LONG WINAPI SCardConnectA(SCARDCONTEXT hContext,
                         LPSCARDHANDLE phCard, 
                         LPDWORD pdwActiveProtocol)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardConnectA);
     LONG lRet;
     struct SCardConnect_params params = { hContext, szReader, dwShareMode, dwPreferredProtocols, phCard, NULL };
+    const struct reader_name *name;
     TRACE(" 0x%08X %s %#lx %#lx %p %p\n",(unsigned int) hContext,debugstr_a(szReader),dwShareMode,dwPreferredProtocols,phCard,pdwActiveProtocol);
     if(!szReader || !phCard || !pdwActiveProtocol)
         lRet = SCARD_E_INVALID_PARAMETER;
     else
     {
+        params.szReader = szReader = ResolveReaderA(hContext, szReader);
+
         /* the value of SCARD_PROTOCOL_RAW is different between MS implementation and
          * pcsc-lite implementation. We must change its value
          */
@@ -1065,12 +4446,14 @@ LONG WINAPI SCardConnectA(SCARDCONTEXT hContext,
                 *pdwActiveProtocol ^= PCSCLITE_SCARD_PROTOCOL_RAW;
                 *pdwActiveProtocol |= SCARD_PROTOCOL_RAW;
             }
-            
+            /* pcsc-lite knows the reader, its name can be interned */
+            name = InternReaderA(szReader);
+            handle_set_connected(hContext, *phCard, name ? name->id : 0, dwShareMode, *pdwActiveProtocol);
         }
     }
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
                         
 LONG WINAPI SCardConnectW(SCARDCONTEXT hContext,
@@ -1080,6 +4463,7 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext,
                         LPSCARDHANDLE phCard, 
                         LPDWORD pdwActiveProtocol)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardConnectW);
     LONG lRet;
     struct SCardConnect_params params = { hContext, NULL, dwShareMode, dwPreferredProtocols, phCard, NULL};
     TRACE(" 0x%08X %s %#lx %#lx %p %p\n",(unsigned int) hContext,debugstr_w(szReader),dwShareMode,dwPreferredProtocols,phCard,pdwActiveProtocol);    
@@ -1088,26 +4472,33 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext,
     else
     {
         LPSTR szReaderA = NULL;
-        int dwLen = WideCharToMultiByte(CP_ACP,0,szReader,-1,NULL,0,NULL,NULL);
-        if(!dwLen)
-        {
-            lRet = SCARD_F_UNKNOWN_ERROR;
-            goto end_label;
-        }
-        
-        szReaderA = (LPSTR) SCardAllocate(dwLen);
-        if(!szReaderA)
-        {
-            lRet = SCARD_E_NO_MEMORY;
-            goto end_label;
-        }
-        
-        dwLen = WideCharToMultiByte(CP_ACP,0,szReader,-1,szReaderA,dwLen,NULL,NULL);
-        if(!dwLen)
+        const struct reader_name *name = ResolveReaderW(hContext, szReader);
+        if(name)
+            params.szReader = name->szA;
+        else
         {
-            SCardFree(szReaderA);
-            lRet = SCARD_F_UNKNOWN_ERROR;
-            goto end_label;
+            int dwLen = WideCharToMultiByte(CP_ACP,0,szReader,-1,NULL,0,NULL,NULL);
+            if(!dwLen)
+            {
+                lRet = SCARD_F_UNKNOWN_ERROR;
+                goto end_label;
+            }
+            
+            szReaderA = (LPSTR) SCardAllocate(dwLen);
+            if(!szReaderA)
+            {
+                lRet = SCARD_E_NO_MEMORY;
+                goto end_label;
+            }
+            
+            dwLen = WideCharToMultiByte(CP_ACP,0,szReader,-1,szReaderA,dwLen,NULL,NULL);
+            if(!dwLen)
+            {
+                SCardFree(szReaderA);
+                lRet = SCARD_F_UNKNOWN_ERROR;
+                goto end_label;
+            }
+            params.szReader = szReaderA;
         }
         
         /* the value of SCARD_PROTOCOL_RAW is different between MS implementation and
@@ -1120,7 +4511,6 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext,
             params.dwPreferredProtocols = dwPreferredProtocols;
         }
 
-        params.szReader = szReaderA;
         if (pdwActiveProtocol)
         {
             DWORD_LITE dwProtocol = *pdwActiveProtocol;
@@ -1137,15 +4527,19 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext,
             {
                 *pdwActiveProtocol ^= PCSCLITE_SCARD_PROTOCOL_RAW;
                 *pdwActiveProtocol |= SCARD_PROTOCOL_RAW;
-            }            
+            }
+            if(!name)
+                name = InternReaderA(params.szReader);
+            handle_set_connected(hContext, *phCard, name ? name->id : 0, dwShareMode, *pdwActiveProtocol);
         }
         
         /* free the allocate ANSI string */
-        SCardFree(szReaderA);
+        if(szReaderA)
+            SCardFree(szReaderA);
     }        
 end_label:    
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);    
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardReconnect(SCARDHANDLE hCard,
@@ -1154,6 +4548,7 @@ LONG WINAPI SCardReconnect(SCARDHANDLE hCard,
                         DWORD dwInitialization, 
                         LPDWORD pdwActiveProtocol)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardReconnect);
     LONG lRet;
     struct SCardReconnect_params params = { hCard, dwShareMode, dwPreferredProtocols, dwInitialization, NULL};
     TRACE(" 0x%08X %#lx %#lx %#lx %p\n",(unsigned int) hCard,dwShareMode,dwPreferredProtocols,dwInitialization,pdwActiveProtocol);
@@ -1188,28 +4583,35 @@ LONG WINAPI SCardReconnect(SCARDHANDLE hCard,
             {
                 *pdwActiveProtocol ^= PCSCLITE_SCARD_PROTOCOL_RAW;
                 *pdwActiveProtocol |= SCARD_PROTOCOL_RAW;
-            }            
-        }        
+            }
+            handle_set_reconnected(hCard, dwShareMode, *pdwActiveProtocol);
+        }
+        else
+            handle_check_result(hCard, lRet);
     }
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardDisconnect);
     LONG lRet;
     struct SCardDisconnect_params params = { hCard, dwDisposition};
     TRACE(" 0x%08X %#lx\n",(unsigned int) hCard,dwDisposition);
 
     lRet = WINSCARD_CALL( SCardDisconnect, &params );
+    if(SCARD_S_SUCCESS == lRet || SCARD_E_INVALID_HANDLE == lRet)
+        handle_remove(hCard);
 
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardBeginTransaction(SCARDHANDLE hCard)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardBeginTransaction);
     LONG lRet;
     struct SCardBeginTransaction_params params = { hCard };
     TRACE(" 0x%08X\n",(unsigned int) hCard);
@@ -1217,19 +4619,50 @@ LONG WINAPI SCardBeginTransaction(SCARDHANDLE hCard)
     lRet = WINSCARD_CALL( SCardBeginTransaction, &params );
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 {    
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardEndTransaction);
     LONG lRet;
     struct SCardEndTransaction_params params = { hCard, dwDisposition };
     TRACE(" 0x%08X %#lx\n",(unsigned int) hCard,dwDisposition);
     
     lRet = WINSCARD_CALL( SCardEndTransaction, &params );
+    if(dwDisposition == SCARD_RESET_CARD || dwDisposition == SCARD_UNPOWER_CARD)
+        handle_set_protocol(hCard, 0);
+    else
+        handle_check_result(hCard, lRet);
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
+}
+
+/* start the watch thread the card state cache relies on, TRUE once it is running */
+static BOOL StatusCacheActive(void)
+{
+    return status_max_age && CacheWatchActive();
+}
+
+static BOOL StatusIsFresh(const struct handle_entry *entry, ULONGLONG ullNow)
+{
+    return entry->dwState && entry->dwReaderId && entry->lReaderSerial
+        && entry->lReaderSerial == ReadAcquire(&reader_state_serial[entry->dwReaderId - 1])
+        && ullNow - entry->ullStatusTime <= status_max_age;
+}
+
+/* answer SCardStatusA from the handles registry */
+static LONG StatusFromEntry(const struct handle_entry *entry, const struct reader_name *name,
+    LPSTR mszReaderNames, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol,
+    LPBYTE pbAtr, LPDWORD pcbAtrLen)
+{
+    LONG lRet = CopyCachedList(name->szA, name->cchA + 1, sizeof(CHAR), mszReaderNames, pcchReaderLen);
+    *pdwState = entry->dwState;
+    *pdwProtocol = entry->dwProtocol;
+    if(lRet != SCARD_S_SUCCESS)
+        return lRet;
+    return CopyCachedList(entry->rgbAtr, entry->cbAtr, 1, pbAtr, pcbAtrLen);
 }
 
 LONG WINAPI SCardState(
@@ -1240,19 +4673,26 @@ LONG WINAPI SCardState(
     LPDWORD pcbAtrLen)
 {
     LONG lRet ;
-    LPSTR szName = NULL;
-    DWORD cchReaderLen = SCARD_AUTOALLOCATE;
+    DWORD cchReaderLen = 0;
     TRACE(" 0x%08X %p %p %p %p\n",(unsigned int) hCard,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
-    lRet = SCardStatusA(hCard,(LPSTR) &szName,&cchReaderLen,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
-    
-    /* free szName is allocated by SCardStatusA */
-    if(szName)
-        SCardFree((void*) szName);
+    /* only the length of the reader name is asked, nothing to allocate */
+    lRet = SCardStatusA(hCard,NULL,&cchReaderLen,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
     
     TRACE(" returned %#lx\n",lRet);
     return TranslateToWin32(lRet);    
 }
 
+/*
+ * Wine extension: make the next SCardStatus or SCardState call for hCard,
+ * or for every handle when it is 0, ask pcsc-lite instead of the card state cache
+ */
+LONG WINAPI SCardFlushStatus(SCARDHANDLE hCard)
+{
+    TRACE(" 0x%08X\n",(unsigned int) hCard);
+    handle_flush_status(hCard);
+    return SCARD_S_SUCCESS;
+}
+
 LONG WINAPI SCardStatusA(
         SCARDHANDLE hCard,
         LPSTR mszReaderNames, 
@@ -1262,6 +4702,7 @@ LONG WINAPI SCardStatusA(
         LPBYTE pbAtr, 
         LPDWORD pcbAtrLen)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardStatusA);
     LONG lRet;
     struct SCardStatus_params params;
     TRACE(" 0x%08X %p %p %p %p %p %p\n",(unsigned int) hCard,mszReaderNames,pcchReaderLen,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
@@ -1272,6 +4713,22 @@ LONG WINAPI SCardStatusA(
         DWORD_LITE dwNameLen = 0,dwAtrLen=MAX_ATR_SIZE, dwState, dwProtocol = 0;
         LPDWORD_LITE pdwStateLite = NULL, pdwProtocolLite = NULL, pdwNameLenLite = NULL, pdwAtrLenLite = NULL;
         BYTE atr[MAX_ATR_SIZE];
+        ULONGLONG ullTime = GetTickCount64();
+        LONG lReaderSerial = 0;
+        const struct reader_name *name;
+        struct handle_entry entry;
+
+        if(StatusCacheActive() && handle_lookup(hCard, HANDLE_CARD, &entry))
+        {
+            if(StatusIsFresh(&entry, ullTime) && (name = ReaderNameById(entry.dwReaderId)))
+            {
+                lRet = StatusFromEntry(&entry, name, mszReaderNames, pcchReaderLen, pdwState, pdwProtocol, pbAtr, pcbAtrLen);
+                goto end_label;
+            }
+            /* taken before asking pcsc-lite, so that a change while it answers isn't missed */
+            if(entry.dwReaderId)
+                lReaderSerial = ReadAcquire(&reader_state_serial[entry.dwReaderId - 1]);
+        }
         if (pdwState)
         {
             dwState = *pdwState;
@@ -1285,19 +4742,29 @@ LONG WINAPI SCardStatusA(
         if(!mszReaderNames || !pbAtr 
             || (*pcchReaderLen == SCARD_AUTOALLOCATE) || (*pcbAtrLen == SCARD_AUTOALLOCATE))
         {
-            /* retreive the information from pcsc-lite */
+            /* retreive the information from pcsc-lite in a single call */
             BOOL bHasAutoAllocated = FALSE;            
             LPSTR szNames = NULL;
             
             params.hCard = hCard;
-            params.mszReaderName = NULL;
-            params.pcchReaderLen = &dwNameLen;
             params.pdwState = pdwStateLite;
             params.pdwProtocol = pdwProtocolLite;
             params.pbAtr = atr;
             params.pcbAtrLen = &dwAtrLen;
 
-            lRet = WINSCARD_CALL( SCardStatus, &params );
+            if(mszReaderNames && *pcchReaderLen == SCARD_AUTOALLOCATE)
+            {
+                lRet = AllocateAndFill(FillStatus, &params, &status_size_hint, (LPBYTE*) &szNames, &dwNameLen);
+                bHasAutoAllocated = (lRet == SCARD_S_SUCCESS)? TRUE : FALSE;
+            }
+            else
+            {
+                if(mszReaderNames)
+                    dwNameLen = *pcchReaderLen;
+                params.mszReaderName = mszReaderNames;
+                params.pcchReaderLen = &dwNameLen;
+                lRet = WINSCARD_CALL( SCardStatus, &params );
+            }
             if (pdwState)
             {
                 *pdwState = (DWORD) dwState;
@@ -1307,7 +4774,15 @@ LONG WINAPI SCardStatusA(
                 *pdwProtocol = lite_proto2ms_proto(dwProtocol);
             }
             if(lRet != SCARD_S_SUCCESS && lRet != SCARD_E_INSUFFICIENT_BUFFER)
+            {
+                handle_check_result(hCard, lRet);
                 goto end_label;
+            }
+            if(lRet == SCARD_S_SUCCESS)
+                handle_set_status(hCard, (DWORD) dwState, lite_proto2ms_proto(dwProtocol), atr, dwAtrLen,
+                    lReaderSerial, ullTime);
+            else if(dwProtocol)
+                handle_set_protocol(hCard, lite_proto2ms_proto(dwProtocol));
             
             /* case 1: asking for reader names length */
             if(!mszReaderNames)
@@ -1338,32 +4813,9 @@ LONG WINAPI SCardStatusA(
             }
             
             /* case 2: reader names pointer provided but its length is unsufficient */
-            if(*pcchReaderLen < dwNameLen)
+            if(lRet == SCARD_E_INSUFFICIENT_BUFFER)
             {
                 *pcchReaderLen = (DWORD) dwNameLen;
-                lRet = SCARD_E_INSUFFICIENT_BUFFER;
-                goto end_label;
-            }
-            
-            bHasAutoAllocated = (*pcchReaderLen == SCARD_AUTOALLOCATE)? TRUE : FALSE;
-            if(bHasAutoAllocated)            
-                szNames = (LPSTR) SCardAllocate(dwNameLen);
-            else
-                szNames = mszReaderNames;
-            
-            params.hCard = hCard;
-            params.mszReaderName = szNames;
-            params.pcchReaderLen = &dwNameLen;
-            params.pdwState = pdwStateLite;
-            params.pdwProtocol = pdwProtocolLite;
-            params.pbAtr = atr;
-            params.pcbAtrLen = &dwAtrLen;
-
-            lRet = WINSCARD_CALL( SCardStatus, &params );
-            if(lRet != SCARD_S_SUCCESS)
-            {
-                if(bHasAutoAllocated)
-                    SCardFree(szNames);
                 goto end_label;
             }
             
@@ -1442,12 +4894,17 @@ LONG WINAPI SCardStatusA(
             {
                 *pcbAtrLen = dwAtrLen;
             }
+            if(lRet == SCARD_S_SUCCESS)
+                handle_set_status(hCard, (DWORD) dwState, lite_proto2ms_proto(dwProtocol), pbAtr, dwAtrLen,
+                    lReaderSerial, ullTime);
+            else
+                handle_check_result(hCard, lRet);
         }
     }
     
 end_label:    
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
         
 LONG WINAPI SCardStatusW(
@@ -1459,27 +4916,40 @@ LONG WINAPI SCardStatusW(
         LPBYTE pbAtr, 
         LPDWORD pcbAtrLen)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardStatusW);
     LONG lRet;
     TRACE(" 0x%08X %p %p %p %p %p %p\n",(unsigned int) hCard,mszReaderNames,pcchReaderLen,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
     if(!pcchReaderLen || !pdwState || !pdwProtocol || !pcbAtrLen)
         lRet = SCARD_E_INVALID_PARAMETER;
     else
     {    
-        /* call the ANSI version with SCARD_AUTOALLOCATE */
-        LPSTR mszReaderNamesA = NULL;
-        DWORD dwAnsiNamesLength = SCARD_AUTOALLOCATE;
-        lRet = SCardStatusA(hCard,(LPSTR) &mszReaderNamesA,&dwAnsiNamesLength,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
-        if(lRet == SCARD_S_SUCCESS)
+        /* call the ANSI version, the name usually fits in a local buffer */
+        CHAR szNamesBuffer[256];
+        LPSTR mszReaderNamesA = szNamesBuffer;
+        DWORD dwAnsiNamesLength = sizeof(szNamesBuffer);
+        const struct reader_name *name;
+        lRet = SCardStatusA(hCard,mszReaderNamesA,&dwAnsiNamesLength,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
+        if(lRet == SCARD_E_INSUFFICIENT_BUFFER)
+        {
+            mszReaderNamesA = NULL;
+            dwAnsiNamesLength = SCARD_AUTOALLOCATE;
+            lRet = SCardStatusA(hCard,(LPSTR) &mszReaderNamesA,&dwAnsiNamesLength,pdwState,pdwProtocol,pbAtr,pcbAtrLen);
+        }
+        if(lRet != SCARD_S_SUCCESS)
+            ;
+        else if(mszReaderNamesA && (name = LookupReaderA(mszReaderNamesA))
+            && !mszReaderNamesA[name->cchA])
+        {
+            /* a single reader, use its interned wide-char form */
+            lRet = CopyCachedList(name->szW, name->cchW + 1, sizeof(WCHAR), mszReaderNames, pcchReaderLen);
+        }
+        else
         {
             /* convert mszReaderNamesA to a wide char multi-string */
             LPWSTR mszWideNamesList = NULL;
             DWORD dwWideNamesLength = 0;
             lRet = ConvertListToWideChar(mszReaderNamesA,&mszWideNamesList,&dwWideNamesLength);
             
-            /* no more needed */
-            if(mszReaderNamesA)
-                    SCardFree(mszReaderNamesA);
-            
             if(lRet == SCARD_S_SUCCESS)
             {
                 if(!mszReaderNames)
@@ -1499,17 +4969,82 @@ LONG WINAPI SCardStatusW(
                 else
                 {
                     *pcchReaderLen = dwWideNamesLength;
-                    memcpy(mszReaderNames,mszWideNamesList,dwWideNamesLength);
+                    memcpy(mszReaderNames,mszWideNamesList,dwWideNamesLength * sizeof(WCHAR));
                 }
             }
             
             if(mszWideNamesList)
                 SCardFree(mszWideNamesList);    
         }
+        
+        /* no more needed */
+        if(mszReaderNamesA && mszReaderNamesA != szNamesBuffer)
+            SCardFree(mszReaderNamesA);
     }
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
+}
+
+/*
+ * SCardGetStatusChange marshalling.
+ * The pcsc-lite states and, for the wide-char version, the ANSI reader names
+ * are built in a single block, taken from the stack when it is small enough,
+ * and the results are copied back once to the caller array
+ */
+#define STATES_STACK_SIZE 4096
+
+static void StateToLite(LPSCARD_READERSTATE_LITE pState, LPCSTR szReader, DWORD dwTimeout,
+        LPVOID pvUserData, DWORD dwCurrentState, DWORD dwEventState, DWORD cbAtr, const BYTE *rgbAtr)
+{
+    memset(pState,0,sizeof(*pState));
+    pState->szReader = szReader;
+    pState->pvUserData = pvUserData;
+    /* in pcsclite, dwTimeout = 0 is equivalent to dwTimeout = INFINITE
+     * In Windows, dwTimeout = 0 means return immediately
+     * We will simulate an immediate return by asking for the current state
+     * and comparing it with the caller one afterwards
+     */
+    if(dwTimeout)
+    {
+        pState->dwCurrentState = dwCurrentState;
+        pState->dwEventState = dwEventState;
+        pState->cbAtr = min (MAX_ATR_SIZE, cbAtr);
+        memcpy(pState->rgbAtr,rgbAtr,pState->cbAtr);
+    }
+}
+
+/* returns TRUE when the state differs from the one given by the caller */
+static BOOL StateFromLite(const SCARD_READERSTATE_LITE *pState, DWORD dwTimeout,
+        DWORD dwCurrentState, LPDWORD pdwEventState, LPDWORD pcbAtr, LPBYTE rgbAtr, DWORD cbMaxAtr)
+{
+    BOOL bStateChanges = TRUE;
+    *pcbAtr = pState->cbAtr;
+    memcpy(rgbAtr,pState->rgbAtr,min (pState->cbAtr, cbMaxAtr));
+    if(dwTimeout)
+        *pdwEventState = pState->dwEventState;
+    else
+    {
+        DWORD dwState = pState->dwEventState & (~SCARD_STATE_CHANGED);
+        if(dwState != dwCurrentState)
+            *pdwEventState = pState->dwEventState;
+        else
+        {
+            *pdwEventState = dwState;
+            bStateChanges = FALSE;
+        }
+    }
+    return bStateChanges;
+}
+
+static LONG GetStatusChangeLite(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE_LITE pStates, DWORD cReaders)
+{
+    struct SCardGetStatusChange_params params;
+    params.hContext = hContext;
+    params.dwTimeout = dwTimeout;
+    params.rgReaderStates = pStates;
+    params.cReaders = cReaders;
+    return WINSCARD_CALL( SCardGetStatusChange, &params );
 }
 
 LONG WINAPI SCardGetStatusChangeA(
@@ -1518,8 +5053,8 @@ LONG WINAPI SCardGetStatusChangeA(
         LPSCARD_READERSTATEA rgReaderStates, 
         DWORD cReaders)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardGetStatusChangeA);
     LONG lRet;
-    struct SCardGetStatusChange_params params; 
     TRACE(" 0x%08X %#lx %p %#lx\n",(unsigned int) hContext, dwTimeout,rgReaderStates,cReaders);
     if(!rgReaderStates && cReaders)
         lRet =  SCARD_E_INVALID_PARAMETER;
@@ -1529,82 +5064,41 @@ LONG WINAPI SCardGetStatusChangeA(
     }
     else
     {
-        DWORD i;
-        LPSCARD_READERSTATE_LITE pStates = (LPSCARD_READERSTATE_LITE) SCardAllocate(cReaders * sizeof(SCARD_READERSTATE_LITE));
-        memset(pStates,0,cReaders * sizeof(SCARD_READERSTATE_LITE));
+        ULONGLONG buffer[STATES_STACK_SIZE / sizeof(ULONGLONG)];
+        DWORD i, cbStates = cReaders * sizeof(SCARD_READERSTATE_LITE);
+        LPSCARD_READERSTATE_LITE pStates;
+        BOOL bStateChanges = FALSE;
+
+        if(cbStates <= sizeof(buffer))
+            pStates = (LPSCARD_READERSTATE_LITE) buffer;
+        else if(!(pStates = (LPSCARD_READERSTATE_LITE) SCardAllocate(cbStates)))
+            return ProfileLeave(&profile_frame, SCARD_E_NO_MEMORY);
+
         for(i=0;i<cReaders;i++)
-        {
-            pStates[i].szReader = rgReaderStates[i].szReader;
-            pStates[i].pvUserData = rgReaderStates[i].pvUserData;
-        }
+            StateToLite(&pStates[i], ResolveReaderA(hContext, rgReaderStates[i].szReader), dwTimeout, rgReaderStates[i].pvUserData,
+                rgReaderStates[i].dwCurrentState, rgReaderStates[i].dwEventState,
+                rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
 
-        /* in pcsclite, dwTimeout = 0 is equivalent to dwTimeout = INFINITE
-         * In Windows, dwTimeout = 0 means return immediately
-         * We will simulate an immediate return
-         */
-        if(dwTimeout == 0)
+        lRet = GetStatusChangeLite(hContext, dwTimeout, pStates, cReaders);
+        if(dwTimeout || lRet == SCARD_S_SUCCESS)
         {
-            /* get the current state of readers and compare it with input
-             * Return SCARD_S_SUCCESS if a change is detected and
+            for(i=0;i<cReaders;i++)
+                bStateChanges |= StateFromLite(&pStates[i], dwTimeout, rgReaderStates[i].dwCurrentState,
+                    &rgReaderStates[i].dwEventState, &rgReaderStates[i].cbAtr,
+                    rgReaderStates[i].rgbAtr, sizeof (rgReaderStates[i].rgbAtr));
+            /* Return SCARD_S_SUCCESS if a change is detected and
              * SCARD_E_TIMEOUT otherwide
              */
-            params.hContext = hContext;
-            params.dwTimeout = 0;
-            params.rgReaderStates = pStates;
-            params.cReaders = cReaders;
-            lRet = WINSCARD_CALL( SCardGetStatusChange, &params );
-            if(lRet == SCARD_S_SUCCESS)
-            {
-                BOOL bStateChanges = FALSE;
-                for(i=0;i<cReaders;i++)
-                {
-                    DWORD dwState = pStates[i].dwEventState & (~SCARD_STATE_CHANGED);
-                    rgReaderStates[i].cbAtr = pStates[i].cbAtr;
-                    memcpy(rgReaderStates[i].rgbAtr,pStates[i].rgbAtr,min (rgReaderStates[i].cbAtr, sizeof (rgReaderStates[i].rgbAtr)));                    
-                    
-                    if(dwState != rgReaderStates[i].dwCurrentState)
-                    {
-                        rgReaderStates[i].dwEventState = pStates[i].dwEventState;
-                        bStateChanges = TRUE;
-                    }
-                    else
-                        rgReaderStates[i].dwEventState = dwState;
-                }
-                
-                if(!bStateChanges)
-                    lRet = SCARD_E_TIMEOUT;
-            }
+            if(!dwTimeout && !bStateChanges)
+                lRet = SCARD_E_TIMEOUT;
         }
-        else
-        {
-            for(i=0;i<cReaders;i++)
-            {
-                pStates[i].dwCurrentState = rgReaderStates[i].dwCurrentState;
-                pStates[i].dwEventState = rgReaderStates[i].dwEventState;
-                pStates[i].cbAtr = min (MAX_ATR_SIZE, rgReaderStates[i].cbAtr);
-                memcpy(pStates[i].rgbAtr,rgReaderStates[i].rgbAtr,pStates[i].cbAtr);
-            }
-
-            params.hContext = hContext;
-            params.dwTimeout = dwTimeout;
-            params.rgReaderStates = pStates;
-            params.cReaders = cReaders;
-            lRet = WINSCARD_CALL( SCardGetStatusChange, &params );
 
-            for(i=0;i<cReaders;i++)
-            {
-                rgReaderStates[i].dwCurrentState = pStates[i].dwCurrentState;
-                rgReaderStates[i].dwEventState = pStates[i].dwEventState;
-                rgReaderStates[i].cbAtr = pStates[i].cbAtr;
-                memcpy(rgReaderStates[i].rgbAtr,pStates[i].rgbAtr, MAX_ATR_SIZE);
-            }            
-        }
-        
-        SCardFree(pStates);
+        if(pStates != (LPSCARD_READERSTATE_LITE) buffer)
+            SCardFree(pStates);
     }
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);    
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
         
 LONG WINAPI SCardGetStatusChangeW(
@@ -1613,6 +5107,7 @@ LONG WINAPI SCardGetStatusChangeW(
         LPSCARD_READERSTATEW rgReaderStates, 
         DWORD cReaders)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardGetStatusChangeW);
     LONG lRet;
     TRACE(" 0x%08X %#lx %p %#lx\n",(unsigned int) hContext, dwTimeout,rgReaderStates,cReaders);    
     if(!rgReaderStates && cReaders)
@@ -1623,50 +5118,81 @@ LONG WINAPI SCardGetStatusChangeW(
     }    
     else
     {
-        /* create an ANSI array of readers states* */
-        DWORD i;
-        LPSCARD_READERSTATEA rgReaderStatesAnsi = (LPSCARD_READERSTATEA) SCardAllocate(cReaders * sizeof(SCARD_READERSTATEA));
-        if(!rgReaderStatesAnsi)
-            return SCARD_E_NO_MEMORY;
-        memset(rgReaderStatesAnsi,0,cReaders * sizeof(SCARD_READERSTATEA));
+        /* the lite states use the interned ANSI reader names,
+         * the ones that couldn't be interned are converted after the states */
+        ULONGLONG buffer[STATES_STACK_SIZE / sizeof(ULONGLONG)];
+        DWORD i, cbStates = cReaders * sizeof(SCARD_READERSTATE_LITE), cbNames = 0;
+        LPSCARD_READERSTATE_LITE pStates;
+        LPSTR szNames = NULL;
+        LPVOID pNamesBlock = NULL;
+        BOOL bStateChanges = FALSE;
+
+        if(cbStates <= sizeof(buffer))
+            pStates = (LPSCARD_READERSTATE_LITE) buffer;
+        else if(!(pStates = (LPSCARD_READERSTATE_LITE) SCardAllocate(cbStates)))
+            return ProfileLeave(&profile_frame, SCARD_E_NO_MEMORY);
+
         for(i=0;i<cReaders;i++)
         {
-            int alen = WideCharToMultiByte(CP_ACP,0,rgReaderStates[i].szReader,-1,NULL,0,NULL,NULL);
-            if(!alen)
-                break;
-            rgReaderStatesAnsi[i].szReader = (LPSTR) SCardAllocate(alen);
-            WideCharToMultiByte(CP_ACP,0,rgReaderStates[i].szReader,-1,(LPSTR) rgReaderStatesAnsi[i].szReader,alen,NULL,NULL);
-            rgReaderStatesAnsi[i].pvUserData = rgReaderStates[i].pvUserData;
-            rgReaderStatesAnsi[i].dwCurrentState = rgReaderStates[i].dwCurrentState;
-            rgReaderStatesAnsi[i].dwEventState = rgReaderStates[i].dwEventState;
-            rgReaderStatesAnsi[i].cbAtr = rgReaderStates[i].cbAtr;        
-            memcpy(rgReaderStatesAnsi[i].rgbAtr,rgReaderStates[i].rgbAtr, sizeof (rgReaderStatesAnsi[i].rgbAtr));
+            const struct reader_name *name = ResolveReaderW(hContext, rgReaderStates[i].szReader);
+            StateToLite(&pStates[i], name ? name->szA : NULL, dwTimeout, rgReaderStates[i].pvUserData,
+                rgReaderStates[i].dwCurrentState, rgReaderStates[i].dwEventState,
+                rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
+            if(!name)
+            {
+                int alen = WideCharToMultiByte(CP_ACP,0,rgReaderStates[i].szReader,-1,NULL,0,NULL,NULL);
+                if(!alen)
+                    break;
+                cbNames += alen;
+            }
         }
-        
         if(i < cReaders)
+        {
             lRet = SCARD_F_UNKNOWN_ERROR;
-        else
+            goto free_label;
+        }
+
+        if(cbNames)
         {
-            lRet = SCardGetStatusChangeA(hContext,dwTimeout,rgReaderStatesAnsi,cReaders);
-            /* copy back the information */
-            for(i=0;i<cReaders;i++)
+            if(pStates == (LPSCARD_READERSTATE_LITE) buffer && cbStates + cbNames <= sizeof(buffer))
+                szNames = (LPSTR) pStates + cbStates;
+            else if(!(szNames = pNamesBlock = SCardAllocate(cbNames)))
+            {
+                lRet = SCARD_E_NO_MEMORY;
+                goto free_label;
+            }
+            for(i=0;i<cReaders && cbNames;i++)
             {
-                rgReaderStates[i].dwEventState = rgReaderStatesAnsi[i].dwEventState;
-                rgReaderStates[i].cbAtr = rgReaderStatesAnsi[i].cbAtr;        
-                memcpy(rgReaderStates[i].rgbAtr,rgReaderStatesAnsi[i].rgbAtr, sizeof (rgReaderStates[i].rgbAtr));                        
-            }               
+                int alen;
+                if(pStates[i].szReader)
+                    continue;
+                alen = WideCharToMultiByte(CP_ACP,0,rgReaderStates[i].szReader,-1,szNames,cbNames,NULL,NULL);
+                pStates[i].szReader = szNames;
+                szNames += alen;
+                cbNames -= alen;
+            }
         }
-        /* free memory */
-        for(i=0;i<cReaders;i++)
+
+        lRet = GetStatusChangeLite(hContext, dwTimeout, pStates, cReaders);
+        if(dwTimeout || lRet == SCARD_S_SUCCESS)
         {
-            if(rgReaderStatesAnsi[i].szReader)
-                SCardFree((void*) rgReaderStatesAnsi[i].szReader);
+            for(i=0;i<cReaders;i++)
+                bStateChanges |= StateFromLite(&pStates[i], dwTimeout, rgReaderStates[i].dwCurrentState,
+                    &rgReaderStates[i].dwEventState, &rgReaderStates[i].cbAtr,
+                    rgReaderStates[i].rgbAtr, sizeof (rgReaderStates[i].rgbAtr));
+            if(!dwTimeout && !bStateChanges)
+                lRet = SCARD_E_TIMEOUT;
         }
-        SCardFree(rgReaderStatesAnsi);    
+
+free_label:
+        if(pNamesBlock)
+            SCardFree(pNamesBlock);
+        if(pStates != (LPSCARD_READERSTATE_LITE) buffer)
+            SCardFree(pStates);
     }
     
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardControl(
@@ -1678,6 +5204,7 @@ LONG WINAPI SCardControl(
             DWORD cbRecvLength, 
             LPDWORD lpBytesReturned)
 {
+        struct profile_frame profile_frame = ProfileEnter(profile_SCardControl);
         struct SCardControl_params params = { hCard, dwControlCode, pbSendBuffer, cbSendLength, pbRecvBuffer, cbRecvLength, NULL };
         DWORD_LITE dwBytesReturned = 0;
         LONG lRet;
@@ -1689,7 +5216,32 @@ LONG WINAPI SCardControl(
         lRet = WINSCARD_CALL( SCardControl, &params );
         if (lpBytesReturned)
             *lpBytesReturned = dwBytesReturned;
-        return TranslateToWin32(lRet);
+        return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
+}
+
+/*
+ * Fill the pcsc-lite PCI of a transmit request.
+ * In MS PC/SC, pioSendPci can be NULL. But not in pcsc-lite
+ */
+static LONG GetSendPci(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, SCARD_IO_REQUEST_LITE *pioSendPciLite)
+{
+    LONG lRet = SCARD_S_SUCCESS;
+    pioSendPciLite->cbPciLength = sizeof(*pioSendPciLite);
+    if(pioSendPci)
+    {
+        pioSendPciLite->dwProtocol = ms_proto2lite_proto(pioSendPci->dwProtocol);
+    }
+    else
+    {
+        /* Get the protocol and set the correct value for pioSendPci*/
+        DWORD protocol,dwState;
+        DWORD dwAtrLen,dwNameLen;
+        if(!handle_get_protocol(hCard,&protocol))
+            lRet = SCardStatusA(hCard,NULL,&dwNameLen,&dwState,&protocol,NULL,&dwAtrLen);
+        if(lRet == SCARD_S_SUCCESS)
+            pioSendPciLite->dwProtocol = ms_proto2lite_proto(protocol);
+    }
+    return lRet;
 }
 
 LONG WINAPI SCardTransmit(
@@ -1701,12 +5253,12 @@ LONG WINAPI SCardTransmit(
         LPBYTE pbRecvBuffer, 
         LPDWORD pcbRecvLength)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardTransmit);
     LONG lRet;
     struct SCardTransmit_params params;
     DWORD_LITE dwRecvLength = 0;
     LPDWORD_LITE pdwRecvLengthLite = NULL;
     SCARD_IO_REQUEST_LITE ioSendPci, ioRecvPci;
-    ioSendPci.cbPciLength = sizeof(ioSendPci);
     ioRecvPci.cbPciLength = sizeof(ioRecvPci);
     
     if (pcbRecvLength)
@@ -1719,24 +5271,9 @@ LONG WINAPI SCardTransmit(
         ioRecvPci.dwProtocol = ms_proto2lite_proto(pioRecvPci->dwProtocol);
     }
     
-    if(pioSendPci)
-    {
-        ioSendPci.dwProtocol = ms_proto2lite_proto(pioSendPci->dwProtocol);
-    }
-    else
-    {
-        /* In MS PC/SC, pioSendPci can be NULL. But not in pcsc-lite */
-        /* Get the protocol and set the correct value for pioSendPci*/
-        DWORD protocol,dwState;
-        DWORD dwAtrLen,dwNameLen;
-        lRet = SCardStatusA(hCard,NULL,&dwNameLen,&dwState,&protocol,NULL,&dwAtrLen);
-        if(lRet == SCARD_S_SUCCESS)
-        {
-            ioSendPci.dwProtocol = ms_proto2lite_proto(protocol);
-        }
-        else
-            goto transmit_end;
-    }
+    lRet = GetSendPci(hCard, pioSendPci, &ioSendPci);
+    if(lRet != SCARD_S_SUCCESS)
+        goto transmit_end;
 
     params.hCard = hCard;
     params.pioSendPci = &ioSendPci;
@@ -1745,24 +5282,107 @@ LONG WINAPI SCardTransmit(
     params.pioRecvPci = pioRecvPci? &ioRecvPci : NULL;
     params.pbRecvBuffer = pbRecvBuffer;
     params.pcbRecvLength = pdwRecvLengthLite;
-    lRet = WINSCARD_CALL( SCardTransmit, &params );
+    lRet = WINSCARD_CALL_APDU( SCardTransmit, &params, hCard, pbSendBuffer, cbSendLength );
+    if(lRet != SCARD_S_SUCCESS)
+        handle_check_result(hCard, lRet);
 
     if (pcbRecvLength)
         *pcbRecvLength = dwRecvLength;
     
 transmit_end:
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
         
+/*
+ * Wine extension: exchange a list of APDUs with the card in a single
+ * unix call. Every item receives its own result and response length,
+ * pcProcessed receives the number of items that were sent. When
+ * SCARD_TRANSMIT_STOP_ON_SW stops the list, the call and the last item sent
+ * return SCARD_W_TRANSMIT_STOPPED.
+ */
+LONG WINAPI SCardTransmitBatch(
+        SCARDHANDLE hCard,
+        LPCSCARD_IO_REQUEST pioSendPci,
+        LPSCARD_TRANSMIT_ITEM rgItems,
+        DWORD cItems,
+        DWORD dwFlags,
+        LPDWORD pcProcessed)
+{
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardTransmitBatch);
+    LONG lRet;
+    struct SCardTransmitBatch_params params;
+    SCARD_IO_REQUEST_LITE ioSendPci;
+    SCARD_TRANSMIT_ITEM_LITE itemsBuffer[16];
+    LPSCARD_TRANSMIT_ITEM_LITE pItems = itemsBuffer;
+    DWORD_LITE dwProcessed = 0;
+    DWORD i;
+    TRACE(" 0x%08X %p %p %#lx %#lx %p\n",(unsigned int) hCard,pioSendPci,rgItems,cItems,dwFlags,pcProcessed);
+
+    if(pcProcessed)
+        *pcProcessed = 0;
+    if(!rgItems && cItems)
+        return ProfileLeave(&profile_frame, SCARD_E_INVALID_PARAMETER);
+    if(!cItems)
+        return ProfileLeave(&profile_frame, SCARD_S_SUCCESS);
+
+    lRet = GetSendPci(hCard, pioSendPci, &ioSendPci);
+    if(lRet != SCARD_S_SUCCESS)
+        goto end_label;
+
+    if(cItems > ARRAY_SIZE(itemsBuffer))
+    {
+        pItems = (LPSCARD_TRANSMIT_ITEM_LITE) SCardAllocate(cItems * sizeof(SCARD_TRANSMIT_ITEM_LITE));
+        if(!pItems)
+        {
+            lRet = SCARD_E_NO_MEMORY;
+            goto end_label;
+        }
+    }
+    for(i=0;i<cItems;i++)
+    {
+        pItems[i].pbSendBuffer = rgItems[i].pbSendBuffer;
+        pItems[i].cbSendLength = rgItems[i].cbSendLength;
+        pItems[i].pbRecvBuffer = rgItems[i].pbRecvBuffer;
+        pItems[i].cbRecvLength = rgItems[i].cbRecvLength;
+        pItems[i].lResult = SCARD_E_NOT_TRANSACTED;
+    }
+
+    params.hCard = hCard;
+    params.pioSendPci = &ioSendPci;
+    params.rgItems = pItems;
+    params.cItems = cItems;
+    params.dwFlags = dwFlags;
+    params.pcProcessed = &dwProcessed;
+    lRet = WINSCARD_CALL( SCardTransmitBatch, &params );
+
+    for(i=0;i<cItems;i++)
+    {
+        rgItems[i].lResult = TranslateToWin32(pItems[i].lResult);
+        rgItems[i].cbRecvLength = (i < dwProcessed)? (DWORD) pItems[i].cbRecvLength : 0;
+    }
+    if(dwProcessed)
+        handle_check_result(hCard, pItems[dwProcessed - 1].lResult);
+    if(pcProcessed)
+        *pcProcessed = (DWORD) dwProcessed;
+
+    if(pItems != itemsBuffer)
+        SCardFree(pItems);
+
+end_label:
+    TRACE(" returned %#lx, %lu APDUs sent\n",lRet,(unsigned long) dwProcessed);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
+}
+
 LONG WINAPI SCardCancel(SCARDCONTEXT hContext)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardCancel);
     LONG lRet;
     struct SCardCancel_params params = { hContext };
     TRACE(" 0x%08X \n",(unsigned int) hContext);
     lRet = WINSCARD_CALL( SCardCancel, &params );
 
     TRACE(" returned %#lx\n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardGetAttrib(
@@ -1771,54 +5391,38 @@ LONG WINAPI SCardGetAttrib(
             LPBYTE pbAttr, 
             LPDWORD pcbAttrLen)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardGetAttrib);
     LONG lRet;
     TRACE(" 0x%08X %#lx %p %p \n",(unsigned int) hCard, dwAttrId,pbAttr,pcbAttrLen);
     if(!pcbAttrLen)
         lRet = SCARD_E_INVALID_PARAMETER;
     else
     {
-        LPBYTE ptr = NULL;
         DWORD_LITE dwLength = 0;
         struct SCardGetAttrib_params params = {hCard, dwAttrId, NULL, &dwLength}; 
-        lRet = WINSCARD_CALL( SCardGetAttrib, &params );
-        if(lRet == SCARD_S_SUCCESS || lRet == SCARD_E_INSUFFICIENT_BUFFER)
+        if(pbAttr && *pcbAttrLen == SCARD_AUTOALLOCATE)
         {
-            if(!pbAttr)
-                *pcbAttrLen = (DWORD) dwLength;
-            else if(*pcbAttrLen < (DWORD) dwLength)
+            LPBYTE ptr = NULL;
+            lRet = AllocateAndFill(FillAttrib, &params, &attrib_size_hint, &ptr, &dwLength);
+            if(lRet == SCARD_S_SUCCESS)
             {
+                LPBYTE *ppbAttr = (LPBYTE*) pbAttr;
+                *ppbAttr = ptr;
                 *pcbAttrLen = (DWORD) dwLength;
-                lRet = SCARD_E_INSUFFICIENT_BUFFER;
-            }
-            else
-            {        
-                BOOL bHasAutoAllocate = (*pcbAttrLen == SCARD_AUTOALLOCATE)? TRUE : FALSE;
-                if(bHasAutoAllocate)
-                    ptr = (LPBYTE) SCardAllocate((DWORD) dwLength);
-                else
-                    ptr = pbAttr;
-
-                params.hCard = hCard;
-                params.dwAttrId = dwAttrId;
-                params.pbAttr = ptr;
-                params.pcbAttrLen = &dwLength;
-                lRet = WINSCARD_CALL( SCardGetAttrib, &params );
-
-                if(lRet == SCARD_S_SUCCESS)
-                {
-                    *pcbAttrLen = (DWORD) dwLength;
-                    if(bHasAutoAllocate)
-                    {
-                        LPBYTE *ppbAttr = (LPBYTE*) pbAttr;
-                        *ppbAttr = ptr;
-                        ptr = NULL;
-                    }    
-                }
-            
-                if(bHasAutoAllocate && ptr)
-                    SCardFree(ptr);
             }
         }
+        else
+        {
+            /* the caller buffer (or none, to get the length) is handed over as is */
+            if(pbAttr)
+                dwLength = *pcbAttrLen;
+            params.pbAttr = pbAttr;
+            lRet = WINSCARD_CALL( SCardGetAttrib, &params );
+            if(lRet == SCARD_S_SUCCESS || lRet == SCARD_E_INSUFFICIENT_BUFFER)
+                *pcbAttrLen = (DWORD) dwLength;
+            if(!pbAttr && lRet == SCARD_E_INSUFFICIENT_BUFFER)
+                lRet = SCARD_S_SUCCESS;
+        }
         
         if(SCARD_E_UNSUPPORTED_FEATURE == TranslateToWin32(lRet))
         {
@@ -1830,15 +5434,34 @@ LONG WINAPI SCardGetAttrib(
                 || SCARD_ATTR_DEVICE_SYSTEM_NAME_W == dwAttrId)
             {
                 DWORD dwState;
-                DWORD dwProtocol;
+                DWORD dwProtocol = 0;
                 BYTE pbAtr[MAX_ATR_SIZE];
                 DWORD dwAtrLen =MAX_ATR_SIZE;
                 LPVOID pszReaderNames = NULL;
                 DWORD dwNameLength = SCARD_AUTOALLOCATE;
+                const struct reader_name *name = NULL;
+                struct handle_entry entry;
+                BOOL bWide = SCARD_ATTR_DEVICE_SYSTEM_NAME_W == dwAttrId
+                    || SCARD_ATTR_DEVICE_FRIENDLY_NAME_W == dwAttrId;
                 LONG status;
-                
-                if(SCARD_ATTR_DEVICE_SYSTEM_NAME_W == dwAttrId 
-                    || SCARD_ATTR_DEVICE_FRIENDLY_NAME_W == dwAttrId)                    
+
+                /* the protocol and the reader of a handle are known since it was connected */
+                if(handle_lookup(hCard, HANDLE_CARD, &entry))
+                {
+                    if(SCARD_ATTR_CURRENT_PROTOCOL_TYPE == dwAttrId)
+                        dwProtocol = entry.dwProtocol;
+                    else if(SCARD_ATTR_ICC_PRESENCE != dwAttrId && SCARD_ATTR_ATR_STRING != dwAttrId)
+                        name = ReaderNameById(entry.dwReaderId);
+                }
+                if(name)
+                {
+                    pszReaderNames = bWide ? (LPVOID) name->szW : (LPVOID) name->szA;
+                    dwNameLength = (bWide ? name->cchW : name->cchA) + 1;
+                    status = SCARD_S_SUCCESS;
+                }
+                else if(dwProtocol)
+                    status = SCARD_S_SUCCESS;
+                else if(bWide)
                     status = SCardStatusW(hCard,(LPWSTR) &pszReaderNames, &dwNameLength, &dwState,&dwProtocol, pbAtr,&dwAtrLen);
                 else
                     status = SCardStatusA(hCard,(LPSTR) &pszReaderNames, &dwNameLength, &dwState,&dwProtocol, pbAtr,&dwAtrLen);
@@ -1900,13 +5523,14 @@ LONG WINAPI SCardGetAttrib(
                         memcpy(pbAttr,pValuePtr,dwValueLen);
                     }
                     
-                    SCardFree(pszReaderNames);
+                    if(!name)
+                        SCardFree(pszReaderNames);
                 }
             }
         }
     }
     TRACE(" returned %#lx \n",lRet);
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
 
 LONG WINAPI SCardSetAttrib(
@@ -1915,10 +5539,11 @@ LONG WINAPI SCardSetAttrib(
             const BYTE* pbAttr, 
             DWORD cbAttrLen)
 {
+    struct profile_frame profile_frame = ProfileEnter(profile_SCardSetAttrib);
     LONG lRet;
     struct SCardSetAttrib_params params = {hCard, dwAttrId, pbAttr, cbAttrLen}; 
     TRACE(" 0x%08X %#lx %p %#lx \n",(unsigned int) hCard,dwAttrId,pbAttr,cbAttrLen);
     lRet = WINSCARD_CALL( SCardGetAttrib, &params );
     TRACE(" returned %#lx \n",lRet);    
-    return TranslateToWin32(lRet);
+    return ProfileLeave(&profile_frame, TranslateToWin32(lRet));
 }
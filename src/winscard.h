@@ -39,6 +39,11 @@ typedef struct _SCARD_ATRMASK
     BYTE  rgbMask[36];
 } SCARD_ATRMASK, *PSCARD_ATRMASK, *LPSCARD_ATRMASK;
 
+#define SCARD_PROVIDER_PRIMARY      1
+#define SCARD_PROVIDER_CSP          2
+#define SCARD_PROVIDER_KSP          3
+#define SCARD_PROVIDER_CARD_MODULE  0x80000001
+
 typedef struct
 {
     LPCSTR szReader;
@@ -61,11 +66,29 @@ DECL_WINELIB_TYPE_AW(SCARD_READERSTATE)
 DECL_WINELIB_TYPE_AW(PSCARD_READERSTATE)
 DECL_WINELIB_TYPE_AW(LPSCARD_READERSTATE)
 
+/* Wine extension: APDU list for SCardTransmitBatch */
+typedef struct _SCARD_TRANSMIT_ITEM
+{
+    LPCBYTE pbSendBuffer;
+    DWORD   cbSendLength;
+    LPBYTE  pbRecvBuffer;
+    DWORD   cbRecvLength;    /* in: size of pbRecvBuffer, out: response length */
+    LONG    lResult;         /* result of the exchange */
+} SCARD_TRANSMIT_ITEM, *PSCARD_TRANSMIT_ITEM, *LPSCARD_TRANSMIT_ITEM;
+
+#define SCARD_TRANSMIT_STOP_ON_ERROR    0x00000001  /* stop on the first failed exchange */
+#define SCARD_TRANSMIT_STOP_ON_SW       0x00000002  /* stop on the first status word other than 90 00 */
+
+/* SCARD_TRANSMIT_STOP_ON_SW stopped the list: returned by SCardTransmitBatch and set
+ * in lResult of the last item sent, whose response and length are complete */
+#define SCARD_W_TRANSMIT_STOPPED        ((LONG)0x801000F0)
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+HANDLE      WINAPI SCardAccessNewReaderEvent(void);
 HANDLE      WINAPI SCardAccessStartedEvent(void);
 LONG        WINAPI SCardAddReaderToGroupA(SCARDCONTEXT,LPCSTR,LPCSTR);
 LONG        WINAPI SCardAddReaderToGroupW(SCARDCONTEXT,LPCWSTR,LPCWSTR);
@@ -128,7 +151,9 @@ LONG        WINAPI SCardLocateCardsByATRA(SCARDCONTEXT,LPSCARD_ATRMASK,DWORD,LPS
 LONG        WINAPI SCardLocateCardsByATRW(SCARDCONTEXT,LPSCARD_ATRMASK,DWORD,LPSCARD_READERSTATEW,DWORD);
 #define     SCardLocateCardsByATR WINELIB_NAME_AW(SCardLocateCardsByATR)
 LONG        WINAPI SCardReconnect(SCARDHANDLE,DWORD,DWORD,DWORD,LPDWORD);
+void        WINAPI SCardReleaseAllEvents(void);
 LONG        WINAPI SCardReleaseContext(SCARDCONTEXT);
+void        WINAPI SCardReleaseNewReaderEvent(HANDLE hNewReaderEventHandle);
 void        WINAPI SCardReleaseStartedEvent(HANDLE hStartedEventHandle);
 LONG        WINAPI SCardRemoveReaderFromGroupA(SCARDCONTEXT,LPCSTR,LPCSTR);
 LONG        WINAPI SCardRemoveReaderFromGroupW(SCARDCONTEXT,LPCWSTR,LPCWSTR);
@@ -142,6 +167,10 @@ LONG        WINAPI SCardStatusA(SCARDHANDLE,LPSTR,LPDWORD,LPDWORD,LPDWORD,LPBYTE
 LONG        WINAPI SCardStatusW(SCARDHANDLE,LPWSTR,LPDWORD,LPDWORD,LPDWORD,LPBYTE,LPDWORD);
 #define     SCardStatus WINELIB_NAME_AW(SCardStatus)
 LONG        WINAPI SCardTransmit(SCARDHANDLE,LPCSCARD_IO_REQUEST,LPCBYTE,DWORD,LPSCARD_IO_REQUEST,LPBYTE,LPDWORD);
+LONG        WINAPI SCardTransmitBatch(SCARDHANDLE,LPCSCARD_IO_REQUEST,LPSCARD_TRANSMIT_ITEM,DWORD,DWORD,LPDWORD);
+LONG        WINAPI SCardDumpProfile(LPCSTR);
+LONG        WINAPI SCardDumpStatistics(LPCSTR);
+LONG        WINAPI SCardFlushStatus(SCARDHANDLE);
 
 #ifdef __cplusplus
 }
@@ -1,7 +1,7 @@
 @ stub ClassInstall32
 @ stdcall SCardAccessNewReaderEvent()
-@ stub SCardReleaseAllEvents()
-@ stub SCardReleaseNewReaderEvent()
+@ stdcall SCardReleaseAllEvents()
+@ stdcall SCardReleaseNewReaderEvent(long)
 @ stdcall SCardAccessStartedEvent()
 @ stdcall SCardAddReaderToGroupA(long str str)
 @ stdcall SCardAddReaderToGroupW(long wstr wstr)
@@ -11,8 +11,11 @@
 @ stdcall SCardConnectW(long wstr long long ptr ptr)
 @ stdcall SCardControl(long long ptr long ptr long ptr)
 @ stdcall SCardDisconnect(long long)
+@ stdcall SCardDumpProfile(str)
+@ stdcall SCardDumpStatistics(str)
 @ stdcall SCardEndTransaction(long long)
 @ stdcall SCardEstablishContext(long ptr ptr ptr)
+@ stdcall SCardFlushStatus(long)
 @ stdcall SCardForgetCardTypeA(long str)
 @ stdcall SCardForgetCardTypeW(long wstr)
 @ stdcall SCardForgetReaderA(long str)
@@ -58,6 +61,7 @@
 @ stdcall SCardStatusA(long str ptr ptr ptr ptr ptr)
 @ stdcall SCardStatusW(long wstr ptr ptr ptr ptr ptr)
 @ stdcall SCardTransmit(long ptr ptr long ptr ptr ptr)
+@ stdcall SCardTransmitBatch(long ptr ptr long long ptr)
 @ extern g_rgSCardRawPci
 @ extern g_rgSCardT0Pci	
 @ extern g_rgSCardT1Pci